@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "churn.h"
+#include "config.h"
+#include "control.h"
+#include "driver.h"
+#include "micro.h"
+#include "workload.h"
+
+// End-to-end benchmark of sop-backup: generates the synthetic trees of
+// workload.h, then for every scenario (a tree and a set of `add` flags)
+// drives a fresh sop-backup process through an initial copy, steady churn,
+// a burst of new files, and a restore of a damaged source. Last, one more
+// process carries thousands of backup pairs through its command loop.
+
+#define MAX_SCENARIOS 32
+#define HOUR_MS (3600 * 1000)
+
+typedef struct {
+  const char *binary;
+  const char *dir;
+  const char *out;
+  const char *label;
+  double scale;
+  int trees[TREE_COUNT];
+  int threads[8];
+  int threads_count;
+  ChurnConfig churn;
+  unsigned long long pairs; // control plane run, 0 = none
+  int keep;    // leave the generated trees behind
+  int verbose;
+} Config;
+
+typedef struct {
+  TreeKind tree;
+  char flags[64];
+} Scenario;
+
+// what a scenario's process reports back through a pipe
+typedef struct {
+  int ok;
+  double initial_s;
+  ChurnResult churn;
+  BurstResult burst;
+  long damaged;
+  double restore_s;
+  long peak_rss_kb; // largest of sop-backup and its watchers
+  unsigned long long target_bytes; // allocated in the target after the copy
+} RunResult;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: sop-bench [options]\n"
+          "  --binary PATH       sop-backup to drive (default ./sop-backup)\n"
+          "  --dir DIR           scratch directory (default /tmp/sop-bench)\n"
+          "  --scale X           multiply tree sizes by X (default 1)\n"
+          "  --trees LIST        comma separated: tiny,huge,deep,symlinks\n"
+          "  --threads LIST      initial copy threads to compare on tiny "
+          "(default 1,4)\n"
+          "  --churn-rate N      churn operations/s offered (default 2000)\n"
+          "  --churn-seconds N   churn duration (default 10)\n"
+          "  --pairs N           backup pairs for the control plane run\n"
+          "                      (default 10000 times the scale, 0 = skip)\n"
+          "  --out FILE          write the JSON report to FILE\n"
+          "  --label STR         recorded in the report (e.g. a git revision)\n"
+          "  --keep              keep the generated trees\n"
+          "  --verbose           echo the daemon's output\n");
+}
+
+static int parse_args(int argc, char *argv[], Config *c) {
+  *c = (Config){.binary = "./sop-backup",
+                .dir = "/tmp/sop-bench",
+                .label = "",
+                .scale = 1.0,
+                .threads = {1, 4},
+                .threads_count = 2,
+                .churn = {.rate = 2000, .seconds = 10, .window = 256,
+                          .timeout_ms = 10000}};
+  for (int k = 0; k < TREE_COUNT; k++)
+    c->trees[k] = 1;
+  int pairs = -1;
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(a, "--keep") == 0) {
+      c->keep = 1;
+      continue;
+    }
+    if (strcmp(a, "--verbose") == 0) {
+      c->verbose = 1;
+      continue;
+    }
+    if (!v) {
+      usage();
+      return -1;
+    }
+    i++;
+    if (strcmp(a, "--binary") == 0) {
+      c->binary = v;
+    } else if (strcmp(a, "--dir") == 0) {
+      c->dir = v;
+    } else if (strcmp(a, "--out") == 0) {
+      c->out = v;
+    } else if (strcmp(a, "--label") == 0) {
+      c->label = v;
+    } else if (strcmp(a, "--scale") == 0) {
+      c->scale = strtod(v, NULL);
+      if (c->scale <= 0 || c->scale > 100) {
+        fprintf(stderr, "bench: bad --scale %s\n", v);
+        return -1;
+      }
+    } else if (strcmp(a, "--churn-rate") == 0) {
+      c->churn.rate = atoi(v);
+    } else if (strcmp(a, "--churn-seconds") == 0) {
+      c->churn.seconds = atoi(v);
+    } else if (strcmp(a, "--pairs") == 0) {
+      pairs = atoi(v);
+    } else if (strcmp(a, "--trees") == 0) {
+      memset(c->trees, 0, sizeof(c->trees));
+      char list[256];
+      snprintf(list, sizeof(list), "%s", v);
+      for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        TreeKind k;
+        if (tree_kind(tok, &k) < 0) {
+          fprintf(stderr, "bench: unknown tree %s\n", tok);
+          return -1;
+        }
+        c->trees[k] = 1;
+      }
+    } else if (strcmp(a, "--threads") == 0) {
+      c->threads_count = 0;
+      char list[256];
+      snprintf(list, sizeof(list), "%s", v);
+      for (char *tok = strtok(list, ","); tok && c->threads_count < 8;
+           tok = strtok(NULL, ","))
+        c->threads[c->threads_count++] = atoi(tok);
+    } else {
+      usage();
+      return -1;
+    }
+  }
+  if (c->churn.rate < 1 || c->churn.seconds < 0) {
+    fprintf(stderr, "bench: bad churn settings\n");
+    return -1;
+  }
+  if (pairs < 0) {
+    double scaled = 10000 * c->scale;
+    pairs = scaled < 100 ? 100 : (int)scaled;
+  }
+  c->pairs = (unsigned long long)pairs;
+  return 0;
+}
+
+// tiny carries the thread scaling and io_uring comparisons, huge the
+// compression one
+static int build_scenarios(const Config *c, Scenario *out) {
+  int n = 0;
+  if (c->trees[TREE_TINY]) {
+    for (int i = 0; i < c->threads_count; i++) {
+      out[n].tree = TREE_TINY;
+      if (c->threads[i] > 1)
+        snprintf(out[n].flags, sizeof(out[n].flags), "--threads %d",
+                 c->threads[i]);
+      else
+        out[n].flags[0] = '\0';
+      n++;
+    }
+    out[n++] = (Scenario){TREE_TINY, "--io-uring"};
+  }
+  if (c->trees[TREE_HUGE]) {
+    out[n++] = (Scenario){TREE_HUGE, ""};
+    out[n++] = (Scenario){TREE_HUGE, "--compress"};
+  }
+  if (c->trees[TREE_DEEP])
+    out[n++] = (Scenario){TREE_DEEP, ""};
+  if (c->trees[TREE_SYMLINKS])
+    out[n++] = (Scenario){TREE_SYMLINKS, ""};
+  return n;
+}
+
+static unsigned long long g_du;
+
+static int du_entry(const char *path, const struct stat *st, int flag,
+                    struct FTW *ftw) {
+  g_du += (unsigned long long)st->st_blocks * 512;
+  return 0;
+}
+
+static unsigned long long disk_usage(const char *root) {
+  g_du = 0;
+  nftw(root, du_entry, 64, FTW_PHYS);
+  return g_du;
+}
+
+static int join(char out[PATH_MAX], const char *dir, const char *name) {
+  if (snprintf(out, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(%s)\n", dir);
+    return -1;
+  }
+  return 0;
+}
+
+// the target with the metadata and snapshot directories kept next to it
+static int remove_target(const char *dst) {
+  char side[PATH_MAX];
+  if (snprintf(side, PATH_MAX, "%s.meta", dst) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(%s)\n", dst);
+    return -1;
+  }
+  if (tree_remove(side) < 0)
+    return -1;
+  snprintf(side, PATH_MAX, "%s.snap", dst);
+  if (tree_remove(side) < 0)
+    return -1;
+  return tree_remove(dst);
+}
+
+static int reset_dir(const char *path) {
+  if (tree_remove(path) < 0 || mkdir(path, 0755) < 0) {
+    perror("reset(bench dir)");
+    return -1;
+  }
+  return 0;
+}
+
+// the body of a scenario's process
+static void run_scenario(const Config *c, const Scenario *s, const char *src,
+                         RunResult *r) {
+  char dst[PATH_MAX], sub_src[PATH_MAX], sub_dst[PATH_MAX];
+  if (snprintf(dst, PATH_MAX, "%s/dst-%s", c->dir, tree_name(s->tree)) >=
+      PATH_MAX) {
+    fprintf(stderr, "Name too long(%s)\n", c->dir);
+    return;
+  }
+  if (join(sub_src, src, "churn") < 0 || reset_dir(sub_src) < 0 ||
+      join(sub_src, src, "burst") < 0 || reset_dir(sub_src) < 0 ||
+      remove_target(dst) < 0)
+    return;
+
+  Daemon d;
+  if (daemon_start(&d, c->binary, c->verbose) < 0)
+    return;
+
+  fprintf(stderr, "  initial copy\n");
+  double t = now_s();
+  if (daemon_send(&d, "add %s \"%s\" \"%s\"", s->flags, src, dst) < 0 ||
+      daemon_wait(&d, "added src=", 60 * 1000, NULL, 0) < 0 ||
+      daemon_wait(&d, "initial copy done", 6 * HOUR_MS, NULL, 0) < 0)
+    goto stop;
+  r->initial_s = now_s() - t;
+  r->target_bytes = disk_usage(dst);
+
+  if (c->churn.seconds > 0) {
+    fprintf(stderr, "  churn, %d ops/s for %d s\n", c->churn.rate,
+            c->churn.seconds);
+    if (join(sub_src, src, "churn") < 0 || join(sub_dst, dst, "churn") < 0 ||
+        churn_run(sub_src, sub_dst, &c->churn, &d, &r->churn) < 0)
+      goto stop;
+  }
+
+  double files = 20000 * c->scale;
+  int burst = files < 1000 ? 1000 : (int)files;
+  fprintf(stderr, "  burst of %d files\n", burst);
+  if (join(sub_src, src, "burst") < 0 || join(sub_dst, dst, "burst") < 0 ||
+      burst_run(sub_src, sub_dst, burst, 120 * 1000, &d, &r->burst) < 0)
+    goto stop;
+
+  fprintf(stderr, "  restore\n");
+  if (daemon_send(&d, "end \"%s\" \"%s\"", src, dst) < 0 ||
+      daemon_wait(&d, "ended src=", 60 * 1000, NULL, 0) < 0)
+    goto stop;
+  r->damaged = tree_damage(src, 10);
+  if (r->damaged < 0)
+    goto stop;
+  t = now_s();
+  if (daemon_send(&d, "restore \"%s\" \"%s\"", src, dst) < 0 ||
+      daemon_wait(&d, "restored src=", 6 * HOUR_MS, NULL, 0) < 0)
+    goto stop;
+  r->restore_s = now_s() - t;
+  r->ok = 1;
+stop:
+  if (daemon_stop(&d, 30 * 1000) < 0)
+    r->ok = 0;
+  struct rusage ru;
+  if (getrusage(RUSAGE_CHILDREN, &ru) == 0)
+    r->peak_rss_kb = ru.ru_maxrss;
+  remove_target(dst);
+}
+
+// runs a scenario in its own process, so that RUSAGE_CHILDREN covers only
+// its sop-backup
+static int run_isolated(const Config *c, const Scenario *s, const char *src,
+                        RunResult *r) {
+  memset(r, 0, sizeof(*r));
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe(bench)");
+    return -1;
+  }
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork(bench)");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    run_scenario(c, s, src, r);
+    ssize_t n = write(fds[1], r, sizeof(*r));
+    _exit(n == (ssize_t)sizeof(*r) ? 0 : 1);
+  }
+  close(fds[1]);
+  ssize_t n;
+  while ((n = read(fds[0], r, sizeof(*r))) < 0 && errno == EINTR) {
+  }
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  if (n != (ssize_t)sizeof(*r)) {
+    memset(r, 0, sizeof(*r));
+    return -1;
+  }
+  return 0;
+}
+
+static void json_str(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char)*s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void write_json(FILE *f, const Config *c, const MicroResult *m,
+                       const TreeStats *trees, const double *gen_s,
+                       const Scenario *sc, const RunResult *runs, int n,
+                       const ControlResult *ctl) {
+  struct utsname u;
+  uname(&u);
+  fprintf(f, "{\n  \"version\": 1,\n  \"label\": ");
+  json_str(f, c->label);
+  fprintf(f, ",\n  \"host\": {\"kernel\": ");
+  json_str(f, u.release);
+  fprintf(f, ", \"machine\": ");
+  json_str(f, u.machine);
+  fprintf(f, ", \"cpus\": %ld},\n", sysconf(_SC_NPROCESSORS_ONLN));
+  fprintf(f, "  \"scale\": %g,\n", c->scale);
+  fprintf(f,
+          "  \"micro\": {\"lz_text_mb_per_s\": %.1f, "
+          "\"lz_text_unpack_mb_per_s\": %.1f, \"lz_text_ratio\": %.2f, "
+          "\"lz_random_mb_per_s\": %.1f, \"hash_gb_per_s\": %.2f, "
+          "\"watches\": %llu, \"watch_find_mops\": %.1f, "
+          "\"watch_lookup_mops\": %.1f, \"pairs\": %llu, "
+          "\"registry_add_mops\": %.1f, \"registry_find_mops\": %.1f},\n",
+          m->lz_text_mbs, m->lz_text_unpack_mbs, m->lz_text_ratio,
+          m->lz_random_mbs, m->hash_gbs, m->watches, m->watch_find_mops,
+          m->watch_lookup_mops, m->pairs, m->registry_add_mops,
+          m->registry_find_mops);
+  fprintf(f, "  \"trees\": {");
+  const char *sep = "";
+  for (int k = 0; k < TREE_COUNT; k++) {
+    if (!c->trees[k])
+      continue;
+    fprintf(f,
+            "%s\n    \"%s\": {\"files\": %llu, \"dirs\": %llu, "
+            "\"symlinks\": %llu, \"bytes\": %llu, \"generate_s\": %.3f}",
+            sep, tree_name((TreeKind)k), trees[k].files, trees[k].dirs,
+            trees[k].symlinks, trees[k].bytes, gen_s[k]);
+    sep = ",";
+  }
+  fprintf(f, "\n  },\n  \"runs\": [");
+  for (int i = 0; i < n; i++) {
+    const RunResult *r = &runs[i];
+    const TreeStats *ts = &trees[sc[i].tree];
+    double init = r->initial_s > 0 ? r->initial_s : 1;
+    fprintf(f, "%s\n    {\"tree\": \"%s\", \"flags\": ", i ? "," : "",
+            tree_name(sc[i].tree));
+    json_str(f, sc[i].flags);
+    fprintf(f,
+            ", \"ok\": %s,\n"
+            "     \"initial\": {\"seconds\": %.3f, \"mb_per_s\": %.1f, "
+            "\"entries_per_s\": %.0f, \"target_bytes\": %llu},\n",
+            r->ok ? "true" : "false", r->initial_s,
+            (double)ts->bytes / 1e6 / init,
+            (double)(ts->files + ts->dirs + ts->symlinks) / init,
+            r->target_bytes);
+    fprintf(f,
+            "     \"churn\": {\"ops\": %llu, \"lost\": %llu, "
+            "\"ops_per_s\": %.0f, \"p50_us\": %.0f, \"p90_us\": %.0f, "
+            "\"p99_us\": %.0f, \"p999_us\": %.0f, \"max_us\": %.0f},\n",
+            r->churn.ops, r->churn.lost, r->churn.rate, r->churn.p50_us,
+            r->churn.p90_us, r->churn.p99_us, r->churn.p999_us,
+            r->churn.max_us);
+    fprintf(f,
+            "     \"burst\": {\"files\": %llu, \"mirrored\": %llu, "
+            "\"seconds\": %.3f, \"files_per_s\": %.0f},\n",
+            r->burst.files, r->burst.mirrored, r->burst.seconds,
+            r->burst.files_per_s);
+    fprintf(f,
+            "     \"restore\": {\"damaged\": %ld, \"seconds\": %.3f},\n"
+            "     \"peak_rss_kb\": %ld}",
+            r->damaged, r->restore_s, r->peak_rss_kb);
+  }
+  fprintf(f, "\n  ]");
+  if (c->pairs)
+    fprintf(f,
+            ",\n  \"control\": {\"ok\": %s, \"pairs\": %llu, "
+            "\"sources\": %llu, \"add_s\": %.3f, \"add_per_s\": %.0f,\n"
+            "    \"stats_p50_us\": %.0f, \"stats_p99_us\": %.0f, "
+            "\"list_s\": %.3f, \"end_s\": %.3f, \"end_per_s\": %.0f}",
+            ctl->ok ? "true" : "false", ctl->pairs, ctl->sources, ctl->add_s,
+            ctl->add_per_s, ctl->stats_p50_us, ctl->stats_p99_us,
+            ctl->list_s, ctl->end_s, ctl->end_per_s);
+  fprintf(f, "\n}\n");
+}
+
+static void print_summary(const Scenario *sc, const RunResult *runs, int n,
+                          const TreeStats *trees) {
+  printf("%-9s %-13s %9s %9s %9s %9s %10s %9s %8s\n", "tree", "flags",
+         "init s", "MB/s", "p50 us", "p99 us", "burst f/s", "restore s",
+         "rss MB");
+  for (int i = 0; i < n; i++) {
+    const RunResult *r = &runs[i];
+    double init = r->initial_s > 0 ? r->initial_s : 1;
+    printf("%-9s %-13s %9.2f %9.1f %9.0f %9.0f %10.0f %9.2f %8.1f%s\n",
+           tree_name(sc[i].tree), sc[i].flags[0] ? sc[i].flags : "-",
+           r->initial_s, (double)trees[sc[i].tree].bytes / 1e6 / init,
+           r->churn.p50_us, r->churn.p99_us, r->burst.files_per_s,
+           r->restore_s, (double)r->peak_rss_kb / 1024,
+           r->ok ? "" : "  FAILED");
+  }
+}
+
+static void print_control(const ControlResult *r) {
+  printf("control plane, %llu pairs over %llu sources%s\n", r->pairs,
+         r->sources, r->ok ? "" : "  FAILED");
+  printf("  add %.0f pairs/s, stats p50 %.0f us p99 %.0f us, list %.3f s, "
+         "end %.0f pairs/s\n",
+         r->add_per_s, r->stats_p50_us, r->stats_p99_us, r->list_s,
+         r->end_per_s);
+}
+
+int main(int argc, char *argv[]) {
+  Config c;
+  if (parse_args(argc, argv, &c) < 0)
+    return 2;
+  if (access(c.binary, X_OK) < 0) {
+    fprintf(stderr, "bench: cannot run %s\n", c.binary);
+    return 2;
+  }
+  if (mkdir(c.dir, 0755) < 0 && errno != EEXIST) {
+    perror("mkdir(bench dir)");
+    return 2;
+  }
+
+  fprintf(stderr, "micro benchmarks\n");
+  MicroResult micro;
+  if (micro_run(c.scale, &micro) < 0)
+    return 1;
+
+  TreeStats trees[TREE_COUNT] = {0};
+  double gen_s[TREE_COUNT] = {0};
+  char src[TREE_COUNT][PATH_MAX];
+  for (int k = 0; k < TREE_COUNT; k++) {
+    if (!c.trees[k])
+      continue;
+    if (snprintf(src[k], PATH_MAX, "%s/src-%s", c.dir,
+                 tree_name((TreeKind)k)) >= PATH_MAX) {
+      fprintf(stderr, "Name too long(%s)\n", c.dir);
+      return 2;
+    }
+    fprintf(stderr, "generating %s tree\n", tree_name((TreeKind)k));
+    double t = now_s();
+    if (tree_remove(src[k]) < 0 ||
+        tree_generate((TreeKind)k, src[k], c.scale, &trees[k]) < 0)
+      return 1;
+    gen_s[k] = now_s() - t;
+  }
+
+  Scenario sc[MAX_SCENARIOS];
+  RunResult runs[MAX_SCENARIOS];
+  int n = build_scenarios(&c, sc);
+  int failed = 0;
+  for (int i = 0; i < n; i++) {
+    fprintf(stderr, "run %d/%d: %s %s\n", i + 1, n, tree_name(sc[i].tree),
+            sc[i].flags);
+    if (run_isolated(&c, &sc[i], src[sc[i].tree], &runs[i]) < 0 ||
+        !runs[i].ok)
+      failed++;
+  }
+
+  if (!c.keep)
+    for (int k = 0; k < TREE_COUNT; k++)
+      if (c.trees[k])
+        tree_remove(src[k]);
+
+  // 50 sources keep the watchers well inside the default limit of 128
+  // fanotify groups and inotify instances per user
+  ControlResult ctl = {0};
+  if (c.pairs) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, PATH_MAX, "%s/control", c.dir) >= PATH_MAX) {
+      fprintf(stderr, "Name too long(%s)\n", c.dir);
+      return 2;
+    }
+    fprintf(stderr, "control plane\n");
+    if (control_run(c.binary, dir, c.pairs, 50, c.verbose, &ctl) < 0)
+      failed++;
+  }
+
+  print_summary(sc, runs, n, trees);
+  if (c.pairs)
+    print_control(&ctl);
+  if (!c.out) {
+    write_json(stdout, &c, &micro, trees, gen_s, sc, runs, n, &ctl);
+  } else {
+    FILE *f = fopen(c.out, "w");
+    if (!f) {
+      perror("fopen(bench report)");
+      return 1;
+    }
+    write_json(f, &c, &micro, trees, gen_s, sc, runs, n, &ctl);
+    fclose(f);
+    fprintf(stderr, "report written to %s\n", c.out);
+  }
+  return failed ? 1 : 0;
+}
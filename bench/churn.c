@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include "churn.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "io_utils.h"
+
+#define CREATE_SIZE 100
+#define MODIFY_SIZE 200
+
+enum { OP_CREATE, OP_MODIFY, OP_RENAME, OP_DELETE, OP_COUNT };
+
+typedef struct {
+  unsigned long long id; // file n<id> / r<id>; slot = id % window
+  int op;                // next (or pending) operation
+  int pending;
+  uint64_t issued_ns;
+} Slot;
+
+static int write_sized(const char *path, size_t len) {
+  char buf[MODIFY_SIZE];
+  memset(buf, 'x', len);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("open(churn)");
+    return -1;
+  }
+  int ret = write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+  if (ret < 0)
+    perror("write(churn)");
+  close(fd);
+  return ret;
+}
+
+static int issue(const char *src_dir, Slot *s) {
+  char a[PATH_MAX], b[PATH_MAX];
+  snprintf(a, PATH_MAX, "%s/n%llu", src_dir, s->id);
+  snprintf(b, PATH_MAX, "%s/r%llu", src_dir, s->id);
+  s->issued_ns = now_ns();
+  s->pending = 1;
+  switch (s->op) {
+  case OP_CREATE:
+    return write_sized(a, CREATE_SIZE);
+  case OP_MODIFY:
+    return write_sized(a, MODIFY_SIZE);
+  case OP_RENAME:
+    return rename(a, b);
+  default:
+    return unlink(b);
+  }
+}
+
+// whether an event on the target side completes the slot's pending operation
+static int completes(const char *dst_dir, const Slot *s,
+                     const struct inotify_event *ev) {
+  char want = s->op >= OP_RENAME ? 'r' : 'n';
+  if (ev->name[0] != want)
+    return 0;
+  if (s->op == OP_DELETE)
+    return (ev->mask & IN_DELETE) != 0;
+  if (!(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+    return 0;
+  if (s->op == OP_RENAME)
+    return 1;
+  // a create can be copied twice; only the right contents count
+  char path[PATH_MAX];
+  struct stat st;
+  snprintf(path, PATH_MAX, "%s/%s", dst_dir, ev->name);
+  return stat(path, &st) == 0 &&
+         st.st_size == (s->op == OP_CREATE ? CREATE_SIZE : MODIFY_SIZE);
+}
+
+static void advance(Slot *s, int window) {
+  s->pending = 0;
+  if (++s->op == OP_COUNT) {
+    s->op = OP_CREATE;
+    s->id += (unsigned long long)window;
+  }
+}
+
+typedef struct {
+  uint32_t *us;
+  size_t count, capacity;
+} Samples;
+
+static int record(Samples *smp, uint64_t ns) {
+  if (smp->count == smp->capacity) {
+    size_t cap = smp->capacity ? smp->capacity * 2 : 65536;
+    uint32_t *p = realloc(smp->us, cap * sizeof(*p));
+    if (!p)
+      return -1;
+    smp->us = p;
+    smp->capacity = cap;
+  }
+  uint64_t us = ns / 1000;
+  smp->us[smp->count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+  return 0;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const Samples *smp, double p) {
+  if (smp->count == 0)
+    return 0;
+  size_t i = (size_t)(p * (double)(smp->count - 1) + 0.5);
+  return smp->us[i];
+}
+
+static void read_events(int fd, const char *dst_dir, Slot *slots, int window,
+                        Samples *smp, unsigned long long *done) {
+  char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    uint64_t now = now_ns();
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(*ev) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW)
+        fprintf(stderr, "bench: churn watch overflowed\n");
+      if (ev->len == 0 || (ev->name[0] != 'n' && ev->name[0] != 'r'))
+        continue;
+      char *end;
+      unsigned long long id = strtoull(ev->name + 1, &end, 10);
+      if (*end)
+        continue;
+      Slot *s = &slots[id % (unsigned long long)window];
+      if (s->id != id || !s->pending || !completes(dst_dir, s, ev))
+        continue;
+      if (record(smp, now - s->issued_ns) < 0)
+        return;
+      (*done)++;
+      advance(s, window);
+    }
+  }
+}
+
+// slots whose operation ran out of time start over with a fresh file
+static unsigned long long expire(Slot *slots, int window, uint64_t now,
+                                 uint64_t timeout_ns) {
+  unsigned long long lost = 0;
+  for (int i = 0; i < window; i++) {
+    if (slots[i].pending && now - slots[i].issued_ns > timeout_ns) {
+      slots[i].pending = 0;
+      slots[i].op = OP_CREATE;
+      slots[i].id += (unsigned long long)window;
+      lost++;
+    }
+  }
+  return lost;
+}
+
+int churn_run(const char *src_dir, const char *dst_dir, const ChurnConfig *cfg,
+              Daemon *d, ChurnResult *out) {
+  memset(out, 0, sizeof(*out));
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0) {
+    perror("inotify_init1(churn)");
+    return -1;
+  }
+  if (inotify_add_watch(fd, dst_dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                                         IN_DELETE) < 0) {
+    perror("inotify_add_watch(churn)");
+    close(fd);
+    return -1;
+  }
+  int window = cfg->window > 0 ? cfg->window : 1;
+  Slot *slots = calloc((size_t)window, sizeof(*slots));
+  if (!slots) {
+    close(fd);
+    return -1;
+  }
+  for (int i = 0; i < window; i++)
+    slots[i].id = (unsigned long long)i;
+
+  Samples smp = {0};
+  uint64_t timeout_ns = (uint64_t)cfg->timeout_ms * 1000000ull;
+  uint64_t start = now_ns();
+  uint64_t stop = start + (uint64_t)cfg->seconds * 1000000000ull;
+  unsigned long long issued = 0, done = 0;
+  int cursor = 0, ret = 0;
+
+  for (uint64_t now = start; now < stop; now = now_ns()) {
+    unsigned long long due =
+        (unsigned long long)((double)(now - start) / 1e9 * cfg->rate);
+    // offered load; when every slot is busy the daemon is behind and the
+    // backlog is simply not offered
+    for (int tried = 0; issued < due && tried < window; tried++) {
+      Slot *s = &slots[cursor];
+      cursor = (cursor + 1) % window;
+      if (s->pending)
+        continue;
+      if (issue(src_dir, s) < 0) {
+        ret = -1;
+        break;
+      }
+      issued++;
+    }
+    if (ret < 0)
+      break;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    poll(&pfd, 1, 1);
+    read_events(fd, dst_dir, slots, window, &smp, &done);
+    out->lost += expire(slots, window, now_ns(), timeout_ns);
+    daemon_drain(d);
+  }
+
+  // let what is in flight settle
+  uint64_t settle = now_ns() + timeout_ns;
+  while (ret == 0 && now_ns() < settle) {
+    int pending = 0;
+    for (int i = 0; i < window; i++)
+      pending += slots[i].pending;
+    if (!pending)
+      break;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    poll(&pfd, 1, 10);
+    read_events(fd, dst_dir, slots, window, &smp, &done);
+    daemon_drain(d);
+  }
+  for (int i = 0; i < window; i++)
+    out->lost += (unsigned long long)slots[i].pending;
+  double elapsed = (double)(now_ns() - start) / 1e9;
+
+  qsort(smp.us, smp.count, sizeof(*smp.us), cmp_u32);
+  out->ops = done;
+  out->rate = elapsed > 0 ? (double)done / elapsed : 0;
+  out->p50_us = percentile(&smp, 0.50);
+  out->p90_us = percentile(&smp, 0.90);
+  out->p99_us = percentile(&smp, 0.99);
+  out->p999_us = percentile(&smp, 0.999);
+  out->max_us = percentile(&smp, 1.0);
+  free(smp.us);
+  free(slots);
+  close(fd);
+  return ret;
+}
+
+int burst_run(const char *src_dir, const char *dst_dir, int files,
+              int timeout_ms, Daemon *d, BurstResult *out) {
+  memset(out, 0, sizeof(*out));
+  out->files = (unsigned long long)files;
+  char path[PATH_MAX];
+  uint64_t start = now_ns();
+  for (int i = 0; i < files; i++) {
+    snprintf(path, PATH_MAX, "%s/b%d", src_dir, i);
+    if (write_sized(path, CREATE_SIZE) < 0)
+      return -1;
+    if (i % 1024 == 0)
+      daemon_drain(d);
+  }
+  // files are mirrored roughly in creation order, so walking a cursor over
+  // them finds the end without a watch that could overflow
+  uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+  uint64_t last = start;
+  struct stat st;
+  int next = 0;
+  while (next < files && now_ns() < deadline) {
+    snprintf(path, PATH_MAX, "%s/b%d", dst_dir, next);
+    if (stat(path, &st) == 0 && st.st_size == CREATE_SIZE) {
+      last = now_ns();
+      next++;
+      continue;
+    }
+    daemon_drain(d);
+    struct timespec ts = {0, 500 * 1000};
+    nanosleep(&ts, NULL);
+  }
+  out->mirrored = (unsigned long long)next;
+  out->seconds = (double)(last - start) / 1e9;
+  out->files_per_s = out->seconds > 0 ? (double)next / out->seconds : 0;
+  return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef BENCH_CHURN_H
+#define BENCH_CHURN_H
+
+#include "driver.h"
+
+// Steady churn: every file goes through create, modify, rename and delete in
+// the source directory, one operation at a time per file but with up to
+// `window` files in flight, offered at `rate` operations per second. Each
+// operation's latency runs until the target directory shows its effect.
+typedef struct {
+  int rate;       // operations/s offered
+  int seconds;    // how long to offer them
+  int window;     // files in flight at most
+  int timeout_ms; // an operation not mirrored by then counts as lost
+} ChurnConfig;
+
+typedef struct {
+  unsigned long long ops; // mirrored operations
+  unsigned long long lost;
+  double rate;            // mirrored operations/s actually achieved
+  double p50_us, p90_us, p99_us, p999_us, max_us;
+} ChurnResult;
+
+int churn_run(const char *src_dir, const char *dst_dir, const ChurnConfig *cfg,
+              Daemon *d, ChurnResult *out);
+
+// Burst: `files` new files created in the source directory back to back,
+// timed until the last of them exists in the target.
+typedef struct {
+  unsigned long long files;
+  unsigned long long mirrored;
+  double seconds;      // first create to last file mirrored
+  double files_per_s;
+} BurstResult;
+
+int burst_run(const char *src_dir, const char *dst_dir, int files,
+              int timeout_ms, Daemon *d, BurstResult *out);
+
+#endif
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "driver.h"
+#include "workload.h"
+
+// targets per `add` and `end` line, within the daemon's 32 arguments
+#define PER_COMMAND 30
+#define STATS_SAMPLES 1000
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void src_path(char out[PATH_MAX], const char *dir,
+                     unsigned long long s) {
+  snprintf(out, PATH_MAX, "%s/src/s%04llu", dir, s);
+}
+
+// pair i belongs to source i % sources
+static void dst_path(char out[PATH_MAX], const char *dir,
+                     unsigned long long i) {
+  snprintf(out, PATH_MAX, "%s/dst/t%06llu", dir, i);
+}
+
+static int make_sources(const char *dir, unsigned long long sources) {
+  char path[PATH_MAX];
+  if (strlen(dir) > PATH_MAX - 64) {
+    fprintf(stderr, "Name too long(%s)\n", dir);
+    return -1;
+  }
+  if (tree_remove(dir) < 0 || mkdir(dir, 0755) < 0) {
+    perror("mkdir(bench control)");
+    return -1;
+  }
+  snprintf(path, PATH_MAX, "%s/src", dir);
+  if (mkdir(path, 0755) < 0) {
+    perror("mkdir(bench control)");
+    return -1;
+  }
+  snprintf(path, PATH_MAX, "%s/dst", dir);
+  if (mkdir(path, 0755) < 0) {
+    perror("mkdir(bench control)");
+    return -1;
+  }
+  for (unsigned long long s = 0; s < sources; s++) {
+    src_path(path, dir, s);
+    if (mkdir(path, 0755) < 0) {
+      perror("mkdir(bench control)");
+      return -1;
+    }
+    strcat(path, "/file");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, "control\n", 8) != 8) {
+      perror("write(bench control)");
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    close(fd);
+  }
+  return 0;
+}
+
+// Sends `verb src t...` for the pairs of source s from `first` on, at most
+// PER_COMMAND of them, and waits for the answer about the last one. Returns
+// how many pairs the line covered, or -1.
+static long batch(Daemon *d, const char *verb, const char *answer,
+                  const char *dir, unsigned long long pairs,
+                  unsigned long long sources, unsigned long long s,
+                  unsigned long long first) {
+  static char line[PER_COMMAND * (PATH_MAX + 3) + PATH_MAX + 16];
+  char path[PATH_MAX], needle[PATH_MAX + 32];
+  src_path(path, dir, s);
+  int len = snprintf(line, sizeof(line), "%s \"%s\"", verb, path);
+  long n = 0;
+  unsigned long long i = first;
+  for (; i < pairs && n < PER_COMMAND; i += sources, n++) {
+    dst_path(path, dir, i);
+    len += snprintf(line + len, sizeof(line) - (size_t)len, " \"%s\"", path);
+  }
+  snprintf(needle, sizeof(needle), answer, path);
+  if (n == 0)
+    return 0;
+  if (daemon_send(d, "%s", line) < 0 ||
+      daemon_wait(d, needle, 60 * 1000, NULL, 0) < 0)
+    return -1;
+  return n;
+}
+
+// `add` or `end` of every pair, source by source
+static int all_pairs(Daemon *d, const char *verb, const char *answer,
+                     const char *dir, unsigned long long pairs,
+                     unsigned long long sources) {
+  for (unsigned long long s = 0; s < sources; s++) {
+    for (unsigned long long first = s; first < pairs;) {
+      long n = batch(d, verb, answer, dir, pairs, sources, s, first);
+      if (n < 0)
+        return -1;
+      first += (unsigned long long)n * sources;
+    }
+  }
+  return 0;
+}
+
+int control_run(const char *binary, const char *dir, unsigned long long pairs,
+                unsigned long long sources, int verbose, ControlResult *out) {
+  memset(out, 0, sizeof(*out));
+  if (sources > pairs)
+    sources = pairs;
+  out->pairs = pairs;
+  out->sources = sources;
+  if (make_sources(dir, sources) < 0)
+    return -1;
+
+  Daemon d;
+  if (daemon_start(&d, binary, verbose) < 0)
+    return -1;
+  double *samples = malloc(STATS_SAMPLES * sizeof(*samples));
+  if (!samples) {
+    fprintf(stderr, "bench buffer allocation failed\n");
+    goto stop;
+  }
+
+  fprintf(stderr, "  add %llu pairs over %llu sources\n", pairs, sources);
+  double t = now_s();
+  if (all_pairs(&d, "add", "-> dst=\"%s\"", dir, pairs, sources) < 0)
+    goto stop;
+  out->add_s = now_s() - t;
+  out->add_per_s = (double)pairs / out->add_s;
+
+  fprintf(stderr, "  stats of %d random pairs\n", STATS_SAMPLES);
+  uint64_t rng = 0x5DEECE66Dull;
+  char src[PATH_MAX], dst[PATH_MAX];
+  for (int k = 0; k < STATS_SAMPLES; k++) {
+    unsigned long long i = rng_next(&rng) % pairs;
+    src_path(src, dir, i % sources);
+    dst_path(dst, dir, i);
+    t = now_s();
+    if (daemon_send(&d, "stats \"%s\" \"%s\"", src, dst) < 0 ||
+        daemon_wait(&d, "event-to-mirror latency", 60 * 1000, NULL, 0) < 0)
+      goto stop;
+    samples[k] = (now_s() - t) * 1e6;
+  }
+  qsort(samples, STATS_SAMPLES, sizeof(*samples), cmp_double);
+  out->stats_p50_us = samples[STATS_SAMPLES / 2];
+  out->stats_p99_us = samples[STATS_SAMPLES * 99 / 100];
+
+  // the registry lists pairs in the order they were added
+  unsigned long long last = sources - 1;
+  unsigned long long last_pair = last;
+  while (last_pair + sources < pairs)
+    last_pair += sources;
+  src_path(src, dir, last);
+  dst_path(dst, dir, last_pair);
+  char needle[2 * PATH_MAX + 16];
+  snprintf(needle, sizeof(needle), "src=\"%s\" dst=\"%s\"", src, dst);
+  t = now_s();
+  if (daemon_send(&d, "list") < 0 ||
+      daemon_wait(&d, needle, 60 * 1000, NULL, 0) < 0)
+    goto stop;
+  out->list_s = now_s() - t;
+
+  fprintf(stderr, "  end %llu pairs\n", pairs);
+  t = now_s();
+  if (all_pairs(&d, "end", "dst=\"%s\" (backup kept", dir, pairs, sources) < 0)
+    goto stop;
+  out->end_s = now_s() - t;
+  out->end_per_s = (double)pairs / out->end_s;
+  out->ok = 1;
+stop:
+  free(samples);
+  if (daemon_stop(&d, 120 * 1000) < 0)
+    out->ok = 0;
+  tree_remove(dir);
+  return out->ok ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef BENCH_CONTROL_H
+#define BENCH_CONTROL_H
+
+// Thousands of (source, target) pairs on one sop-backup process: how fast
+// its command loop adds, inspects, lists and ends them. The trees are a
+// single file each, so the parent's bookkeeping is what gets measured.
+typedef struct {
+  int ok;
+  unsigned long long pairs;
+  unsigned long long sources;
+  double add_s;      // `add` of every pair answered
+  double add_per_s;
+  double stats_p50_us; // `stats` of a random pair, command to answer
+  double stats_p99_us;
+  double list_s;     // one `list` of every pair
+  double end_s;      // `end` of every pair answered
+  double end_per_s;
+} ControlResult;
+
+// Drives `pairs` targets spread over `sources` sources below dir, which is
+// removed again afterwards.
+int control_run(const char *binary, const char *dir, unsigned long long pairs,
+                unsigned long long sources, int verbose, ControlResult *out);
+
+#endif
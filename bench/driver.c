@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+#include "driver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int daemon_start(Daemon *d, const char *binary, int verbose) {
+  memset(d, 0, sizeof(*d));
+  d->verbose = verbose;
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) < 0) {
+    perror("pipe(daemon)");
+    return -1;
+  }
+  if (pipe2(out, O_CLOEXEC) < 0) {
+    perror("pipe(daemon)");
+    close(in[0]);
+    close(in[1]);
+    return -1;
+  }
+  d->pid = fork();
+  if (d->pid < 0) {
+    perror("fork(daemon)");
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+  if (d->pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    execl(binary, binary, (char *)NULL);
+    perror("exec(daemon)");
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  d->in_fd = in[1];
+  d->out_fd = out[0];
+  fcntl(d->out_fd, F_SETFL, O_NONBLOCK);
+  return 0;
+}
+
+int daemon_send(Daemon *d, const char *fmt, ...) {
+  char line[16384];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= sizeof(line) - 1) {
+    fprintf(stderr, "Name too long(daemon command)\n");
+    return -1;
+  }
+  line[n++] = '\n';
+  if (d->verbose)
+    fprintf(stderr, "bench> %.*s", n, line);
+  for (int done = 0; done < n;) {
+    ssize_t w = write(d->in_fd, line + done, (size_t)(n - done));
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write(daemon)");
+      return -1;
+    }
+    done += (int)w;
+  }
+  return 0;
+}
+
+// 1 when more output arrived, 0 when none is pending, -1 on EOF
+static int fill(Daemon *d) {
+  if (d->len == sizeof(d->buf)) // a line longer than the buffer: drop it
+    d->len = 0;
+  ssize_t n = read(d->out_fd, d->buf + d->len, sizeof(d->buf) - d->len);
+  if (n < 0)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  if (n == 0)
+    return -1;
+  if (d->verbose)
+    fwrite(d->buf + d->len, 1, (size_t)n, stderr);
+  d->len += (size_t)n;
+  return 1;
+}
+
+// consumes complete lines up to and including the first containing needle
+static int scan(Daemon *d, const char *needle, char *line, size_t line_size) {
+  size_t start = 0;
+  char *nl;
+  while ((nl = memchr(d->buf + start, '\n', d->len - start))) {
+    size_t end = (size_t)(nl - d->buf);
+    *nl = '\0';
+    int hit = needle && strstr(d->buf + start, needle) != NULL;
+    if (hit && line)
+      snprintf(line, line_size, "%s", d->buf + start);
+    start = end + 1;
+    if (hit) {
+      memmove(d->buf, d->buf + start, d->len - start);
+      d->len -= start;
+      return 1;
+    }
+  }
+  memmove(d->buf, d->buf + start, d->len - start);
+  d->len -= start;
+  return 0;
+}
+
+int daemon_wait(Daemon *d, const char *needle, int timeout_ms, char *line,
+                size_t line_size) {
+  long long deadline = now_ms() + timeout_ms;
+  while (1) {
+    if (scan(d, needle, line, line_size))
+      return 0;
+    long long left = deadline - now_ms();
+    if (left <= 0) {
+      fprintf(stderr, "bench: no \"%s\" within %d ms\n", needle, timeout_ms);
+      return -1;
+    }
+    struct pollfd pfd = {.fd = d->out_fd, .events = POLLIN};
+    if (poll(&pfd, 1, left > 1000 ? 1000 : (int)left) < 0 && errno != EINTR) {
+      perror("poll(daemon)");
+      return -1;
+    }
+    if (fill(d) < 0) {
+      fprintf(stderr, "bench: daemon exited while waiting for \"%s\"\n",
+              needle);
+      return -1;
+    }
+  }
+}
+
+void daemon_drain(Daemon *d) {
+  while (fill(d) > 0)
+    scan(d, NULL, NULL, 0);
+  scan(d, NULL, NULL, 0);
+}
+
+int daemon_stop(Daemon *d, int timeout_ms) {
+  if (d->pid <= 0)
+    return 0;
+  daemon_send(d, "exit");
+  close(d->in_fd);
+  long long deadline = now_ms() + timeout_ms;
+  int status = 0;
+  pid_t r;
+  while ((r = waitpid(d->pid, &status, WNOHANG)) == 0) {
+    daemon_drain(d);
+    if (now_ms() > deadline) {
+      fprintf(stderr, "bench: daemon did not exit, killing it\n");
+      kill(d->pid, SIGKILL);
+      waitpid(d->pid, &status, 0);
+      break;
+    }
+    struct timespec ts = {0, 10 * 1000000};
+    nanosleep(&ts, NULL);
+  }
+  daemon_drain(d);
+  close(d->out_fd);
+  d->pid = 0;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
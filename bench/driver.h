@@ -0,0 +1,33 @@
+#ifndef BENCH_DRIVER_H
+#define BENCH_DRIVER_H
+
+#include <stddef.h>     // size_t
+#include <sys/types.h>  // pid_t
+
+// A sop-backup process driven through its command prompt, the way a user
+// would: commands go to its stdin, its stdout and stderr come back merged
+// on one pipe and are scanned line by line.
+typedef struct {
+  pid_t pid;
+  int in_fd;     // its stdin
+  int out_fd;    // its stdout + stderr, non-blocking
+  char buf[65536];
+  size_t len;    // unconsumed output in buf
+  int verbose;   // echo everything it prints to our stderr
+} Daemon;
+
+int daemon_start(Daemon *d, const char *binary, int verbose);
+// sends one command line; the newline is added
+int daemon_send(Daemon *d, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+// Waits up to timeout_ms for an output line containing needle and copies it
+// to line (may be NULL). Lines before it are consumed. 0 when found, -1 on
+// timeout or when the process went away.
+int daemon_wait(Daemon *d, const char *needle, int timeout_ms,
+                char *line, size_t line_size);
+// reads whatever is pending without waiting
+void daemon_drain(Daemon *d);
+// `exit`, then waits for the process (killing it after timeout_ms)
+int daemon_stop(Daemon *d, int timeout_ms);
+
+#endif
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "micro.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+#include "hash.h"
+#include "registry.h"
+#include "watch_map.h"
+#include "workload.h"
+
+#define SAMPLE (16 * 1024 * 1024)
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// keeps results alive so the timed loops are not optimized away
+static volatile uint64_t g_sink;
+
+// MB/s packing len bytes of buf block by block into out; with ratio set
+// also the ratio and the speed of unpacking them again into back
+static double lz_speed(const char *buf, size_t len, char *out, char *back,
+                       double *ratio, double *unpack_mbs) {
+  size_t sizes[SAMPLE / COMPRESS_BLOCK], packed = 0;
+  double t = now_s();
+  for (size_t off = 0; off < len; off += COMPRESS_BLOCK) {
+    size_t n = lz_compress(buf + off, COMPRESS_BLOCK, out + off, COMPRESS_BLOCK);
+    sizes[off / COMPRESS_BLOCK] = n;
+    packed += n ? n : COMPRESS_BLOCK;
+  }
+  double mbs = (double)len / 1e6 / (now_s() - t);
+  if (!ratio)
+    return mbs;
+  *ratio = (double)len / (double)packed;
+
+  t = now_s();
+  for (size_t off = 0; off < len; off += COMPRESS_BLOCK) {
+    size_t n = sizes[off / COMPRESS_BLOCK];
+    if (n && lz_decompress(out + off, n, back + off, COMPRESS_BLOCK) !=
+                 COMPRESS_BLOCK) {
+      fprintf(stderr, "bench: lz round trip failed at %zu\n", off);
+      return -1;
+    }
+  }
+  *unpack_mbs = (double)len / 1e6 / (now_s() - t);
+  return mbs;
+}
+
+static int codec(MicroResult *out) {
+  char *buf = malloc(SAMPLE), *packed = malloc(SAMPLE), *back = malloc(SAMPLE);
+  int ret = -1;
+  if (!buf || !packed || !back) {
+    fprintf(stderr, "bench buffer allocation failed\n");
+    goto done;
+  }
+  uint64_t rng = 42;
+  fill_content(&rng, buf, SAMPLE, 100);
+  out->lz_text_mbs = lz_speed(buf, SAMPLE, packed, back, &out->lz_text_ratio,
+                              &out->lz_text_unpack_mbs);
+  if (out->lz_text_mbs < 0)
+    goto done;
+
+  double t = now_s();
+  for (int i = 0; i < 8; i++)
+    g_sink += hash_content(buf, SAMPLE, (uint64_t)i);
+  out->hash_gbs = 8.0 * SAMPLE / 1e9 / (now_s() - t);
+
+  fill_content(&rng, buf, SAMPLE, 0);
+  out->lz_random_mbs = lz_speed(buf, SAMPLE, packed, back, NULL, NULL);
+  ret = 0;
+done:
+  free(buf);
+  free(packed);
+  free(back);
+  return ret;
+}
+
+static int watches(double scale, MicroResult *out) {
+  // side * side leaf directories: 90000 at full scale
+  unsigned side = (unsigned)(300.0 * (scale < 1 ? scale : 1) + 0.5);
+  if (side < 10)
+    side = 10;
+  size_t count = (size_t)side * side;
+  char (*paths)[48] = malloc(count * sizeof(*paths));
+  WatchMap map;
+  memset(&map, 0, sizeof(map));
+  int ret = -1;
+  if (!paths || watch_add(&map, 1, "/bench") < 0)
+    goto done;
+  int wd = 2;
+  for (unsigned a = 0; a < side; a++) {
+    char top[24];
+    snprintf(top, sizeof(top), "/bench/a%03u", a);
+    if (watch_add(&map, wd++, top) < 0)
+      goto done;
+    for (unsigned b = 0; b < side; b++) {
+      snprintf(paths[a * side + b], sizeof(paths[0]), "%s/b%03u", top, b);
+      if (watch_add(&map, wd++, paths[a * side + b]) < 0)
+        goto done;
+    }
+  }
+  out->watches = map.watches_count;
+
+  size_t rounds = 2000000 / count + 1;
+  double t = now_s();
+  for (size_t r = 0; r < rounds; r++)
+    for (int w = 1; w < wd; w++)
+      g_sink += (uint64_t)(uintptr_t)watch_find(&map, w);
+  out->watch_find_mops = (double)rounds * (wd - 1) / 1e6 / (now_s() - t);
+
+  rounds = 500000 / count + 1;
+  t = now_s();
+  for (size_t r = 0; r < rounds; r++)
+    for (size_t i = 0; i < count; i++)
+      g_sink += (uint64_t)(uintptr_t)watch_lookup(&map, paths[i]);
+  out->watch_lookup_mops = (double)rounds * count / 1e6 / (now_s() - t);
+  ret = 0;
+done:
+  watch_free_all(&map);
+  free(paths);
+  return ret;
+}
+
+// the parent's lookups with as many pairs as the control benchmark drives,
+// 100 targets per source
+static int registry(double scale, MicroResult *out) {
+  size_t count = (size_t)(10000.0 * scale + 0.5);
+  if (count < 100)
+    count = 100;
+  char (*dsts)[48] = malloc(count * sizeof(*dsts));
+  char (*srcs)[32] = malloc((count / 100 + 1) * sizeof(*srcs));
+  Registry reg;
+  memset(&reg, 0, sizeof(reg));
+  int ret = -1;
+  if (!dsts || !srcs) {
+    fprintf(stderr, "bench buffer allocation failed\n");
+    goto done;
+  }
+  for (size_t i = 0; i < count; i++) {
+    snprintf(srcs[i / 100], sizeof(srcs[0]), "/bench/src%04zu", i / 100);
+    snprintf(dsts[i], sizeof(dsts[0]), "/bench/dst/s%04zu/t%03zu", i / 100,
+             i % 100);
+  }
+
+  double t = now_s();
+  for (size_t i = 0; i < count; i++)
+    if (registry_add(&reg, srcs[i / 100], dsts[i]) < 0)
+      goto done;
+  out->registry_add_mops = (double)count / 1e6 / (now_s() - t);
+  out->pairs = count;
+
+  size_t rounds = 2000000 / count + 1;
+  t = now_s();
+  for (size_t r = 0; r < rounds; r++)
+    for (size_t i = 0; i < count; i++)
+      g_sink += (uint64_t)registry_find(&reg, srcs[i / 100], dsts[i]);
+  out->registry_find_mops = (double)rounds * count / 1e6 / (now_s() - t);
+  ret = 0;
+done:
+  registry_free(&reg);
+  free(dsts);
+  free(srcs);
+  return ret;
+}
+
+int micro_run(double scale, MicroResult *out) {
+  memset(out, 0, sizeof(*out));
+  if (codec(out) < 0 || watches(scale, out) < 0 || registry(scale, out) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef BENCH_MICRO_H
+#define BENCH_MICRO_H
+
+// In-process measurements of the hot pieces the end-to-end runs hide.
+typedef struct {
+  double lz_text_mbs, lz_text_unpack_mbs, lz_text_ratio;
+  double lz_random_mbs; // the incompressible path: how fast lz gives up
+  double hash_gbs;
+  unsigned long long watches;
+  double watch_find_mops;   // wd -> watch
+  double watch_lookup_mops; // path -> watch
+  unsigned long long pairs;
+  double registry_add_mops;  // (source, target) pairs registered
+  double registry_find_mops; // (source, target) -> backup
+} MicroResult;
+
+int micro_run(double scale, MicroResult *out);
+
+#endif
@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include "workload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#define CHUNK (4 * 1024 * 1024)
+
+static const char *const NAMES[TREE_COUNT] = {"tiny", "huge", "deep",
+                                              "symlinks"};
+
+const char *tree_name(TreeKind kind) { return NAMES[kind]; }
+
+int tree_kind(const char *name, TreeKind *out) {
+  for (int k = 0; k < TREE_COUNT; k++) {
+    if (strcmp(name, NAMES[k]) == 0) {
+      *out = (TreeKind)k;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+uint64_t rng_next(uint64_t *state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+void fill_content(uint64_t *rng, char *buf, size_t len, int text_percent) {
+  static const char *const LEVELS[] = {"INFO", "INFO", "INFO", "DEBUG", "WARN",
+                                       "ERROR"};
+  static const char *const PATHS[] = {"/api/v1/items", "/api/v1/users",
+                                      "/static/app.js", "/healthz",
+                                      "/api/v2/orders"};
+  size_t pos = 0;
+  while (pos < len) {
+    uint64_t r = rng_next(rng);
+    if ((int)(r % 100) >= text_percent) {
+      size_t n = 256 + (size_t)(r >> 40) % 1792;
+      for (size_t i = 0; i < n && pos < len; i++)
+        buf[pos++] = (char)rng_next(rng);
+      continue;
+    }
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+                     "2026-10-16T%02u:%02u:%02u.%03u %s worker-%u request "
+                     "id=%llu path=%s status=%u bytes=%u\n",
+                     (unsigned)(r % 24), (unsigned)(r >> 8) % 60,
+                     (unsigned)(r >> 16) % 60, (unsigned)(r >> 24) % 1000,
+                     LEVELS[(r >> 34) % 6], (unsigned)(r >> 37) % 16,
+                     (unsigned long long)(r >> 20), PATHS[(r >> 41) % 5],
+                     (r >> 44) % 7 ? 200u : 404u, (unsigned)(r >> 47) % 65536);
+    size_t take = (size_t)n < len - pos ? (size_t)n : len - pos;
+    memcpy(buf + pos, line, take);
+    pos += take;
+  }
+}
+
+static unsigned long long scaled(unsigned long long n, double scale) {
+  unsigned long long v = (unsigned long long)((double)n * scale + 0.5);
+  return v ? v : 1;
+}
+
+static int make_dir(const char *path, TreeStats *stats) {
+  if (mkdir(path, 0755) < 0) {
+    perror("mkdir(bench tree)");
+    return -1;
+  }
+  stats->dirs++;
+  return 0;
+}
+
+static int write_file(const char *path, const char *buf, size_t len,
+                      TreeStats *stats) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("open(bench file)");
+    return -1;
+  }
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, buf + done, len - done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write(bench file)");
+      close(fd);
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  close(fd);
+  stats->files++;
+  stats->bytes += len;
+  return 0;
+}
+
+static int make_link(const char *target, const char *path, TreeStats *stats) {
+  if (symlink(target, path) < 0) {
+    perror("symlink(bench tree)");
+    return -1;
+  }
+  stats->symlinks++;
+  return 0;
+}
+
+static int gen_tiny(const char *root, double scale, char *buf,
+                    TreeStats *stats, uint64_t *rng) {
+  unsigned long long files = scaled(1000000, scale);
+  char path[PATH_MAX];
+  for (unsigned long long i = 0; i < files; i++) {
+    if (i % 1000 == 0) {
+      snprintf(path, PATH_MAX, "%s/d%04llu", root, i / 1000);
+      if (make_dir(path, stats) < 0)
+        return -1;
+    }
+    snprintf(path, PATH_MAX, "%s/d%04llu/f%03llu", root, i / 1000, i % 1000);
+    size_t len = (size_t)(rng_next(rng) % 513);
+    fill_content(rng, buf, len, 100);
+    if (write_file(path, buf, len, stats) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int gen_huge(const char *root, double scale, char *buf,
+                    TreeStats *stats, uint64_t *rng) {
+  unsigned long long size = scaled(1024ull * 1024 * 1024, scale);
+  char path[PATH_MAX];
+  for (int i = 0; i < 4; i++) {
+    snprintf(path, PATH_MAX, "%s/huge%d.log", root, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      perror("open(bench file)");
+      return -1;
+    }
+    for (unsigned long long done = 0; done < size;) {
+      size_t len = size - done < CHUNK ? (size_t)(size - done) : CHUNK;
+      fill_content(rng, buf, len, 75);
+      ssize_t n = write(fd, buf, len);
+      if (n < 0) {
+        perror("write(bench file)");
+        close(fd);
+        return -1;
+      }
+      done += (unsigned long long)n;
+    }
+    close(fd);
+    stats->files++;
+    stats->bytes += size;
+  }
+  return 0;
+}
+
+static int gen_deep(const char *root, double scale, char *buf,
+                    TreeStats *stats, uint64_t *rng) {
+  unsigned long long chains = scaled(256, scale);
+  char path[PATH_MAX], file[PATH_MAX];
+  for (unsigned long long c = 0; c < chains; c++) {
+    int len = snprintf(path, PATH_MAX, "%s/c%03llu", root, c);
+    if (make_dir(path, stats) < 0)
+      return -1;
+    for (int level = 0; level < 64; level++) {
+      len += snprintf(path + len, PATH_MAX - (size_t)len, "/l%02d", level);
+      if (make_dir(path, stats) < 0)
+        return -1;
+      for (int f = 0; f < 2; f++) {
+        if (snprintf(file, PATH_MAX, "%s/f%d", path, f) >= PATH_MAX) {
+          fprintf(stderr, "Name too long(%s)\n", path);
+          return -1;
+        }
+        fill_content(rng, buf, 1024, 100);
+        if (write_file(file, buf, 1024, stats) < 0)
+          return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int gen_symlinks(const char *root, double scale, char *buf,
+                        TreeStats *stats, uint64_t *rng) {
+  unsigned long long files = scaled(20000, scale);
+  unsigned long long links = scaled(200000, scale);
+  char path[PATH_MAX], target[PATH_MAX];
+  for (unsigned long long i = 0; i < files; i++) {
+    if (i % 100 == 0) {
+      snprintf(path, PATH_MAX, "%s/s%03llu", root, i / 100);
+      if (make_dir(path, stats) < 0)
+        return -1;
+    }
+    snprintf(path, PATH_MAX, "%s/s%03llu/f%02llu", root, i / 100, i % 100);
+    fill_content(rng, buf, 1024, 100);
+    if (write_file(path, buf, 1024, stats) < 0)
+      return -1;
+  }
+  for (unsigned long long i = 0; i < links; i++) {
+    if (i % 1000 == 0) {
+      snprintf(path, PATH_MAX, "%s/l%03llu", root, i / 1000);
+      if (make_dir(path, stats) < 0)
+        return -1;
+    }
+    unsigned long long f = rng_next(rng) % files;
+    switch (i % 8) {
+    case 4:
+    case 5: // absolute, rewritten into the target by the daemon
+      snprintf(target, PATH_MAX, "%s/s%03llu/f%02llu", root, f / 100, f % 100);
+      break;
+    case 6:
+      snprintf(target, PATH_MAX, "../s%03llu", f / 100);
+      break;
+    case 7:
+      snprintf(target, PATH_MAX, "../missing/%llu", i);
+      break;
+    default:
+      snprintf(target, PATH_MAX, "../s%03llu/f%02llu", f / 100, f % 100);
+      break;
+    }
+    snprintf(path, PATH_MAX, "%s/l%03llu/k%03llu", root, i / 1000, i % 1000);
+    if (make_link(target, path, stats) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int tree_generate(TreeKind kind, const char *root, double scale,
+                  TreeStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  char *buf = malloc(CHUNK);
+  if (!buf) {
+    fprintf(stderr, "bench buffer allocation failed\n");
+    return -1;
+  }
+  char path[PATH_MAX];
+  uint64_t rng = 0x9E3779B97F4A7C15ull + (uint64_t)kind;
+  int ret = make_dir(root, stats);
+  if (ret == 0) {
+    snprintf(path, PATH_MAX, "%s/churn", root);
+    ret = make_dir(path, stats);
+  }
+  if (ret == 0) {
+    snprintf(path, PATH_MAX, "%s/burst", root);
+    ret = make_dir(path, stats);
+  }
+  if (ret == 0) {
+    switch (kind) {
+    case TREE_TINY:
+      ret = gen_tiny(root, scale, buf, stats, &rng);
+      break;
+    case TREE_HUGE:
+      ret = gen_huge(root, scale, buf, stats, &rng);
+      break;
+    case TREE_DEEP:
+      ret = gen_deep(root, scale, buf, stats, &rng);
+      break;
+    default:
+      ret = gen_symlinks(root, scale, buf, stats, &rng);
+      break;
+    }
+  }
+  free(buf);
+  return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+  if (remove(path) < 0 && errno != ENOENT) {
+    perror("remove(bench tree)");
+    return -1;
+  }
+  return 0;
+}
+
+int tree_remove(const char *root) {
+  struct stat st;
+  if (lstat(root, &st) < 0)
+    return errno == ENOENT ? 0 : -1;
+  return nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// nftw passes no context
+static long g_damage_every;
+static long g_damage_seen;
+static long g_damaged;
+
+static int damage_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+  if (flag != FTW_F || !S_ISREG(st->st_mode) ||
+      ++g_damage_seen % g_damage_every != 0)
+    return 0;
+  if (g_damaged++ % 2 == 0) {
+    if (unlink(path) < 0)
+      perror("unlink(bench damage)");
+    return 0;
+  }
+  int fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (fd < 0 || write(fd, "damaged\n", 8) != 8)
+    perror("rewrite(bench damage)");
+  if (fd >= 0)
+    close(fd);
+  return 0;
+}
+
+long tree_damage(const char *root, int every) {
+  g_damage_every = every > 0 ? every : 1;
+  g_damage_seen = 0;
+  g_damaged = 0;
+  if (nftw(root, damage_entry, 64, FTW_PHYS) < 0)
+    return -1;
+  return g_damaged;
+}
@@ -0,0 +1,44 @@
+#ifndef BENCH_WORKLOAD_H
+#define BENCH_WORKLOAD_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>
+
+// Synthetic source trees, each stressing something else: file count, data
+// volume, path depth and watch count, symlink handling.
+typedef enum {
+  TREE_TINY,     // 1M files of up to 512 bytes, 1000 per directory
+  TREE_HUGE,     // 4 files of 1 GiB, mostly log-like text
+  TREE_DEEP,     // 256 directory chains 64 levels deep, 2 files per level
+  TREE_SYMLINKS, // 200k symlinks (relative, absolute, dangling) to 20k files
+  TREE_COUNT
+} TreeKind;
+
+typedef struct {
+  unsigned long long files;
+  unsigned long long dirs;
+  unsigned long long symlinks;
+  unsigned long long bytes;
+} TreeStats;
+
+const char *tree_name(TreeKind kind);
+// -1 when name is no tree kind
+int tree_kind(const char *name, TreeKind *out);
+
+// Builds the tree at root (which must not exist), with every count and size
+// multiplied by scale. Every tree also gets the empty directories churn/ and
+// burst/ the event benchmarks write into.
+int tree_generate(TreeKind kind, const char *root, double scale,
+                  TreeStats *stats);
+// Removes root and everything below it; a missing root is no error.
+int tree_remove(const char *root);
+// Deletes or rewrites (alternately) one in every `every` regular files, so
+// a restore has work to do. Returns how many were damaged, or -1.
+long tree_damage(const char *root, int every);
+
+uint64_t rng_next(uint64_t *state);
+// len bytes of log-like text lines, with random binary stretches making up
+// about (100 - text_percent)% of it
+void fill_content(uint64_t *rng, char *buf, size_t len, int text_percent);
+
+#endif
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include "coalesce.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filesystem_utils.h"
+#include "hash.h"
+#include "io_utils.h"
+
+#define SLOT_EMPTY ((size_t)-1)
+
+static uint64_t due_ns(const Coalescer *c, const DirtyFile *f) {
+  uint64_t quiet = f->last_ns + c->quiet_ns;
+  uint64_t hard = f->first_ns + c->max_delay_ns;
+  return quiet < hard ? quiet : hard;
+}
+
+static uint64_t path_hash(const char *path) {
+  return hash64(path, strlen(path), 0);
+}
+
+// slot holding path, or the empty slot ending its probe sequence
+static size_t find_slot(const Coalescer *c, const char *path, uint64_t hash) {
+  size_t mask = c->slots_capacity - 1;
+  size_t i = (size_t)hash & mask;
+  while (c->slots[i] != SLOT_EMPTY) {
+    const DirtyFile *f = &c->files[c->slots[i]];
+    if (f->hash == hash && strcmp(f->path, path) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int rehash(Coalescer *c, size_t new_cap) {
+  size_t *new_slots = malloc(new_cap * sizeof(*new_slots));
+  if (!new_slots) {
+    fprintf(stderr, "coalesce index malloc failed\n");
+    return -1;
+  }
+  for (size_t i = 0; i < new_cap; i++)
+    new_slots[i] = SLOT_EMPTY;
+
+  free(c->slots);
+  c->slots = new_slots;
+  c->slots_capacity = new_cap;
+  for (size_t i = 0; i < c->count; i++)
+    c->slots[find_slot(c, c->files[i].path, c->files[i].hash)] = i;
+  return 0;
+}
+
+// removes slot i and pulls later entries of the cluster back into the gap
+static void slot_delete(Coalescer *c, size_t i) {
+  size_t mask = c->slots_capacity - 1;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (c->slots[j] == SLOT_EMPTY)
+      break;
+    size_t home = (size_t)c->files[c->slots[j]].hash & mask;
+    if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    c->slots[i] = c->slots[j];
+    i = j;
+  }
+  c->slots[i] = SLOT_EMPTY;
+}
+
+// takes files[idx] out of the set; the caller owns its path afterwards
+static void detach(Coalescer *c, size_t idx) {
+  slot_delete(c, find_slot(c, c->files[idx].path, c->files[idx].hash));
+  size_t last = c->count - 1;
+  if (idx != last) {
+    c->files[idx] = c->files[last];
+    c->slots[find_slot(c, c->files[idx].path, c->files[idx].hash)] = idx;
+  }
+  c->count--;
+}
+
+// adds or merges a dirty file; takes ownership of path
+static int insert(Coalescer *c, char *path, uint64_t first, uint64_t last) {
+  if (c->count >= COALESCE_MAX) {
+    free(path);
+    return -1;
+  }
+  if ((c->count + 1) * 2 > c->slots_capacity &&
+      rehash(c, c->slots_capacity ? c->slots_capacity * 2 : 64) < 0) {
+    free(path);
+    return -1;
+  }
+
+  uint64_t hash = path_hash(path);
+  size_t slot = find_slot(c, path, hash);
+  if (c->slots[slot] != SLOT_EMPTY) {
+    DirtyFile *f = &c->files[c->slots[slot]];
+    if (first < f->first_ns)
+      f->first_ns = first;
+    if (last > f->last_ns)
+      f->last_ns = last;
+    free(path);
+    return 0;
+  }
+
+  if (c->count == c->capacity) {
+    size_t new_cap = c->capacity ? c->capacity * 2 : 64;
+    DirtyFile *new_files = realloc(c->files, new_cap * sizeof(*new_files));
+    if (!new_files) {
+      fprintf(stderr, "coalesce realloc failed\n");
+      free(path);
+      return -1;
+    }
+    c->files = new_files;
+    c->capacity = new_cap;
+  }
+
+  DirtyFile *f = &c->files[c->count];
+  f->path = path;
+  f->hash = hash;
+  f->first_ns = first;
+  f->last_ns = last;
+  c->slots[slot] = c->count++;
+
+  uint64_t due = due_ns(c, f);
+  if (due < c->next_due)
+    c->next_due = due;
+  return 0;
+}
+
+void coalesce_init(Coalescer *c, int quiet_ms, int max_delay_ms) {
+  memset(c, 0, sizeof(*c));
+  if (max_delay_ms < quiet_ms)
+    max_delay_ms = quiet_ms;
+  c->quiet_ns = (uint64_t)quiet_ms * 1000000ull;
+  c->max_delay_ns = (uint64_t)max_delay_ms * 1000000ull;
+  c->next_due = UINT64_MAX;
+}
+
+int coalesce_enabled(const Coalescer *c) { return c->quiet_ns > 0; }
+
+int coalesce_dirty(Coalescer *c, const char *src_path) {
+  c->writes++;
+  uint64_t now = now_ns();
+
+  if (c->count > 0) {
+    size_t slot = find_slot(c, src_path, path_hash(src_path));
+    if (c->slots[slot] != SLOT_EMPTY) {
+      // a later due time only moves away from next_due, which stays a bound
+      c->files[c->slots[slot]].last_ns = now;
+      c->merged++;
+      return 0;
+    }
+  }
+
+  char *path = strdup(src_path);
+  if (!path)
+    return -1;
+  return insert(c, path, now, now);
+}
+
+void coalesce_cancel(Coalescer *c, const char *src_path, int is_dir) {
+  if (c->count == 0)
+    return;
+
+  if (!is_dir) {
+    size_t slot = find_slot(c, src_path, path_hash(src_path));
+    if (c->slots[slot] == SLOT_EMPTY)
+      return;
+    size_t idx = c->slots[slot];
+    char *path = c->files[idx].path;
+    detach(c, idx);
+    free(path);
+    c->cancelled++;
+    return;
+  }
+
+  // walking down keeps the swapped-in last element already visited
+  for (size_t i = c->count; i-- > 0;) {
+    if (!has_prefix_path(c->files[i].path, src_path))
+      continue;
+    char *path = c->files[i].path;
+    detach(c, i);
+    free(path);
+    c->cancelled++;
+  }
+}
+
+void coalesce_rename(Coalescer *c, const char *old_path, const char *new_path,
+                     int is_dir) {
+  if (c->count == 0)
+    return;
+
+  size_t old_len = strlen(old_path);
+  for (size_t i = c->count; i-- > 0;) {
+    const char *path = c->files[i].path;
+    if (is_dir ? !has_prefix_path(path, old_path) : strcmp(path, old_path) != 0)
+      continue;
+
+    char moved[PATH_MAX];
+    if (snprintf(moved, PATH_MAX, "%s%s", new_path, path + old_len) >= PATH_MAX)
+      continue;
+    char *moved_path = strdup(moved);
+    if (!moved_path)
+      continue;
+
+    DirtyFile f = c->files[i];
+    detach(c, i);
+    free(f.path);
+    if (insert(c, moved_path, f.first_ns, f.last_ns) == 0)
+      c->renamed++;
+    // entries appended by insert sit above i and are not visited again
+    if (!is_dir)
+      return;
+  }
+}
+
+int coalesce_timeout(const Coalescer *c) {
+  if (c->count == 0)
+    return -1;
+  uint64_t now = now_ns();
+  if (c->next_due <= now)
+    return 0;
+  uint64_t ms = (c->next_due - now + 999999) / 1000000;
+  return ms < INT_MAX ? (int)ms : INT_MAX;
+}
+
+void coalesce_flush(Coalescer *c, int force,
+                    void (*copy)(void *arg, const char *src_path,
+                                 uint64_t first_ns),
+                    void *arg) {
+  if (c->count == 0)
+    return;
+  uint64_t now = now_ns();
+  if (!force && now < c->next_due)
+    return;
+
+  uint64_t next = UINT64_MAX;
+  for (size_t i = c->count; i-- > 0;) {
+    uint64_t due = due_ns(c, &c->files[i]);
+    if (!force && due > now) {
+      if (due < next)
+        next = due;
+      continue;
+    }
+    char *path = c->files[i].path;
+    uint64_t first = c->files[i].first_ns;
+    detach(c, i);
+    copy(arg, path, first);
+    free(path);
+    c->flushed++;
+  }
+  c->next_due = next;
+}
+
+void coalesce_free(Coalescer *c) {
+  for (size_t i = 0; i < c->count; i++)
+    free(c->files[i].path);
+  free(c->files);
+  free(c->slots);
+  memset(c, 0, sizeof(*c));
+}
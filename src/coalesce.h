@@ -0,0 +1,62 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// past this many dirty files further writes are copied right away
+#define COALESCE_MAX 65536
+
+typedef struct {
+  char *path;          // source path whose contents need copying
+  uint64_t hash;
+  uint64_t first_ns;   // first write since the last copy
+  uint64_t last_ns;    // latest write
+} DirtyFile;
+
+// Holds modified files until they have been quiet for `quiet` or dirty for
+// `max_delay`, whichever comes first. Repeated writes merge into one copy,
+// deletes cancel the copy and renames move it to the new name.
+typedef struct {
+  uint64_t quiet_ns;     // 0 disables coalescing
+  uint64_t max_delay_ns;
+  DirtyFile *files;
+  size_t count;
+  size_t capacity;
+  size_t *slots;         // path hash -> index in files, linear probing
+  size_t slots_capacity;
+  uint64_t next_due;     // no file is due before this
+
+  unsigned long long writes;    // close_write events seen
+  unsigned long long merged;    // writes folded into an already pending copy
+  unsigned long long cancelled; // pending copies dropped by a delete
+  unsigned long long renamed;   // pending copies moved by a rename
+  unsigned long long flushed;   // copies actually performed
+} Coalescer;
+
+void coalesce_init(Coalescer *c, int quiet_ms, int max_delay_ms);
+int  coalesce_enabled(const Coalescer *c);
+
+// Records a finished write. Returns -1 if the caller should copy right away.
+int  coalesce_dirty(Coalescer *c, const char *src_path);
+// Drops pending copies of path, and of everything below it if is_dir.
+void coalesce_cancel(Coalescer *c, const char *src_path, int is_dir);
+void coalesce_rename(Coalescer *c, const char *old_path, const char *new_path,
+                     int is_dir);
+
+// Milliseconds until the next copy is due, -1 if nothing is pending.
+int  coalesce_timeout(const Coalescer *c);
+// Calls copy for every file that is due (every pending one if force) and
+// forgets it; first_ns is when the file got dirty.
+void coalesce_flush(Coalescer *c, int force,
+                    void (*copy)(void *arg, const char *src_path,
+                                 uint64_t first_ns),
+                    void *arg);
+
+void coalesce_free(Coalescer *c);
+
+#endif
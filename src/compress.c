@@ -0,0 +1,605 @@
+#define _GNU_SOURCE
+#include "compress.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "copy_engine.h"
+#include "filesystem_utils.h"
+#include "hash.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+// a block ends in at least this many literals and no match starts closer
+// to the end than LZ_MATCH_LIMIT, so the match loop needs no end checks
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+// the probe looks at PROBE_SPAN bytes out of every PROBE_STRIDE; past 7.5
+// bits per byte LZ matches don't pay for the work
+#define PROBE_STRIDE 256
+#define PROBE_SPAN 32
+#define PROBE_MAX_BITS_Q4 120
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// common prefix of a and b, at most max bytes
+static size_t match_length(const unsigned char *a, const unsigned char *b,
+                           size_t max) {
+  size_t len = 0;
+  while (len + 8 <= max) {
+    uint64_t x, y;
+    memcpy(&x, a + len, 8);
+    memcpy(&y, b + len, 8);
+    if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return len + ((size_t)__builtin_ctzll(x ^ y) >> 3);
+#else
+      return len + ((size_t)__builtin_clzll(x ^ y) >> 3);
+#endif
+    }
+    len += 8;
+  }
+  while (len < max && a[len] == b[len])
+    len++;
+  return len;
+}
+
+// a length of 15 or more continues in bytes of 255 and a final smaller one
+static unsigned char *put_length(unsigned char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+// one sequence: token, literal run, then offset and match length unless it
+// is the last one (len 0)
+static unsigned char *put_sequence(unsigned char *op, unsigned char *end,
+                                   const unsigned char *lit, size_t lit_len,
+                                   size_t offset, size_t len) {
+  size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + len / 255 + 1;
+  if ((size_t)(end - op) < need)
+    return NULL;
+  unsigned char *token = op++;
+  *token = (unsigned char)((lit_len >= 15 ? 15 : lit_len) << 4);
+  if (lit_len >= 15)
+    op = put_length(op, lit_len - 15);
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (len == 0)
+    return op;
+  *op++ = (unsigned char)(offset & 0xff);
+  *op++ = (unsigned char)(offset >> 8);
+  size_t ml = len - LZ_MIN_MATCH;
+  *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+  if (ml >= 15)
+    op = put_length(op, ml - 15);
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap) {
+  const unsigned char *in = src;
+  unsigned char *out = dst;
+  unsigned char *op = out, *end = out + cap;
+  size_t anchor = 0;
+
+  if (n > LZ_MATCH_LIMIT) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t limit = n - LZ_MATCH_LIMIT;
+    size_t i = 0;
+    while (i < limit) {
+      uint32_t seq = read32(in + i);
+      uint32_t h = lz_hash(seq);
+      size_t ref = table[h];
+      table[h] = (uint32_t)i;
+      if (ref >= i || i - ref > LZ_MAX_OFFSET || read32(in + ref) != seq) {
+        // the longer since the last match, the bigger the steps: data
+        // without repeats is crossed quickly
+        i += 1 + ((i - anchor) >> 6);
+        continue;
+      }
+      while (i > anchor && ref > 0 && in[i - 1] == in[ref - 1]) {
+        i--;
+        ref--;
+      }
+      size_t len = LZ_MIN_MATCH +
+                   match_length(in + ref + LZ_MIN_MATCH, in + i + LZ_MIN_MATCH,
+                                n - LZ_LAST_LITERALS - i - LZ_MIN_MATCH);
+      op = put_sequence(op, end, in + anchor, i - anchor, i - ref, len);
+      if (!op)
+        return 0;
+      i += len;
+      anchor = i;
+      if (i < limit)
+        table[lz_hash(read32(in + i - 2))] = (uint32_t)(i - 2);
+    }
+  }
+
+  op = put_sequence(op, end, in + anchor, n - anchor, 0, 0);
+  if (!op || op == end)
+    return 0;
+  return (size_t)(op - out);
+}
+
+// a length continued past its nibble; -1 when the input ends in it
+static int get_length(const unsigned char *in, size_t n, size_t *ip,
+                      size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip >= n)
+      return -1;
+    b = in[(*ip)++];
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+ssize_t lz_decompress(const void *src, size_t n, void *dst, size_t cap) {
+  const unsigned char *in = src;
+  unsigned char *out = dst;
+  size_t ip = 0, op = 0;
+  while (ip < n) {
+    unsigned token = in[ip++];
+    size_t lit = token >> 4;
+    if (lit == 15 && get_length(in, n, &ip, &lit) < 0)
+      return -1;
+    if (lit > n - ip || lit > cap - op)
+      return -1;
+    memcpy(out + op, in + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n)
+      break;
+
+    if (n - ip < 2)
+      return -1;
+    size_t offset = (size_t)in[ip] | ((size_t)in[ip + 1] << 8);
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && get_length(in, n, &ip, &len) < 0)
+      return -1;
+    len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || len > cap - op)
+      return -1;
+    unsigned char *d = out + op;
+    const unsigned char *s = d - offset;
+    if (offset >= len) {
+      memcpy(d, s, len);
+    } else {
+      // overlapping: a run repeating the last offset bytes
+      for (size_t k = 0; k < len; k++)
+        d[k] = s[k];
+    }
+    op += len;
+  }
+  return (ssize_t)op;
+}
+
+// log2(x) in 1/16 units, good to a sixteenth
+static uint64_t log2_q4(uint32_t x) {
+  static const unsigned char frac[16] = {0, 1,  3,  4,  5,  6,  7,  8,
+                                         9, 10, 11, 12, 13, 14, 15, 15};
+  unsigned top = 31u - (unsigned)__builtin_clz(x);
+  unsigned f = top >= 4 ? (x >> (top - 4)) & 15 : (x << (4 - top)) & 15;
+  return (uint64_t)top * 16 + frac[f];
+}
+
+int compress_probe(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint32_t counts[256] = {0};
+  uint32_t total = 0;
+  for (size_t off = 0; off < len; off += PROBE_STRIDE) {
+    size_t span = len - off < PROBE_SPAN ? len - off : PROBE_SPAN;
+    for (size_t k = 0; k < span; k++)
+      counts[p[off + k]]++;
+    total += (uint32_t)span;
+  }
+  if (total < 64)
+    return 1;
+  // entropy times total: total log2 total - sum of c log2 c
+  uint64_t sum = 0;
+  for (int b = 0; b < 256; b++) {
+    if (counts[b])
+      sum += counts[b] * log2_q4(counts[b]);
+  }
+  uint64_t bits = total * log2_q4(total) - sum;
+  return bits < (uint64_t)total * PROBE_MAX_BITS_Q4;
+}
+
+static uint32_t header_check(const CompressHeader *h) {
+  return (uint32_t)hash64(h, offsetof(CompressHeader, check), 0);
+}
+
+// 1 and the header when fd (described by st) holds a container
+static int read_header(int fd, const struct stat *st, CompressHeader *h) {
+  if (!S_ISREG(st->st_mode) || st->st_size < (off_t)sizeof(*h))
+    return 0;
+  ssize_t n = TEMP_FAILURE_RETRY(pread(fd, h, sizeof(*h), 0));
+  if (n < 0) {
+    perror("pread(compress header)");
+    return -1;
+  }
+  uint64_t file_size = h->size > h->data_len ? h->size : h->data_len;
+  return n == (ssize_t)sizeof(*h) &&
+         memcmp(h->magic, COMPRESS_MAGIC, sizeof(h->magic)) == 0 &&
+         h->block_size == COMPRESS_BLOCK && h->check == header_check(h) &&
+         h->data_len >= sizeof(*h) && (uint64_t)st->st_size == file_size;
+}
+
+// up to len bytes at off; fewer only at EOF
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = TEMP_FAILURE_RETRY(
+        pread(fd, (char *)buf + done, len - done, off + (off_t)done));
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+static int pwritev_full(int fd, struct iovec *iov, int count, off_t off) {
+  while (count > 0) {
+    ssize_t n = TEMP_FAILURE_RETRY(pwritev(fd, iov, count, off));
+    if (n < 0)
+      return -1;
+    off += n;
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+  return 0;
+}
+
+static int all_zero(const unsigned char *p, size_t len) {
+  return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+static off_t round_up(off_t v, off_t unit) {
+  return (v + unit - 1) / unit * unit;
+}
+
+// writes in's contents into the empty file out as a container, starting
+// from the first block already in raw; 1 when that saved nothing and out
+// is to get the plain contents instead
+static int pack_blocks(int in, int out, off_t size, unsigned char *raw,
+                       size_t first, int must_pack, CompressStats *stats,
+                       volatile sig_atomic_t *stop_flag) {
+  unsigned char *packed = malloc(COMPRESS_BLOCK);
+  if (!packed) {
+    fprintf(stderr, "compress buffer allocation failed\n");
+    return -1;
+  }
+  HashState hs;
+  hash_init(&hs, 0);
+  off_t done = 0, pos = (off_t)sizeof(CompressHeader);
+  size_t n = first;
+  int ret = 0;
+  while (n > 0) {
+    if (*stop_flag) {
+      errno = EINTR;
+      ret = -1;
+      break;
+    }
+    hash_update(&hs, raw, n);
+    uint32_t word = 0;
+    struct iovec iov[2] = {{&word, sizeof(word)}, {NULL, 0}};
+    if (!all_zero(raw, n)) {
+      size_t len = compress_probe(raw, n) ? lz_compress(raw, n, packed, n) : 0;
+      if (len > 0) {
+        word = (uint32_t)len;
+        iov[1] = (struct iovec){packed, len};
+      } else {
+        word = COMPRESS_BLOCK_RAW | (uint32_t)n;
+        iov[1] = (struct iovec){raw, n};
+      }
+    }
+    off_t written = (off_t)(sizeof(word) + iov[1].iov_len);
+    if (pwritev_full(out, iov, 2, pos) < 0) {
+      perror("pwritev(compress)");
+      ret = -1;
+      break;
+    }
+    pos += written;
+    done += (off_t)n;
+    if (n < COMPRESS_BLOCK || done >= size)
+      break;
+    size_t want = size - done < COMPRESS_BLOCK ? (size_t)(size - done)
+                                               : COMPRESS_BLOCK;
+    ssize_t got = pread_full(in, raw, want, done);
+    if (got < 0) {
+      perror("pread(compress)");
+      ret = -1;
+      break;
+    }
+    n = (size_t)got;
+  }
+  free(packed);
+  if (ret < 0)
+    return -1;
+
+  // a hole only saves whole blocks
+  struct stat out_st;
+  off_t unit = fstat(out, &out_st) == 0 && out_st.st_blksize > 0
+                   ? (off_t)out_st.st_blksize
+                   : 4096;
+  if (!must_pack && round_up(pos, unit) >= round_up(done, unit))
+    return 1;
+
+  CompressHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, COMPRESS_MAGIC, sizeof(h.magic));
+  h.size = (uint64_t)done;
+  h.data_len = (uint64_t)pos;
+  h.content_hash = hash_final(&hs);
+  h.block_size = COMPRESS_BLOCK;
+  h.check = header_check(&h);
+  if (TEMP_FAILURE_RETRY(pwrite(out, &h, sizeof(h), 0)) != (ssize_t)sizeof(h) ||
+      ftruncate(out, done > pos ? done : pos) < 0) {
+    perror("write(compress header)");
+    return -1;
+  }
+  if (stats) {
+    atomic_fetch_add(&stats->files, 1);
+    atomic_fetch_add(&stats->bytes_in, (unsigned long long)done);
+    atomic_fetch_add(&stats->bytes_out, (unsigned long long)pos);
+  }
+  return 0;
+}
+
+static int pack_fd(int in, int out, const struct stat *st, CompressStats *stats,
+                   volatile sig_atomic_t *stop_flag) {
+  unsigned char *raw = malloc(COMPRESS_BLOCK);
+  if (!raw) {
+    fprintf(stderr, "compress buffer allocation failed\n");
+    return -1;
+  }
+  size_t want = st->st_size < COMPRESS_BLOCK ? (size_t)st->st_size
+                                             : COMPRESS_BLOCK;
+  ssize_t first = pread_full(in, raw, want, 0);
+  if (first < 0) {
+    perror("pread(compress)");
+    free(raw);
+    return -1;
+  }
+
+  // small files and ones that start out incompressible keep the fast
+  // paths of copy_fd (clone, copy_file_range)
+  int must_pack = first >= 8 && memcmp(raw, COMPRESS_MAGIC, 8) == 0;
+  int ret = 1;
+  if (must_pack ||
+      (st->st_size > (off_t)st->st_blksize && compress_probe(raw, first)))
+    ret = pack_blocks(in, out, st->st_size, raw, (size_t)first, must_pack,
+                      stats, stop_flag);
+  free(raw);
+  if (ret <= 0)
+    return ret;
+
+  if (stats)
+    atomic_fetch_add(&stats->plain, 1);
+  if (ftruncate(out, 0) < 0) {
+    perror("ftruncate(compress)");
+    return -1;
+  }
+  return copy_fd(in, out, st->st_size, stop_flag);
+}
+
+// the source mtime goes with the data, as in copy_file_from_fd
+static int finish_copy(int out, const struct stat *st, int ret) {
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  if (ret == 0 && futimens(out, times) < 0) {
+    perror("futimens(compress)");
+    ret = -1;
+  }
+  int saved = errno;
+  if (close(out) < 0) {
+    perror("close");
+    return -1;
+  }
+  errno = saved;
+  return ret;
+}
+
+int compress_file(const char *src, const char *dst, mode_t mode,
+                  CompressStats *stats, volatile sig_atomic_t *stop_flag) {
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    perror("open src");
+    return -1;
+  }
+  struct stat st;
+  int ret = -1;
+  if (fstat(in, &st) < 0) {
+    perror("fstat src");
+  } else {
+    st.st_mode = mode;
+    int out = open_copy_dst(dst, &st);
+    if (out >= 0)
+      ret = finish_copy(out, &st, pack_fd(in, out, &st, stats, stop_flag));
+  }
+  close(in);
+  return ret;
+}
+
+// unpacks the container in (header h) into the empty file out; blocks of
+// zeros stay holes
+static int unpack_fd(int in, int out, const CompressHeader *h,
+                     const char *path, volatile sig_atomic_t *stop_flag) {
+  unsigned char *raw = malloc(COMPRESS_BLOCK);
+  unsigned char *packed = malloc(COMPRESS_BLOCK);
+  if (!raw || !packed) {
+    fprintf(stderr, "decompress buffer allocation failed\n");
+    free(raw);
+    free(packed);
+    return -1;
+  }
+  HashState hs;
+  hash_init(&hs, 0);
+  uint64_t done = 0, pos = sizeof(*h);
+  int ret = 0, corrupt = 0;
+  while (done < h->size) {
+    if (*stop_flag) {
+      errno = EINTR;
+      ret = -1;
+      break;
+    }
+    size_t want = h->size - done < COMPRESS_BLOCK ? (size_t)(h->size - done)
+                                                  : COMPRESS_BLOCK;
+    uint32_t word;
+    if (pos + sizeof(word) > h->data_len ||
+        pread_full(in, &word, sizeof(word), (off_t)pos) != sizeof(word)) {
+      corrupt = 1;
+      break;
+    }
+    pos += sizeof(word);
+    size_t len = word & ~COMPRESS_BLOCK_RAW;
+    if (len > COMPRESS_BLOCK || pos + len > h->data_len ||
+        ((word & COMPRESS_BLOCK_RAW) && len != want) ||
+        (word == 0 && len != 0)) {
+      corrupt = 1;
+      break;
+    }
+    if (word == 0) {
+      memset(raw, 0, want);
+    } else {
+      unsigned char *buf = (word & COMPRESS_BLOCK_RAW) ? raw : packed;
+      if (pread_full(in, buf, len, (off_t)pos) != (ssize_t)len ||
+          (buf == packed && lz_decompress(packed, len, raw, want) !=
+                                (ssize_t)want)) {
+        corrupt = 1;
+        break;
+      }
+      struct iovec iov = {raw, want};
+      if (pwritev_full(out, &iov, 1, (off_t)done) < 0) {
+        perror("pwrite(decompress)");
+        ret = -1;
+        break;
+      }
+    }
+    hash_update(&hs, raw, want);
+    pos += len;
+    done += want;
+  }
+  free(raw);
+  free(packed);
+  if (ret == 0 && !corrupt && ftruncate(out, (off_t)h->size) < 0) {
+    perror("ftruncate(decompress)");
+    ret = -1;
+  }
+  if (ret == 0 && (corrupt || hash_final(&hs) != h->content_hash)) {
+    fprintf(stderr, "corrupt compressed file \"%s\"\n", path);
+    errno = EBADMSG;
+    ret = -1;
+  }
+  return ret;
+}
+
+int decompress_file(const char *src, const char *dst, mode_t mode,
+                    volatile sig_atomic_t *stop_flag) {
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    perror("open src");
+    return -1;
+  }
+  struct stat st;
+  CompressHeader h;
+  int ret = -1, packed = -1;
+  if (fstat(in, &st) < 0)
+    perror("fstat src");
+  else
+    packed = read_header(in, &st, &h);
+  st.st_mode = mode;
+  if (packed == 0) {
+    ret = copy_file_from_fd(in, &st, dst, stop_flag);
+  } else if (packed > 0) {
+    int out = open_copy_dst(dst, &st);
+    if (out >= 0)
+      ret = finish_copy(out, &st, unpack_fd(in, out, &h, src, stop_flag));
+  }
+  close(in);
+  return ret;
+}
+
+int compress_content_hash(const char *path, uint64_t *out) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open(compress hash)");
+    return -1;
+  }
+  struct stat st;
+  CompressHeader h;
+  int packed = fstat(fd, &st) == 0 ? read_header(fd, &st, &h) : -1;
+  int ret = -1;
+  if (packed > 0) {
+    *out = h.content_hash;
+    ret = 0;
+  } else if (packed == 0) {
+    ret = hash_fd(fd, out);
+  }
+  close(fd);
+  return ret;
+}
+
+static int marker_path(const char *dst_real, char out[PATH_MAX]) {
+  if (snprintf(out, PATH_MAX, "%s.meta/" COMPRESS_MARKER, dst_real) >=
+      PATH_MAX) {
+    fprintf(stderr, "Name too long(compress marker)\n");
+    return -1;
+  }
+  return 0;
+}
+
+int compress_mark(const char *dst_real, int on) {
+  char path[PATH_MAX], dir[PATH_MAX];
+  if (marker_path(dst_real, path) < 0)
+    return -1;
+  if (!on)
+    return unlink(path) < 0 && errno != ENOENT ? -1 : 0;
+
+  snprintf(dir, PATH_MAX, "%s.meta", dst_real);
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    perror("mkdir(compress marker)");
+    return -1;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror("open(compress marker)");
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+int compress_marked(const char *dst_real) {
+  char path[PATH_MAX];
+  return marker_path(dst_real, path) == 0 && access(path, F_OK) == 0;
+}
@@ -0,0 +1,74 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <signal.h>     // sig_atomic_t
+#include <stdatomic.h>
+#include <stddef.h>     // size_t
+#include <stdint.h>
+#include <sys/types.h>  // mode_t, ssize_t
+
+// marker next to a target's manifest: its files may be stored compressed
+#define COMPRESS_MARKER "compressed"
+
+// how the copies of a LinkMap are written
+enum { COMPRESS_OFF = 0, COMPRESS_PACK, COMPRESS_UNPACK };
+
+// A compressed file is a container: a CompressHeader, then the contents in
+// COMPRESS_BLOCK-sized blocks, each a 32-bit word and its payload. The file
+// keeps the size of its contents: the container sits at the start and the
+// rest is a hole, so targets are still compared to their sources by size
+// and mtime, and only the container is ever written or takes space. A
+// source file beginning with the magic is always packed, so no plain file
+// of a compressed target passes for a container.
+#define COMPRESS_MAGIC "SOPLZ01\n"
+#define COMPRESS_BLOCK (64 * 1024)
+// word flag: the payload is the block as it is; a word of 0 is a block of
+// zeros with no payload, which unpacks to a hole
+#define COMPRESS_BLOCK_RAW 0x80000000u
+
+typedef struct {
+  char magic[8];
+  uint64_t size;         // of the contents
+  uint64_t data_len;     // of the container, header included
+  uint64_t content_hash; // hash_final of the contents, seed 0
+  uint32_t block_size;
+  uint32_t check;        // of the fields above
+} CompressHeader;
+
+typedef struct {
+  atomic_ullong files;     // written as containers
+  atomic_ullong bytes_in;  // their contents
+  atomic_ullong bytes_out; // ...and what was written for them
+  atomic_ullong plain;     // copied as they are: small or incompressible
+} CompressStats;
+
+// LZ4-style block codec: literal runs and matches of at least 4 bytes up to
+// 64 KiB back, no entropy coding, so it runs at memory-bandwidth-like speed.
+// Returns the packed size, or 0 when it would not be below cap.
+size_t lz_compress(const void *in, size_t n, void *out, size_t cap);
+// Returns the unpacked size, or -1 when in is malformed or needs more than
+// cap bytes; never reads or writes out of bounds.
+ssize_t lz_decompress(const void *in, size_t n, void *out, size_t cap);
+
+// Byte entropy of a sample of data: 0 when it looks incompressible
+// (compressed, encrypted, media), which is cheaper to tell than to try.
+int compress_probe(const void *data, size_t len);
+
+// copy_file writing a container when that saves at least a filesystem
+// block, the plain contents otherwise. stats may be NULL.
+int compress_file(const char *src, const char *dst, mode_t mode,
+                  CompressStats *stats, volatile sig_atomic_t *stop_flag);
+// copy_file unpacking src when it is a container; the contents are checked
+// against the hash in its header.
+int decompress_file(const char *src, const char *dst, mode_t mode,
+                    volatile sig_atomic_t *stop_flag);
+// Content hash of what the file stands for: a container answers with the
+// hash in its header, anything else is read.
+int compress_content_hash(const char *path, uint64_t *out);
+
+// Records in dst_real's metadata whether it may hold containers, which
+// restore has to know.
+int compress_mark(const char *dst_real, int on);
+int compress_marked(const char *dst_real);
+
+#endif
@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include "copy_engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "io_utils.h"
+
+typedef ssize_t (*copy_chunk_fn)(int in, int out, size_t count, char *buf);
+
+static ssize_t chunk_copy_file_range(int in, int out, size_t count, char *buf) {
+  return copy_file_range(in, NULL, out, NULL, count, 0);
+}
+
+static ssize_t chunk_sendfile(int in, int out, size_t count, char *buf) {
+  return sendfile(out, in, NULL, count);
+}
+
+static ssize_t chunk_read_write(int in, int out, size_t count, char *buf) {
+  if (count > COPY_RW_BUF)
+    count = COPY_RW_BUF;
+  ssize_t r = bulk_read(in, buf, count);
+  if (r <= 0)
+    return r;
+  if (bulk_write(out, buf, (size_t)r) < 0)
+    return -1;
+  return r;
+}
+
+static const copy_chunk_fn engines[COPY_ENGINE_COUNT] = {
+    [COPY_ENGINE_RANGE] = chunk_copy_file_range,
+    [COPY_ENGINE_SENDFILE] = chunk_sendfile,
+    [COPY_ENGINE_RW] = chunk_read_write,
+};
+
+// set once the kernel told us a syscall does not exist at all
+static atomic_int engine_missing[COPY_ENGINE_COUNT];
+
+// errors meaning "this engine can't do this pair of fds", not a real failure
+static int engine_unsupported(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+         err == ENOTSUP || err == EBADF;
+}
+
+ssize_t copy_fd_range(int in, int out, off_t len,
+                      volatile sig_atomic_t *stop_flag) {
+  int kind = COPY_ENGINE_RANGE;
+  while (kind < COPY_ENGINE_COUNT && atomic_load(&engine_missing[kind]))
+    kind++;
+
+  char *buf = NULL;
+  off_t done = 0;
+  while (done < len) {
+    if (*stop_flag) {
+      free(buf);
+      errno = EINTR;
+      return -1;
+    }
+
+    if (kind == COPY_ENGINE_RW && !buf) {
+      if (posix_memalign((void **)&buf, 4096, COPY_RW_BUF) != 0) {
+        fprintf(stderr, "copy buffer allocation failed\n");
+        return -1;
+      }
+    }
+
+    size_t count = (size_t)(len - done);
+    if (count > COPY_CHUNK)
+      count = COPY_CHUNK;
+
+    ssize_t c = engines[kind](in, out, count, buf);
+    if (c < 0) {
+      if (errno == EINTR)
+        continue;
+      // RW is the last resort, any error from it is final
+      if (kind + 1 < COPY_ENGINE_COUNT && engine_unsupported(errno)) {
+        if (errno == ENOSYS)
+          atomic_store(&engine_missing[kind], 1);
+        kind++;
+        continue;
+      }
+      perror("copy_fd_range");
+      free(buf);
+      return -1;
+    }
+    if (c == 0)
+      break; // EOF, the source got shorter than expected
+    done += c;
+  }
+
+  free(buf);
+  return (ssize_t)done;
+}
+
+#ifndef BCACHEFS_SUPER_MAGIC
+#define BCACHEFS_SUPER_MAGIC 0xca451a4e
+#endif
+
+#define CLONE_PAIRS_MAX 16
+
+// what we know about reflinking from one device to another:
+// 0 = looks possible, not tried yet; 1 = works; -1 = doesn't
+typedef struct {
+  dev_t src_dev;
+  dev_t dst_dev;
+  int state;
+} ClonePair;
+
+static ClonePair clone_pairs[CLONE_PAIRS_MAX];
+static size_t clone_pairs_count;
+static pthread_mutex_t clone_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long fs_type(int fd) {
+  struct statfs sfs;
+  if (fstatfs(fd, &sfs) < 0)
+    return 0;
+  return (long)sfs.f_type;
+}
+
+static int fs_type_can_clone(long type) {
+  switch (type) {
+  case BTRFS_SUPER_MAGIC:
+  case XFS_SUPER_MAGIC:
+  case OCFS2_SUPER_MAGIC:
+  case NFS_SUPER_MAGIC:
+  case BCACHEFS_SUPER_MAGIC:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// caller holds clone_lock
+static ClonePair *clone_pair_get(int in, int out) {
+  struct stat in_st, out_st;
+  if (fstat(in, &in_st) < 0 || fstat(out, &out_st) < 0)
+    return NULL;
+
+  for (size_t i = 0; i < clone_pairs_count; i++) {
+    if (clone_pairs[i].src_dev == in_st.st_dev &&
+        clone_pairs[i].dst_dev == out_st.st_dev) {
+      return &clone_pairs[i];
+    }
+  }
+
+  // statfs only rules out filesystems that never share extents; the first
+  // real clone decides for the rest (btrfs subvolumes, NFS servers, ...)
+  long type = fs_type(in);
+  int state = (fs_type_can_clone(type) && fs_type(out) == type) ? 0 : -1;
+
+  if (clone_pairs_count == CLONE_PAIRS_MAX)
+    clone_pairs_count--;
+  ClonePair *pair = &clone_pairs[clone_pairs_count++];
+  pair->src_dev = in_st.st_dev;
+  pair->dst_dev = out_st.st_dev;
+  pair->state = state;
+  return pair;
+}
+
+static void clone_pair_set(int in, int out, int state) {
+  pthread_mutex_lock(&clone_lock);
+  ClonePair *pair = clone_pair_get(in, out);
+  if (pair)
+    pair->state = state;
+  pthread_mutex_unlock(&clone_lock);
+}
+
+int clone_supported(int in, int out) {
+  pthread_mutex_lock(&clone_lock);
+  ClonePair *pair = clone_pair_get(in, out);
+  int supported = pair && pair->state >= 0;
+  pthread_mutex_unlock(&clone_lock);
+  return supported;
+}
+
+static int clone_refused(int err) {
+  return err == EOPNOTSUPP || err == ENOTSUP || err == EXDEV ||
+         err == ENOTTY || err == ENOSYS;
+}
+
+int clone_fd(int in, int out) {
+  if (ioctl(out, FICLONE, in) < 0) {
+    // EINVAL is about this file (btrfs nodatacow, mismatched flags), the
+    // next one may still clone
+    if (clone_refused(errno))
+      clone_pair_set(in, out, -1);
+    return -1;
+  }
+  clone_pair_set(in, out, 1);
+  return 0;
+}
+
+int clone_fd_range(int in, int out, off_t offset, off_t len) {
+  struct file_clone_range range = {
+      .src_fd = in,
+      .src_offset = (__u64)offset,
+      .src_length = (__u64)len,
+      .dest_offset = (__u64)offset,
+  };
+  if (ioctl(out, FICLONERANGE, &range) < 0) {
+    // EINVAL here is usually an unaligned range, not a missing feature
+    if (clone_refused(errno))
+      clone_pair_set(in, out, -1);
+    return -1;
+  }
+  return 0;
+}
+
+void extents_init(FileExtents *e, int fd) {
+  e->fd = fd;
+  e->data = 0;
+  e->hole = 0;
+}
+
+int extents_hole(FileExtents *e, off_t off, off_t len) {
+  if (off >= e->hole) {
+    // past the known extent: look up the next one
+    off_t data = lseek(e->fd, off, SEEK_DATA);
+    off_t hole = data >= 0 ? lseek(e->fd, data, SEEK_HOLE) : -1;
+    if (data < 0 && errno == ENXIO) {
+      data = hole = INT64_MAX; // nothing but a hole up to EOF
+    } else if (data < 0 || hole < 0) {
+      data = off;              // no SEEK_DATA here: treat it all as data
+      hole = INT64_MAX;
+    }
+    e->data = data;
+    e->hole = hole;
+  }
+  return off < e->data && e->data - off >= len;
+}
+
+int punch_hole(int fd, off_t off, off_t len) {
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+}
+
+// fewer blocks than the size needs: there are holes worth keeping
+static int fd_is_sparse(int fd, off_t size) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && (off_t)st.st_blocks * 512 < size;
+}
+
+// copies the data extents only; the gaps are never written, so they stay
+// holes in the (empty) out. Returns 1 when the filesystem can't tell where
+// the holes are.
+static int copy_sparse(int in, int out, off_t size,
+                       volatile sig_atomic_t *stop_flag) {
+  off_t pos = 0;
+  while (pos < size) {
+    off_t data = lseek(in, pos, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO)
+        break; // only a hole left
+      if (pos == 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+        return 1;
+      perror("lseek(SEEK_DATA)");
+      return -1;
+    }
+    if (data >= size)
+      break;
+    off_t hole = lseek(in, data, SEEK_HOLE);
+    if (hole < 0) {
+      perror("lseek(SEEK_HOLE)");
+      return -1;
+    }
+    if (hole > size)
+      hole = size;
+
+    if (lseek(in, data, SEEK_SET) < 0 || lseek(out, data, SEEK_SET) < 0) {
+      perror("lseek(copy_sparse)");
+      return -1;
+    }
+    ssize_t copied = copy_fd_range(in, out, hole - data, stop_flag);
+    if (copied < 0)
+      return -1;
+    pos = data + copied;
+    if (copied < hole - data) {
+      size = pos; // the source got shorter than expected
+      break;
+    }
+  }
+
+  // a trailing hole only exists as file size
+  if (ftruncate(out, size) < 0) {
+    perror("ftruncate");
+    return -1;
+  }
+  return 0;
+}
+
+int copy_fd(int in, int out, off_t size, volatile sig_atomic_t *stop_flag) {
+  // same CoW volume: share the extents instead of copying them
+  if (size > 0 && clone_supported(in, out) && clone_fd(in, out) == 0)
+    return 0;
+
+  // no preallocation here, it would fill the holes in
+  if (size > 0 && fd_is_sparse(in, size)) {
+    int ret = copy_sparse(in, out, size, stop_flag);
+    if (ret <= 0)
+      return ret;
+  }
+
+  // reserve the blocks up front so big files don't fragment; KEEP_SIZE leaves
+  // the visible size alone in case the source shrinks while we copy
+  if (size > 0 && fallocate(out, FALLOC_FL_KEEP_SIZE, 0, size) < 0 &&
+      errno != EOPNOTSUPP && errno != ENOSYS) {
+    perror("fallocate");
+    return -1;
+  }
+
+  ssize_t copied = copy_fd_range(in, out, size, stop_flag);
+  if (copied < 0)
+    return -1;
+
+  // drop preallocated blocks past what we actually wrote
+  if (copied < size && ftruncate(out, copied) < 0) {
+    perror("ftruncate");
+    return -1;
+  }
+  return 0;
+}
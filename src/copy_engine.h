@@ -0,0 +1,58 @@
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#include <signal.h>     // sig_atomic_t
+#include <sys/types.h>  // off_t, ssize_t
+
+// Engines are tried in this order; a later one picks up at the current file
+// offsets when an earlier one is not supported for the given pair of fds.
+typedef enum {
+  COPY_ENGINE_RANGE = 0, // copy_file_range(2), in-kernel (may reflink)
+  COPY_ENGINE_SENDFILE,  // sendfile(2), in-kernel page cache copy
+  COPY_ENGINE_RW,        // read/write through a large aligned buffer
+  COPY_ENGINE_COUNT
+} CopyEngineKind;
+
+// chunk size between stop_flag checks for the in-kernel engines
+#define COPY_CHUNK (8 * 1024 * 1024)
+// user-space buffer of the read/write fallback
+#define COPY_RW_BUF (1024 * 1024)
+
+// Copies up to len bytes from the current offset of in to the current offset
+// of out, stopping early at EOF. Returns the number of bytes copied or -1
+// (errno == EINTR when stop_flag was raised).
+ssize_t copy_fd_range(int in, int out, off_t len,
+                      volatile sig_atomic_t *stop_flag);
+
+// Copies a whole regular file of the given size into the empty file out. On
+// filesystems that share extents (btrfs, XFS, ...) the file is cloned instead
+// of copied. A sparse source has only its data extents copied, so its holes
+// stay holes; otherwise out is preallocated, filled from in and trimmed to
+// what was actually copied.
+int copy_fd(int in, int out, off_t size, volatile sig_atomic_t *stop_flag);
+
+// Where a file's data is, found with SEEK_DATA/SEEK_HOLE one extent at a
+// time as the caller moves forward through the file.
+typedef struct {
+  int fd;
+  off_t data; // current data extent is [data, hole)
+  off_t hole;
+} FileExtents;
+
+void extents_init(FileExtents *e, int fd);
+// 1 when [off, off + len) lies entirely in a hole. Offsets must not go
+// backwards between calls, and fd's file offset moves. Without SEEK_DATA
+// support everything is data.
+int extents_hole(FileExtents *e, off_t off, off_t len);
+// Deallocates a range without changing the file size; -1 when the filesystem
+// can't, and the caller has to write zeros instead.
+int punch_hole(int fd, off_t off, off_t len);
+
+// Reflink helpers. clone_supported() checks once per (src, dst) device pair
+// whether FICLONE works between them and remembers the answer; the clone
+// calls return -1 when the kernel refuses so callers can fall back to copying.
+int clone_supported(int in, int out);
+int clone_fd(int in, int out);
+int clone_fd_range(int in, int out, off_t offset, off_t len);
+
+#endif
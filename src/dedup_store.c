@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include "dedup_store.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "filesystem_utils.h"
+#include "hash.h"
+
+// first two hex digits of the hash pick one of 256 subdirectories
+#define OBJECT_NAME_MAX 96
+
+static void object_name(char out[OBJECT_NAME_MAX], const uint64_t h[2],
+                        const struct stat *st, mode_t mode) {
+  snprintf(out, OBJECT_NAME_MAX,
+           "%02x/%014" PRIx64 "%016" PRIx64 "-%03o-%lld.%09ld",
+           (unsigned)(h[0] >> 56), (uint64_t)(h[0] & 0x00FFFFFFFFFFFFFFull), h[1],
+           (unsigned)(mode & 0777), (long long)st->st_mtim.tv_sec,
+           st->st_mtim.tv_nsec);
+}
+
+DedupStore *dedup_store_open(const char *root, const char *dst_real) {
+  DedupStore *ds = calloc(1, sizeof(*ds));
+  if (!ds) {
+    fprintf(stderr, "dedup store calloc failed\n");
+    return NULL;
+  }
+  if (snprintf(ds->root, PATH_MAX, "%s", root) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(dedup store)\n");
+    free(ds);
+    return NULL;
+  }
+  struct stat root_st, dst_st;
+  if (mkdir_p(root, 0700) < 0 ||
+      (ds->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    perror("open(dedup store)");
+    free(ds);
+    return NULL;
+  }
+  if (fstat(ds->root_fd, &root_st) < 0 || lstat(dst_real, &dst_st) < 0 ||
+      root_st.st_dev != dst_st.st_dev) {
+    fprintf(stderr, "dedup store \"%s\" is not on the filesystem of \"%s\"\n",
+            root, dst_real);
+    dedup_store_close(ds);
+    return NULL;
+  }
+  ds->dev = root_st.st_dev;
+
+  // objects are written unnamed and linked in once complete
+  int probe = openat(ds->root_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600);
+  if (probe < 0) {
+    perror("O_TMPFILE(dedup store)");
+    dedup_store_close(ds);
+    return NULL;
+  }
+  close(probe);
+  return ds;
+}
+
+void dedup_store_close(DedupStore *ds) {
+  if (!ds)
+    return;
+  close(ds->root_fd);
+  free(ds);
+}
+
+// dst_path becomes a link to the object, replacing what was there
+static int link_object(DedupStore *ds, const char *name, const char *dst_path) {
+  if (linkat(ds->root_fd, name, AT_FDCWD, dst_path, 0) == 0)
+    return 0;
+  if (errno != EEXIST)
+    return -1;
+
+  struct stat obj, dst;
+  if (fstatat(ds->root_fd, name, &obj, AT_SYMLINK_NOFOLLOW) == 0 &&
+      lstat(dst_path, &dst) == 0 && obj.st_ino == dst.st_ino &&
+      obj.st_dev == dst.st_dev)
+    return 0;
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, PATH_MAX, "%s.sop-dedup~", dst_path) >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  unlink(tmp);
+  if (linkat(ds->root_fd, name, AT_FDCWD, tmp, 0) < 0)
+    return -1;
+  if (rename(tmp, dst_path) < 0) {
+    int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    return -1;
+  }
+  return 0;
+}
+
+// dst_path becomes the unnamed file behind proc, outside the store
+static int link_private(const char *proc, const char *dst_path) {
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, PATH_MAX, "%s.sop-dedup~", dst_path) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(dedup)\n");
+    return -1;
+  }
+  unlink(tmp);
+  if (linkat(AT_FDCWD, proc, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) < 0 ||
+      rename(tmp, dst_path) < 0) {
+    perror("link(dedup private copy)");
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+#define COMPARE_CHUNK (64 * 1024)
+
+// whether the first size bytes of a and b are the same; -1 on read errors
+static int same_contents(int a, int b, off_t size) {
+  char *buf = malloc(2 * COMPARE_CHUNK);
+  if (!buf) {
+    fprintf(stderr, "dedup compare buffer allocation failed\n");
+    return -1;
+  }
+  int ret = 1;
+  for (off_t off = 0; off < size && ret == 1;) {
+    size_t want = (size - off < COMPARE_CHUNK) ? (size_t)(size - off)
+                                                : COMPARE_CHUNK;
+    ssize_t x = TEMP_FAILURE_RETRY(pread(a, buf, want, off));
+    ssize_t y = TEMP_FAILURE_RETRY(pread(b, buf + COMPARE_CHUNK, want, off));
+    if (x < 0 || y < 0) {
+      perror("pread(dedup compare)");
+      ret = -1;
+    } else if (x != y || x == 0 ||
+               memcmp(buf, buf + COMPARE_CHUNK, (size_t)x) != 0) {
+      ret = 0;
+    } else {
+      off += x;
+    }
+  }
+  free(buf);
+  return ret;
+}
+
+// links the stored object under name to dst_path if it holds exactly what
+// fd (size bytes) does; 0 when there is none to reuse
+static int reuse_object(DedupStore *ds, const char *name, int fd,
+                        const char *dst_path, off_t size) {
+  int obj_fd = openat(ds->root_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (obj_fd < 0)
+    return 0;
+  struct stat obj;
+  int same = fstat(obj_fd, &obj) == 0 && S_ISREG(obj.st_mode) &&
+             obj.st_size == size;
+  // the name is only a hash: different contents under it stay apart
+  if (same)
+    same = same_contents(fd, obj_fd, size);
+  close(obj_fd);
+  if (same < 0)
+    return -1;
+  if (!same)
+    return 0;
+  // the object vanished (collected meanwhile) or has all the links the
+  // filesystem allows: a new one is written
+  if (link_object(ds, name, dst_path) < 0)
+    return errno == ENOENT || errno == EMLINK ? 0 : -1;
+  atomic_fetch_add(&ds->shared, 1);
+  atomic_fetch_add(&ds->bytes_saved, (unsigned long long)size);
+  return 1;
+}
+
+// writes in's contents into a new object and links it to dst_path
+static int store_object(DedupStore *ds, int in, const struct stat *src_st,
+                        mode_t mode, const char *dst_path,
+                        volatile sig_atomic_t *stop_flag) {
+  int out = openat(ds->root_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (out < 0) {
+    perror("O_TMPFILE(dedup object)");
+    return -1;
+  }
+  struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+  if (copy_fd(in, out, src_st->st_size, stop_flag) < 0 ||
+      fchmod(out, mode & 0777) < 0 || futimens(out, times) < 0) {
+    if (!*stop_flag)
+      perror("write(dedup object)");
+    close(out);
+    return -1;
+  }
+
+  // named after what was copied, the source may have changed since it was
+  // hashed
+  uint64_t h[2];
+  struct stat st;
+  char name[OBJECT_NAME_MAX], proc[64];
+  if (hash_fd128(out, h) < 0 || fstat(out, &st) < 0) {
+    close(out);
+    return -1;
+  }
+  object_name(name, h, &st, mode);
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", out);
+  char sub[3] = {name[0], name[1], '\0'};
+  if (mkdirat(ds->root_fd, sub, 0700) < 0 && errno != EEXIST) {
+    perror("mkdir(dedup store)");
+    close(out);
+    return -1;
+  }
+
+  // until dst_path links it the new object has a single link, which a
+  // collection by another target may take away: named again from the still
+  // open file then
+  int ret = -1;
+  for (int attempt = 0; attempt < 3 && ret < 0; attempt++) {
+    if (linkat(AT_FDCWD, proc, ds->root_fd, name, AT_SYMLINK_FOLLOW) < 0) {
+      if (errno != EEXIST) {
+        perror("linkat(dedup object)");
+        break;
+      }
+      // another target stored the same contents meanwhile
+      int reused = reuse_object(ds, name, out, dst_path, st.st_size);
+      if (reused < 0)
+        break;
+      if (reused > 0) {
+        ret = 0;
+        break;
+      }
+      // ...but it is different or can't take more links: this copy stays
+      // the target's own
+      ret = link_private(proc, dst_path);
+      break;
+    }
+    if (link_object(ds, name, dst_path) == 0) {
+      atomic_fetch_add(&ds->stored, 1);
+      ret = 0;
+    } else if (errno != ENOENT) {
+      perror("link(dedup object)");
+      break;
+    }
+  }
+  close(out);
+  return ret;
+}
+
+int dedup_store_file(DedupStore *ds, const char *src_path, const char *dst_path,
+                     const struct stat *st, volatile sig_atomic_t *stop_flag) {
+  int in = open(src_path, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    perror("open src");
+    return -1;
+  }
+  struct stat src_st;
+  uint64_t h[2];
+  char name[OBJECT_NAME_MAX];
+  int ret = -1;
+  if (fstat(in, &src_st) < 0 || hash_fd128(in, h) < 0)
+    goto out;
+
+  // contents already stored cost one hash pass over the source and a link
+  object_name(name, h, &src_st, st->st_mode);
+  ret = reuse_object(ds, name, in, dst_path, src_st.st_size);
+  if (ret == 0)
+    ret = store_object(ds, in, &src_st, st->st_mode, dst_path, stop_flag);
+  else if (ret > 0)
+    ret = 0;
+
+out:
+  close(in);
+  return ret;
+}
+
+static int marker_path(const char *dst_real, char out[PATH_MAX]) {
+  if (snprintf(out, PATH_MAX, "%s.meta/" DEDUP_MARKER, dst_real) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(dedup marker)\n");
+    return -1;
+  }
+  return 0;
+}
+
+int dedup_store_mark(const char *dst_real, const char *root) {
+  char path[PATH_MAX], dir[PATH_MAX];
+  if (marker_path(dst_real, path) < 0)
+    return -1;
+  if (!root)
+    return unlink(path) < 0 && errno != ENOENT ? -1 : 0;
+
+  snprintf(dir, PATH_MAX, "%s.meta", dst_real);
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    perror("mkdir(dedup marker)");
+    return -1;
+  }
+  FILE *f = fopen(path, "we");
+  if (!f) {
+    perror("fopen(dedup marker)");
+    return -1;
+  }
+  fprintf(f, "%s\n", root);
+  if (fclose(f) != 0) {
+    perror("fclose(dedup marker)");
+    return -1;
+  }
+  return 0;
+}
+
+int dedup_store_marked(const char *dst_real) {
+  char path[PATH_MAX];
+  return marker_path(dst_real, path) == 0 && access(path, F_OK) == 0;
+}
+
+// collects one of the 256 subdirectories
+static int gc_dir(DedupStore *ds, const char *sub, unsigned long long *removed,
+                  unsigned long long *bytes_freed) {
+  int fd = openat(ds->root_fd, sub, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -1;
+  DIR *d = fdopendir(fd);
+  if (!d) {
+    close(fd);
+    return -1;
+  }
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    struct stat st;
+    if (entity->d_name[0] == '.' ||
+        fstatat(fd, entity->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+        !S_ISREG(st.st_mode) || st.st_nlink != 1)
+      continue;
+    if (unlinkat(fd, entity->d_name, 0) == 0) {
+      (*removed)++;
+      *bytes_freed += (unsigned long long)st.st_blocks * 512;
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+int dedup_store_gc(DedupStore *ds, unsigned long long *removed,
+                   unsigned long long *bytes_freed) {
+  *removed = 0;
+  *bytes_freed = 0;
+  int ret = 0;
+  for (int i = 0; i < 256; i++) {
+    char sub[3];
+    snprintf(sub, sizeof(sub), "%02x", i);
+    if (gc_dir(ds, sub, removed, bytes_freed) < 0) {
+      perror("gc(dedup store)");
+      ret = -1;
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,62 @@
+#ifndef DEDUP_STORE_H
+#define DEDUP_STORE_H
+
+#include <signal.h>     // sig_atomic_t
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/types.h>  // dev_t
+
+#include "config.h"
+
+// marker next to a target's manifest: its files are links into a store
+#define DEDUP_MARKER "dedup"
+
+// A content-addressed object store shared by any number of targets on one
+// filesystem. Every regular file of a target is a hard link to an object
+// named after its contents, so identical files across all targets take the
+// space once. An object's link count is its reference count: one link is
+// the store's own, the rest are target files. Objects are never written to
+// after they get their name; a target file that changes is re-linked to
+// another object, never written through.
+//
+// Contents alone don't make an object: links share one inode and with it
+// mode and mtime, which the targets are compared by, so those are part of
+// the name too. The content part is a fast, not a cryptographic, hash, so a
+// name match is confirmed byte by byte before anything is linked to it.
+typedef struct DedupStore {
+  char root[PATH_MAX];
+  int root_fd;
+  dev_t dev;
+  atomic_ullong stored;      // new objects written
+  atomic_ullong shared;      // files linked to an object already there
+  atomic_ullong bytes_saved; // ...and the bytes they didn't take
+} DedupStore;
+
+// Opens (creating it if needed) the store at root for the target at
+// dst_real, which must be on the same filesystem.
+DedupStore *dedup_store_open(const char *root, const char *dst_real);
+void dedup_store_close(DedupStore *ds);
+
+// Makes dst_path a link to the object holding src_path's contents with
+// st's mode, storing it first when it is new. Replaces whatever dst_path
+// was atomically.
+int dedup_store_file(DedupStore *ds, const char *src_path, const char *dst_path,
+                     const struct stat *st, volatile sig_atomic_t *stop_flag);
+
+// Records in dst_real's metadata whether its files are links into a store
+// (root, or NULL when they are not), which restore has to know: links
+// there don't mean the source had links.
+int dedup_store_mark(const char *dst_real, const char *root);
+int dedup_store_marked(const char *dst_real);
+
+// while target files keep being removed, unused objects are collected at
+// most this often (seconds)
+#define DEDUP_GC_INTERVAL 60
+
+// Removes objects no target file links to any more. Racing a target that
+// is just linking one of them only costs that target a second copy of the
+// contents, never the file.
+int dedup_store_gc(DedupStore *ds, unsigned long long *removed,
+                   unsigned long long *bytes_freed);
+
+#endif
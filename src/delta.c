@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include "delta.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "filesystem_utils.h"
+#include "hash.h"
+
+#define SLOT_EMPTY ((size_t)-1)
+
+static size_t blocks_for(off_t size) {
+  return (size_t)((size + DELTA_BLOCK - 1) / DELTA_BLOCK);
+}
+
+static size_t block_len(off_t size, size_t b) {
+  off_t off = (off_t)b * DELTA_BLOCK;
+  if (off >= size)
+    return 0;
+  return (size - off < DELTA_BLOCK) ? (size_t)(size - off) : DELTA_BLOCK;
+}
+
+static ssize_t pread_full(int fd, char *buf, size_t count, off_t off) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t r = TEMP_FAILURE_RETRY(pread(fd, buf + done, count - done,
+                                         off + (off_t)done));
+    if (r < 0)
+      return -1;
+    if (r == 0)
+      break;
+    done += (size_t)r;
+  }
+  return (ssize_t)done;
+}
+
+static ssize_t pwrite_full(int fd, const char *buf, size_t count, off_t off) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t w = TEMP_FAILURE_RETRY(pwrite(fd, buf + done, count - done,
+                                          off + (off_t)done));
+    if (w < 0)
+      return -1;
+    done += (size_t)w;
+  }
+  return (ssize_t)done;
+}
+
+static uint64_t path_hash(const char *path) {
+  return hash64(path, strlen(path), 0);
+}
+
+// slot holding path, or the empty slot ending its probe sequence
+static size_t file_slot(const DeltaCache *cache, const char *path,
+                        uint64_t hash) {
+  size_t mask = cache->slots_capacity - 1;
+  size_t i = (size_t)hash & mask;
+  while (cache->slots[i] != SLOT_EMPTY) {
+    const DeltaFile *f = &cache->files[cache->slots[i]];
+    if (f->hash == hash && strcmp(f->path, path) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int delta_rehash(DeltaCache *cache, size_t new_cap) {
+  size_t *new_slots = malloc(new_cap * sizeof(*new_slots));
+  if (!new_slots) {
+    fprintf(stderr, "delta index malloc failed\n");
+    return -1;
+  }
+  for (size_t i = 0; i < new_cap; i++)
+    new_slots[i] = SLOT_EMPTY;
+
+  free(cache->slots);
+  cache->slots = new_slots;
+  cache->slots_capacity = new_cap;
+  for (size_t i = 0; i < cache->files_count; i++) {
+    const DeltaFile *f = &cache->files[i];
+    cache->slots[file_slot(cache, f->path, f->hash)] = i;
+  }
+  return 0;
+}
+
+// removes slot i and pulls later entries of the cluster back into the gap
+static void slot_delete(DeltaCache *cache, size_t i) {
+  size_t mask = cache->slots_capacity - 1;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (cache->slots[j] == SLOT_EMPTY)
+      break;
+    size_t home = (size_t)cache->files[cache->slots[j]].hash & mask;
+    if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    cache->slots[i] = cache->slots[j];
+    i = j;
+  }
+  cache->slots[i] = SLOT_EMPTY;
+}
+
+static DeltaFile *delta_find(DeltaCache *cache, const char *path) {
+  if (cache->files_count == 0)
+    return NULL;
+  size_t index = cache->slots[file_slot(cache, path, path_hash(path))];
+  return index == SLOT_EMPTY ? NULL : &cache->files[index];
+}
+
+static void use_unlink(DeltaCache *cache, size_t i) {
+  DeltaFile *f = &cache->files[i];
+  if (f->prev != DELTA_NONE)
+    cache->files[f->prev].next = f->next;
+  else
+    cache->newest = f->next;
+  if (f->next != DELTA_NONE)
+    cache->files[f->next].prev = f->prev;
+  else
+    cache->oldest = f->prev;
+}
+
+static void use_push(DeltaCache *cache, size_t i) {
+  DeltaFile *f = &cache->files[i];
+  f->prev = DELTA_NONE;
+  f->next = cache->newest;
+  if (cache->newest != DELTA_NONE)
+    cache->files[cache->newest].prev = i;
+  else
+    cache->oldest = i;
+  cache->newest = i;
+}
+
+// marks the file as the most recently used one
+static void delta_touch(DeltaCache *cache, DeltaFile *f) {
+  size_t i = (size_t)(f - cache->files);
+  if (cache->newest == i)
+    return;
+  use_unlink(cache, i);
+  use_push(cache, i);
+}
+
+static void delta_drop(DeltaCache *cache, size_t i) {
+  DeltaFile *f = &cache->files[i];
+  use_unlink(cache, i);
+  slot_delete(cache, file_slot(cache, f->path, f->hash));
+  cache->cached_blocks -= f->blocks_count;
+  free(f->path);
+  free(f->blocks);
+
+  // the last file fills the gap, everything pointing at it follows
+  size_t last = cache->files_count - 1;
+  if (i != last) {
+    DeltaFile *moved = &cache->files[last];
+    cache->slots[file_slot(cache, moved->path, moved->hash)] = i;
+    if (moved->prev != DELTA_NONE)
+      cache->files[moved->prev].next = i;
+    else
+      cache->newest = i;
+    if (moved->next != DELTA_NONE)
+      cache->files[moved->next].prev = i;
+    else
+      cache->oldest = i;
+    *f = *moved;
+  }
+  cache->files_count--;
+}
+
+static DeltaFile *delta_insert(DeltaCache *cache, const char *path) {
+  if ((cache->files_count + 1) * 2 > cache->slots_capacity &&
+      delta_rehash(cache, cache->slots_capacity ? cache->slots_capacity * 2
+                                                : 64) < 0)
+    return NULL;
+  if (cache->files_count == cache->files_capacity) {
+    size_t new_cap =
+        (cache->files_capacity == 0) ? 16 : (cache->files_capacity * 2);
+    DeltaFile *new_files = realloc(cache->files, new_cap * sizeof(*new_files));
+    if (!new_files) {
+      fprintf(stderr, "delta cache realloc failed\n");
+      return NULL;
+    }
+    cache->files = new_files;
+    cache->files_capacity = new_cap;
+  }
+  if (cache->files_count == 0) {
+    cache->newest = DELTA_NONE;
+    cache->oldest = DELTA_NONE;
+  }
+
+  size_t i = cache->files_count;
+  DeltaFile *f = &cache->files[i];
+  memset(f, 0, sizeof(*f));
+  f->path = strdup(path);
+  if (!f->path)
+    return NULL;
+  f->hash = path_hash(path);
+  cache->slots[file_slot(cache, path, f->hash)] = i;
+  cache->files_count++;
+  use_push(cache, i);
+  return f;
+}
+
+// evicts least recently used files until the block budget fits; keep is the
+// file being worked on and always survives
+static void delta_evict(DeltaCache *cache, const DeltaFile *keep) {
+  while (cache->cached_blocks > DELTA_CACHE_MAX_BLOCKS &&
+         cache->oldest != DELTA_NONE &&
+         &cache->files[cache->oldest] != keep)
+    delta_drop(cache, cache->oldest);
+}
+
+static int delta_resize(DeltaCache *cache, DeltaFile *f, size_t count) {
+  if (count > f->blocks_count) {
+    uint64_t *new_blocks = realloc(f->blocks, count * sizeof(*new_blocks));
+    if (!new_blocks) {
+      fprintf(stderr, "delta signature realloc failed\n");
+      return -1;
+    }
+    memset(new_blocks + f->blocks_count, 0,
+           (count - f->blocks_count) * sizeof(*new_blocks));
+    f->blocks = new_blocks;
+  }
+  cache->cached_blocks = cache->cached_blocks - f->blocks_count + count;
+  f->blocks_count = count;
+  return 0;
+}
+
+static int delta_matches(const DeltaFile *f, const struct stat *st) {
+  return f->size == st->st_size && f->ino == st->st_ino &&
+         f->mtime.tv_sec == st->st_mtim.tv_sec &&
+         f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void delta_remember(DeltaFile *f, const struct stat *st) {
+  f->size = st->st_size;
+  f->mtime = st->st_mtim;
+  f->ino = st->st_ino;
+}
+
+static uint64_t block_sig(const char *buf, size_t n) {
+  return hash_content(buf, n, 0);
+}
+
+static const char zeros[DELTA_BLOCK];
+static uint64_t zero_block_sig;
+static pthread_once_t zero_block_once = PTHREAD_ONCE_INIT;
+
+static void zero_block_init(void) {
+  zero_block_sig = block_sig(zeros, DELTA_BLOCK);
+}
+
+// signature of a block that lies in a hole, without reading it
+static uint64_t zero_sig(size_t n) {
+  if (n != DELTA_BLOCK)
+    return block_sig(zeros, n);
+  pthread_once(&zero_block_once, zero_block_init);
+  return zero_block_sig;
+}
+
+// (re)computes the signatures of the target as it is on disk right now
+static int delta_scan(DeltaCache *cache, DeltaFile *f, int fd,
+                      const struct stat *st, char *buf,
+                      volatile sig_atomic_t *stop_flag) {
+  size_t count = blocks_for(st->st_size);
+  if (delta_resize(cache, f, count) < 0)
+    return -1;
+
+  FileExtents ext;
+  extents_init(&ext, fd);
+  for (size_t b = 0; b < count; b++) {
+    if (*stop_flag) {
+      errno = EINTR;
+      return -1;
+    }
+    size_t want = block_len(st->st_size, b);
+    if (extents_hole(&ext, (off_t)b * DELTA_BLOCK, (off_t)want)) {
+      f->blocks[b] = zero_sig(want);
+      continue;
+    }
+    ssize_t n = pread_full(fd, buf, want, (off_t)b * DELTA_BLOCK);
+    if (n < 0 || (size_t)n != want) {
+      perror("pread(delta_scan)");
+      return -1;
+    }
+    f->blocks[b] = block_sig(buf, (size_t)n);
+  }
+  delta_remember(f, st);
+  return 0;
+}
+
+// rewrites one changed block, sharing extents with src where the fs allows;
+// a block that is a hole in src becomes a hole in out as well
+static int delta_write_block(int in, int out, const char *buf, size_t n,
+                             off_t off, int hole) {
+  if (hole && punch_hole(out, off, (off_t)n) == 0)
+    return 0;
+  if (!hole && clone_supported(in, out) &&
+      clone_fd_range(in, out, off, (off_t)n) == 0)
+    return 0;
+  if (pwrite_full(out, buf, n, off) < 0) {
+    perror("pwrite(delta)");
+    return -1;
+  }
+  return 0;
+}
+
+static int delta_apply(DeltaCache *cache, DeltaFile *f, int in, int out,
+                       const struct stat *src_st, const struct stat *dst_st,
+                       char *buf,
+                       volatile sig_atomic_t *stop_flag) {
+  if (!delta_matches(f, dst_st)) {
+    if (delta_scan(cache, f, out, dst_st, buf, stop_flag) < 0)
+      return -1;
+  }
+
+  off_t old_size = f->size;
+  off_t new_size = 0;
+  // holes of a sparse source are neither read nor written out as zeros
+  FileExtents ext;
+  extents_init(&ext, in);
+  for (size_t b = 0;; b++) {
+    if (*stop_flag) {
+      errno = EINTR;
+      return -1;
+    }
+
+    off_t off = (off_t)b * DELTA_BLOCK;
+    size_t want = block_len(src_st->st_size, b);
+    int hole = want > 0 && extents_hole(&ext, off, (off_t)want);
+    ssize_t n = (ssize_t)want;
+    if (hole)
+      memset(buf, 0, want);
+    else
+      n = pread_full(in, buf, DELTA_BLOCK, off);
+    if (n < 0) {
+      perror("pread(delta)");
+      return -1;
+    }
+    if (n == 0)
+      break;
+    new_size = off + n;
+
+    if (b >= f->blocks_count && delta_resize(cache, f, b + 1) < 0)
+      return -1;
+
+    uint64_t sig = hole ? zero_sig((size_t)n) : block_sig(buf, (size_t)n);
+    if (block_len(old_size, b) == (size_t)n && f->blocks[b] == sig) {
+      cache->bytes_skipped += (unsigned long long)n;
+      continue;
+    }
+    if (delta_write_block(in, out, buf, (size_t)n, off, hole) < 0)
+      return -1;
+    f->blocks[b] = sig;
+    if (!hole)
+      cache->bytes_written += (unsigned long long)n;
+  }
+
+  // also extends out when the source ends in a hole that was only punched
+  if (new_size != old_size && ftruncate(out, new_size) < 0) {
+    perror("ftruncate(delta)");
+    return -1;
+  }
+  if (delta_resize(cache, f, blocks_for(new_size)) < 0)
+    return -1;
+
+  // keep the target mtime equal to the source, like copy_file does
+  struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+  if (futimens(out, times) < 0) {
+    perror("futimens(delta)");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(out, &st) < 0) {
+    perror("fstat(delta)");
+    return -1;
+  }
+  delta_remember(f, &st);
+  return 0;
+}
+
+int delta_sync_file(DeltaCache *cache, const char *src_path,
+                    const char *dst_path, volatile sig_atomic_t *stop_flag) {
+  int in = open(src_path, O_RDONLY);
+  if (in < 0) {
+    perror("open src(delta)");
+    return -1;
+  }
+
+  struct stat src_st;
+  if (fstat(in, &src_st) < 0) {
+    perror("fstat src(delta)");
+    close(in);
+    return -1;
+  }
+  if (src_st.st_size < DELTA_MIN_SIZE) {
+    close(in);
+    return 1;
+  }
+
+  int out = open(dst_path, O_RDWR);
+  if (out < 0) {
+    int saved = errno;
+    close(in);
+    if (saved == ENOENT)
+      return 1;
+    errno = saved;
+    perror("open dst(delta)");
+    return -1;
+  }
+
+  // a target file shared with a snapshot is never patched in place, the
+  // full copy replaces it
+  struct stat dst_st;
+  if (fstat(out, &dst_st) < 0 || !S_ISREG(dst_st.st_mode) ||
+      dst_st.st_size < DELTA_MIN_SIZE || dst_st.st_nlink > src_st.st_nlink) {
+    close(in);
+    close(out);
+    return 1;
+  }
+
+  char *buf = malloc(DELTA_BLOCK);
+  if (!buf) {
+    fprintf(stderr, "delta buffer allocation failed\n");
+    close(in);
+    close(out);
+    return -1;
+  }
+
+  int ret = 0;
+  DeltaFile *f = delta_find(cache, dst_path);
+  if (!f)
+    f = delta_insert(cache, dst_path);
+  if (!f) {
+    ret = -1;
+  } else {
+    delta_touch(cache, f);
+    if (delta_apply(cache, f, in, out, &src_st, &dst_st, buf,
+                    stop_flag) < 0) {
+      // the target is half updated, its signatures can't be trusted
+      delta_drop(cache, (size_t)(f - cache->files));
+      ret = -1;
+    } else {
+      delta_evict(cache, f);
+    }
+  }
+
+  free(buf);
+  if (close(in) < 0)
+    perror("close");
+  if (close(out) < 0) {
+    perror("close");
+    ret = -1;
+  }
+  return ret;
+}
+
+void delta_forget(DeltaCache *cache, const char *dst_path, int is_dir) {
+  DeltaFile *f = delta_find(cache, dst_path);
+  if (f)
+    delta_drop(cache, (size_t)(f - cache->files));
+  if (!is_dir)
+    return;
+  // directories are rare here, their subtrees take a walk over the cache
+  size_t i = 0;
+  while (i < cache->files_count) {
+    if (has_prefix_path(cache->files[i].path, dst_path)) {
+      delta_drop(cache, i);
+      continue;
+    }
+    i++;
+  }
+}
+
+void delta_free_all(DeltaCache *cache) {
+  for (size_t i = 0; i < cache->files_count; i++) {
+    free(cache->files[i].path);
+    free(cache->files[i].blocks);
+  }
+  free(cache->files);
+  free(cache->slots);
+  memset(cache, 0, sizeof(*cache));
+}
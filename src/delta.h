@@ -0,0 +1,61 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <signal.h>     // sig_atomic_t
+#include <stddef.h>     // size_t
+#include <stdint.h>
+#include <sys/types.h>  // off_t, ino_t
+#include <time.h>       // struct timespec
+
+// files are compared in fixed blocks of this size
+#define DELTA_BLOCK (64 * 1024)
+// below this size a plain copy is cheaper than bookkeeping
+#define DELTA_MIN_SIZE (1024 * 1024)
+// upper bound of cached block signatures over all files (~16 MiB of memory)
+#define DELTA_CACHE_MAX_BLOCKS (1024 * 1024)
+
+#define DELTA_NONE ((size_t)-1)
+
+// Content hashes of a target file's blocks as we last wrote it; valid while
+// the target still has the recorded size, mtime and inode. Blocks only ever
+// get compared at the same offset, so no rolling checksum is kept.
+typedef struct {
+  char *path;
+  uint64_t hash; // of path, for the index
+  off_t size;
+  struct timespec mtime;
+  ino_t ino;
+  size_t blocks_count;
+  uint64_t *blocks;
+  size_t prev; // neighbours in use order, most recent first
+  size_t next;
+} DeltaFile;
+
+// Cached files with an open-addressing index on path (linear probing,
+// power-of-two size, no tombstones) and a use-ordered list for eviction.
+typedef struct {
+  DeltaFile *files;
+  size_t files_count;
+  size_t files_capacity;
+  size_t *slots;
+  size_t slots_capacity;
+  size_t newest;
+  size_t oldest;
+  size_t cached_blocks;
+  unsigned long long bytes_written; // what delta updates actually wrote
+  unsigned long long bytes_skipped; // unchanged bytes left in place
+} DeltaCache;
+
+// Brings dst up to date with src by rewriting only blocks that differ.
+// Returns 0 on success, 1 when a delta doesn't apply (no target yet, small
+// file) and the caller should do a full copy, -1 on error.
+int delta_sync_file(DeltaCache *cache, const char *src_path,
+                    const char *dst_path, volatile sig_atomic_t *stop_flag);
+
+// Drops cached signatures for dst_path, and for everything below it when
+// is_dir is set.
+void delta_forget(DeltaCache *cache, const char *dst_path, int is_dir);
+
+void delta_free_all(DeltaCache *cache);
+
+#endif
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "fanotify_events.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "filesystem_utils.h"
+#include "hash.h"
+
+#define FAN_EVENTS \
+  (FAN_CREATE | FAN_DELETE | FAN_RENAME | FAN_CLOSE_WRITE | FAN_ONDIR)
+
+// direct-mapped; most events hit the few directories being written to
+#define FAN_DIR_CACHE 256
+
+struct FanDirEntry {
+  uint64_t key;
+  size_t handle_len;
+  unsigned char handle[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+  char *path;
+};
+
+static void dir_cache_clear(FanotifySource *fs) {
+  for (size_t i = 0; i < FAN_DIR_CACHE; i++) {
+    free(fs->dirs[i].path);
+    fs->dirs[i].path = NULL;
+  }
+}
+
+// directory handle -> current path; fails when the directory is gone
+static int resolve_dir(FanotifySource *fs, const struct file_handle *fh,
+                       char out[PATH_MAX]) {
+  size_t len = sizeof(*fh) + fh->handle_bytes;
+  if (fh->handle_bytes > MAX_HANDLE_SZ)
+    return -1;
+
+  uint64_t key = hash64(fh, len, 0);
+  struct FanDirEntry *e = &fs->dirs[key % FAN_DIR_CACHE];
+  if (e->path && e->key == key && e->handle_len == len &&
+      memcmp(e->handle, fh, len) == 0) {
+    snprintf(out, PATH_MAX, "%s", e->path);
+    return 0;
+  }
+
+  int fd = open_by_handle_at(fs->mount_fd, (struct file_handle *)fh,
+                             O_PATH | O_CLOEXEC);
+  if (fd < 0)
+    return -1; // ESTALE: deleted before we got to the event
+
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, out, PATH_MAX - 1);
+  struct stat st;
+  int gone = fstat(fd, &st) < 0 || st.st_nlink == 0;
+  close(fd);
+  if (n < 0 || gone)
+    return -1;
+  out[n] = '\0';
+
+  free(e->path);
+  e->path = strdup(out);
+  if (e->path) {
+    e->key = key;
+    e->handle_len = len;
+    memcpy(e->handle, fh, len);
+  }
+  return 0;
+}
+
+static int resolve_entry(FanotifySource *fs,
+                         const struct fanotify_event_info_fid *fid,
+                         char out[PATH_MAX]) {
+  const struct file_handle *fh = (const struct file_handle *)fid->handle;
+  const char *name = (const char *)fh->f_handle + fh->handle_bytes;
+
+  char dir[PATH_MAX];
+  if (resolve_dir(fs, fh, dir) < 0)
+    return -1;
+  if (name[0] == '\0' || strcmp(name, ".") == 0)
+    return snprintf(out, PATH_MAX, "%s", dir) >= PATH_MAX ? -1 : 0;
+  return snprintf(out, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX ? -1 : 0;
+}
+
+int fanotify_source_open(FanotifySource *fs, const char *src_real) {
+  memset(fs, 0, sizeof(*fs));
+  fs->mount_fd = -1;
+  fs->src_real = src_real;
+
+  fs->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC |
+                             FAN_NONBLOCK,
+                         O_RDONLY | O_LARGEFILE);
+  if (fs->fd < 0) {
+    // EPERM without CAP_SYS_ADMIN, EINVAL before name reporting (5.9)
+    if (errno != EPERM && errno != EINVAL && errno != ENOSYS)
+      perror("fanotify_init");
+    return -1;
+  }
+
+  // EINVAL: no FAN_RENAME (5.17); ENODEV, EOPNOTSUPP, EXDEV: the filesystem
+  // can't encode file handles for us
+  if (fanotify_mark(fs->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_EVENTS,
+                    AT_FDCWD, src_real) < 0) {
+    fanotify_source_close(fs);
+    return -1;
+  }
+
+  fs->mount_fd = open(src_real, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  fs->dirs = calloc(FAN_DIR_CACHE, sizeof(*fs->dirs));
+  if (fs->mount_fd < 0 || !fs->dirs) {
+    fanotify_source_close(fs);
+    return -1;
+  }
+
+  // open_by_handle_at also wants CAP_DAC_READ_SEARCH; check it works once
+  struct {
+    struct file_handle fh;
+    unsigned char bytes[MAX_HANDLE_SZ];
+  } probe;
+  probe.fh.handle_bytes = MAX_HANDLE_SZ;
+  int mount_id;
+  char path[PATH_MAX];
+  if (name_to_handle_at(AT_FDCWD, src_real, &probe.fh, &mount_id, 0) < 0 ||
+      resolve_dir(fs, &probe.fh, path) < 0 || strcmp(path, src_real) != 0) {
+    fanotify_source_close(fs);
+    return -1;
+  }
+  return 0;
+}
+
+void fanotify_source_close(FanotifySource *fs) {
+  if (fs->dirs) {
+    dir_cache_clear(fs);
+    free(fs->dirs);
+    fs->dirs = NULL;
+  }
+  if (fs->mount_fd >= 0)
+    close(fs->mount_fd);
+  if (fs->fd >= 0)
+    close(fs->fd);
+  fs->mount_fd = -1;
+  fs->fd = -1;
+}
+
+int fanotify_decode(FanotifySource *fs,
+                    const struct fanotify_event_metadata *md, const char *raw,
+                    FanEvent *ev) {
+  ev->mask = md->mask;
+  ev->is_dir = (md->mask & FAN_ONDIR) != 0;
+  ev->in_src = 0;
+  ev->old_in_src = 0;
+
+  // the mark covers the whole filesystem, including our own writes when the
+  // target lives on it too
+  if (md->pid == getpid())
+    return 0;
+
+  const char *p = raw + md->metadata_len;
+  const char *end = raw + md->event_len;
+  while (p + sizeof(struct fanotify_event_info_header) <= end) {
+    const struct fanotify_event_info_header *hdr =
+        (const struct fanotify_event_info_header *)p;
+    if (hdr->len == 0 || p + hdr->len > end)
+      break;
+
+    const struct fanotify_event_info_fid *fid =
+        (const struct fanotify_event_info_fid *)p;
+    if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+        hdr->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME) {
+      ev->in_src = resolve_entry(fs, fid, ev->path) == 0 &&
+                   has_prefix_path(ev->path, fs->src_real);
+    } else if (hdr->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME) {
+      ev->old_in_src = resolve_entry(fs, fid, ev->old_path) == 0 &&
+                       has_prefix_path(ev->old_path, fs->src_real);
+    }
+    p += hdr->len;
+  }
+
+  // cached directory paths below a renamed or deleted directory are stale
+  if (ev->is_dir && (md->mask & (FAN_RENAME | FAN_DELETE)))
+    dir_cache_clear(fs);
+
+  return ev->in_src || ev->old_in_src;
+}
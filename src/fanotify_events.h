@@ -0,0 +1,44 @@
+#ifndef FANOTIFY_EVENTS_H
+#define FANOTIFY_EVENTS_H
+
+#include <stdint.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+struct fanotify_event_metadata;
+struct FanDirEntry;
+
+// One fanotify group marking the whole filesystem that holds the source.
+// Events carry (directory handle, name) pairs which are turned back into
+// paths and filtered to the source tree, so no per-directory watches exist.
+typedef struct {
+  int fd;         // fanotify group, non-blocking
+  int mount_fd;   // the source directory, anchors open_by_handle_at
+  const char *src_real;
+  struct FanDirEntry *dirs; // directory handle -> path cache
+} FanotifySource;
+
+typedef struct {
+  uint64_t mask;
+  int is_dir;
+  int in_src;      // path lies in the source tree
+  int old_in_src;  // FAN_RENAME: old_path lies in the source tree
+  char path[PATH_MAX];     // the entry, new location for a rename
+  char old_path[PATH_MAX]; // FAN_RENAME only
+} FanEvent;
+
+// Returns 0 when the fanotify backend is usable for src_real, -1 when the
+// caller should fall back to inotify (no CAP_SYS_ADMIN, old kernel, or a
+// filesystem that can't report file handles).
+int fanotify_source_open(FanotifySource *fs, const char *src_real);
+void fanotify_source_close(FanotifySource *fs);
+
+// Resolves one event: md is an aligned copy of the header at raw, whose info
+// records follow it. Returns 1 if it touches the source tree, 0 to skip it.
+int fanotify_decode(FanotifySource *fs,
+                    const struct fanotify_event_metadata *md, const char *raw,
+                    FanEvent *ev);
+
+#endif
@@ -16,7 +16,7 @@
 #include <unistd.h>
 #include <poll.h>
 
-#include "io_utils.h"
+#include "copy_engine.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -168,6 +168,24 @@ int ensure_empty_dir(char *dst) {
   return 0;
 }
 
+// like ensure_empty_dir, but an existing directory may have contents
+int ensure_dir_or_missing(char *dst) {
+  struct stat st;
+  if (lstat(dst, &st) == 0) {
+    if (!S_ISDIR(st.st_mode)) {
+      fprintf(stderr, "%s is not a directory\n", dst);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (errno != ENOENT) {
+    perror("lstat(dst)");
+    return -1;
+  }
+  return 0;
+}
+
 int create_empty_dir(char *dst) {
   struct stat st;
   if (lstat(dst, &st) == 0) { // it already exists and 100% empty
@@ -189,77 +207,76 @@ int has_prefix_path(const char *s, const char *prefix) {
   return (s[len] == '\0' || s[len] == '/');
 }
 
-int copy_file(const char *src, const char *dst, mode_t mode, volatile sig_atomic_t* g_child_exit) {
-  int in = open(src, O_RDONLY);
-  if (in < 0) {
-    perror("open src");
+int open_copy_dst(const char *dst, const struct stat *st) {
+  // more links than the source has: the file is shared with a snapshot (or
+  // is a link the source no longer has) and gets a new inode, written
+  // through the change would reach those other names as well
+  struct stat dst_st;
+  if (lstat(dst, &dst_st) == 0 && S_ISREG(dst_st.st_mode) &&
+      dst_st.st_nlink > st->st_nlink && unlink(dst) < 0) {
+    perror("unlink(shared dst)");
     return -1;
   }
 
-  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
-  if (out < 0) {
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+  if (out < 0)
     perror("open dst");
-    close(in);
-    return -1;
-  }
+  return out;
+}
 
-  char buf[1024];
-  while (1) {
-    if (*g_child_exit) {
-      if (close(in) < 0) {
-        perror("close");
-        return -1;
-      }
-      if (close(out) < 0) {
-        perror("close");
-        return -1;
-      }
-      errno = EINTR;
-      return -1;
-    }
+int copy_file_from_fd(int in, const struct stat *st, const char *dst,
+                      volatile sig_atomic_t *g_child_exit) {
+  int out = open_copy_dst(dst, st);
+  if (out < 0)
+    return -1;
 
-    ssize_t r = bulk_read(in, buf, sizeof(buf));
-    if (r < 0) {
-      perror("bulk_read");
-      if (close(in) < 0) {
-        perror("close");
-        return -1;
-      }
-      if (close(out) < 0) {
-        perror("close");
-        return -1;
-      }
-      return -1;
-    }
-    if (r == 0)
-      break;
-
-    ssize_t w = bulk_write(out, buf, r);
-    if (w < 0) {
-      perror("bulk_write");
-      if (close(in) < 0) {
-        perror("close");
-      }
-      if (close(out) < 0) {
-        perror("close");
-      }
-      return -1;
+  // the source mtime travels with the data so later size+mtime comparisons
+  // (incremental sync, restore) can tell the copy is current
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  if (copy_fd(in, out, st->st_size, g_child_exit) < 0 ||
+      futimens(out, times) < 0) {
+    int saved = errno;
+    if (close(out) < 0) {
+      perror("close");
     }
+    errno = saved;
+    return -1;
   }
 
-  if (close(in) < 0) {
+  if (close(out) < 0) {
     perror("close");
     return -1;
   }
-  if (close(out) < 0) {
+  return 0;
+}
+
+int copy_file(const char *src, const char *dst, mode_t mode, volatile sig_atomic_t* g_child_exit) {
+  int in = open(src, O_RDONLY);
+  if (in < 0) {
+    perror("open src");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(in, &st) < 0) {
+    perror("fstat src");
+    close(in);
+    return -1;
+  }
+  st.st_mode = mode;
+
+  int ret = copy_file_from_fd(in, &st, dst, g_child_exit);
+  int saved = errno;
+  if (close(in) < 0) {
     perror("close");
     return -1;
   }
-  return 0;
+  errno = saved;
+  return ret;
 }
 
-int copy_symplink_rewrite(const char *src_link, const char *dst_link,
-                          const char *src_real, const char *dst_real) {
+int symlink_rewrite_target(const char *src_link, const char *src_real,
+                           const char *dst_real, char out[PATH_MAX]) {
   char linkbuf[PATH_MAX];
   ssize_t n = readlink(src_link, linkbuf, sizeof(linkbuf) - 1);
   if (n < 0) {
@@ -268,20 +285,27 @@ int copy_symplink_rewrite(const char *src_link, const char *dst_link,
   }
   linkbuf[n] = '\0';
 
-  char *final_target = linkbuf;
-  char rewritten[PATH_MAX];
-
   if (linkbuf[0] == '/' &&
       has_prefix_path(linkbuf, src_real)) { // checking if contains an absolute
                                             // path leading to this directory
     char *suffix = linkbuf + strlen(src_real);
-    if (snprintf(rewritten, PATH_MAX, "%s%s", dst_real, suffix) >= PATH_MAX) {
+    if (snprintf(out, PATH_MAX, "%s%s", dst_real, suffix) >= PATH_MAX) {
       perror("Name too long(link)");
       return -1;
     }
-    final_target = rewritten;
+    return 0;
   }
 
+  snprintf(out, PATH_MAX, "%s", linkbuf);
+  return 0;
+}
+
+int copy_symplink_rewrite(const char *src_link, const char *dst_link,
+                          const char *src_real, const char *dst_real) {
+  char final_target[PATH_MAX];
+  if (symlink_rewrite_target(src_link, src_real, dst_real, final_target) < 0)
+    return -1;
+
   unlink(dst_link);
   if (symlink(final_target, dst_link) < 0) {
     perror("symlink");
@@ -291,7 +315,8 @@ int copy_symplink_rewrite(const char *src_link, const char *dst_link,
 }
 
 int copy_tree(const char *src_dir, const char *dst_dir, const char *src_real,
-              const char *dst_real, volatile sig_atomic_t* g_child_exit) {
+              const char *dst_real, LinkMap *links,
+              volatile sig_atomic_t* g_child_exit) {
   DIR *d = opendir(src_dir);
   if (!d) {
     perror("opendir(src_dir)");
@@ -348,7 +373,8 @@ int copy_tree(const char *src_dir, const char *dst_dir, const char *src_real,
         }
         return -1;
       }
-      if (copy_tree(src_path, dst_path, src_real, dst_real, g_child_exit) < 0) {
+      if (copy_tree(src_path, dst_path, src_real, dst_real, links,
+                    g_child_exit) < 0) {
         if (closedir(d) < 0) {
           perror("closedir");
           return -1;
@@ -356,7 +382,7 @@ int copy_tree(const char *src_dir, const char *dst_dir, const char *src_real,
         return -1;
       }
     } else if (S_ISREG(st.st_mode)) {
-      if (copy_file(src_path, dst_path, st.st_mode, g_child_exit) < 0) {
+      if (link_or_copy(links, src_path, dst_path, &st, g_child_exit) < 0) {
         if (closedir(d) < 0) {
           perror("closedir");
           return -1;
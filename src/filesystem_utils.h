@@ -2,6 +2,7 @@
 #define FILESYSTEM_UTILS_H
 
 #include "config.h"     // for PATH_MAX 
+#include "link_map.h"
 #include <signal.h>     // sig_atomic_t
 #include <sys/stat.h>   // mode_t
 #include <sys/types.h>  // ssize_t
@@ -15,6 +16,7 @@ int norm_target_path(char *in, char out[PATH_MAX]);
 int is_dir_empty(char *path);
 int mkdir_p(const char *path, mode_t mode);
 int ensure_empty_dir(char *dst);
+int ensure_dir_or_missing(char *dst);
 int create_empty_dir(char *dst);
 
 // Path prefix helper
@@ -23,12 +25,26 @@ int has_prefix_path(const char *s, const char *prefix);
 // File / symlink / tree operations
 int copy_file(const char *src, const char *dst, mode_t mode,
               volatile sig_atomic_t *stop_flag);
+// same, from an already open source described by st. A target file with
+// more links than the source is replaced rather than written to.
+int copy_file_from_fd(int in, const struct stat *st, const char *dst,
+                      volatile sig_atomic_t *stop_flag);
+// dst truncated (or created with st's mode) for such a copy to be written
+// into; -1 on error
+int open_copy_dst(const char *dst, const struct stat *st);
+
+// target a mirrored copy of src_link should point to (absolute links into
+// src_real are redirected into dst_real)
+int symlink_rewrite_target(const char *src_link, const char *src_real,
+                           const char *dst_real, char out[PATH_MAX]);
 
 int copy_symplink_rewrite(const char *src_link, const char *dst_link,
                           const char *src_real, const char *dst_real);
 
+// links (may be NULL) turns further links of a multiply linked file into
+// link() calls on the target
 int copy_tree(const char *src_dir, const char *dst_dir,
-              const char *src_real, const char *dst_real,
+              const char *src_real, const char *dst_real, LinkMap *links,
               volatile sig_atomic_t *stop_flag);
 
 
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include "hash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// HASH_NO_SIMD builds the portable code only (same results)
+#if defined(__x86_64__) && defined(__SSE2__) && !defined(HASH_NO_SIMD)
+#include <immintrin.h>
+#define HASH_X86 1
+#endif
+
+#define HASH_FILE_CHUNK (1024 * 1024)
+
+// four independent multiply-rotate lanes over 32-byte stripes, in the spirit
+// of xxHash64, so the compiler can keep all of them in flight at once
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl64(acc, 31);
+  return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t lane) {
+  acc ^= round64(0, lane);
+  return acc * P1 + P4;
+}
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + P1 + P2;
+    uint64_t v2 = seed + P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - P1;
+    const unsigned char *limit = end - 32;
+    do {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = merge64(h, v1);
+    h = merge64(h, v2);
+    h = merge64(h, v3);
+    h = merge64(h, v4);
+  } else {
+    h = seed + P5;
+  }
+
+  h += (uint64_t)len;
+
+  while (p + 8 <= end) {
+    h ^= round64(0, read64(p));
+    h = rotl64(h, 27) * P1 + P4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * P1;
+    h = rotl64(h, 23) * P2 + P3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * P5;
+    h = rotl64(h, 11) * P1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+// content hash: every stripe adds (data ^ key) lo32 * hi32 to its lane and
+// the raw data to the neighbouring lane, a block ends with a scramble of all
+// lanes. The keys slide by one word per stripe, as in XXH3.
+#define STRIPE 64
+#define STRIPES_PER_BLOCK (HASH_BLOCK / STRIPE)
+#define P32_1 0x9E3779B1U
+
+static const uint64_t stripe_keys[24] = {
+    0xd8a99966bf48b38eULL, 0xcf7e73d6dff07335ULL, 0xef084a4c5cfd1d9dULL,
+    0x197ee9753ebfbbc6ULL, 0xf842e3705a9a0a2eULL, 0xa6fbf0ace873f6eeULL,
+    0xd70587994fc53dd2ULL, 0xcdc61c92fe8ec5ecULL, 0x2cb570b171d97c01ULL,
+    0x5e0b8edd87ea5409ULL, 0x508b9bb707f38ab3ULL, 0xc6a63f31833047a0ULL,
+    0xe434824897729cceULL, 0x8333b728c92c1561ULL, 0xe76efc25041f87a9ULL,
+    0x5b7255a6fc7ae75bULL, 0x58aec96e987fe946ULL, 0x9dda7fd03cf5ae6cULL,
+    0x38b170bce7cfc649ULL, 0xeaff8ce88ce3d87eULL, 0x6ffb45141c3d13b7ULL,
+    0x6f1169423712463eULL, 0xbbb56e820ccd0fc9ULL, 0x763b53853fe47773ULL,
+};
+// the scramble and the final merge use the last eight
+#define SCRAMBLE_KEYS (stripe_keys + STRIPES_PER_BLOCK)
+
+static void accumulate_scalar(uint64_t acc[8], const unsigned char *p,
+                              const uint64_t *key) {
+  for (int i = 0; i < 8; i++) {
+    uint64_t d = read64(p + 8 * i);
+    uint64_t dk = d ^ key[i];
+    acc[i ^ 1] += d;
+    acc[i] += (dk & 0xFFFFFFFFu) * (dk >> 32);
+  }
+}
+
+#ifndef HASH_X86
+static void blocks_scalar(uint64_t acc[8], const unsigned char *p,
+                          size_t blocks) {
+  for (; blocks > 0; blocks--, p += HASH_BLOCK) {
+    for (int n = 0; n < STRIPES_PER_BLOCK; n++)
+      accumulate_scalar(acc, p + n * STRIPE, stripe_keys + n);
+    for (int i = 0; i < 8; i++) {
+      acc[i] ^= acc[i] >> 47;
+      acc[i] ^= SCRAMBLE_KEYS[i];
+      acc[i] *= P32_1;
+    }
+  }
+}
+#endif
+
+#ifdef HASH_X86
+static void blocks_sse2(uint64_t acc[8], const unsigned char *p,
+                        size_t blocks) {
+  __m128i a[4];
+  for (int i = 0; i < 4; i++)
+    a[i] = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+  const __m128i prime = _mm_set1_epi32((int)P32_1);
+
+  for (; blocks > 0; blocks--, p += HASH_BLOCK) {
+    for (int n = 0; n < STRIPES_PER_BLOCK; n++) {
+      for (int i = 0; i < 4; i++) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + n * STRIPE + 16 * i));
+        __m128i k =
+            _mm_loadu_si128((const __m128i *)(stripe_keys + n + 2 * i));
+        __m128i dk = _mm_xor_si128(d, k);
+        __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+        __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a[i] = _mm_add_epi64(a[i], _mm_add_epi64(prod, swapped));
+      }
+    }
+    for (int i = 0; i < 4; i++) {
+      __m128i k = _mm_loadu_si128((const __m128i *)(SCRAMBLE_KEYS + 2 * i));
+      __m128i x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+      x = _mm_xor_si128(x, k);
+      __m128i lo = _mm_mul_epu32(x, prime);
+      __m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+      a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+  }
+  for (int i = 0; i < 4; i++)
+    _mm_storeu_si128((__m128i *)(acc + 2 * i), a[i]);
+}
+
+__attribute__((target("avx2"))) static void
+blocks_avx2(uint64_t acc[8], const unsigned char *p, size_t blocks) {
+  __m256i a[2];
+  for (int i = 0; i < 2; i++)
+    a[i] = _mm256_loadu_si256((const __m256i *)(acc + 4 * i));
+  const __m256i prime = _mm256_set1_epi32((int)P32_1);
+
+  for (; blocks > 0; blocks--, p += HASH_BLOCK) {
+    for (int n = 0; n < STRIPES_PER_BLOCK; n++) {
+      for (int i = 0; i < 2; i++) {
+        __m256i d =
+            _mm256_loadu_si256((const __m256i *)(p + n * STRIPE + 32 * i));
+        __m256i k =
+            _mm256_loadu_si256((const __m256i *)(stripe_keys + n + 4 * i));
+        __m256i dk = _mm256_xor_si256(d, k);
+        __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+        __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(prod, swapped));
+      }
+    }
+    for (int i = 0; i < 2; i++) {
+      __m256i k =
+          _mm256_loadu_si256((const __m256i *)(SCRAMBLE_KEYS + 4 * i));
+      __m256i x = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+      x = _mm256_xor_si256(x, k);
+      __m256i lo = _mm256_mul_epu32(x, prime);
+      __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+      a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+  }
+  for (int i = 0; i < 2; i++)
+    _mm256_storeu_si256((__m256i *)(acc + 4 * i), a[i]);
+}
+#endif
+
+static void hash_blocks(uint64_t acc[8], const unsigned char *p,
+                        size_t blocks) {
+#ifdef HASH_X86
+  if (__builtin_cpu_supports("avx2")) {
+    blocks_avx2(acc, p, blocks);
+    return;
+  }
+  blocks_sse2(acc, p, blocks);
+#else
+  blocks_scalar(acc, p, blocks);
+#endif
+}
+
+void hash_init(HashState *s, uint64_t seed) {
+  static const uint64_t init[8] = {P3, P1, P2, P4, P5, P2 ^ P3, P1 ^ P5, P4 ^ P1};
+  for (int i = 0; i < 8; i++)
+    s->acc[i] = (i & 1) ? init[i] - seed : init[i] + seed;
+  s->buffered = 0;
+  s->total = 0;
+  s->seed = seed;
+}
+
+void hash_update(HashState *s, const void *data, size_t len) {
+  const unsigned char *p = data;
+  s->total += len;
+  if (s->buffered > 0) {
+    size_t n = HASH_BLOCK - s->buffered;
+    if (n > len)
+      n = len;
+    memcpy(s->buf + s->buffered, p, n);
+    s->buffered += n;
+    p += n;
+    len -= n;
+    if (s->buffered < HASH_BLOCK)
+      return;
+    hash_blocks(s->acc, s->buf, 1);
+    s->buffered = 0;
+  }
+  size_t blocks = len / HASH_BLOCK;
+  if (blocks > 0) {
+    hash_blocks(s->acc, p, blocks);
+    p += blocks * HASH_BLOCK;
+    len -= blocks * HASH_BLOCK;
+  }
+  memcpy(s->buf, p, len);
+  s->buffered = len;
+}
+
+static uint64_t fold128(uint64_t a, uint64_t b) {
+  unsigned __int128 m = (unsigned __int128)a * b;
+  return (uint64_t)m ^ (uint64_t)(m >> 64);
+}
+
+static uint64_t avalanche(uint64_t h) {
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+// the lanes with the whole stripes of the last partial block folded in;
+// returns where the bytes after them start in s->buf
+static size_t final_lanes(const HashState *s, uint64_t acc[8]) {
+  memcpy(acc, s->acc, 8 * sizeof(*acc));
+  size_t stripes = s->buffered / STRIPE;
+  for (size_t n = 0; n < stripes; n++)
+    accumulate_scalar(acc, s->buf + n * STRIPE, stripe_keys + n);
+  return stripes * STRIPE;
+}
+
+uint64_t hash_final(const HashState *s) {
+  uint64_t acc[8];
+  size_t tail = final_lanes(s, acc);
+  uint64_t h = s->total * P1 + s->seed;
+  for (int i = 0; i < 4; i++)
+    h += fold128(acc[2 * i] ^ SCRAMBLE_KEYS[2 * i],
+                 acc[2 * i + 1] ^ SCRAMBLE_KEYS[2 * i + 1]);
+  h ^= hash64(s->buf + tail, s->buffered - tail, h);
+  return avalanche(h);
+}
+
+void hash_final128(const HashState *s, uint64_t out[2]) {
+  out[0] = hash_final(s);
+  // the second half pairs the lanes the other way round
+  uint64_t acc[8];
+  size_t tail = final_lanes(s, acc);
+  uint64_t h = ~(s->total * P2) + s->seed;
+  for (int i = 0; i < 4; i++)
+    h += fold128(acc[i] ^ SCRAMBLE_KEYS[7 - i], acc[i + 4] ^ SCRAMBLE_KEYS[i]);
+  h ^= hash64(s->buf + tail, s->buffered - tail, h ^ P5);
+  out[1] = avalanche(h);
+}
+
+uint64_t hash_content(const void *data, size_t len, uint64_t seed) {
+  HashState s;
+  hash_init(&s, seed);
+  hash_update(&s, data, len);
+  return hash_final(&s);
+}
+
+static int hash_fd_state(int fd, HashState *s) {
+  char *buf = malloc(HASH_FILE_CHUNK);
+  if (!buf) {
+    fprintf(stderr, "hash buffer allocation failed\n");
+    return -1;
+  }
+
+  hash_init(s, 0);
+  off_t off = 0;
+  while (1) {
+    ssize_t r = TEMP_FAILURE_RETRY(pread(fd, buf, HASH_FILE_CHUNK, off));
+    if (r < 0) {
+      perror("pread(hash_fd)");
+      free(buf);
+      return -1;
+    }
+    if (r == 0)
+      break;
+    hash_update(s, buf, (size_t)r);
+    off += r;
+  }
+  free(buf);
+  return 0;
+}
+
+int hash_fd(int fd, uint64_t *out) {
+  HashState s;
+  if (hash_fd_state(fd, &s) < 0)
+    return -1;
+  *out = hash_final(&s);
+  return 0;
+}
+
+int hash_fd128(int fd, uint64_t out[2]) {
+  HashState s;
+  if (hash_fd_state(fd, &s) < 0)
+    return -1;
+  hash_final128(&s, out);
+  return 0;
+}
+
+int hash_file(const char *path, uint64_t *out) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open(hash_file)");
+    return -1;
+  }
+  int ret = hash_fd(fd, out);
+  if (close(fd) < 0) {
+    perror("close");
+    return -1;
+  }
+  return ret;
+}
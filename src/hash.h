@@ -0,0 +1,36 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>  // size_t
+#include <stdint.h>
+
+// Fast non-cryptographic 64-bit hash for keys and short strings.
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+// Content hash for file data and large blocks, in the style of XXH3: 64-byte
+// stripes are folded into eight 64-bit lanes, with SSE2 or AVX2 when the CPU
+// has them (same result either way). Not the same function as hash64.
+#define HASH_BLOCK 1024 // 16 stripes, scrambled after each
+
+typedef struct {
+  uint64_t acc[8];
+  unsigned char buf[HASH_BLOCK]; // input not making a whole block yet
+  size_t buffered;
+  uint64_t total;
+  uint64_t seed;
+} HashState;
+
+void hash_init(HashState *s, uint64_t seed);
+void hash_update(HashState *s, const void *data, size_t len);
+// the hash of everything passed so far, however it was split up
+uint64_t hash_final(const HashState *s);
+// 128 bits of it, for naming contents; out[0] is hash_final
+void hash_final128(const HashState *s, uint64_t out[2]);
+uint64_t hash_content(const void *data, size_t len, uint64_t seed);
+
+// Content hash of fd (read from offset 0) into *out.
+int hash_fd(int fd, uint64_t *out);
+int hash_fd128(int fd, uint64_t out[2]);
+int hash_file(const char *path, uint64_t *out);
+
+#endif
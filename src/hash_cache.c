@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include "hash_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "io_utils.h"
+
+typedef struct {
+  char magic[8];
+  uint64_t count;
+} HashCacheHeader;
+
+static size_t home_slot(const HashCache *hc, uint64_t dev, uint64_t ino) {
+  uint64_t key[2] = {dev, ino};
+  return (size_t)hash64(key, sizeof(key), 0) & (hc->capacity - 1);
+}
+
+// slot holding the inode, or the empty slot ending its probe sequence
+static size_t find_slot(const HashCache *hc, uint64_t dev, uint64_t ino) {
+  size_t mask = hc->capacity - 1;
+  size_t i = home_slot(hc, dev, ino);
+  while (hc->entries[i].ino &&
+         (hc->entries[i].dev != dev || hc->entries[i].ino != ino))
+    i = (i + 1) & mask;
+  return i;
+}
+
+static int grow(HashCache *hc) {
+  size_t new_cap = hc->capacity ? hc->capacity * 2 : 1024;
+  HashCacheEntry *old = hc->entries;
+  unsigned char *old_used = hc->used;
+  size_t old_cap = hc->capacity;
+  HashCacheEntry *entries = calloc(new_cap, sizeof(*entries));
+  unsigned char *used = calloc(new_cap, 1);
+  if (!entries || !used) {
+    fprintf(stderr, "hash cache calloc failed\n");
+    free(entries);
+    free(used);
+    return -1;
+  }
+  hc->entries = entries;
+  hc->used = used;
+  hc->capacity = new_cap;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (!old[i].ino)
+      continue;
+    size_t j = find_slot(hc, old[i].dev, old[i].ino);
+    hc->entries[j] = old[i];
+    hc->used[j] = old_used[i];
+  }
+  free(old);
+  free(old_used);
+  return 0;
+}
+
+static void fill_entry(HashCacheEntry *e, const struct stat *st,
+                       uint64_t hash) {
+  e->dev = (uint64_t)st->st_dev;
+  e->ino = (uint64_t)st->st_ino;
+  e->size = st->st_size;
+  e->mtime_sec = st->st_mtim.tv_sec;
+  e->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+  e->ctime_sec = st->st_ctim.tv_sec;
+  e->ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+  e->hash = hash;
+}
+
+static int entry_matches(const HashCacheEntry *e, const struct stat *st) {
+  return e->size == st->st_size && e->mtime_sec == st->st_mtim.tv_sec &&
+         e->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+         e->ctime_sec == st->st_ctim.tv_sec &&
+         e->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec;
+}
+
+// caller holds the lock
+static void insert_locked(HashCache *hc, const HashCacheEntry *e, int used) {
+  if ((hc->count + 1) * 2 > hc->capacity) {
+    if (hc->count >= HASH_CACHE_MAX || grow(hc) < 0)
+      return;
+  }
+  size_t i = find_slot(hc, e->dev, e->ino);
+  if (!hc->entries[i].ino)
+    hc->count++;
+  hc->entries[i] = *e;
+  hc->used[i] = (unsigned char)used;
+}
+
+int hash_cache_open(HashCache *hc, const char *path) {
+  memset(hc, 0, sizeof(*hc));
+  pthread_mutex_init(&hc->lock, NULL);
+  if (snprintf(hc->path, PATH_MAX, "%s", path) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(hash cache)\n");
+    return -1;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT)
+      return 0;
+    perror("open(hash cache)");
+    return -1;
+  }
+  HashCacheHeader hdr;
+  struct stat st;
+  if (bulk_read(fd, (char *)&hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+      memcmp(hdr.magic, HASH_CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      fstat(fd, &st) < 0 || hdr.count > HASH_CACHE_MAX ||
+      (uint64_t)st.st_size !=
+          sizeof(hdr) + hdr.count * sizeof(HashCacheEntry)) {
+    // not ours or cut short: start over
+    close(fd);
+    return 0;
+  }
+
+  HashCacheEntry batch[256];
+  uint64_t left = hdr.count;
+  while (left > 0) {
+    size_t n = left < 256 ? (size_t)left : 256;
+    if (bulk_read(fd, (char *)batch, n * sizeof(*batch)) !=
+        (ssize_t)(n * sizeof(*batch)))
+      break;
+    for (size_t i = 0; i < n; i++) {
+      if (batch[i].ino)
+        insert_locked(hc, &batch[i], 0);
+    }
+    left -= n;
+  }
+  close(fd);
+  return 0;
+}
+
+int hash_cache_save(HashCache *hc) {
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.new", hc->path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror("open(hash cache)");
+    return -1;
+  }
+
+  pthread_mutex_lock(&hc->lock);
+  // a big cache sheds the files this run didn't look at
+  int prune = hc->count > HASH_CACHE_MAX / 2;
+  HashCacheHeader hdr;
+  memcpy(hdr.magic, HASH_CACHE_MAGIC, sizeof(hdr.magic));
+  hdr.count = 0;
+  for (size_t i = 0; i < hc->capacity; i++)
+    hdr.count += hc->entries[i].ino && (hc->used[i] || !prune);
+
+  int ret = bulk_write(fd, (char *)&hdr, sizeof(hdr)) < 0 ? -1 : 0;
+  HashCacheEntry batch[256];
+  size_t n = 0;
+  for (size_t i = 0; ret == 0 && i < hc->capacity; i++) {
+    if (!hc->entries[i].ino || (prune && !hc->used[i]))
+      continue;
+    batch[n++] = hc->entries[i];
+    if (n == 256) {
+      if (bulk_write(fd, (char *)batch, n * sizeof(*batch)) < 0)
+        ret = -1;
+      n = 0;
+    }
+  }
+  if (ret == 0 && n > 0 &&
+      bulk_write(fd, (char *)batch, n * sizeof(*batch)) < 0)
+    ret = -1;
+  pthread_mutex_unlock(&hc->lock);
+
+  if (close(fd) < 0)
+    ret = -1;
+  if (ret == 0 && rename(tmp, hc->path) < 0)
+    ret = -1;
+  if (ret < 0) {
+    perror("save(hash cache)");
+    unlink(tmp);
+  }
+  return ret;
+}
+
+void hash_cache_free(HashCache *hc) {
+  free(hc->entries);
+  free(hc->used);
+  hc->entries = NULL;
+  hc->used = NULL;
+  hc->count = hc->capacity = 0;
+  pthread_mutex_destroy(&hc->lock);
+}
+
+int hash_cache_file(HashCache *hc, const char *path, uint64_t *out) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open(hash cache file)");
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat(hash cache file)");
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutex_lock(&hc->lock);
+  if (hc->capacity > 0) {
+    size_t i = find_slot(hc, (uint64_t)st.st_dev, (uint64_t)st.st_ino);
+    if (hc->entries[i].ino && entry_matches(&hc->entries[i], &st)) {
+      *out = hc->entries[i].hash;
+      hc->used[i] = 1;
+      hc->hits++;
+      pthread_mutex_unlock(&hc->lock);
+      close(fd);
+      return 0;
+    }
+  }
+  hc->misses++;
+  pthread_mutex_unlock(&hc->lock);
+
+  // hashed outside the lock, other workers keep going meanwhile
+  int ret = hash_fd(fd, out);
+  close(fd);
+  if (ret == 0)
+    hash_cache_put(hc, &st, *out);
+  return ret;
+}
+
+void hash_cache_put(HashCache *hc, const struct stat *st, uint64_t hash) {
+  HashCacheEntry e;
+  fill_entry(&e, st, hash);
+  pthread_mutex_lock(&hc->lock);
+  insert_locked(hc, &e, 1);
+  pthread_mutex_unlock(&hc->lock);
+}
@@ -0,0 +1,54 @@
+#ifndef HASH_CACHE_H
+#define HASH_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>    // size_t
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+#define HASH_CACHE_MAGIC "SOPHASH1"
+// past this many files further hashes are computed but not remembered
+#define HASH_CACHE_MAX (4 * 1024 * 1024)
+
+// what a file looked like when it was hashed; any change to it (ctime
+// included, so an mtime put back by hand doesn't fool it) means rehashing
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t ctime_sec;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+  uint64_t hash;
+} HashCacheEntry;
+
+// Content hashes of files, kept in a file between runs so unchanged files
+// are not read again. Open addressing on (dev, ino). Once it holds more
+// than half of HASH_CACHE_MAX, only the entries used during a run are
+// saved, so files that went away drop out. Safe to share between threads.
+typedef struct {
+  char path[PATH_MAX];
+  HashCacheEntry *entries; // ino 0 = empty
+  unsigned char *used;     // per slot: looked up or stored this run
+  size_t count;
+  size_t capacity;
+  pthread_mutex_t lock;
+  unsigned long long hits;
+  unsigned long long misses;
+} HashCache;
+
+// Loads path if it holds a cache; a missing or damaged file starts empty.
+int hash_cache_open(HashCache *hc, const char *path);
+// Writes the entries back to the file (atomically).
+int hash_cache_save(HashCache *hc);
+void hash_cache_free(HashCache *hc);
+
+// Content hash of the file at path: remembered or computed (and remembered).
+int hash_cache_file(HashCache *hc, const char *path, uint64_t *out);
+// Remembers hash for the file st describes (it was just written, say).
+void hash_cache_put(HashCache *hc, const struct stat *st, uint64_t hash);
+
+#endif
@@ -1,8 +1,10 @@
+#define _GNU_SOURCE
 #include"io_utils.h"
 
 #include<stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 
 ssize_t bulk_read(int fd, char *buf, size_t count) {
@@ -33,4 +35,10 @@ ssize_t bulk_write(int fd, char *buf, size_t count) {
     count -= (size_t)c;
   } while (count > 0);
   return len;
-}
\ No newline at end of file
+}
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
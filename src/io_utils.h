@@ -2,9 +2,13 @@
 #define IO_UTILS_H
 
 #include <stddef.h>     // size_t
+#include <stdint.h>
 #include <sys/types.h>  // ssize_t
 
 ssize_t bulk_read(int fd, char *buf, size_t count);
 ssize_t bulk_write(int fd, char *buf, size_t count);
 
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t now_ns(void);
+
 #endif
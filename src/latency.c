@@ -0,0 +1,64 @@
+#define _GNU_SOURCE
+#include "latency.h"
+#include <string.h>
+
+static const char *const KIND_NAMES[LAT_KINDS] = {"create", "close_write",
+                                                  "move", "delete"};
+
+const char *latency_kind_name(LatencyKind kind) { return KIND_NAMES[kind]; }
+
+static unsigned bucket_of(uint64_t us) {
+  if (us >= (1ull << 32))
+    us = (1ull << 32) - 1;
+  if (us < LATENCY_SUB)
+    return (unsigned)us;
+  unsigned shift = 63 - (unsigned)__builtin_clzll(us) - LATENCY_SUB_BITS;
+  return shift * LATENCY_SUB + (unsigned)(us >> shift);
+}
+
+static unsigned long long bucket_mid(unsigned b) {
+  if (b < LATENCY_SUB)
+    return b;
+  unsigned shift = b / LATENCY_SUB - 1;
+  unsigned long long low = (unsigned long long)(b % LATENCY_SUB + LATENCY_SUB)
+                           << shift;
+  return low + (1ull << shift) / 2;
+}
+
+void latency_record(LatencyHist *h, uint64_t ns) {
+  uint64_t us = ns / 1000;
+  atomic_ullong *c = &h->counts[bucket_of(us)];
+  // the only writer, so load + store cannot lose an increment
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+  if (us > atomic_load_explicit(&h->max_us, memory_order_relaxed))
+    atomic_store_explicit(&h->max_us, us, memory_order_relaxed);
+}
+
+void latency_summarize(const LatencyHist *h, LatencySummary *out) {
+  memset(out, 0, sizeof(*out));
+  // a copy first: the writer keeps going while we walk the buckets
+  unsigned long long counts[LATENCY_BUCKETS];
+  for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+    counts[b] = atomic_load_explicit(&h->counts[b], memory_order_relaxed);
+    out->count += counts[b];
+  }
+  out->max_us = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+  if (out->count == 0)
+    return;
+
+  const double quantiles[3] = {0.50, 0.99, 0.999};
+  unsigned long long *dest[3] = {&out->p50_us, &out->p99_us, &out->p999_us};
+  unsigned long long seen = 0;
+  unsigned b = 0;
+  for (int q = 0; q < 3; q++) {
+    unsigned long long rank =
+        (unsigned long long)(quantiles[q] * (double)out->count + 0.999999);
+    if (rank == 0)
+      rank = 1;
+    while (b < LATENCY_BUCKETS && seen + counts[b] < rank)
+      seen += counts[b++];
+    unsigned long long v = bucket_mid(b < LATENCY_BUCKETS ? b : b - 1);
+    *dest[q] = v < out->max_us ? v : out->max_us;
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// what a mirrored change started out as in the source
+typedef enum {
+  LAT_CREATE,      // new entry: directory, symlink, hard link
+  LAT_CLOSE_WRITE, // file contents written (or a file moved in)
+  LAT_MOVE,
+  LAT_DELETE,
+  LAT_KINDS
+} LatencyKind;
+
+// Log-linear buckets in the style of HdrHistogram: every power of two of
+// microseconds is split into LATENCY_SUB linear steps, so any recorded value
+// is known to within 1/LATENCY_SUB (3%), from 1 us up to over an hour.
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+// One writer (a target thread) and any number of readers; counts are
+// relaxed atomics, so recording is a plain store or two and needs no lock.
+typedef struct {
+  atomic_ullong counts[LATENCY_BUCKETS];
+  atomic_ullong max_us;
+} LatencyHist;
+
+// percentiles are the midpoints of their buckets; all in microseconds
+typedef struct {
+  unsigned long long count;
+  unsigned long long p50_us, p99_us, p999_us, max_us;
+} LatencySummary;
+
+void latency_record(LatencyHist *h, uint64_t ns);
+void latency_summarize(const LatencyHist *h, LatencySummary *out);
+const char *latency_kind_name(LatencyKind kind);
+
+#endif
@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include "link_map.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dedup_store.h"
+#include "filesystem_utils.h"
+#include "hash.h"
+
+#define SLOT_EMPTY ((size_t)-1)
+#define DIR_ROOT ((size_t)-2) // parent of the top-level names
+#define DIR_GONE ((size_t)-3) // parent of a directory a rename replaced
+
+void link_map_init(LinkMap *lm, const char *src_real, const char *dst_real) {
+  memset(lm, 0, sizeof(*lm));
+  lm->src_real = src_real;
+  lm->dst_real = dst_real;
+  pthread_mutex_init(&lm->lock, NULL);
+}
+
+static void free_others(LinkEntry *e) {
+  for (size_t i = 0; i < e->others_count; i++)
+    free(e->others[i].name);
+  free(e->others);
+  e->others = NULL;
+  e->others_count = 0;
+}
+
+void link_map_free(LinkMap *lm) {
+  for (size_t i = 0; i < lm->capacity; i++) {
+    free(lm->entries[i].rel.name);
+    free_others(&lm->entries[i]);
+  }
+  free(lm->entries);
+  lm->entries = NULL;
+  lm->count = lm->capacity = 0;
+  for (size_t i = 0; i < lm->dirs_count; i++)
+    free(lm->dirs[i].name);
+  free(lm->dirs);
+  free(lm->dir_slots);
+  lm->dirs = NULL;
+  lm->dir_slots = NULL;
+  lm->dirs_count = lm->dirs_capacity = lm->dir_slots_capacity = 0;
+  pthread_mutex_destroy(&lm->lock);
+}
+
+// directory index
+
+static size_t dir_home(const LinkMap *lm, size_t parent, const char *name,
+                       size_t len) {
+  return (size_t)(hash64(name, len, (uint64_t)parent) &
+                  (lm->dir_slots_capacity - 1));
+}
+
+// slot holding the directory name (len bytes) in parent, or the empty slot
+// ending its probe sequence
+static size_t dir_slot(const LinkMap *lm, size_t parent, const char *name,
+                       size_t len) {
+  size_t mask = lm->dir_slots_capacity - 1;
+  size_t i = dir_home(lm, parent, name, len);
+  while (lm->dir_slots[i] != SLOT_EMPTY) {
+    const LinkDir *d = &lm->dirs[lm->dir_slots[i]];
+    if (d->parent == parent && strncmp(d->name, name, len) == 0 &&
+        d->name[len] == '\0')
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int dir_rehash(LinkMap *lm, size_t new_cap) {
+  size_t *slots = malloc(new_cap * sizeof(*slots));
+  if (!slots) {
+    fprintf(stderr, "link map malloc failed\n");
+    return -1;
+  }
+  for (size_t i = 0; i < new_cap; i++)
+    slots[i] = SLOT_EMPTY;
+
+  free(lm->dir_slots);
+  lm->dir_slots = slots;
+  lm->dir_slots_capacity = new_cap;
+  for (size_t i = 0; i < lm->dirs_count; i++) {
+    const LinkDir *d = &lm->dirs[i];
+    if (d->parent != DIR_GONE)
+      lm->dir_slots[dir_slot(lm, d->parent, d->name, strlen(d->name))] = i;
+  }
+  return 0;
+}
+
+// removes slot i and pulls later entries of the cluster back into the gap
+static void dir_delete(LinkMap *lm, size_t i) {
+  size_t mask = lm->dir_slots_capacity - 1;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (lm->dir_slots[j] == SLOT_EMPTY)
+      break;
+    const LinkDir *d = &lm->dirs[lm->dir_slots[j]];
+    size_t home = dir_home(lm, d->parent, d->name, strlen(d->name));
+    // move j into the gap unless its home lies cyclically in (i, j]
+    if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    lm->dir_slots[i] = lm->dir_slots[j];
+    i = j;
+  }
+  lm->dir_slots[i] = SLOT_EMPTY;
+}
+
+// the directory name (len bytes) in parent; a missing one is added when
+// create is set, else SLOT_EMPTY
+static size_t dir_child(LinkMap *lm, size_t parent, const char *name,
+                        size_t len, int create) {
+  if (lm->dir_slots_capacity) {
+    size_t node = lm->dir_slots[dir_slot(lm, parent, name, len)];
+    if (node != SLOT_EMPTY || !create)
+      return node;
+  } else if (!create) {
+    return SLOT_EMPTY;
+  }
+  if (lm->dirs_count >= LINK_MAP_MAX)
+    return SLOT_EMPTY;
+  if ((lm->dirs_count + 1) * 2 > lm->dir_slots_capacity &&
+      dir_rehash(lm, lm->dir_slots_capacity ? lm->dir_slots_capacity * 2
+                                            : 1024) < 0)
+    return SLOT_EMPTY;
+  if (lm->dirs_count == lm->dirs_capacity) {
+    size_t new_cap = lm->dirs_capacity ? lm->dirs_capacity * 2 : 256;
+    LinkDir *dirs = realloc(lm->dirs, new_cap * sizeof(*dirs));
+    if (!dirs) {
+      fprintf(stderr, "link map realloc failed\n");
+      return SLOT_EMPTY;
+    }
+    lm->dirs = dirs;
+    lm->dirs_capacity = new_cap;
+  }
+  char *copy = strndup(name, len);
+  if (!copy)
+    return SLOT_EMPTY;
+  size_t node = lm->dirs_count++;
+  lm->dirs[node].name = copy;
+  lm->dirs[node].parent = parent;
+  lm->dir_slots[dir_slot(lm, parent, copy, len)] = node;
+  return node;
+}
+
+// directory holding rel (DIR_ROOT at the top), *base its last component;
+// SLOT_EMPTY when a directory on the way is missing and create is not set
+static size_t dir_of(LinkMap *lm, const char *rel, int create,
+                     const char **base) {
+  size_t dir = DIR_ROOT;
+  const char *slash;
+  while ((slash = strchr(rel, '/'))) {
+    dir = dir_child(lm, dir, rel, (size_t)(slash - rel), create);
+    if (dir == SLOT_EMPTY)
+      return SLOT_EMPTY;
+    rel = slash + 1;
+  }
+  *base = rel;
+  return dir;
+}
+
+// root/name, built from the last component up; -1 when too long or a
+// directory on the way was replaced
+static int name_path(const LinkMap *lm, const char *root, const LinkName *n,
+                     char path[PATH_MAX]) {
+  size_t pos = PATH_MAX - 1;
+  size_t len = strlen(n->name);
+  path[pos] = '\0';
+  if (len > pos)
+    return -1;
+  pos -= len;
+  memcpy(path + pos, n->name, len);
+  for (size_t dir = n->dir; dir != DIR_ROOT; dir = lm->dirs[dir].parent) {
+    const LinkDir *d = &lm->dirs[dir];
+    if (d->parent == DIR_GONE)
+      return -1;
+    len = strlen(d->name);
+    if (len + 1 > pos)
+      return -1;
+    path[--pos] = '/';
+    pos -= len;
+    memcpy(path + pos, d->name, len);
+  }
+  len = strlen(root);
+  if (len + 1 > pos)
+    return -1;
+  path[--pos] = '/';
+  pos -= len;
+  memcpy(path + pos, root, len);
+  memmove(path, path + pos, PATH_MAX - pos);
+  return 0;
+}
+
+static int name_is(const LinkName *n, size_t dir, const char *base) {
+  return n->dir == dir && strcmp(n->name, base) == 0;
+}
+
+// entry table
+
+static size_t home_slot(const LinkMap *lm, dev_t dev, ino_t ino) {
+  uint64_t key[2] = {(uint64_t)dev, (uint64_t)ino};
+  return (size_t)hash64(key, sizeof(key), 0) & (lm->capacity - 1);
+}
+
+// slot holding the inode, or the empty slot ending its probe sequence
+static LinkEntry *find_slot(const LinkMap *lm, dev_t dev, ino_t ino) {
+  size_t mask = lm->capacity - 1;
+  size_t i = home_slot(lm, dev, ino);
+  while (lm->entries[i].rel.name &&
+         (lm->entries[i].dev != dev || lm->entries[i].ino != ino))
+    i = (i + 1) & mask;
+  return &lm->entries[i];
+}
+
+static int grow(LinkMap *lm) {
+  size_t new_cap = lm->capacity ? lm->capacity * 2 : 1024;
+  LinkEntry *old = lm->entries;
+  size_t old_cap = lm->capacity;
+  LinkEntry *entries = calloc(new_cap, sizeof(*entries));
+  if (!entries) {
+    fprintf(stderr, "link map calloc failed\n");
+    return -1;
+  }
+  lm->entries = entries;
+  lm->capacity = new_cap;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i].rel.name)
+      *find_slot(lm, old[i].dev, old[i].ino) = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+// path of dst_path below dst_real, NULL when it is outside
+static const char *dst_rel(const LinkMap *lm, const char *dst_path) {
+  size_t n = strlen(lm->dst_real);
+  if (strncmp(dst_path, lm->dst_real, n) != 0 || dst_path[n] != '/')
+    return NULL;
+  return dst_path + n + 1;
+}
+
+// the recorded copy, if both its source and its target name still hold the
+// inodes they had when it was recorded
+static LinkEntry *usable_copy(const LinkMap *lm, const struct stat *st,
+                              char dst_copy[PATH_MAX]) {
+  if (lm->capacity == 0)
+    return NULL;
+  LinkEntry *e = find_slot(lm, st->st_dev, st->st_ino);
+  if (!e->rel.name)
+    return NULL;
+
+  char src_copy[PATH_MAX];
+  struct stat src_st, dst_st;
+  if (name_path(lm, lm->src_real, &e->rel, src_copy) < 0 ||
+      name_path(lm, lm->dst_real, &e->rel, dst_copy) < 0)
+    return NULL;
+  if (lstat(src_copy, &src_st) < 0 || src_st.st_dev != e->dev ||
+      src_st.st_ino != e->ino)
+    return NULL;
+  if (lstat(dst_copy, &dst_st) < 0 || !S_ISREG(dst_st.st_mode) ||
+      dst_st.st_ino != e->dst_ino)
+    return NULL;
+  return e;
+}
+
+// whether src_real/name is still a name of the entry's source inode
+static int still_linked(const LinkMap *lm, const LinkEntry *e,
+                        const LinkName *n) {
+  char src_path[PATH_MAX];
+  struct stat st;
+  return name_path(lm, lm->src_real, n, src_path) == 0 &&
+         lstat(src_path, &st) == 0 && st.st_dev == e->dev &&
+         st.st_ino == e->ino;
+}
+
+// remembers base in dir as another name of the copy; names the source
+// dropped since are forgotten first once there are more than the inode has
+// links
+static void add_other(LinkMap *lm, LinkEntry *e, size_t dir, const char *base,
+                      nlink_t nlink) {
+  if (name_is(&e->rel, dir, base))
+    return;
+  for (size_t i = 0; i < e->others_count; i++) {
+    if (name_is(&e->others[i], dir, base))
+      return;
+  }
+  if (e->others_count >= nlink) {
+    size_t kept = 0;
+    for (size_t i = 0; i < e->others_count; i++) {
+      if (still_linked(lm, e, &e->others[i]))
+        e->others[kept++] = e->others[i];
+      else
+        free(e->others[i].name);
+    }
+    e->others_count = kept;
+  }
+  LinkName *others =
+      realloc(e->others, (e->others_count + 1) * sizeof(*others));
+  char *copy = strdup(base);
+  if (others)
+    e->others = others;
+  if (!others || !copy) {
+    free(copy);
+    return;
+  }
+  e->others[e->others_count].dir = dir;
+  e->others[e->others_count++].name = copy;
+}
+
+static int link_locked(LinkMap *lm, const struct stat *st,
+                       const char *dst_path) {
+  char dst_copy[PATH_MAX];
+  LinkEntry *e = usable_copy(lm, st, dst_copy);
+  if (!e)
+    return 0;
+
+  struct stat dst_st;
+  if (lstat(dst_path, &dst_st) == 0) {
+    if (dst_st.st_ino == e->dst_ino || S_ISDIR(dst_st.st_mode))
+      return 0;
+    // link() won't replace; the old file goes first
+    if (unlink(dst_path) < 0)
+      return 0;
+  }
+  // EMLINK and the like: a copy still does the job
+  if (link(dst_copy, dst_path) < 0)
+    return 0;
+  const char *rel = dst_rel(lm, dst_path);
+  const char *base;
+  size_t dir = rel ? dir_of(lm, rel, 1, &base) : SLOT_EMPTY;
+  if (dir != SLOT_EMPTY)
+    add_other(lm, e, dir, base, st->st_nlink);
+  lm->linked++;
+  return 1;
+}
+
+// Records dst_path (inode dst_ino) as the copy; returns the copy recorded
+// before, 0 when there was none.
+static ino_t add_locked(LinkMap *lm, const struct stat *st,
+                        const char *dst_path, ino_t dst_ino) {
+  const char *rel = dst_rel(lm, dst_path);
+  if (!rel)
+    return 0;
+  if ((lm->count + 1) * 2 > lm->capacity) {
+    if (lm->count >= LINK_MAP_MAX || grow(lm) < 0)
+      return 0;
+  }
+  const char *base;
+  size_t dir = dir_of(lm, rel, 1, &base);
+  if (dir == SLOT_EMPTY)
+    return 0;
+
+  LinkEntry *e = find_slot(lm, st->st_dev, st->st_ino);
+  char *copy = strdup(base);
+  if (!copy)
+    return 0;
+  ino_t old_ino = 0;
+  if (e->rel.name) {
+    // the name recorded so far stays known as one of the group
+    LinkName old_rel = e->rel;
+    old_ino = e->dst_ino;
+    e->rel.dir = dir;
+    e->rel.name = copy;
+    e->dst_ino = dst_ino;
+    add_other(lm, e, old_rel.dir, old_rel.name, st->st_nlink);
+    free(old_rel.name);
+    for (size_t i = 0; i < e->others_count; i++) {
+      if (name_is(&e->others[i], dir, base)) {
+        free(e->others[i].name);
+        e->others[i] = e->others[--e->others_count];
+        break;
+      }
+    }
+    return old_ino;
+  }
+  lm->count++;
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->dst_ino = dst_ino;
+  e->rel.dir = dir;
+  e->rel.name = copy;
+  return 0;
+}
+
+// The copy got a new inode while other names of the group still hold
+// old_ino: they become links of the new copy, each replaced atomically.
+static void rejoin_locked(LinkMap *lm, const struct stat *st, ino_t old_ino) {
+  LinkEntry *e = find_slot(lm, st->st_dev, st->st_ino);
+  if (!e->rel.name)
+    return;
+  char dst_copy[PATH_MAX];
+  if (name_path(lm, lm->dst_real, &e->rel, dst_copy) < 0)
+    return;
+  for (size_t i = 0; i < e->others_count; i++) {
+    char dst_path[PATH_MAX], tmp[PATH_MAX];
+    struct stat dst_st;
+    if (name_path(lm, lm->dst_real, &e->others[i], dst_path) < 0 ||
+        snprintf(tmp, PATH_MAX, "%s.sop-link~", dst_path) >= PATH_MAX ||
+        lstat(dst_path, &dst_st) < 0 || !S_ISREG(dst_st.st_mode) ||
+        dst_st.st_ino != old_ino || !still_linked(lm, e, &e->others[i]))
+      continue;
+    unlink(tmp);
+    if (link(dst_copy, tmp) < 0) {
+      perror("link(rejoin)");
+      continue;
+    }
+    if (rename(tmp, dst_path) < 0) {
+      perror("rename(rejoin)");
+      unlink(tmp);
+    }
+  }
+}
+
+int link_map_link(LinkMap *lm, const struct stat *st, const char *dst_path) {
+  if (st->st_nlink < 2)
+    return 0;
+  pthread_mutex_lock(&lm->lock);
+  int ret = link_locked(lm, st, dst_path);
+  pthread_mutex_unlock(&lm->lock);
+  return ret;
+}
+
+void link_map_add(LinkMap *lm, const struct stat *st, const char *dst_path) {
+  struct stat dst_st;
+  if (st->st_nlink < 2 || lstat(dst_path, &dst_st) < 0)
+    return;
+  pthread_mutex_lock(&lm->lock);
+  ino_t old_ino = add_locked(lm, st, dst_path, dst_st.st_ino);
+  if (old_ino && old_ino != dst_st.st_ino)
+    rejoin_locked(lm, st, old_ino);
+  pthread_mutex_unlock(&lm->lock);
+}
+
+// The directory node is renamed and reparented; the names below it only
+// refer to it, so they follow without being touched.
+static void rename_locked(LinkMap *lm, const char *old_rel,
+                          const char *new_rel) {
+  const char *old_base, *new_base;
+  size_t old_parent = dir_of(lm, old_rel, 0, &old_base);
+  if (old_parent == SLOT_EMPTY)
+    return;
+  size_t old_slot = dir_slot(lm, old_parent, old_base, strlen(old_base));
+  size_t node = lm->dir_slots[old_slot];
+  if (node == SLOT_EMPTY)
+    return; // nothing was recorded below it
+  size_t new_parent = dir_of(lm, new_rel, 1, &new_base);
+  for (size_t dir = new_parent; dir != DIR_ROOT && dir != SLOT_EMPTY;
+       dir = lm->dirs[dir].parent) {
+    if (dir == node)
+      new_parent = SLOT_EMPTY;
+  }
+  char *copy = new_parent == SLOT_EMPTY ? NULL : strdup(new_base);
+  old_slot = dir_slot(lm, old_parent, old_base, strlen(old_base));
+  dir_delete(lm, old_slot);
+  if (!copy) {
+    // its names can't be placed any more and go stale
+    lm->dirs[node].parent = DIR_GONE;
+    return;
+  }
+  size_t len = strlen(copy);
+  size_t new_slot = dir_slot(lm, new_parent, copy, len);
+  size_t replaced = lm->dir_slots[new_slot];
+  if (replaced != SLOT_EMPTY) {
+    // the directory the rename replaced takes its names with it
+    lm->dirs[replaced].parent = DIR_GONE;
+    dir_delete(lm, new_slot);
+    new_slot = dir_slot(lm, new_parent, copy, len);
+  }
+  free(lm->dirs[node].name);
+  lm->dirs[node].name = copy;
+  lm->dirs[node].parent = new_parent;
+  lm->dir_slots[new_slot] = node;
+}
+
+void link_map_rename(LinkMap *lm, const char *old_dst, const char *new_dst) {
+  const char *old_rel = dst_rel(lm, old_dst);
+  const char *new_rel = dst_rel(lm, new_dst);
+  if (!old_rel || !new_rel)
+    return;
+  pthread_mutex_lock(&lm->lock);
+  rename_locked(lm, old_rel, new_rel);
+  pthread_mutex_unlock(&lm->lock);
+}
+
+// the data of one file, written the way lm's files are kept; 0 or -1
+static int copy_data(LinkMap *lm, const char *src_path, const char *dst_path,
+                     const struct stat *st, volatile sig_atomic_t *stop_flag) {
+  int ret;
+  if (lm && lm->compress == COMPRESS_PACK)
+    ret = compress_file(src_path, dst_path, st->st_mode, &lm->compress_stats,
+                        stop_flag);
+  else if (lm && lm->compress == COMPRESS_UNPACK)
+    ret = decompress_file(src_path, dst_path, st->st_mode, stop_flag);
+  else
+    ret = copy_file(src_path, dst_path, st->st_mode, stop_flag);
+  return ret < 0 ? -1 : 0;
+}
+
+static int link_or_copy_uncounted(LinkMap *lm, const char *src_path,
+                                  const char *dst_path, const struct stat *st,
+                                  volatile sig_atomic_t *stop_flag) {
+  if (lm && lm->store)
+    return dedup_store_file(lm->store, src_path, dst_path, st, stop_flag) < 0
+               ? -1
+               : 0;
+  if (!lm || st->st_nlink < 2)
+    return copy_data(lm, src_path, dst_path, st, stop_flag);
+
+  pthread_mutex_lock(&lm->lock);
+  int linked = link_locked(lm, st, dst_path);
+  ino_t old_ino = 0, new_ino = 0;
+  if (!linked) {
+    // recorded before the data is in: other links found meanwhile (by
+    // another worker) join this copy instead of making their own. The
+    // inode is the one the copy will write, a shared old one is already
+    // replaced by then.
+    struct stat dst_st;
+    if (lstat(dst_path, &dst_st) == 0 && S_ISREG(dst_st.st_mode))
+      old_ino = dst_st.st_ino;
+    int fd = open_copy_dst(dst_path, st);
+    if (fd >= 0 && fstat(fd, &dst_st) == 0 && S_ISREG(dst_st.st_mode)) {
+      new_ino = dst_st.st_ino;
+      add_locked(lm, st, dst_path, new_ino);
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  pthread_mutex_unlock(&lm->lock);
+
+  if (linked)
+    return 1;
+  int ret = copy_data(lm, src_path, dst_path, st, stop_flag);
+  if (ret == 0 && old_ino && new_ino && old_ino != new_ino) {
+    pthread_mutex_lock(&lm->lock);
+    rejoin_locked(lm, st, old_ino);
+    pthread_mutex_unlock(&lm->lock);
+  }
+  return ret;
+}
+
+int link_or_copy(LinkMap *lm, const char *src_path, const char *dst_path,
+                 const struct stat *st, volatile sig_atomic_t *stop_flag) {
+  int ret = link_or_copy_uncounted(lm, src_path, dst_path, st, stop_flag);
+  // a link() wrote nothing, the data is the copy's
+  if (ret == 1)
+    live_kept(lm->live, (unsigned long long)st->st_size);
+  else if (ret == 0 && lm)
+    live_copied(lm->live, (unsigned long long)st->st_size);
+  return ret;
+}
@@ -0,0 +1,88 @@
+#ifndef LINK_MAP_H
+#define LINK_MAP_H
+
+#include <pthread.h>
+#include <signal.h>     // sig_atomic_t
+#include <stddef.h>     // size_t
+#include <sys/stat.h>
+#include <sys/types.h>  // dev_t, ino_t
+
+#include "compress.h"
+#include "live_stats.h"
+
+typedef struct DedupStore DedupStore;
+
+// past this many multiply linked inodes further ones are copied as usual
+#define LINK_MAP_MAX (1024 * 1024)
+
+// a directory below the roots, shared by every name recorded in it
+typedef struct {
+  char *name;
+  size_t parent; // index into dirs, or the roots; see link_map.c
+} LinkDir;
+
+// a path below dst_real, the same as the source's below src_real
+typedef struct {
+  size_t dir;    // its directory, as for LinkDir.parent
+  char *name;    // last component
+} LinkName;
+
+// where the target copy of one source inode lives
+typedef struct {
+  dev_t dev;     // source inode
+  ino_t ino;
+  ino_t dst_ino; // the copy, as recorded
+  LinkName rel;  // the copy's name
+  LinkName *others; // further names seen linked to the copy, checked before use
+  size_t others_count;
+} LinkEntry;
+
+// Remembers the copy of every source file with more than one link, so that
+// further links to it become link() calls on the target instead of copies.
+// Entries are checked against both trees before use, so a stale one (the
+// file was renamed, deleted or replaced since) only costs a copy; nothing
+// has to be removed when the trees change. Names point at directory nodes,
+// so a renamed directory takes every name below it along in one step.
+typedef struct {
+  const char *src_real;
+  const char *dst_real;
+  LinkEntry *entries;      // open addressing on (dev, ino), rel.name NULL = empty
+  size_t count;
+  size_t capacity;
+  LinkDir *dirs;           // kept until link_map_free, at most LINK_MAP_MAX
+  size_t dirs_count;
+  size_t dirs_capacity;
+  size_t *dir_slots;       // open addressing on (parent, name) into dirs
+  size_t dir_slots_capacity;
+  pthread_mutex_t lock;    // parallel_copy_tree workers share one map
+  unsigned long long linked; // files linked instead of copied
+  DedupStore *store;       // set: every file goes through it, see dedup_store.h
+  int compress;            // COMPRESS_PACK or _UNPACK: copies go through it
+  CompressStats compress_stats; // COMPRESS_PACK
+  LiveTarget *live;        // counts what link_or_copy writes, may be NULL
+} LinkMap;
+
+void link_map_init(LinkMap *lm, const char *src_real, const char *dst_real);
+void link_map_free(LinkMap *lm);
+
+// Makes dst_path another link of the recorded copy of st's inode, replacing
+// whatever file is there. Returns 1 when it linked, 0 when there is no
+// usable copy or dst_path already is it; the caller then writes the data.
+int link_map_link(LinkMap *lm, const struct stat *st, const char *dst_path);
+// Records dst_path as the copy of st's inode (only if st_nlink > 1). When it
+// replaced the recorded copy (a write through one name got a new inode
+// because the old one was shared with a snapshot), the other names still
+// holding the old copy are linked to the new one, so the group stays one.
+void link_map_add(LinkMap *lm, const struct stat *st, const char *dst_path);
+// A directory of the target moved: entries below it follow.
+void link_map_rename(LinkMap *lm, const char *old_dst, const char *new_dst);
+
+// copy_file for a regular file, or a link to another name's copy of the same
+// inode. lm may be NULL. Returns 1 when linked, 0 when copied, -1 on error.
+// With a store the file is linked into it instead (0), and links in the
+// source come out linked anyway: their contents are one object. With
+// compress set copies are packed into containers or unpacked from them.
+int link_or_copy(LinkMap *lm, const char *src_path, const char *dst_path,
+                 const struct stat *st, volatile sig_atomic_t *stop_flag);
+
+#endif
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "live_stats.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_utils.h"
+
+#define RELAXED memory_order_relaxed
+
+LiveShared *live_shared_create(void) {
+  void *p = mmap(NULL, sizeof(LiveShared), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap(live stats)");
+    return NULL;
+  }
+  return p;
+}
+
+void live_shared_destroy(LiveShared *ls) {
+  if (ls)
+    munmap(ls, sizeof(*ls));
+}
+
+void live_target_reset(LiveTarget *lt) {
+  // the slot's previous target is gone, nobody writes to it meanwhile
+  memset(lt, 0, sizeof(*lt));
+  atomic_store_explicit(&lt->started_ns, now_ns(), RELAXED);
+  atomic_store_explicit(&lt->phase, PHASE_INITIAL, RELAXED);
+}
+
+void live_copied(LiveTarget *lt, unsigned long long bytes) {
+  if (!lt)
+    return;
+  atomic_fetch_add_explicit(&lt->files, 1, RELAXED);
+  atomic_fetch_add_explicit(&lt->bytes, bytes, RELAXED);
+}
+
+void live_kept(LiveTarget *lt, unsigned long long bytes) {
+  if (!lt)
+    return;
+  atomic_fetch_add_explicit(&lt->kept_files, 1, RELAXED);
+  atomic_fetch_add_explicit(&lt->kept_bytes, bytes, RELAXED);
+}
+
+void live_phase(LiveTarget *lt, LivePhase phase) {
+  if (lt)
+    atomic_store_explicit(&lt->phase, phase, RELAXED);
+}
+
+// a seqlock: writers take the sequence from even to odd and back, readers
+// retry when it was odd or moved while they copied
+void live_error(LiveTarget *lt, const char *fmt, ...) {
+  if (!lt)
+    return;
+  char msg[LIVE_ERROR_MAX];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+
+  unsigned seq = atomic_load_explicit(&lt->error_seq, RELAXED);
+  while ((seq & 1) || !atomic_compare_exchange_weak_explicit(
+                          &lt->error_seq, &seq, seq + 1,
+                          memory_order_acquire, RELAXED))
+    seq = atomic_load_explicit(&lt->error_seq, RELAXED);
+  memcpy(lt->last_error, msg, sizeof(msg));
+  atomic_store_explicit(&lt->error_time, (long long)time(NULL), RELAXED);
+  atomic_store_explicit(&lt->error_seq, seq + 2, memory_order_release);
+}
+
+long long live_last_error(LiveTarget *lt, char out[LIVE_ERROR_MAX]) {
+  while (1) {
+    unsigned seq = atomic_load_explicit(&lt->error_seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
+    memcpy(out, lt->last_error, LIVE_ERROR_MAX);
+    long long when = atomic_load_explicit(&lt->error_time, RELAXED);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&lt->error_seq, RELAXED) == seq) {
+      out[LIVE_ERROR_MAX - 1] = '\0';
+      return when;
+    }
+  }
+}
+
+typedef struct {
+  unsigned long long files;
+  unsigned long long bytes;
+  volatile sig_atomic_t *stop_flag;
+  const atomic_int *abort;
+} Count;
+
+static int count_dir(Count *c, int dir_fd) {
+  DIR *dir = fdopendir(dir_fd);
+  if (!dir) {
+    close(dir_fd);
+    return 0;
+  }
+  struct dirent *de;
+  int ret = 0;
+  while (ret == 0 && (de = readdir(dir))) {
+    if (*c->stop_flag || atomic_load_explicit(c->abort, RELAXED)) {
+      ret = -1;
+      break;
+    }
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if (de->d_type == DT_DIR) {
+      int fd = openat(dirfd(dir), de->d_name,
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd >= 0)
+        ret = count_dir(c, fd);
+      continue;
+    }
+    if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+      continue;
+    struct stat st;
+    if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      int fd = openat(dirfd(dir), de->d_name,
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd >= 0)
+        ret = count_dir(c, fd);
+    } else if (S_ISREG(st.st_mode)) {
+      c->files++;
+      c->bytes += (unsigned long long)st.st_size;
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+void live_count_source(LiveTarget *lt, const char *src_real,
+                       volatile sig_atomic_t *stop_flag,
+                       const atomic_int *abort) {
+  Count c = {0, 0, stop_flag, abort};
+  int fd = open(src_real, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || count_dir(&c, fd) < 0)
+    return;
+  atomic_store_explicit(&lt->total_bytes, c.bytes, RELAXED);
+  atomic_store_explicit(&lt->total_files, c.files, RELAXED);
+}
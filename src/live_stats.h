@@ -0,0 +1,67 @@
+#ifndef LIVE_STATS_H
+#define LIVE_STATS_H
+
+#include <signal.h>     // sig_atomic_t
+#include <stdatomic.h>
+#include <stdint.h>
+
+// targets of one watcher that get counters; further ones run uncounted
+#define LIVE_TARGETS 32
+#define LIVE_ERROR_MAX 200
+
+typedef enum {
+  PHASE_NONE,    // slot unused
+  PHASE_INITIAL, // first copy or incremental sync of the whole source
+  PHASE_LIVE,    // following events
+  PHASE_RESCAN,  // reconciling after lost events
+} LivePhase;
+
+// One target's counters. Every field is written with relaxed atomics by the
+// watcher's threads and read by the parent at any time.
+typedef struct {
+  atomic_int phase;
+  atomic_ullong started_ns;   // CLOCK_MONOTONIC, shared by all processes
+  atomic_ullong files;        // files written or linked into the target
+  atomic_ullong bytes;        // ...and their sizes
+  atomic_ullong kept_files;   // initial sync: found already up to date
+  atomic_ullong kept_bytes;
+  atomic_ullong total_files;  // regular files in the source, counted during
+  atomic_ullong total_bytes;  // the initial phase; 0 until known
+  atomic_ullong ops;          // queued operations applied
+  atomic_ullong queued;       // queue depth
+  atomic_uint error_seq;      // odd while last_error is being written
+  atomic_llong error_time;    // time_t of last_error, 0 = none yet
+  char last_error[LIVE_ERROR_MAX];
+} LiveTarget;
+
+// Memory shared between the parent and one watcher: mapped by the parent
+// before the fork, so reading it costs the parent no round trip.
+typedef struct {
+  atomic_ullong events;  // source events read
+  atomic_ullong watches; // inotify watches held, 0 under fanotify
+  LiveTarget targets[LIVE_TARGETS];
+} LiveShared;
+
+// MAP_SHARED anonymous mapping, zeroed; NULL on failure
+LiveShared *live_shared_create(void);
+void live_shared_destroy(LiveShared *ls);
+// clears a slot for a new target and starts its clock
+void live_target_reset(LiveTarget *lt);
+
+// lt may be NULL in all of these
+void live_copied(LiveTarget *lt, unsigned long long bytes);
+void live_kept(LiveTarget *lt, unsigned long long bytes);
+void live_phase(LiveTarget *lt, LivePhase phase);
+void live_error(LiveTarget *lt, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Copies the last error out; returns its time, 0 when there was none.
+long long live_last_error(LiveTarget *lt, char out[LIVE_ERROR_MAX]);
+
+// Counts the regular files below src_real and their bytes into
+// lt->total_*, unless stop_flag or *abort is set first.
+void live_count_source(LiveTarget *lt, const char *src_real,
+                       volatile sig_atomic_t *stop_flag,
+                       const atomic_int *abort);
+
+#endif
@@ -8,46 +8,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-#include <poll.h>
 
 #include "config.h"
 #include "filesystem_utils.h"
+#include "io_utils.h"
+#include "live_stats.h"
 #include "monitor.h"
 #include "restore.h"
 #include "mirror.h"
+#include "options.h"
+#include "registry.h"
+#include "snapshot.h"
 
 #define MAX_ARGS 32
+#define INPUT_MAX 4096
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 static volatile sig_atomic_t g_terminate = 0;
-static volatile sig_atomic_t g_got_sigchld = 0;
 static volatile sig_atomic_t g_child_exit = 0;
 
-typedef struct {
-  char *src;
-  char *dst;
-  pid_t pid;
-  time_t created_at;
-  int active;
-} Backup;
-
-typedef struct {
-  Backup *backups;
-  size_t backups_count;
-  size_t backups_capacity;
-} BackupList;
+static Registry g_reg = {0};
 
-
-static BackupList g_list = {0};
+// The parent sleeps in one epoll_wait on stdin, a signalfd for SIGINT and
+// SIGTERM, and a pidfd per watcher; events carry the watcher itself, or one
+// of these tags.
+static int g_epoll_fd = -1;
+static int g_signal_fd = -1;
+static sigset_t g_term_mask;
+static char g_stdin_tag, g_signal_tag;
 
 static void on_parent_terminate(int sig) { g_terminate = 1; }
 
-static void on_sigchld(int sig) { g_got_sigchld = 1; }
-
 static void on_child_term(int sig) { g_child_exit = 1; }
 
 static int sethandler(void (*f)(int), int sigNo) {
@@ -63,15 +66,36 @@ static int sethandler(void (*f)(int), int sigNo) {
   return 0;
 }
 
-static void install_parent_signals(void) {
+// SIGINT and SIGTERM stay blocked and arrive through g_signal_fd; the
+// handler only runs while allow_terminate lets them through
+static int install_parent_signals(void) {
   sethandler(on_parent_terminate, SIGINT);
   sethandler(on_parent_terminate, SIGTERM);
-  sethandler(on_sigchld, SIGCHLD);
+  sigemptyset(&g_term_mask);
+  sigaddset(&g_term_mask, SIGINT);
+  sigaddset(&g_term_mask, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &g_term_mask, NULL) < 0) {
+    perror("sigprocmask");
+    return -1;
+  }
+  g_signal_fd = signalfd(-1, &g_term_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (g_signal_fd < 0) {
+    perror("signalfd");
+    return -1;
+  }
+  return 0;
+}
+
+// restore and snapshots run inside a command for as long as they take;
+// meanwhile a signal has to reach the handler to cut them short
+static void allow_terminate(int allow) {
+  sigprocmask(allow ? SIG_UNBLOCK : SIG_BLOCK, &g_term_mask, NULL);
 }
 
 static void child_install_signals(void) {
   if (sethandler(on_child_term, SIGTERM) < 0)
     _exit(1);
+  allow_terminate(1);
 }
 
 // parsing
@@ -153,223 +177,94 @@ int parse_line(char *line, char *argv[MAX_ARGS],
   return 0;
 }
 
-// restoring helpers
-int check_src_against_backup(const char *src_path, const char *backup_path) {
-  struct stat backup_st;
-  if (lstat(backup_path, &backup_st) <
-      0) { // if backup doesn't have smth, delete it from src
-    if (errno == ENOENT) {
-      return rm_tree(src_path); // rm_tree handles non-existent files
-    }
-    perror("lstat(check_src_against_backup)");
-    return -1;
+// closes what the parent holds of a watcher that is gone, and forgets it
+static void forget_watcher(Watcher *watcher) {
+  if (watcher->pidfd >= 0) {
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, watcher->pidfd, NULL);
+    close(watcher->pidfd);
   }
+  close(watcher->ctl_fd);
+  live_shared_destroy(watcher->live);
+  registry_remove_watcher(&g_reg, watcher);
+}
 
-  struct stat source_st;
-  if (lstat(src_path, &source_st) < 0) {
-    if (errno == ENOENT) {
-      return 0;
-    }
-    perror("lstat(check_src_against_backup)");
+// sends one ControlMsg and waits for the watcher's answer, which must be
+// exactly reply_size bytes
+static int watcher_call(Watcher *watcher, int op, const char *dst,
+                        const BackupOptions *opts, int slot, void *reply,
+                        size_t reply_size) {
+  ControlMsg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.op = op;
+  msg.slot = slot;
+  if (opts)
+    msg.opts = *opts;
+  if (snprintf(msg.dst, PATH_MAX, "%s", dst) >= PATH_MAX)
     return -1;
-  }
-
-  int src_is_dir = S_ISDIR(source_st.st_mode) && !S_ISLNK(source_st.st_mode);
-  int bck_is_dir = S_ISDIR(backup_st.st_mode) && !S_ISLNK(backup_st.st_mode);
-
-  if (src_is_dir != bck_is_dir ||
-      (S_ISREG(source_st.st_mode) != S_ISREG(backup_st.st_mode)) ||
-      (S_ISLNK(source_st.st_mode) != S_ISLNK(backup_st.st_mode))) {
-    return rm_tree(src_path);
-  }
 
-  if (!src_is_dir)
-    return 0;
-
-  DIR *dir;
-  if ((dir = opendir(src_path)) == NULL) {
-    perror("opendir(check_src_against_backup)");
+  if (send(watcher->ctl_fd, &msg, sizeof(msg), MSG_NOSIGNAL) < 0) {
+    perror("send(watcher)");
     return -1;
   }
-  struct dirent *entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-      continue;
-
-    char src_child[PATH_MAX], bck_child[PATH_MAX];
-    if (snprintf(src_child, PATH_MAX, "%s/%s", src_path, entry->d_name) >=
-        PATH_MAX) {
-      if (closedir(dir) < 0) {
-        perror("closedir(check_src_against_backup)");
-      }
-      return -1;
-    }
-    if (snprintf(bck_child, PATH_MAX, "%s/%s", backup_path, entry->d_name) >=
-        PATH_MAX) {
-      if (closedir(dir) < 0) {
-        perror("closedir(check_src_against_backup)");
-      }
-      return -1;
-    }
-
-    if (check_src_against_backup(src_child, bck_child) < 0) {
-      if (closedir(dir) < 0) {
-        perror("closedir(check_src_against_backup)");
-      }
-      return -1;
-    }
+  ssize_t n;
+  while ((n = recv(watcher->ctl_fd, reply, reply_size, 0)) < 0 &&
+         errno == EINTR) {
   }
-
-  if (closedir(dir) < 0) {
-    perror("closedir(check_src_against_backup)");
+  if (n != (ssize_t)reply_size) {
+    fprintf(stderr, "watcher pid=%d did not answer\n", (int)watcher->pid);
     return -1;
   }
   return 0;
 }
 
-int apply_backup(const char *backup_path, const char *src_path,
-                 const char *backup_real, const char *src_real,
-                 time_t created_at) {
-  struct stat backup_st;
-  if (lstat(backup_path, &backup_st) < 0)
+// a request answered with a plain status
+int watcher_request(Watcher *watcher, int op, const char *dst,
+                    const BackupOptions *opts) {
+  int status;
+  if (watcher_call(watcher, op, dst, opts, -1, &status, sizeof(status)) < 0)
     return -1;
-
-  if (S_ISDIR(backup_st.st_mode) && !S_ISLNK(backup_st.st_mode)) {
-    if (mkdir_p(src_path, backup_st.st_mode & 0777) < 0)
-      return -1;
-
-    DIR *dir;
-    if ((dir = opendir(backup_path)) == NULL) {
-      perror("opendir(apply_backup)");
-      return -1;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-      if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-        continue;
-
-      char bck_child[PATH_MAX], src_child[PATH_MAX];
-      if (snprintf(bck_child, PATH_MAX, "%s/%s", backup_path, entry->d_name) >=
-          PATH_MAX) {
-        if (closedir(dir) < 0)
-          perror("closedir(apply_backup)");
-        return -1;
-      }
-      if (snprintf(src_child, PATH_MAX, "%s/%s", src_path, entry->d_name) >=
-          PATH_MAX) {
-        if (closedir(dir) < 0)
-          perror("closedir(apply_backup)");
-        return -1;
-      }
-
-      if (apply_backup(bck_child, src_child, backup_real, src_real,
-                       created_at) < 0) {
-        closedir(dir);
-        return -1;
-      }
-    }
-    if (closedir(dir) < 0) {
-      perror("closedir(apply_backup)");
-      return -1;
-    }
-    return 0;
-  }
-
-  struct stat source_st;
-  int src_exists = (lstat(src_path, &source_st) == 0);
-  int to_write = 0;
-  if (!src_exists) {
-    to_write = 1;
-  } else if (source_st.st_mtime > created_at) {
-    to_write = 1;
-  }
-
-  if (!to_write)
-    return 0;
-
-  // types dont match
-  if (src_exists &&
-      ((S_ISREG(source_st.st_mode) != S_ISREG(backup_st.st_mode)) ||
-       (S_ISLNK(source_st.st_mode) != S_ISLNK(backup_st.st_mode)) ||
-       (S_ISDIR(source_st.st_mode) &&
-        !S_ISLNK(source_st.st_mode) != S_ISDIR(backup_st.st_mode) &&
-        !S_ISLNK(backup_st.st_mode)))) {
-    if (rm_tree(src_path) < 0)
-      return -1;
-  }
-
-  if (ensure_parent_dir(src_path) < 0)
-    return -1;
-
-  if (S_ISREG(backup_st.st_mode)) {
-    return copy_file(backup_path, src_path, backup_st.st_mode, &g_child_exit);
-  }
-
-  if (S_ISLNK(backup_st.st_mode)) {
-    return copy_symplink_rewrite(backup_path, src_path, backup_real, src_real);
-  }
-  return 0;
+  return status;
 }
 
-// dynamic registry for backups
-int ensure_capacity(BackupList *lst, size_t need) {
-  if (lst->backups_capacity >= need) {
-    return 0;
-  }
-  size_t new_capacity =
-      (lst->backups_capacity == 0) ? 8 : (lst->backups_capacity * 2);
-  while (new_capacity < need) {
-    new_capacity *= 2;
-  }
-  Backup *new_backup = realloc(lst->backups, sizeof(Backup) * new_capacity);
-  if (!new_backup) {
-    return -1;
+// a free counter slot of the watcher, cleared for a new target; -1 if none
+static int slot_take(Watcher *watcher) {
+  for (int i = 0; watcher->live && i < LIVE_TARGETS; i++) {
+    if (watcher->slots & (1u << i))
+      continue;
+    watcher->slots |= 1u << i;
+    live_target_reset(&watcher->live->targets[i]);
+    return i;
   }
-  lst->backups = new_backup;
-  lst->backups_capacity = new_capacity;
-  return 0;
+  return -1;
 }
 
-void free_backup(Backup *backup) {
-  if (!backup) {
-    return;
-  }
-  free(backup->dst);
-  free(backup->src);
-  backup->dst = NULL;
-  backup->src = NULL;
-  backup->created_at = 0;
-  backup->active = 0;
+static void slot_release(Watcher *watcher, int slot) {
+  if (slot >= 0)
+    watcher->slots &= ~(1u << slot);
 }
 
-int find_backup(char *src, char *dst) {
-  for (int i = 0; i < (int)g_list.backups_count; i++) {
-    if (strcmp(g_list.backups[i].src, src) == 0 &&
-        strcmp(g_list.backups[i].dst, dst) == 0) {
-      return i;
-    }
-  }
-  return -1;
+// the watcher's pidfd turned readable: it exited on its own, and all its
+// targets ended with it
+static void watcher_exited(Watcher *watcher) {
+  if (waitpid(watcher->pid, NULL, 0) < 0)
+    perror("waitpid");
+  while (watcher->first != REG_NONE) {
+    size_t index = watcher->first;
+    g_reg.backups[index].slot = -1;
+    registry_unlink(&g_reg, index);
+  }
+  forget_watcher(watcher);
 }
 
-void reap_children() {
-  while (1) {
-    pid_t pid = waitpid(-1, NULL, WNOHANG);
-    if (pid <= 0)
-      break;
-
-    for (size_t i = 0; i < g_list.backups_count; i++) {
-      if (g_list.backups[i].active && g_list.backups[i].pid == pid) {
-        g_list.backups[i].active = 0;
-        g_list.backups[i].pid = 0;
-        break;
-      }
-    }
-  }
+// waits for a watcher whose last target was detached, it exits on its own
+static void retire_watcher(Watcher *watcher) {
+  if (waitpid(watcher->pid, NULL, 0) < 0)
+    perror("waitpid");
+  forget_watcher(watcher);
 }
 
-void child_loop(char *src, char *dst) {
+void child_loop(char *src, char *dst, const BackupOptions *opts, int ctl_fd,
+                LiveShared *live) {
   g_child_exit = 0; 
   child_install_signals();
 
@@ -379,95 +274,287 @@ void child_loop(char *src, char *dst) {
     _exit(0);
   }
 
-  if (create_empty_dir(dst)) {
-    _exit(0);
-  }
-
-  char dst_real[PATH_MAX];
-  if (!realpath(dst, dst_real)) {
-    _exit(0);
-  }
-
-  copy_tree(src_real, dst_real, src_real, dst_real, &g_child_exit);
-
-  if (monitor_and_mirror(src_real, dst_real, &g_child_exit) < 0)
+  if (monitor_source(src_real, dst, opts, ctl_fd, live, &g_child_exit) < 0)
     _exit(1);
   _exit(0);
 }
 
 // spawning
-static int spawn_backup(char *src, char *dst) {
+// Forks the watcher of src with dst as its first target. slot gets the
+// target's counters.
+static Watcher *start_watcher(char *src, char *dst, const BackupOptions *opts,
+                              int *slot) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    perror("socketpair");
+    return NULL;
+  }
+  Watcher *watcher = registry_add_watcher(&g_reg, src);
+  if (!watcher) {
+    close(sv[0]);
+    close(sv[1]);
+    return NULL;
+  }
+  watcher->ctl_fd = sv[0];
+  // mapped before the fork, so both sides share it without any IPC;
+  // without it the backup just runs uncounted
+  watcher->live = live_shared_create();
+  *slot = slot_take(watcher);
+
   pid_t pid = fork();
   if (pid < 0) {
     perror("fork");
-    return -1;
+    close(sv[1]);
+    forget_watcher(watcher);
+    return NULL;
   }
 
   if (pid == 0) {
-    child_loop(src, dst);
+    // other watchers must see EOF when the parent goes away
+    for (size_t i = 0; i < g_reg.watchers_count; i++) {
+      Watcher *other = g_reg.watchers[i];
+      if (other == watcher)
+        continue;
+      close(other->ctl_fd);
+      close(other->pidfd);
+      live_shared_destroy(other->live);
+    }
+    close(sv[0]);
+    close(g_epoll_fd);
+    close(g_signal_fd);
+    child_loop(src, dst, opts, sv[1], watcher->live);
     _exit(EXIT_SUCCESS);
   }
 
-  if (ensure_capacity(&g_list, g_list.backups_count + 1) < 0) {
-    if (kill(pid, SIGTERM) < 0) {
-      perror("kill");
+  close(sv[1]);
+  watcher->pid = pid;
+  watcher->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = watcher};
+  if (watcher->pidfd < 0 ||
+      epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, watcher->pidfd, &ev) < 0) {
+    perror("pidfd_open");
+    kill(pid, SIGTERM);
+    retire_watcher(watcher);
+    return NULL;
+  }
+  return watcher;
+}
+
+// A source that is already watched gets the target attached to its watcher,
+// which copies it in the background; otherwise a new watcher is forked.
+static int spawn_backup(char *src, char *dst, const BackupOptions *opts) {
+  int slot;
+  Watcher *watcher = registry_watcher(&g_reg, src);
+  if (watcher) {
+    slot = slot_take(watcher);
+    int status;
+    if (watcher_call(watcher, CTL_ATTACH, dst, opts, slot, &status,
+                     sizeof(status)) < 0 ||
+        status < 0) {
+      slot_release(watcher, slot);
+      return -1;
     }
-    return -1;
+  } else {
+    watcher = start_watcher(src, dst, opts, &slot);
+    if (!watcher)
+      return -1;
   }
 
-  Backup new_backup;
-  new_backup.src = strdup(src);
-  new_backup.dst = strdup(dst);
-  new_backup.pid = pid;
-  new_backup.created_at = time(NULL);
-  new_backup.active = 1;
+  // an ended pair being added again reuses its registry entry
+  int index = registry_find(&g_reg, src, dst);
+  if (index < 0 && (index = registry_add(&g_reg, src, dst)) < 0) {
+    if (watcher_request(watcher, CTL_DETACH, dst, NULL) == 0)
+      slot_release(watcher, slot);
+    if (watcher->targets == 0)
+      retire_watcher(watcher);
+    return -1;
+  }
 
-  g_list.backups[g_list.backups_count++] = new_backup;
+  Backup *backup = &g_reg.backups[index];
+  backup->created_at = time(NULL);
+  backup->opts = *opts;
+  backup->slot = slot;
+  backup->seen_ns = 0;
+  registry_link(&g_reg, (size_t)index, watcher);
   return 0;
 }
 
+// detaches the target from its watcher; the watcher exits with its last
+// target and is reaped here
+static void stop_backup(int index) {
+  Backup *backup = &g_reg.backups[index];
+  Watcher *watcher = backup->watcher;
+  if (!watcher)
+    return;
+  if (watcher_request(watcher, CTL_DETACH, backup->dst, NULL) < 0)
+    fprintf(stderr, "detach failed for dst=\"%s\"\n", backup->dst);
+  slot_release(watcher, backup->slot);
+  backup->slot = -1;
+  registry_unlink(&g_reg, (size_t)index);
+  if (watcher->targets == 0)
+    retire_watcher(watcher);
+}
+
 // commands
 void cmd_help(void) {
   printf("Commands:\n");
-  printf("  add <source> <target1> [target2 ...]\n");
+  printf("  add [options] <source> <target1> [target2 ...]\n");
   printf("  end <source> <target1> [target2 ...]\n");
   printf("  list\n");
-  printf("  restore <source> <target>\n");
+  printf("  restore [options] <source> <target>\n");
+  printf("  snapshot [--list] <source> <target>\n");
+  printf("  stats <source> <target>\n");
   printf("  exit\n");
+  print_backup_options_help();
+  print_restore_options_help();
+}
+
+// bytes in a unit that keeps them short
+static void format_bytes(unsigned long long bytes, char out[16]) {
+  if (bytes < 1024)
+    snprintf(out, 16, "%lluB", bytes);
+  else if (bytes < 1024 * 1024)
+    snprintf(out, 16, "%.1fKiB", (double)bytes / 1024);
+  else if (bytes < 1024ull * 1024 * 1024)
+    snprintf(out, 16, "%.1fMiB", (double)bytes / (1024 * 1024));
+  else
+    snprintf(out, 16, "%.2fGiB", (double)bytes / (1024 * 1024 * 1024));
+}
+
+static const char *phase_name(int phase) {
+  switch (phase) {
+  case PHASE_INITIAL:
+    return "initial sync";
+  case PHASE_LIVE:
+    return "live";
+  case PHASE_RESCAN:
+    return "rescan";
+  default:
+    return "starting";
+  }
+}
+
+// Prints the counters the backup's watcher publishes, read straight from the
+// shared mapping. Rates cover the time since the previous call for this
+// backup, or since the target started.
+static void print_live(Backup *backup) {
+  if (!backup->watcher || backup->slot < 0 || !backup->watcher->live) {
+    printf("    (no live counters)\n");
+    return;
+  }
+  LiveShared *ls = backup->watcher->live;
+  LiveTarget *lt = &ls->targets[backup->slot];
+  int phase = atomic_load_explicit(&lt->phase, memory_order_relaxed);
+  unsigned long long files =
+      atomic_load_explicit(&lt->files, memory_order_relaxed);
+  unsigned long long bytes =
+      atomic_load_explicit(&lt->bytes, memory_order_relaxed);
+  unsigned long long events =
+      atomic_load_explicit(&ls->events, memory_order_relaxed);
+  uint64_t now = now_ns();
+
+  uint64_t since = backup->seen_ns;
+  unsigned long long seen_bytes = backup->seen_bytes;
+  unsigned long long seen_events = backup->seen_events;
+  if (since == 0) {
+    since = atomic_load_explicit(&lt->started_ns, memory_order_relaxed);
+    seen_bytes = 0;
+    seen_events = 0;
+  }
+  double secs = now > since ? (double)(now - since) / 1e9 : 0;
+  double mibs = 0, evs = 0;
+  if (secs > 0) {
+    mibs = (double)(bytes - seen_bytes) / (1024 * 1024) / secs;
+    evs = (double)(events - seen_events) / secs;
+  }
+  backup->seen_ns = now;
+  backup->seen_bytes = bytes;
+  backup->seen_events = events;
+
+  char copied[16];
+  format_bytes(bytes, copied);
+  printf("    %s: %llu files (%s) copied, %.1f MiB/s, %.0f events/s\n",
+         phase_name(phase), files, copied, mibs, evs);
+
+  if (phase == PHASE_INITIAL) {
+    unsigned long long total_files =
+        atomic_load_explicit(&lt->total_files, memory_order_relaxed);
+    unsigned long long total_bytes =
+        atomic_load_explicit(&lt->total_bytes, memory_order_relaxed);
+    unsigned long long done_files =
+        files + atomic_load_explicit(&lt->kept_files, memory_order_relaxed);
+    unsigned long long done_bytes =
+        bytes + atomic_load_explicit(&lt->kept_bytes, memory_order_relaxed);
+    if (total_files == 0) {
+      printf("    progress: counting source...\n");
+    } else {
+      // events copied during the sync can push the counts past the total
+      double pct = total_bytes ? 100.0 * (double)done_bytes / (double)total_bytes
+                               : 100.0 * (double)done_files / (double)total_files;
+      if (pct > 99.9)
+        pct = 99.9;
+      char done[16], total[16];
+      format_bytes(done_bytes, done);
+      format_bytes(total_bytes, total);
+      printf("    progress: %.1f%% (%llu/%llu files, %s/%s)\n", pct,
+             done_files < total_files ? done_files : total_files, total_files,
+             done, total);
+    }
+  }
+
+  printf("    queue %llu, ops %llu, watches %llu\n",
+         atomic_load_explicit(&lt->queued, memory_order_relaxed),
+         atomic_load_explicit(&lt->ops, memory_order_relaxed),
+         atomic_load_explicit(&ls->watches, memory_order_relaxed));
+
+  char error[LIVE_ERROR_MAX];
+  time_t when = (time_t)live_last_error(lt, error);
+  if (when) {
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&when, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("    last error %s: %s\n", stamp, error);
+  }
 }
 
 void cmd_list() {
-  reap_children();
-  if (g_list.backups_count == 0) {
+  if (g_reg.backups_count == 0) {
     printf("(no active backups)\n");
     return;
   }
 
-  for (size_t i = 0; i < g_list.backups_count; i++) {
-    if (g_list.backups[i].active) {
-      printf("[ACTIVE] pid=%d src=\"%s\" dst=\"%s\"\n",
-             (int)g_list.backups[i].pid, g_list.backups[i].src,
-             g_list.backups[i].dst);
+  for (size_t i = 0; i < g_reg.backups_count; i++) {
+    Backup *backup = &g_reg.backups[i];
+    if (backup->active) {
+      printf("[ACTIVE] pid=%d src=\"%s\" dst=\"%s\"\n", (int)backup->pid,
+             backup->src, backup->dst);
+      print_live(backup);
     } else {
-      printf("[ENDED] src=\"%s\" dst=\"%s\"\n", g_list.backups[i].src,
-             g_list.backups[i].dst);
+      printf("[ENDED] src=\"%s\" dst=\"%s\"\n", backup->src, backup->dst);
     }
   }
 }
 
 void cmd_add(char *argv[], int argc) {
-  if (argc < 3) {
-    printf("usage: add <source> <target1> [target2 ...]\n");
+  BackupOptions opts;
+  int first = parse_backup_options(argv, argc, 1, &opts);
+  if (first < 0 || argc - first < 2) {
+    printf("usage: add [options] <source> <target1> [target2 ...]\n");
     return;
   }
 
   char src_norm[PATH_MAX];
-  if (norm_existing_dir(argv[1], src_norm) < 0) {
+  if (norm_existing_dir(argv[first], src_norm) < 0) {
     printf("add: invalid source\n");
     return;
   }
+  if (opts.dedup[0] && has_prefix_path(opts.dedup, src_norm)) {
+    printf("add: dedup store is inside the source \"%s\"\n", opts.dedup);
+    return;
+  }
 
-  for (int i = 2; i < argc; i++) {
+  for (int i = first + 1; i < argc; i++) {
     char dst_norm[PATH_MAX];
     if (norm_target_path(argv[i], dst_norm) < 0) {
       printf("add: invalid target \"%s\"\n", argv[i]);
@@ -480,15 +567,28 @@ void cmd_add(char *argv[], int argc) {
               src_norm, dst_norm);
       continue;
     }
-    if (find_backup(src_norm, dst_norm) >= 0) {
+    // the target's sync would remove the store as an extra, and the other
+    // way round the store would be mirrored
+    if (opts.dedup[0] && (has_prefix_path(opts.dedup, dst_norm) ||
+                          has_prefix_path(dst_norm, opts.dedup))) {
+      printf("add: dedup store and target overlap: \"%s\"\n", dst_norm);
+      continue;
+    }
+    int index = registry_find(&g_reg, src_norm, dst_norm);
+    if (index >= 0 && g_reg.backups[index].active) {
       printf("add: already active src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
       continue;
     }
-    if (ensure_empty_dir(dst_norm) < 0) {
+    if (opts.incremental) {
+      if (ensure_dir_or_missing(dst_norm) < 0) {
+        printf("add: target invalid \"%s\"\n", dst_norm);
+        continue;
+      }
+    } else if (ensure_empty_dir(dst_norm) < 0) {
       perror("add: target invalid");
       continue;
     }
-    if (spawn_backup(src_norm, dst_norm) >= 0) {
+    if (spawn_backup(src_norm, dst_norm, &opts) >= 0) {
       printf("added src=\"%s\" -> dst=\"%s\"\n", src_norm, dst_norm);
     } else {
       printf("add failed for dst=\"%s\"\n", dst_norm);
@@ -514,147 +614,372 @@ void cmd_end(char *argv[], int argc) {
       printf("add: invalid target \"%s\"\n", argv[i]);
       continue;
     }
-    int index = find_backup(src_norm, dst_norm);
+    int index = registry_find(&g_reg, src_norm, dst_norm);
     if (index < 0) {
       printf("end: not found src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
       continue;
     }
 
-    if (!g_list.backups[index].active) {
+    if (!g_reg.backups[index].active) {
       printf("end: already ended src=\"%s\" dst=\"%s\"\n",
-             g_list.backups[index].src, g_list.backups[index].dst);
+             g_reg.backups[index].src, g_reg.backups[index].dst);
       continue;
     }
 
-    if (kill(g_list.backups[index].pid, SIGTERM) < 0) {
-      perror("kill");
-    }
-    if (waitpid(g_list.backups[index].pid, NULL, 0) < 0) {
-      perror("waitpid");
-    }
-    g_list.backups[index].active = 0;
-    g_list.backups[index].pid = 0;
+    stop_backup(index);
 
     printf("ended src=\"%s\" dst=\"%s\" (backup kept for restore)\n",
-           g_list.backups[index].src, g_list.backups[index].dst);
+           g_reg.backups[index].src, g_reg.backups[index].dst);
   }
 }
 
 void cmd_restore(char *argv[], int argc) {
-  if (argc != 3) {
-    printf("usage: end <source> <target1> <target2> ...\n");
+  RestoreOptions opts;
+  int first = parse_restore_options(argv, argc, 1, &opts);
+  if (first < 0)
+    return;
+  if (argc - first != 2) {
+    printf("usage: restore [options] <source> <target>\n");
     return;
   }
 
   char src_norm[PATH_MAX];
-  if (norm_existing_dir(argv[1], src_norm) < 0) {
+  if (norm_existing_dir(argv[first], src_norm) < 0) {
     printf("restore: invalid source\n");
     return;
   }
 
   char dst_norm[PATH_MAX];
-  if (norm_target_path(argv[2], dst_norm) < 0) {
-    printf("restore: invalid target \"%s\"\n", argv[2]);
+  if (norm_target_path(argv[first + 1], dst_norm) < 0) {
+    printf("restore: invalid target \"%s\"\n", argv[first + 1]);
     return;
   }
 
-  int index = find_backup(src_norm, dst_norm);
+  int index = registry_find(&g_reg, src_norm, dst_norm);
   if (index < 0) {
     printf("restore: backup not found for this pair\n");
     return;
   }
+  char snap[PATH_MAX];
+  if (opts.snapshot[0] && snapshot_path(dst_norm, opts.snapshot, snap) < 0) {
+    printf("restore: no snapshot %s of \"%s\"\n", opts.snapshot, dst_norm);
+    return;
+  }
 
-  time_t created_at = g_list.backups[index].created_at;
-  if (g_list.backups[index].active) {
-    pid_t pid = g_list.backups[index].pid;
-    if (kill(pid, SIGTERM) < 0) {
-      perror("kill");
-    }
-    if (waitpid(pid, NULL, 0) < 0) {
-      perror("waitpid");
-    }
-    g_list.backups[index].active = 0;
-    g_list.backups[index].pid = 0;
+  if (g_reg.backups[index].active) {
+    stop_backup(index);
   }
 
-  if (check_src_against_backup(src_norm, dst_norm) < 0) {
+  RestoreStats stats;
+  allow_terminate(1);
+  int ret = restore_tree(dst_norm, src_norm, &opts, &stats, &g_terminate);
+  allow_terminate(0);
+  if (ret < 0) {
+    printf("restore: incomplete, %llu entries failed\n", stats.failed);
     return;
   }
-  if (apply_backup(dst_norm, src_norm, dst_norm, src_norm, created_at) < 0) {
-    perror("apply backup");
+
+  if (opts.snapshot[0])
+    printf("restored src=\"%s\" from backup=\"%s\" snapshot %s\n", src_norm,
+           dst_norm, opts.snapshot);
+  else
+    printf("restored src=\"%s\" from backup=\"%s\"\n", src_norm, dst_norm);
+}
+
+static void list_snapshots(const char *dst_real) {
+  char **ids;
+  size_t count;
+  if (snapshot_list(dst_real, &ids, &count) < 0) {
+    printf("snapshot: cannot list snapshots of \"%s\"\n", dst_real);
     return;
   }
-
-  printf("restored src=\"%s\" from backup=\"%s\"\n", src_norm, dst_norm);
+  if (count == 0)
+    printf("(no snapshots)\n");
+  for (size_t i = 0; i < count; i++)
+    printf("%s\n", ids[i]);
+  snapshot_list_free(ids, count);
 }
 
-int main() {
-  install_parent_signals();
-  cmd_help();
+void cmd_snapshot(char *argv[], int argc) {
+  int list = argc > 1 && strcmp(argv[1], "--list") == 0;
+  if (argc - list != 3) {
+    printf("usage: snapshot [--list] <source> <target>\n");
+    return;
+  }
 
-  char line[4096];
-  while (!g_terminate) {
-    reap_children();
+  char src_norm[PATH_MAX];
+  if (norm_existing_dir(argv[1 + list], src_norm) < 0) {
+    printf("snapshot: invalid source\n");
+    return;
+  }
+  char dst_norm[PATH_MAX];
+  if (norm_target_path(argv[2 + list], dst_norm) < 0) {
+    printf("snapshot: invalid target \"%s\"\n", argv[2 + list]);
+    return;
+  }
+  int index = registry_find(&g_reg, src_norm, dst_norm);
+  if (index < 0) {
+    printf("snapshot: backup not found for this pair\n");
+    return;
+  }
+  Backup *backup = &g_reg.backups[index];
+  char dst_real[PATH_MAX];
+  if (!realpath(dst_norm, dst_real)) {
+    perror("snapshot: realpath");
+    return;
+  }
+  if (list) {
+    list_snapshots(dst_real);
+    return;
+  }
 
-    printf("> ");
-    fflush(stdout);
+  // a running target takes it between two of its operations, so the
+  // generation is a state the target really was in
+  if (backup->watcher) {
+    if (watcher_request(backup->watcher, CTL_SNAPSHOT, backup->dst, NULL) < 0)
+      printf("snapshot failed for dst=\"%s\"\n", dst_norm);
+    else
+      printf("snapshot queued for dst=\"%s\"\n", dst_norm);
+    return;
+  }
 
-    errno = 0;
-    if (!fgets(line, sizeof(line), stdin)) {
-      if (errno == EINTR) {
-        printf("\n");
-        continue;
-      }
-      break;
-    }
+  char id[SNAPSHOT_ID_MAX];
+  allow_terminate(1);
+  int ret = snapshot_create(dst_real, id, &g_terminate);
+  allow_terminate(0);
+  if (ret < 0) {
+    printf("snapshot failed for dst=\"%s\"\n", dst_norm);
+    return;
+  }
+  printf("snapshot %s of dst=\"%s\"\n", id, dst_norm);
+  int removed = snapshot_prune(dst_real, backup->opts.keep_hourly,
+                               backup->opts.keep_daily);
+  if (removed > 0)
+    printf("removed %d old snapshots\n", removed);
+}
 
-    char *argv[MAX_ARGS];
-    char args_buf[MAX_ARGS][PATH_MAX];
-    int argc = 0;
+// microseconds in a unit that keeps them short
+static void format_us(unsigned long long us, char out[16]) {
+  if (us < 10000)
+    snprintf(out, 16, "%lluus", us);
+  else if (us < 10000000)
+    snprintf(out, 16, "%.1fms", (double)us / 1000);
+  else
+    snprintf(out, 16, "%.1fs", (double)us / 1000000);
+}
 
-    if (parse_line(line, argv, args_buf, &argc) < 0) {
-      printf("parse error\n");
-      continue;
-    }
-    if (argc == 0) {
-      continue;
-    }
+void cmd_stats(char *argv[], int argc) {
+  if (argc != 3) {
+    printf("usage: stats <source> <target>\n");
+    return;
+  }
 
-    if (strcmp(argv[0], "help") == 0)
-      cmd_help();
-    else if (strcmp(argv[0], "list") == 0)
-      cmd_list();
-    else if (strcmp(argv[0], "add") == 0)
-      cmd_add(argv, argc);
-    else if (strcmp(argv[0], "end") == 0)
-      cmd_end(argv, argc);
-    else if (strcmp(argv[0], "restore") == 0)
-      cmd_restore(argv, argc);
-    else if (strcmp(argv[0], "exit") == 0)
-      break;
+  char src_norm[PATH_MAX];
+  if (norm_existing_dir(argv[1], src_norm) < 0) {
+    printf("stats: invalid source\n");
+    return;
+  }
+  char dst_norm[PATH_MAX];
+  if (norm_target_path(argv[2], dst_norm) < 0) {
+    printf("stats: invalid target \"%s\"\n", argv[2]);
+    return;
+  }
+  int index = registry_find(&g_reg, src_norm, dst_norm);
+  if (index < 0) {
+    printf("stats: backup not found for this pair\n");
+    return;
+  }
+  Backup *backup = &g_reg.backups[index];
+  if (!backup->watcher) {
+    printf("stats: backup is not active\n");
+    return;
+  }
+
+  StatsReply reply;
+  if (watcher_call(backup->watcher, CTL_STATS, backup->dst, NULL, -1,
+                   &reply, sizeof(reply)) < 0 ||
+      reply.status < 0) {
+    printf("stats failed for dst=\"%s\"\n", dst_norm);
+    return;
+  }
+
+  printf("src=\"%s\" dst=\"%s\"\n", src_norm, dst_norm);
+  print_live(backup);
+  printf("event-to-mirror latency\n");
+  printf("  %-12s %10s %9s %9s %9s %9s\n", "event", "count", "p50", "p99",
+         "p99.9", "max");
+  for (int k = 0; k < LAT_KINDS; k++) {
+    const LatencySummary *s = &reply.latency[k];
+    char p50[16], p99[16], p999[16], max[16];
+    format_us(s->p50_us, p50);
+    format_us(s->p99_us, p99);
+    format_us(s->p999_us, p999);
+    format_us(s->max_us, max);
+    if (s->count == 0)
+      printf("  %-12s %10s\n", latency_kind_name((LatencyKind)k), "0");
     else
-      printf("unknown command: %s\n", argv[0]);
+      printf("  %-12s %10llu %9s %9s %9s %9s\n",
+             latency_kind_name((LatencyKind)k), s->count, p50, p99, p999,
+             max);
   }
+}
 
-  for (size_t i = 0; i < g_list.backups_count; i++) {
-    if (g_list.backups[i].active) {
-      kill(g_list.backups[i].pid, SIGTERM);
+// runs one input line; 1 when it was `exit`
+static int run_command(char *line) {
+  char *argv[MAX_ARGS];
+  char args_buf[MAX_ARGS][PATH_MAX];
+  int argc = 0;
+
+  if (parse_line(line, argv, args_buf, &argc) < 0) {
+    printf("parse error\n");
+    return 0;
+  }
+  if (argc == 0) {
+    return 0;
+  }
+
+  if (strcmp(argv[0], "help") == 0)
+    cmd_help();
+  else if (strcmp(argv[0], "list") == 0)
+    cmd_list();
+  else if (strcmp(argv[0], "add") == 0)
+    cmd_add(argv, argc);
+  else if (strcmp(argv[0], "end") == 0)
+    cmd_end(argv, argc);
+  else if (strcmp(argv[0], "restore") == 0)
+    cmd_restore(argv, argc);
+  else if (strcmp(argv[0], "snapshot") == 0)
+    cmd_snapshot(argv, argc);
+  else if (strcmp(argv[0], "stats") == 0)
+    cmd_stats(argv, argc);
+  else if (strcmp(argv[0], "exit") == 0)
+    return 1;
+  else
+    printf("unknown command: %s\n", argv[0]);
+  return 0;
+}
+
+static void prompt(void) {
+  printf("> ");
+  fflush(stdout);
+}
+
+// Input read so far that does not make a whole line yet. One read() per
+// readiness event, so stdin is never switched to non-blocking under a shell
+// that shares it.
+static char g_input[INPUT_MAX];
+static size_t g_input_len;
+static int g_input_skip; // dropping the rest of an overlong line
+
+// runs every complete line that arrived; 1 on `exit` or end of input
+static int read_input(void) {
+  ssize_t n = read(STDIN_FILENO, g_input + g_input_len,
+                   sizeof(g_input) - g_input_len - 1);
+  if (n < 0)
+    return errno == EINTR || errno == EAGAIN ? 0 : 1;
+  if (n == 0) {
+    // a last line without a newline still counts
+    if (g_input_len > 0 && !g_input_skip) {
+      g_input[g_input_len] = '\0';
+      g_input_len = 0;
+      run_command(g_input);
+    }
+    return 1;
+  }
+  g_input_len += (size_t)n;
+
+  size_t start = 0;
+  char *nl;
+  while ((nl = memchr(g_input + start, '\n', g_input_len - start))) {
+    *nl = '\0';
+    char *line = g_input + start;
+    start = (size_t)(nl - g_input) + 1;
+    if (g_input_skip) {
+      g_input_skip = 0;
+      continue;
     }
+    if (run_command(line))
+      return 1;
+    prompt();
+  }
+  memmove(g_input, g_input + start, g_input_len - start);
+  g_input_len -= start;
+  if (g_input_len == sizeof(g_input) - 1) {
+    printf("Line too long\n");
+    g_input_len = 0;
+    g_input_skip = 1;
+  }
+  return 0;
+}
+
+static int watch_fd(int fd, void *tag) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = tag};
+  return epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int main() {
+  g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (g_epoll_fd < 0) {
+    perror("epoll_create1");
+    return 1;
+  }
+  if (install_parent_signals() < 0 || watch_fd(g_signal_fd, &g_signal_tag) < 0)
+    return 1;
+  // regular files cannot be polled, they are read whenever the loop comes
+  // round instead
+  int stdin_polled = watch_fd(STDIN_FILENO, &g_stdin_tag) == 0;
+  if (!stdin_polled && errno != EPERM) {
+    perror("epoll_ctl(stdin)");
+    return 1;
   }
+  cmd_help();
+  prompt();
+
+  int done = 0;
+  while (!done && !g_terminate) {
+    struct epoll_event events[64];
+    int n = epoll_wait(g_epoll_fd, events, 64, stdin_polled ? -1 : 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
 
-  for (size_t i = 0; i < g_list.backups_count; i++) {
-    if (g_list.backups[i].active) {
-      if (waitpid(g_list.backups[i].pid, NULL, 0) < 0) {
-        perror("waitpid");
+    // exits are handled first, so commands in the same round see them
+    int input = !stdin_polled;
+    for (int i = 0; i < n; i++) {
+      void *tag = events[i].data.ptr;
+      if (tag == &g_stdin_tag) {
+        input = 1;
+      } else if (tag == &g_signal_tag) {
+        struct signalfd_siginfo si;
+        while (read(g_signal_fd, &si, sizeof(si)) == sizeof(si))
+          g_terminate = 1;
+      } else {
+        watcher_exited(tag);
       }
-      g_list.backups[i].active = 0;
-      g_list.backups[i].pid = 0;
     }
+    if (input && !g_terminate)
+      done = read_input();
   }
 
-  for (size_t i = 0; i < g_list.backups_count; i++)
-    free_backup(&g_list.backups[i]);
-  free(g_list.backups);
+  for (size_t i = 0; i < g_reg.watchers_count; i++) {
+    kill(g_reg.watchers[i]->pid, SIGTERM);
+  }
+
+  for (size_t i = 0; i < g_reg.watchers_count; i++) {
+    Watcher *watcher = g_reg.watchers[i];
+    if (waitpid(watcher->pid, NULL, 0) < 0) {
+      perror("waitpid");
+    }
+    close(watcher->pidfd);
+    close(watcher->ctl_fd);
+    live_shared_destroy(watcher->live);
+  }
+  registry_free(&g_reg);
+  close(g_signal_fd);
+  close(g_epoll_fd);
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,715 @@
+#define _GNU_SOURCE
+#include "manifest.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "hash.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_REMOVED 1
+
+#define TREE_NONE ((size_t)-1)
+
+#define MIN_SLOTS 1024
+#define MIN_NAMES (64 * 1024)
+
+_Static_assert(sizeof(ManifestHeader) == 128, "manifest header layout");
+_Static_assert(sizeof(ManifestEntry) == 64, "manifest entry layout");
+
+struct Manifest {
+  char path[PATH_MAX];
+  int fd;
+  void *map;
+  size_t map_len;
+  ManifestHeader *hdr;
+  ManifestEntry *slots;
+  char *names;
+  int trusted;
+  int failed;  // an update was lost: never trusted again until reopened
+  int dirty;   // the file already says MANIFEST_DIRTY
+
+  // In-memory index of the table by directory, one element per slot, so a
+  // subtree is found without a walk over every slot. Rebuilt with the
+  // table; NULL when it couldn't be allocated (subtrees are then scanned).
+  size_t *parent;
+  size_t *child;  // first entry directly below
+  size_t *next;   // siblings
+  size_t *prev;
+  uint64_t orphans; // entries recorded before their directory was
+};
+
+static uint64_t path_hash(const char *rel) {
+  uint64_t h = hash64(rel, strlen(rel), 0);
+  return h > SLOT_REMOVED ? h : h + 2;
+}
+
+static size_t file_len(uint64_t slots, uint64_t names_size) {
+  return sizeof(ManifestHeader) + slots * sizeof(ManifestEntry) + names_size;
+}
+
+static void set_layout(Manifest *m) {
+  m->hdr = m->map;
+  m->slots = (ManifestEntry *)((char *)m->map + sizeof(ManifestHeader));
+  m->names = (char *)(m->slots + m->hdr->slots);
+}
+
+static int map_fd(Manifest *m, int fd, size_t len) {
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap(manifest)");
+    return -1;
+  }
+  if (m->map)
+    munmap(m->map, m->map_len);
+  if (m->fd >= 0 && m->fd != fd)
+    close(m->fd);
+  m->fd = fd;
+  m->map = map;
+  m->map_len = len;
+  set_layout(m);
+  return 0;
+}
+
+// a fresh, empty manifest file of the given geometry at path
+static int create_file(const char *path, uint64_t slots, uint64_t names_size,
+                       const struct stat *root) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    perror("open(manifest)");
+    return -1;
+  }
+  // the file starts out zeroed: every slot empty
+  if (ftruncate(fd, (off_t)file_len(slots, names_size)) < 0) {
+    perror("ftruncate(manifest)");
+    close(fd);
+    return -1;
+  }
+  ManifestHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+  hdr.version = MANIFEST_VERSION;
+  hdr.state = MANIFEST_DIRTY;
+  hdr.root_dev = (uint64_t)root->st_dev;
+  hdr.root_ino = (uint64_t)root->st_ino;
+  hdr.slots = slots;
+  hdr.names_size = names_size;
+  if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+    perror("pwrite(manifest)");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int valid_file(const ManifestHeader *hdr, size_t len,
+                      const struct stat *root) {
+  return memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) == 0 &&
+         hdr->version == MANIFEST_VERSION && hdr->slots >= MIN_SLOTS &&
+         (hdr->slots & (hdr->slots - 1)) == 0 &&
+         file_len(hdr->slots, hdr->names_size) == len &&
+         hdr->names_used <= hdr->names_size &&
+         hdr->root_dev == (uint64_t)root->st_dev &&
+         hdr->root_ino == (uint64_t)root->st_ino;
+}
+
+// an update couldn't be made, so the entries no longer match the target
+static void lose_update(Manifest *m) {
+  m->failed = 1;
+  m->trusted = 0;
+}
+
+static int64_t find_slot(const Manifest *m, const char *rel, uint64_t hash,
+                         int64_t *free_slot);
+
+// hangs slot i below the entry of its directory; top-level entries have
+// none
+static void tree_link(Manifest *m, size_t i) {
+  m->parent[i] = TREE_NONE;
+  m->next[i] = TREE_NONE;
+  m->prev[i] = TREE_NONE;
+  const char *name = m->names + m->slots[i].name;
+  const char *slash = strrchr(name, '/');
+  if (!slash)
+    return;
+  char dir[PATH_MAX];
+  size_t n = (size_t)(slash - name);
+  int64_t p = -1;
+  if (n < PATH_MAX) {
+    memcpy(dir, name, n);
+    dir[n] = '\0';
+    p = find_slot(m, dir, path_hash(dir), NULL);
+  }
+  if (p < 0) {
+    m->orphans++;
+    return;
+  }
+  m->parent[i] = (size_t)p;
+  m->next[i] = m->child[p];
+  if (m->child[p] != TREE_NONE)
+    m->prev[m->child[p]] = i;
+  m->child[p] = i;
+}
+
+// takes slot i out of its directory; whatever is still below it is orphaned
+static void tree_unlink(Manifest *m, size_t i) {
+  size_t p = m->parent[i];
+  if (p != TREE_NONE) {
+    if (m->prev[i] != TREE_NONE)
+      m->next[m->prev[i]] = m->next[i];
+    else
+      m->child[p] = m->next[i];
+    if (m->next[i] != TREE_NONE)
+      m->prev[m->next[i]] = m->prev[i];
+  }
+  for (size_t c = m->child[i]; c != TREE_NONE; c = m->next[c]) {
+    m->parent[c] = TREE_NONE;
+    m->orphans++;
+  }
+  m->parent[i] = TREE_NONE;
+  m->child[i] = TREE_NONE;
+}
+
+static void tree_build(Manifest *m) {
+  size_t n = (size_t)m->hdr->slots;
+  size_t *block = realloc(m->parent, 4 * n * sizeof(*block));
+  if (!block) {
+    fprintf(stderr, "manifest index realloc failed\n");
+    free(m->parent);
+    m->parent = NULL;
+    return;
+  }
+  m->parent = block;
+  m->child = block + n;
+  m->next = block + 2 * n;
+  m->prev = block + 3 * n;
+  for (size_t i = 0; i < 4 * n; i++)
+    block[i] = TREE_NONE;
+  m->orphans = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (m->slots[i].hash > SLOT_REMOVED)
+      tree_link(m, i);
+  }
+}
+
+// whether subtrees can be walked through the index; orphans may have got
+// their directory since, so they are looked up again first
+static int tree_usable(Manifest *m) {
+  if (m->parent && m->orphans)
+    tree_build(m);
+  return m->parent && !m->orphans;
+}
+
+// the first change after a clean open is made durable before anything else,
+// so a crash can never leave a half-updated manifest marked clean
+static void mark_dirty(Manifest *m) {
+  if (m->dirty)
+    return;
+  m->hdr->state = MANIFEST_DIRTY;
+  if (msync(m->map, sizeof(ManifestHeader), MS_SYNC) < 0)
+    perror("msync(manifest)");
+  m->dirty = 1;
+}
+
+Manifest *manifest_open(const char *dst_real) {
+  Manifest *m = calloc(1, sizeof(*m));
+  if (!m) {
+    fprintf(stderr, "manifest calloc failed\n");
+    return NULL;
+  }
+  m->fd = -1;
+
+  char dir[PATH_MAX];
+  struct stat root;
+  if (snprintf(dir, PATH_MAX, "%s.meta", dst_real) >= PATH_MAX ||
+      snprintf(m->path, PATH_MAX, "%s/manifest", dir) >= PATH_MAX ||
+      lstat(dst_real, &root) < 0) {
+    free(m);
+    return NULL;
+  }
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    perror("mkdir(manifest)");
+    free(m);
+    return NULL;
+  }
+
+  int fd = open(m->path, O_RDWR | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 &&
+      (size_t)st.st_size >= sizeof(ManifestHeader) &&
+      map_fd(m, fd, (size_t)st.st_size) == 0) {
+    if (valid_file(m->hdr, m->map_len, &root)) {
+      m->trusted = m->hdr->state == MANIFEST_CLEAN;
+      m->dirty = m->hdr->state == MANIFEST_DIRTY;
+      if (!m->trusted)
+        manifest_reset(m);
+      tree_build(m);
+      return m;
+    }
+  }
+  if (m->map) {
+    munmap(m->map, m->map_len);
+    m->map = NULL;
+  } else if (fd >= 0) {
+    close(fd);
+  }
+  m->fd = -1;
+
+  // missing, damaged or describing another directory: start over
+  fd = create_file(m->path, MIN_SLOTS, MIN_NAMES, &root);
+  if (fd < 0 || map_fd(m, fd, file_len(MIN_SLOTS, MIN_NAMES)) < 0) {
+    if (fd >= 0)
+      close(fd);
+    free(m);
+    return NULL;
+  }
+  m->dirty = 1;
+  tree_build(m);
+  return m;
+}
+
+void manifest_close(Manifest *m) {
+  if (!m)
+    return;
+  // an untrusted manifest may be missing entries: it stays dirty so the next
+  // open doesn't rely on it
+  if (m->trusted) {
+    if (msync(m->map, m->map_len, MS_SYNC) < 0) {
+      perror("msync(manifest)");
+    } else {
+      m->hdr->state = MANIFEST_CLEAN;
+      if (msync(m->map, sizeof(ManifestHeader), MS_SYNC) < 0)
+        perror("msync(manifest)");
+    }
+  }
+  munmap(m->map, m->map_len);
+  close(m->fd);
+  free(m->parent);
+  free(m);
+}
+
+int manifest_trusted(const Manifest *m) { return m && m->trusted; }
+
+void manifest_set_trusted(Manifest *m, int trusted) {
+  if (m)
+    m->trusted = trusted && !m->failed;
+}
+
+void manifest_reset(Manifest *m) {
+  mark_dirty(m);
+  memset(m->slots, 0, m->hdr->slots * sizeof(ManifestEntry));
+  m->hdr->count = 0;
+  m->hdr->removed = 0;
+  m->hdr->names_used = 0;
+  if (m->parent) {
+    for (size_t i = 0; i < 4 * (size_t)m->hdr->slots; i++)
+      m->parent[i] = TREE_NONE;
+    m->orphans = 0;
+  }
+}
+
+// slot holding rel, or -1 with *free_slot set to where it would go
+static int64_t find_slot(const Manifest *m, const char *rel, uint64_t hash,
+                         int64_t *free_slot) {
+  uint64_t mask = m->hdr->slots - 1;
+  uint64_t i = hash & mask;
+  int64_t first_removed = -1;
+  while (1) {
+    const ManifestEntry *e = &m->slots[i];
+    if (e->hash == SLOT_EMPTY) {
+      if (free_slot)
+        *free_slot = first_removed >= 0 ? first_removed : (int64_t)i;
+      return -1;
+    }
+    if (e->hash == SLOT_REMOVED) {
+      if (first_removed < 0)
+        first_removed = (int64_t)i;
+    } else if (e->hash == hash && strcmp(m->names + e->name, rel) == 0) {
+      return (int64_t)i;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+// copies the live entries into a new file of a size fitting extra more
+// entries and extra_names more bytes of paths, then swaps it in
+static int rebuild(Manifest *m, uint64_t extra, uint64_t extra_names) {
+  uint64_t live_names = 0;
+  for (uint64_t i = 0; i < m->hdr->slots; i++) {
+    if (m->slots[i].hash > SLOT_REMOVED)
+      live_names += strlen(m->names + m->slots[i].name) + 1;
+  }
+  uint64_t slots = MIN_SLOTS;
+  while ((m->hdr->count + extra) * 10 >= slots * 5)
+    slots *= 2;
+  uint64_t names_size = MIN_NAMES;
+  while (names_size < (live_names + extra_names) * 2)
+    names_size *= 2;
+
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.new", m->path);
+  struct stat root = {.st_dev = (dev_t)m->hdr->root_dev,
+                      .st_ino = (ino_t)m->hdr->root_ino};
+  int fd = create_file(tmp, slots, names_size, &root);
+  if (fd < 0)
+    return -1;
+  size_t len = file_len(slots, names_size);
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap(manifest)");
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  Manifest next = {.fd = fd, .map = map, .map_len = len};
+  set_layout(&next);
+  next.hdr->generation = m->hdr->generation;
+  for (uint64_t i = 0; i < m->hdr->slots; i++) {
+    const ManifestEntry *e = &m->slots[i];
+    if (e->hash <= SLOT_REMOVED)
+      continue;
+    const char *name = m->names + e->name;
+    size_t n = strlen(name) + 1;
+    int64_t slot;
+    find_slot(&next, name, e->hash, &slot);
+    next.slots[slot] = *e;
+    next.slots[slot].name = next.hdr->names_used;
+    memcpy(next.names + next.hdr->names_used, name, n);
+    next.hdr->names_used += n;
+    next.hdr->count++;
+  }
+  munmap(map, len);
+
+  if (rename(tmp, m->path) < 0) {
+    perror("rename(manifest)");
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  // the new file was created dirty
+  m->dirty = 1;
+  if (map_fd(m, fd, len) < 0)
+    return -1;
+  tree_build(m);
+  return 0;
+}
+
+static ManifestEntry *insert(Manifest *m, const char *rel) {
+  uint64_t hash = path_hash(rel);
+  int64_t slot;
+  int64_t i = find_slot(m, rel, hash, &slot);
+  if (i >= 0)
+    return &m->slots[i];
+
+  size_t n = strlen(rel) + 1;
+  if ((m->hdr->count + m->hdr->removed + 1) * 10 >= m->hdr->slots * 7 ||
+      m->hdr->names_used + n > m->hdr->names_size) {
+    if (rebuild(m, 1, n) < 0)
+      return NULL;
+    find_slot(m, rel, hash, &slot);
+  }
+
+  ManifestEntry *e = &m->slots[slot];
+  if (e->hash == SLOT_REMOVED)
+    m->hdr->removed--;
+  memset(e, 0, sizeof(*e));
+  e->hash = hash;
+  e->name = m->hdr->names_used;
+  memcpy(m->names + m->hdr->names_used, rel, n);
+  m->hdr->names_used += n;
+  m->hdr->count++;
+  if (m->parent) {
+    m->child[slot] = TREE_NONE;
+    tree_link(m, (size_t)slot);
+  }
+  return e;
+}
+
+static void remove_slot(Manifest *m, ManifestEntry *e) {
+  if (m->parent)
+    tree_unlink(m, (size_t)(e - m->slots));
+  e->hash = SLOT_REMOVED;
+  m->hdr->count--;
+  m->hdr->removed++;
+}
+
+int manifest_get(Manifest *m, const char *rel, ManifestEntry *out) {
+  int64_t i = find_slot(m, rel, path_hash(rel), NULL);
+  if (i < 0)
+    return 0;
+  *out = m->slots[i];
+  return 1;
+}
+
+void manifest_entry_stat(const ManifestEntry *e, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_mode = e->mode;
+  st->st_size = e->size;
+  st->st_mtim.tv_sec = e->mtime_sec;
+  st->st_mtim.tv_nsec = e->mtime_nsec;
+  st->st_ino = (ino_t)e->ino;
+  st->st_nlink = (e->flags & MANIFEST_LINKED) ? 2 : 1;
+}
+
+int manifest_record(Manifest *m, const char *rel, const char *dst_path,
+                    int with_hash) {
+  struct stat st;
+  if (lstat(dst_path, &st) < 0) {
+    if (errno != ENOENT)
+      return -1;
+    manifest_remove(m, rel, 0);
+    return 0;
+  }
+
+  uint64_t content_hash = 0;
+  int have_hash = with_hash && S_ISREG(st.st_mode) &&
+                  hash_file(dst_path, &content_hash) == 0;
+
+  mark_dirty(m);
+  ManifestEntry *e = insert(m, rel);
+  if (!e) {
+    lose_update(m);
+    return -1;
+  }
+  e->size = st.st_size;
+  e->mtime_sec = st.st_mtim.tv_sec;
+  e->mtime_nsec = (uint32_t)st.st_mtim.tv_nsec;
+  e->mode = st.st_mode;
+  e->ino = st.st_ino;
+  e->content_hash = content_hash;
+  e->flags = (have_hash ? MANIFEST_HAS_HASH : 0) |
+             (st.st_nlink > 1 ? MANIFEST_LINKED : 0);
+  e->seen = m->hdr->generation;
+  return 0;
+}
+
+int manifest_record_tree(Manifest *m, const char *rel, const char *dst_dir,
+                         int with_hash) {
+  if (rel[0] && manifest_record(m, rel, dst_dir, with_hash) < 0)
+    return -1;
+  DIR *d = opendir(dst_dir);
+  if (!d) {
+    perror("opendir(manifest)");
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *entity;
+  while (ret == 0 && (entity = readdir(d)) != NULL) {
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+    char child_rel[PATH_MAX], child_path[PATH_MAX];
+    if (snprintf(child_rel, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "",
+                 entity->d_name) >= PATH_MAX ||
+        snprintf(child_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >=
+            PATH_MAX) {
+      fprintf(stderr, "Name too long(manifest)\n");
+      ret = -1;
+      break;
+    }
+    int is_dir = entity->d_type == DT_DIR;
+    struct stat st;
+    if (entity->d_type == DT_UNKNOWN)
+      is_dir = lstat(child_path, &st) == 0 && S_ISDIR(st.st_mode);
+    if (is_dir)
+      ret = manifest_record_tree(m, child_rel, child_path, with_hash);
+    else if (manifest_record(m, child_rel, child_path, with_hash) < 0)
+      ret = -1;
+  }
+  closedir(d);
+  return ret;
+}
+
+void manifest_touch(Manifest *m, const char *rel) {
+  int64_t i = find_slot(m, rel, path_hash(rel), NULL);
+  if (i < 0 || m->slots[i].seen == m->hdr->generation)
+    return;
+  mark_dirty(m);
+  m->slots[i].seen = m->hdr->generation;
+}
+
+void manifest_set_hash(Manifest *m, const char *rel, uint64_t hash) {
+  int64_t i = find_slot(m, rel, path_hash(rel), NULL);
+  if (i < 0 || !S_ISREG(m->slots[i].mode))
+    return;
+  mark_dirty(m);
+  m->slots[i].content_hash = hash;
+  m->slots[i].flags |= MANIFEST_HAS_HASH;
+}
+
+static int under(const char *name, const char *rel, size_t n) {
+  return strncmp(name, rel, n) == 0 && (name[n] == '\0' || name[n] == '/');
+}
+
+void manifest_remove(Manifest *m, const char *rel, int is_dir) {
+  int64_t i = find_slot(m, rel, path_hash(rel), NULL);
+  if (!is_dir || tree_usable(m)) {
+    if (i < 0)
+      return;
+    mark_dirty(m);
+    // deepest entries first, so every entry is a leaf when it goes
+    size_t x = (size_t)i;
+    while (is_dir) {
+      while (m->child[x] != TREE_NONE)
+        x = m->child[x];
+      if (x == (size_t)i)
+        break;
+      size_t p = m->parent[x];
+      remove_slot(m, &m->slots[x]);
+      x = p;
+    }
+    remove_slot(m, &m->slots[i]);
+    return;
+  }
+
+  if (i >= 0) {
+    mark_dirty(m);
+    remove_slot(m, &m->slots[i]);
+  }
+  size_t n = strlen(rel);
+  for (uint64_t j = 0; j < m->hdr->slots; j++) {
+    ManifestEntry *e = &m->slots[j];
+    if (e->hash > SLOT_REMOVED && under(m->names + e->name, rel, n)) {
+      mark_dirty(m);
+      remove_slot(m, e);
+    }
+  }
+}
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} SlotList;
+
+static int slot_list_push(SlotList *l, size_t slot) {
+  if (l->count == l->capacity) {
+    size_t new_cap = l->capacity ? l->capacity * 2 : 16;
+    size_t *new_items = realloc(l->items, new_cap * sizeof(*new_items));
+    if (!new_items) {
+      fprintf(stderr, "manifest realloc failed\n");
+      return -1;
+    }
+    l->items = new_items;
+    l->capacity = new_cap;
+  }
+  l->items[l->count++] = slot;
+  return 0;
+}
+
+// the slots of rel and, if is_dir, everything below it; a directory comes
+// before its entries
+static int collect(Manifest *m, const char *rel, int is_dir, SlotList *out) {
+  int64_t i = find_slot(m, rel, path_hash(rel), NULL);
+  if (!is_dir || tree_usable(m)) {
+    if (i < 0)
+      return 0;
+    size_t x = (size_t)i;
+    while (1) {
+      if (slot_list_push(out, x) < 0)
+        return -1;
+      if (is_dir && m->child[x] != TREE_NONE) {
+        x = m->child[x];
+        continue;
+      }
+      while (x != (size_t)i && m->next[x] == TREE_NONE)
+        x = m->parent[x];
+      if (x == (size_t)i)
+        return 0;
+      x = m->next[x];
+    }
+  }
+
+  size_t n = strlen(rel);
+  for (uint64_t j = 0; j < m->hdr->slots; j++) {
+    const ManifestEntry *e = &m->slots[j];
+    if (e->hash > SLOT_REMOVED && under(m->names + e->name, rel, n) &&
+        slot_list_push(out, (size_t)j) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+void manifest_rename(Manifest *m, const char *old_rel, const char *new_rel,
+                     int is_dir) {
+  // whatever the new name held before is replaced
+  manifest_remove(m, new_rel, is_dir);
+
+  SlotList found = {0};
+  if (collect(m, old_rel, is_dir, &found) < 0) {
+    free(found.items);
+    lose_update(m);
+    return;
+  }
+  if (found.count == 0)
+    return;
+
+  // the moved entries are taken out first: re-adding them may rebuild the
+  // table under us
+  size_t n = strlen(old_rel);
+  ManifestEntry *moved = malloc(found.count * sizeof(*moved));
+  char **names = calloc(found.count, sizeof(*names));
+  if (!moved || !names) {
+    fprintf(stderr, "manifest rename allocation failed\n");
+    free(moved);
+    free(names);
+    free(found.items);
+    lose_update(m);
+    return;
+  }
+  for (size_t k = 0; k < found.count; k++) {
+    moved[k] = m->slots[found.items[k]];
+    const char *rest = m->names + moved[k].name + n;
+    if (asprintf(&names[k], "%s%s", new_rel, rest) < 0) {
+      names[k] = NULL;
+      lose_update(m);
+    }
+  }
+  mark_dirty(m);
+  // entries before their directory, so none is orphaned on the way
+  for (size_t k = found.count; k-- > 0;)
+    remove_slot(m, &m->slots[found.items[k]]);
+
+  for (size_t k = 0; k < found.count; k++) {
+    if (!names[k])
+      continue;
+    ManifestEntry *e = insert(m, names[k]);
+    if (!e) {
+      lose_update(m);
+    } else {
+      uint64_t hash = e->hash, name = e->name;
+      *e = moved[k];
+      e->hash = hash;
+      e->name = name;
+    }
+    free(names[k]);
+  }
+  free(moved);
+  free(names);
+  free(found.items);
+}
+
+void manifest_begin_pass(Manifest *m) {
+  mark_dirty(m);
+  m->hdr->generation++;
+}
+
+void manifest_sweep(Manifest *m, void (*gone)(void *arg, const char *rel),
+                    void *arg) {
+  for (uint64_t i = 0; i < m->hdr->slots; i++) {
+    ManifestEntry *e = &m->slots[i];
+    if (e->hash <= SLOT_REMOVED || e->seen == m->hdr->generation)
+      continue;
+    if (gone)
+      gone(arg, m->names + e->name);
+    mark_dirty(m);
+    remove_slot(m, e);
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Record of what a target holds, kept in <target>.meta/manifest so a restart
+// can compare the source against it instead of crawling the target.
+//
+// The file is mapped and updated in place: a header, an open-addressing
+// table of fixed-size entries indexed by a hash of the path, then the paths
+// themselves. Paths are relative to the target root. The header says dirty
+// from the first change until a clean close; a dirty manifest (the daemon
+// died) is not trusted and gets rebuilt by the next full pass.
+#define MANIFEST_MAGIC "SOPMANI1"
+#define MANIFEST_VERSION 2
+
+#define MANIFEST_CLEAN 0
+#define MANIFEST_DIRTY 1
+
+#define MANIFEST_HAS_HASH 1u // content_hash is valid
+#define MANIFEST_LINKED 2u   // had more than one link when recorded
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t state;      // MANIFEST_CLEAN or MANIFEST_DIRTY
+  uint64_t root_dev;   // the target root it describes
+  uint64_t root_ino;
+  uint64_t slots;      // entries in the table, a power of two
+  uint64_t count;      // live entries
+  uint64_t removed;    // slots freed by removals, still in probe chains
+  uint64_t names_used; // bytes of the path area in use
+  uint64_t names_size;
+  uint32_t generation; // current full pass
+  uint8_t reserved[52];
+} ManifestHeader;
+
+typedef struct {
+  uint64_t hash;       // of the path; 0 = empty, 1 = removed
+  uint64_t name;       // offset of the path in the path area
+  int64_t size;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint32_t mode;
+  uint64_t ino;        // of the target entry
+  uint64_t content_hash;
+  uint32_t seen;       // generation of the last pass that saw it
+  uint32_t flags;
+} ManifestEntry;
+
+typedef struct Manifest Manifest;
+
+// Opens or creates the manifest of the target dst_real. NULL when no
+// manifest can be kept there (the caller works without one).
+Manifest *manifest_open(const char *dst_real);
+// Unmaps the manifest. A trusted one is flushed and marked clean, so the
+// next open trusts it; otherwise it stays dirty.
+void manifest_close(Manifest *m);
+
+// Whether the entries can stand in for lstat on the target: the manifest was
+// closed cleanly, or a full pass has rebuilt it since.
+int manifest_trusted(const Manifest *m);
+void manifest_set_trusted(Manifest *m, int trusted);
+// Drops every entry (the target was emptied).
+void manifest_reset(Manifest *m);
+
+// 1 and a copy in *out when rel is recorded.
+int manifest_get(Manifest *m, const char *rel, ManifestEntry *out);
+// The entry as a struct stat (mode, size, mtime and inode only; st_nlink is
+// 2 for MANIFEST_LINKED entries, 1 otherwise).
+void manifest_entry_stat(const ManifestEntry *e, struct stat *st);
+
+// Records the target entry dst_path (lstat'ed now) as rel, with a content
+// hash for regular files if with_hash; forgets rel when dst_path is gone.
+int manifest_record(Manifest *m, const char *rel, const char *dst_path,
+                    int with_hash);
+// Records dst_dir (at rel) and everything below it.
+int manifest_record_tree(Manifest *m, const char *rel, const char *dst_dir,
+                         int with_hash);
+// Marks rel as seen by the current pass without changing it.
+void manifest_touch(Manifest *m, const char *rel);
+// Stores a content hash of rel's target file computed elsewhere.
+void manifest_set_hash(Manifest *m, const char *rel, uint64_t hash);
+// Forgets rel, and everything below it if is_dir.
+void manifest_remove(Manifest *m, const char *rel, int is_dir);
+void manifest_rename(Manifest *m, const char *old_rel, const char *new_rel,
+                     int is_dir);
+
+// A full pass compares every entry. manifest_begin_pass starts a new
+// generation; manifest_sweep then forgets whatever the pass didn't see,
+// calling gone (may be NULL) for each such entry first.
+void manifest_begin_pass(Manifest *m);
+void manifest_sweep(Manifest *m, void (*gone)(void *arg, const char *rel),
+                    void *arg);
+
+#endif
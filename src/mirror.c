@@ -62,7 +62,8 @@ int ensure_parent_dir(const char *fullpath) {
 }
 
 int mirror_create_or_update(const char *src_path, const char *dst_path,
-                            const char *src_real, const char *dst_real, volatile sig_atomic_t *stop_flag) {
+                            const char *src_real, const char *dst_real,
+                            LinkMap *links, volatile sig_atomic_t *stop_flag) {
   struct stat st;
   if (lstat(src_path, &st) < 0)
     return -1;
@@ -77,7 +78,7 @@ int mirror_create_or_update(const char *src_path, const char *dst_path,
   }
 
   if (S_ISREG(st.st_mode)) {
-    return copy_file(src_path, dst_path, st.st_mode, stop_flag);
+    return link_or_copy(links, src_path, dst_path, &st, stop_flag) < 0 ? -1 : 0;
   }
   if (S_ISLNK(st.st_mode)) {
     return copy_symplink_rewrite(src_path, dst_path, src_real, dst_real);
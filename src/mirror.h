@@ -3,6 +3,8 @@
 
 #include <signal.h>  //sig_atomic_t
 
+#include "link_map.h"
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
@@ -12,9 +14,10 @@ int map_src_to_dst(const char *src_real, const char *dst_real,
 
 int ensure_parent_dir(const char *fullpath);
 
+// links may be NULL, see link_or_copy
 int mirror_create_or_update(const char *src_path, const char *dst_path,
                             const char *src_real, const char *dst_real,
-                            volatile sig_atomic_t *stop_flag);
+                            LinkMap *links, volatile sig_atomic_t *stop_flag);
 
 int mirror_delete_path(char *dst_path);
 
@@ -4,8 +4,13 @@
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/fanotify.h>
 #include <sys/inotify.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -14,140 +19,659 @@
 #include "watch_map.h"
 #include "mirror.h"
 #include "pending_moves.h"
+#include "fanotify_events.h"
+#include "coalesce.h"
+#include "sync_tree.h"
 #include "filesystem_utils.h"
+#include "io_utils.h"
+#include "target.h"
 #include "config.h"
 
-int monitor_and_mirror(const char *src_real, const char *dst_real, volatile sig_atomic_t* stop_flag) {
-  int ifd = inotify_init();
-  if (ifd < 0) {
-    perror("inotify_init");
-    exit(EXIT_FAILURE);
+// state shared by both event backends
+typedef struct {
+  const char *src_real;
+  const BackupOptions *opts; // of the first target: backend, debounce, pace
+  volatile sig_atomic_t *stop_flag;
+  int ctl_fd;                // requests from the parent, see ControlMsg
+  LiveShared *live;          // counters the parent reads, may be NULL
+  const char *first_dst;
+  Target **targets;
+  size_t targets_count;
+  size_t targets_capacity;
+  int ifd;      // inotify only; -1 under fanotify, which needs no watches
+  WatchMap map;
+  Coalescer co; // delays content copies, see --debounce
+  int epfd;     // event fd + control socket + timer
+  int tfd;      // timerfd for coalesce, pending move and rescan deadlines
+  sigset_t wait_mask; // signal mask while sleeping in epoll_pwait
+  char *buffer; // MONITOR_BUFFER bytes, events are read into it
+  uint64_t event_ns; // when the batch in buffer was read
+
+  // inotify: after a queue overflow directories created meanwhile have no
+  // watch yet; the source is walked in slices to add them, then the
+  // targets are told to reconcile
+  SyncScan *rescan;
+  int rescan_again;        // overflowed during the walk, another one follows
+  uint64_t rescan_next_ns; // next slice may start at
+  unsigned long long overflows;
+} Monitor;
+
+// read size for event batches; a burst is drained in few syscalls
+#define MONITOR_BUFFER (256 * 1024)
+// wait_events results
+#define WAIT_EVENTS 1  // the event fd is readable
+#define WAIT_CONTROL 2 // the parent sent a request
+
+// -1 means "no deadline"
+static int earliest(int a_ms, int b_ms) {
+  if (a_ms < 0)
+    return b_ms;
+  if (b_ms < 0)
+    return a_ms;
+  return a_ms < b_ms ? a_ms : b_ms;
+}
+
+static int watch_events(Monitor *m, int fd) {
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+  if (epoll_ctl(m->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    perror("epoll_ctl");
+    return -1;
   }
+  return 0;
+}
 
-  WatchMap map = {0};
-  if (add_watch_tree(ifd, &map, src_real) < 0) {
-    close(ifd);
+// Sleeps until the event fd or the control socket is readable, the timer
+// set to timeout_ms fires or the stop signal arrives; timeout_ms < 0 sleeps
+// without a timer, so an idle monitor doesn't wake up at all. Returns a mask
+// of WAIT_EVENTS and WAIT_CONTROL.
+static int wait_events(Monitor *m, int timeout_ms) {
+  struct itimerspec its = {0};
+  if (timeout_ms == 0) {
+    its.it_value.tv_nsec = 1; // zero would disarm
+  } else if (timeout_ms > 0) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+  }
+  if (timerfd_settime(m->tfd, 0, &its, NULL) < 0) {
+    perror("timerfd_settime");
     return -1;
   }
 
-  PendingMoves pm = {0};
-  struct pollfd pfd = {ifd, POLLIN, 0};
+  // SIGTERM stays blocked outside epoll_pwait so it can't slip in between
+  // the stop flag check and going to sleep
+  sigset_t old;
+  sigset_t term;
+  sigemptyset(&term);
+  sigaddset(&term, SIGTERM);
+  sigprocmask(SIG_BLOCK, &term, &old);
+  struct epoll_event evs[3];
+  int n = 0;
+  if (!(*m->stop_flag))
+    n = epoll_pwait(m->epfd, evs, 3, -1, &m->wait_mask);
+  int saved_errno = errno;
+  sigprocmask(SIG_SETMASK, &old, NULL);
 
-  char buffer[4096];
-  while (!(*stop_flag)) {
-    pm_1s_expire(&pm, ifd, &map);
+  if (n < 0) {
+    if (saved_errno == EINTR)
+      return 0;
+    errno = saved_errno;
+    perror("epoll_pwait");
+    return -1;
+  }
 
-    int poll_return = poll(&pfd, 1, 100);
-    if(poll_return<0){
-      if(errno == EINTR){
-        continue;
-      }
-      break;
+  int ready = 0;
+  for (int i = 0; i < n; i++) {
+    if (evs[i].data.fd == m->tfd) {
+      uint64_t expirations;
+      if (read(m->tfd, &expirations, sizeof(expirations)) < 0 &&
+          errno != EAGAIN)
+        perror("read(timerfd)");
+    } else if (evs[i].data.fd == m->ctl_fd) {
+      ready |= WAIT_CONTROL;
+    } else {
+      ready |= WAIT_EVENTS;
     }
-    if(poll_return==0){
+  }
+  return ready;
+}
+
+static int attach_target(Monitor *m, const char *dst,
+                         const BackupOptions *opts, int slot) {
+  for (size_t i = 0; i < m->targets_count; i++) {
+    if (strcmp(target_dst(m->targets[i]), dst) == 0)
+      return -1;
+  }
+  if (m->targets_count == m->targets_capacity) {
+    size_t new_cap = m->targets_capacity ? m->targets_capacity * 2 : 4;
+    Target **new_targets = realloc(m->targets, new_cap * sizeof(*new_targets));
+    if (!new_targets) {
+      fprintf(stderr, "monitor: targets realloc failed\n");
+      return -1;
+    }
+    m->targets = new_targets;
+    m->targets_capacity = new_cap;
+  }
+  // the new target starts with a full copy of its own, so it needs none of
+  // the events seen so far
+  LiveTarget *live = m->live && slot >= 0 && slot < LIVE_TARGETS
+                         ? &m->live->targets[slot]
+                         : NULL;
+  Target *t = target_start(m->src_real, dst, opts, live);
+  if (!t)
+    return -1;
+  m->targets[m->targets_count++] = t;
+  return 0;
+}
+
+static int detach_target(Monitor *m, const char *dst) {
+  for (size_t i = 0; i < m->targets_count; i++) {
+    if (strcmp(target_dst(m->targets[i]), dst) != 0)
       continue;
+    target_stop(m->targets[i]);
+    m->targets[i] = m->targets[--m->targets_count];
+    return 0;
+  }
+  return -1;
+}
+
+// event_ns: see target_push
+static void broadcast(Monitor *m, TargetOpKind kind, int is_dir,
+                      const char *src_path, const char *src_old,
+                      SharedSource *shared, uint64_t event_ns) {
+  for (size_t i = 0; i < m->targets_count; i++)
+    target_push(m->targets[i], kind, is_dir, src_path, src_old, shared,
+                event_ns);
+}
+
+static void apply_new_dir(Monitor *m, const char *src_path) {
+  if (m->ifd >= 0)
+    add_watch_tree(m->ifd, &m->map, src_path);
+  broadcast(m, OP_NEW_DIR, 1, src_path, NULL, NULL, m->event_ns);
+}
+
+static void apply_create(Monitor *m, const char *src_path, int is_dir) {
+  if (is_dir) {
+    apply_new_dir(m, src_path);
+    return;
+  }
+  // regular files are copied on close_write, except a new link to an
+  // existing file, which gets no close_write at all
+  struct stat st;
+  if (lstat(src_path, &st) == 0 &&
+      (S_ISLNK(st.st_mode) || (S_ISREG(st.st_mode) && st.st_nlink > 1)))
+    broadcast(m, OP_UPDATE, 0, src_path, NULL, NULL, m->event_ns);
+}
+
+static void apply_rename(Monitor *m, const char *src_old, const char *src_path,
+                         int is_dir) {
+  broadcast(m, OP_RENAME, is_dir, src_path, src_old, NULL, m->event_ns);
+  coalesce_rename(&m->co, src_old, src_path, is_dir);
+  if (is_dir && m->ifd >= 0) {
+    // update watch paths for all watches under that directory
+    watch_update_prefix(&m->map, src_old, src_path);
+  }
+}
+
+// the file is opened once here and every target copies from that open file,
+// so the source is read once no matter how many targets there are
+static void copy_modified(Monitor *m, const char *src_path,
+                          uint64_t event_ns) {
+  SharedSource *shared =
+      m->targets_count > 1 ? shared_source_open(src_path) : NULL;
+  broadcast(m, OP_COPY, 0, src_path, NULL, shared, event_ns);
+  shared_source_put(shared);
+}
+
+// coalesce_flush callback; the time held back counts as latency too
+static void copy_settled(void *arg, const char *src_path, uint64_t first_ns) {
+  copy_modified(arg, src_path, first_ns);
+}
+
+static int snapshot_target(Monitor *m, const char *dst) {
+  for (size_t i = 0; i < m->targets_count; i++) {
+    if (strcmp(target_dst(m->targets[i]), dst) != 0)
+      continue;
+    // writes still settling are part of the point in time asked for
+    coalesce_flush(&m->co, 1, copy_settled, m);
+    target_push(m->targets[i], OP_SNAPSHOT, 1, NULL, NULL, NULL, 0);
+    return 0;
+  }
+  return -1;
+}
+
+static int stats_target(Monitor *m, const char *dst, StatsReply *reply) {
+  for (size_t i = 0; i < m->targets_count; i++) {
+    if (strcmp(target_dst(m->targets[i]), dst) != 0)
+      continue;
+    target_latency(m->targets[i], reply->latency);
+    return 0;
+  }
+  return -1;
+}
+
+// one request per datagram, answered with an int status (a StatsReply for
+// CTL_STATS); a closed socket means the parent is gone
+static void handle_control(Monitor *m) {
+  ControlMsg msg;
+  ssize_t n = recv(m->ctl_fd, &msg, sizeof(msg), MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    *m->stop_flag = 1;
+    return;
+  }
+
+  StatsReply reply;
+  memset(&reply, 0, sizeof(reply));
+  int status = -1;
+  if (n == (ssize_t)sizeof(msg)) {
+    msg.dst[PATH_MAX - 1] = '\0';
+    if (msg.op == CTL_STATS) {
+      reply.status = stats_target(m, msg.dst, &reply);
+      if (send(m->ctl_fd, &reply, sizeof(reply), MSG_NOSIGNAL) < 0)
+        perror("send(control)");
+      return;
     }
+    if (msg.op == CTL_ATTACH)
+      status = attach_target(m, msg.dst, &msg.opts, msg.slot);
+    else if (msg.op == CTL_DETACH)
+      status = detach_target(m, msg.dst);
+    else if (msg.op == CTL_SNAPSHOT)
+      status = snapshot_target(m, msg.dst);
+  }
+  if (send(m->ctl_fd, &status, sizeof(status), MSG_NOSIGNAL) < 0)
+    perror("send(control)");
 
-    ssize_t len = read(ifd, buffer, sizeof(buffer));
-    if (len < 0) {
-      if (errno == EINTR)
-        continue;
-      break;
+  // nothing left to mirror to
+  if (m->targets_count == 0)
+    *m->stop_flag = 1;
+}
+
+static void apply_close_write(Monitor *m, const char *src_path) {
+  if (coalesce_enabled(&m->co) && coalesce_dirty(&m->co, src_path) == 0)
+    return;
+  copy_modified(m, src_path, m->event_ns);
+}
+
+// an entry moved in from outside the source
+static void apply_moved_in(Monitor *m, const char *src_path, int is_dir) {
+  if (is_dir) {
+    apply_new_dir(m, src_path);
+  } else {
+    apply_close_write(m, src_path);
+  }
+}
+
+static void apply_delete(Monitor *m, const char *src_path, int is_dir) {
+  broadcast(m, OP_DELETE, is_dir, src_path, NULL, NULL, m->event_ns);
+  coalesce_cancel(&m->co, src_path, is_dir);
+  if (is_dir && m->ifd >= 0)
+    watch_remove_subtree(m->ifd, &m->map, src_path);
+}
+
+// pm_1s_expire callback: the other end of the move is outside the source
+static void moved_out(void *arg, const char *src_old, int is_dir) {
+  apply_delete(arg, src_old, is_dir);
+}
+
+// SyncScan on_dir callback: directories created while events were lost
+// have no inotify watch yet, and renamed ones may carry a stale path
+static void rescan_watch_dir(void *arg, const char *src_dir) {
+  Monitor *m = arg;
+  if (strcmp(src_dir, m->src_real) != 0)
+    add_watch(m->ifd, &m->map, src_dir);
+}
+
+static void rescan_start(Monitor *m) {
+  m->rescan =
+      sync_scan_start(m->src_real, NULL, 0, NULL, NULL, rescan_watch_dir, m);
+  if (!m->rescan) {
+    fprintf(stderr, "monitor: cannot walk the source, re-add the backup\n");
+    broadcast(m, OP_RESCAN, 1, NULL, NULL, NULL, 0);
+  }
+  m->rescan_again = 0;
+  m->rescan_next_ns = now_ns();
+}
+
+// events were dropped: whatever they described is only found by comparing
+// the trees, which every target does on its own
+static void on_overflow(Monitor *m) {
+  m->overflows++;
+  if (m->ifd < 0) {
+    fprintf(stderr, "monitor: event queue overflow, targets unsynced, rescanning\n");
+    broadcast(m, OP_RESCAN, 1, NULL, NULL, NULL, 0);
+    return;
+  }
+  if (m->rescan) {
+    // finishing this walk first keeps repeated overflows from starving it
+    m->rescan_again = 1;
+    return;
+  }
+  fprintf(stderr, "monitor: event queue overflow, targets unsynced, rescanning\n");
+  rescan_start(m);
+}
+
+// one slice of the watch walk, paced to opts->rescan_rate entries per
+// second; the targets start comparing once every directory is watched again
+static void rescan_step(Monitor *m) {
+  if (!m->rescan)
+    return;
+  uint64_t now = now_ns();
+  if (now < m->rescan_next_ns)
+    return;
+
+  int ret = sync_scan_step(m->rescan, RESCAN_SLICE, NULL, m->stop_flag);
+  m->rescan_next_ns =
+      now + (uint64_t)RESCAN_SLICE * 1000000000ull / (uint64_t)m->opts->rescan_rate;
+  if (ret > 0)
+    return;
+
+  sync_scan_free(m->rescan);
+  m->rescan = NULL;
+  if (ret < 0)
+    return;
+  broadcast(m, OP_RESCAN, 1, NULL, NULL, NULL, 0);
+  if (m->rescan_again)
+    rescan_start(m);
+}
+
+static int rescan_timeout(const Monitor *m) {
+  if (!m->rescan)
+    return -1;
+  uint64_t now = now_ns();
+  if (m->rescan_next_ns <= now)
+    return 0;
+  return (int)((m->rescan_next_ns - now + 999999) / 1000000);
+}
+
+// once per batch, the monitor thread being the only writer
+static void publish(Monitor *m, unsigned long long events) {
+  if (!m->live)
+    return;
+  atomic_store_explicit(
+      &m->live->events,
+      atomic_load_explicit(&m->live->events, memory_order_relaxed) + events,
+      memory_order_relaxed);
+  atomic_store_explicit(&m->live->watches, m->map.watches_count,
+                        memory_order_relaxed);
+}
+
+static void inotify_apply(Monitor *m, PendingMoves *pm,
+                          const struct inotify_event *event) {
+  if (event->mask & IN_Q_OVERFLOW) {
+    on_overflow(m);
+    return;
+  }
+
+  Watch *watch = watch_find(&m->map, event->wd);
+  if (!watch)
+    return;
+
+  if (event->mask & IN_IGNORED) {
+    // watch was removed by the kernel
+    watch_remove(&m->map, event->wd);
+    return;
+  }
+
+  char watch_dir[PATH_MAX];
+  if (watch_path(&m->map, watch, watch_dir) < 0)
+    return;
+
+  char src_path[PATH_MAX];
+  int n = (event->len > 0)
+              ? snprintf(src_path, PATH_MAX, "%s/%s", watch_dir, event->name)
+              : snprintf(src_path, PATH_MAX, "%s", watch_dir);
+  if (n < 0 || n >= PATH_MAX)
+    return;
+
+  int is_dir = (event->mask & IN_ISDIR) != 0;
+
+  // root deleted/moved
+  if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) &&
+      strcmp(src_path, m->src_real) == 0) {
+    *m->stop_flag = 1;
+    return;
+  }
+
+  if (event->mask & IN_MOVED_FROM) {
+    pending_move_add(pm, event->cookie, is_dir, src_path);
+    return;
+  }
+
+  if (event->mask & IN_MOVED_TO) {
+    PendingMove mv;
+    if (pm_take(pm, event->cookie, &mv)) { // if it is a pair
+      apply_rename(m, mv.src_old, src_path, mv.is_dir);
+    } else {
+      apply_moved_in(m, src_path, is_dir);
     }
+    return;
+  }
 
-    ssize_t i = 0;
-    while (i < len) {
-      struct inotify_event *event = (struct inotify_event *)&buffer[i];
-      i += (ssize_t)sizeof(*event) + (ssize_t)event->len;
+  if (event->mask & IN_CREATE) {
+    apply_create(m, src_path, is_dir);
+    return;
+  }
 
-      Watch *watch = watch_find(&map, event->wd);
-      if (!watch)
-        continue;
+  if ((event->mask & IN_CLOSE_WRITE) && !is_dir) {
+    apply_close_write(m, src_path);
+    return;
+  }
 
-      if (event->mask & IN_IGNORED) {
-        // watch was removed by the kernel
-        watch_remove(&map, event->wd);
-        continue;
-      }
+  if (event->mask & IN_DELETE) {
+    apply_delete(m, src_path, is_dir);
+  }
+}
 
-      char src_path[PATH_MAX];
-      if (event->len > 0)
-        snprintf(src_path, PATH_MAX, "%s/%s", watch->path, event->name);
-      else
-        snprintf(src_path, PATH_MAX, "%s", watch->path);
+static int run_inotify(Monitor *m) {
+  m->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m->ifd < 0) {
+    perror("inotify_init1");
+    exit(EXIT_FAILURE);
+  }
 
-      char dst_path[PATH_MAX];
-      if (map_src_to_dst(src_real, dst_real, src_path, dst_path) < 0) {
-        continue;
-      }
+  // watches go first, so nothing done to the source during the initial
+  // copy is missed
+  if (add_watch_tree(m->ifd, &m->map, m->src_real) < 0 ||
+      watch_events(m, m->ifd) < 0 ||
+      attach_target(m, m->first_dst, m->opts, 0) < 0) {
+    close(m->ifd);
+    return -1;
+  }
+  publish(m, 0);
 
-      int is_dir = (event->mask & IN_ISDIR) != 0;
+  PendingMoves pm = {0};
+  int ret = 0;
+  while (!(*m->stop_flag)) {
+    pm_1s_expire(&pm, moved_out, m);
+    coalesce_flush(&m->co, 0, copy_settled, m);
+    rescan_step(m);
 
-      // root deleted/moved
-      if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) &&
-          strcmp(src_path, src_real) == 0) {
-        *stop_flag = 1;
+    int timeout = earliest(pm_timeout_ms(&pm), coalesce_timeout(&m->co));
+    int ready = wait_events(m, earliest(timeout, rescan_timeout(m)));
+    if (ready < 0) {
+      ret = -1;
+      break;
+    }
+    if (ready & WAIT_CONTROL)
+      handle_control(m);
+
+    // drain everything queued so a burst costs one wakeup, not one per read
+    while ((ready & WAIT_EVENTS) && !(*m->stop_flag)) {
+      ssize_t len = read(m->ifd, m->buffer, MONITOR_BUFFER);
+      if (len < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN) {
+          perror("read(inotify)");
+          ret = -1;
+        }
         break;
       }
 
-      if (event->mask & IN_MOVED_FROM) {
-        pending_move_add(&pm, event->cookie, is_dir, src_path, dst_path);
-        continue;
+      m->event_ns = now_ns();
+      ssize_t i = 0;
+      unsigned long long events = 0;
+      while (i < len && !(*m->stop_flag)) {
+        struct inotify_event *event = (struct inotify_event *)&m->buffer[i];
+        i += (ssize_t)sizeof(*event) + (ssize_t)event->len;
+        inotify_apply(m, &pm, event);
+        events++;
       }
+      publish(m, events);
+    }
+    if (ret < 0)
+      break;
+  }
 
-      if (event->mask & IN_MOVED_TO) {
-        PendingMove mv;
-        if (pm_take(&pm, event->cookie, &mv)) { // if it is a pair
-          if (ensure_parent_dir(dst_path) < 0) {
-            continue;
-          }
-          rename(mv.dst_old, dst_path);
-          if (mv.is_dir) {
-            // update watch paths for all watches under that directory
-            watch_update_prefix(&map, mv.src_old, src_path);
-          }
-        }
+  close(m->ifd);
+  return ret;
+}
 
-        else {
-          if (is_dir) {
-            mirror_create_or_update(src_path, dst_path, src_real, dst_real, stop_flag);
-            add_watch_tree(ifd, &map, src_path);
-            copy_tree(src_path, dst_path, src_real, dst_real, stop_flag);
-          } else {
-            mirror_create_or_update(src_path, dst_path, src_real, dst_real, stop_flag);
-          }
-        }
-        continue;
-      }
+// renames arrive as one event with both ends, so no cookie pairing is needed
+static void fanotify_apply(Monitor *m, FanEvent *ev) {
+  if (ev->mask & FAN_RENAME) {
+    if (ev->old_in_src && strcmp(ev->old_path, m->src_real) == 0) {
+      *m->stop_flag = 1; // root moved away
+    } else if (ev->old_in_src && ev->in_src) {
+      apply_rename(m, ev->old_path, ev->path, ev->is_dir);
+    } else if (ev->old_in_src) {
+      apply_delete(m, ev->old_path, ev->is_dir);
+    } else {
+      apply_moved_in(m, ev->path, ev->is_dir);
+    }
+    return;
+  }
 
-      if (event->mask & IN_CREATE) {
-        if (is_dir) {
-          mirror_create_or_update(src_path, dst_path, src_real, dst_real, stop_flag);
-          add_watch_tree(ifd, &map, src_path);
-          copy_tree(src_path, dst_path, (char *)src_real, (char *)dst_real, stop_flag);
-        } else {
-          struct stat st;
-          if (lstat(src_path, &st) == 0 && S_ISLNK(st.st_mode)) {
-            mirror_create_or_update(src_path, dst_path, src_real, dst_real, stop_flag);
-          }
-        }
-        continue;
-      }
+  // the queue merges events on the same entry, so one event can carry
+  // several of these; the entry's current state decides about the delete
+  if (ev->mask & FAN_CREATE)
+    apply_create(m, ev->path, ev->is_dir);
+  if ((ev->mask & FAN_CLOSE_WRITE) && !ev->is_dir)
+    apply_close_write(m, ev->path);
+  if (ev->mask & FAN_DELETE) {
+    if (strcmp(ev->path, m->src_real) == 0) {
+      *m->stop_flag = 1; // root deleted
+      return;
+    }
+    struct stat st;
+    if (!(ev->mask & (FAN_CREATE | FAN_CLOSE_WRITE)) ||
+        (lstat(ev->path, &st) < 0 && errno == ENOENT))
+      apply_delete(m, ev->path, ev->is_dir);
+  }
+}
+
+static int run_fanotify(Monitor *m, FanotifySource *fs) {
+  if (watch_events(m, fs->fd) < 0 ||
+      attach_target(m, m->first_dst, m->opts, 0) < 0)
+    return -1;
 
-      if ((event->mask & IN_CLOSE_WRITE) && !is_dir) {
-        mirror_create_or_update(src_path, dst_path, src_real, dst_real, stop_flag);
-        continue;
+  FanEvent ev;
+  while (!(*m->stop_flag)) {
+    coalesce_flush(&m->co, 0, copy_settled, m);
+
+    int ready = wait_events(m, coalesce_timeout(&m->co));
+    if (ready < 0)
+      return -1;
+    if (ready & WAIT_CONTROL)
+      handle_control(m);
+
+    while ((ready & WAIT_EVENTS) && !(*m->stop_flag)) {
+      ssize_t len = read(fs->fd, m->buffer, MONITOR_BUFFER);
+      if (len < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        perror("read(fanotify)");
+        return -1;
       }
+      m->event_ns = now_ns();
 
-      if (event->mask & IN_DELETE) {
-        mirror_delete_path(dst_path);
-        if (is_dir)
-          watch_remove_subtree(ifd, &map, src_path);
+      // records are only 4-byte aligned, so headers are copied out
+      ssize_t off = 0;
+      unsigned long long events = 0;
+      while (len - off >= (ssize_t)FAN_EVENT_METADATA_LEN && !*m->stop_flag) {
+        struct fanotify_event_metadata md;
+        memcpy(&md, m->buffer + off, sizeof(md));
+        if (md.event_len < FAN_EVENT_METADATA_LEN || md.event_len > len - off)
+          break;
+        if (md.vers != FANOTIFY_METADATA_VERSION) {
+          fprintf(stderr, "fanotify: unexpected metadata version\n");
+          return -1;
+        }
+        if (md.mask & FAN_Q_OVERFLOW) {
+          on_overflow(m);
+        } else if (fanotify_decode(fs, &md, m->buffer + off, &ev)) {
+          fanotify_apply(m, &ev);
+        }
+        off += md.event_len;
+        events++;
       }
+      publish(m, events);
     }
   }
-
-  close(ifd);
-  watch_free_all(&map);
   return 0;
-}
\ No newline at end of file
+}
+
+int monitor_source(const char *src_real, const char *dst,
+                   const BackupOptions *opts, int ctl_fd, LiveShared *live,
+                   volatile sig_atomic_t *stop_flag) {
+  Monitor m = {0};
+  m.src_real = src_real;
+  m.first_dst = dst;
+  m.opts = opts;
+  m.stop_flag = stop_flag;
+  m.ctl_fd = ctl_fd;
+  m.live = live;
+  m.ifd = -1;
+  coalesce_init(&m.co, opts->debounce_ms, opts->max_delay_ms);
+
+  sigprocmask(SIG_SETMASK, NULL, &m.wait_mask);
+  sigdelset(&m.wait_mask, SIGTERM);
+  m.buffer = malloc(MONITOR_BUFFER);
+  m.epfd = epoll_create1(EPOLL_CLOEXEC);
+  m.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (!m.buffer || m.epfd < 0 || m.tfd < 0 || watch_events(&m, m.tfd) < 0 ||
+      watch_events(&m, m.ctl_fd) < 0) {
+    perror("monitor setup");
+    free(m.buffer);
+    if (m.epfd >= 0)
+      close(m.epfd);
+    if (m.tfd >= 0)
+      close(m.tfd);
+    return -1;
+  }
+
+  // a single filesystem-wide fanotify mark replaces one inotify watch per
+  // directory when we are privileged enough to place it
+  FanotifySource fs;
+  int ret;
+  if (!opts->inotify && fanotify_source_open(&fs, src_real) == 0) {
+    ret = run_fanotify(&m, &fs);
+    fanotify_source_close(&fs);
+  } else {
+    ret = run_inotify(&m);
+  }
+
+  for (size_t i = 0; i < m.targets_count; i++)
+    target_stop(m.targets[i]);
+  free(m.targets);
+  sync_scan_free(m.rescan);
+  if (m.overflows)
+    fprintf(stderr, "monitor: %llu queue overflows\n", m.overflows);
+
+  close(m.tfd);
+  close(m.epfd);
+  free(m.buffer);
+  watch_free_all(&m.map);
+  if (coalesce_enabled(&m.co)) {
+    fprintf(stderr,
+            "coalesce: %llu writes, %llu copies, saved %llu (merged %llu, "
+            "cancelled %llu), moved %llu\n",
+            m.co.writes, m.co.flushed, m.co.merged + m.co.cancelled,
+            m.co.merged, m.co.cancelled, m.co.renamed);
+  }
+  coalesce_free(&m.co);
+  return ret;
+}
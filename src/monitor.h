@@ -3,8 +3,35 @@
 
 #include <signal.h>  //sig_atomic_t
 
+#include "config.h"
+#include "latency.h"
+#include "live_stats.h"
+#include "options.h"
 
-int monitor_and_mirror(const char *src_real, const char *dst_real,
-                       volatile sig_atomic_t *stop_flag);
+// requests the parent sends over the control socket
+enum { CTL_ATTACH = 1, CTL_DETACH = 2, CTL_SNAPSHOT = 3, CTL_STATS = 4 };
 
-#endif 
+// one datagram per request, answered with an int: 0 done, -1 failed, or for
+// CTL_STATS with a StatsReply
+typedef struct {
+  int op;
+  BackupOptions opts; // CTL_ATTACH: options of the new target
+  int slot;           // CTL_ATTACH: its counters in LiveShared, -1 = none
+  char dst[PATH_MAX];
+} ControlMsg;
+
+typedef struct {
+  int status;
+  LatencySummary latency[LAT_KINDS]; // event-to-mirror, by LatencyKind
+} StatsReply;
+
+// Watches src_real and mirrors it into dst plus every target attached later
+// through ctl_fd. Each change is read from the source once and fanned out to
+// per-target queues. Returns when stop_flag is set, the source disappears or
+// the last target is detached. live (may be NULL) receives the counters, dst
+// in slot 0.
+int monitor_source(const char *src_real, const char *dst,
+                   const BackupOptions *opts, int ctl_fd, LiveShared *live,
+                   volatile sig_atomic_t *stop_flag);
+
+#endif
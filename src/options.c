@@ -0,0 +1,166 @@
+#include "options.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filesystem_utils.h"
+#include "parallel_copy.h"
+
+// value of "--flag N"; advances *i past it
+static int parse_int_arg(char *argv[], int argc, int *i, int min, int max,
+                         int *out) {
+  if (*i + 1 >= argc) {
+    printf("%s needs a value\n", argv[*i]);
+    return -1;
+  }
+  char *end;
+  long v = strtol(argv[*i + 1], &end, 10);
+  if (*end != '\0' || end == argv[*i + 1] || v < min || v > max) {
+    printf("%s: expected a number in [%d, %d]\n", argv[*i], min, max);
+    return -1;
+  }
+  *out = (int)v;
+  (*i)++;
+  return 0;
+}
+
+int parse_backup_options(char *argv[], int argc, int first,
+                         BackupOptions *opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->threads = 1;
+  opts->rescan_rate = RESCAN_RATE_DEFAULT;
+
+  int i = first;
+  while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+    if (strcmp(argv[i], "--") == 0) {
+      return i + 1;
+    }
+    if (strcmp(argv[i], "--delta") == 0) {
+      opts->delta = 1;
+    } else if (strcmp(argv[i], "--incremental") == 0) {
+      opts->incremental = 1;
+    } else if (strcmp(argv[i], "--checksum") == 0) {
+      opts->incremental = 1;
+      opts->checksum = 1;
+    } else if (strcmp(argv[i], "--inotify") == 0) {
+      opts->inotify = 1;
+    } else if (strcmp(argv[i], "--io-uring") == 0) {
+      opts->io_uring = 1;
+    } else if (strcmp(argv[i], "--compress") == 0) {
+      opts->compress = 1;
+    } else if (strcmp(argv[i], "--debounce") == 0) {
+      if (parse_int_arg(argv, argc, &i, 0, 60000, &opts->debounce_ms) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--max-delay") == 0) {
+      if (parse_int_arg(argv, argc, &i, 1, 600000, &opts->max_delay_ms) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--rescan-rate") == 0) {
+      if (parse_int_arg(argv, argc, &i, 100, 10000000, &opts->rescan_rate) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      if (parse_int_arg(argv, argc, &i, 1, COPY_THREADS_MAX, &opts->threads) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--snapshot-every") == 0) {
+      if (parse_int_arg(argv, argc, &i, 1, 525600, &opts->snapshot_every) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--keep-hourly") == 0) {
+      if (parse_int_arg(argv, argc, &i, 0, 100000, &opts->keep_hourly) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--keep-daily") == 0) {
+      if (parse_int_arg(argv, argc, &i, 0, 100000, &opts->keep_daily) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--dedup") == 0) {
+      if (i + 1 >= argc) {
+        printf("%s needs a directory\n", argv[i]);
+        return -1;
+      }
+      if (norm_target_path(argv[++i], opts->dedup) < 0) {
+        printf("--dedup: invalid store \"%s\"\n", argv[i]);
+        return -1;
+      }
+    } else {
+      printf("unknown option: %s\n", argv[i]);
+      return -1;
+    }
+    i++;
+  }
+
+  // a store object is linked by every target using it, packed or not
+  if (opts->compress && opts->dedup[0]) {
+    printf("--compress and --dedup can't be combined\n");
+    return -1;
+  }
+  if (opts->max_delay_ms == 0)
+    opts->max_delay_ms = 10 * opts->debounce_ms;
+  if (opts->max_delay_ms < opts->debounce_ms)
+    opts->max_delay_ms = opts->debounce_ms;
+  return i;
+}
+
+void print_backup_options_help(void) {
+  printf("Options for add:\n");
+  printf("  --delta          rewrite only changed blocks of modified files\n");
+  printf("  --incremental    sync into a non-empty target, skip unchanged files\n");
+  printf("  --checksum       like --incremental, compare file contents by hash\n");
+  printf("  --threads N      copy the initial tree with N worker threads\n");
+  printf("  --io-uring       copy and remove whole trees with batched io_uring\n"
+         "                   requests (falls back when unavailable)\n");
+  printf("  --debounce MS    copy a modified file only after MS quiet milliseconds\n");
+  printf("  --max-delay MS   upper bound for --debounce holds (default 10x)\n");
+  printf("  --rescan-rate N  entries per second checked when resyncing after\n"
+         "                   an event queue overflow (default %d)\n",
+         RESCAN_RATE_DEFAULT);
+  printf("  --inotify        watch every directory with inotify even when a\n"
+         "                   filesystem-wide fanotify mark is possible\n");
+  printf("  --dedup DIR      keep file contents once in the store DIR, shared by\n"
+         "                   all targets using it (same filesystem), and link\n"
+         "                   the target's files to them\n");
+  printf("  --compress       store regular files compressed where that saves\n"
+         "                   space (restore unpacks them)\n");
+  printf("  --snapshot-every MIN  take a snapshot of the target every MIN minutes\n");
+  printf("  --keep-hourly N  keep the newest snapshot of each of the last N hours\n");
+  printf("  --keep-daily N   ...and of each of the last N days (both unset: all)\n");
+}
+
+int parse_restore_options(char *argv[], int argc, int first,
+                          RestoreOptions *opts) {
+  memset(opts, 0, sizeof(*opts));
+  opts->threads = RESTORE_THREADS_DEFAULT;
+
+  int i = first;
+  while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+    if (strcmp(argv[i], "--") == 0) {
+      return i + 1;
+    }
+    if (strcmp(argv[i], "--threads") == 0) {
+      if (parse_int_arg(argv, argc, &i, 1, COPY_THREADS_MAX, &opts->threads) < 0)
+        return -1;
+    } else if (strcmp(argv[i], "--verify") == 0) {
+      opts->verify = 1;
+    } else if (strcmp(argv[i], "--snapshot") == 0) {
+      if (i + 1 >= argc) {
+        printf("%s needs a snapshot id\n", argv[i]);
+        return -1;
+      }
+      if (snprintf(opts->snapshot, SNAPSHOT_ID_MAX, "%s", argv[++i]) >=
+          SNAPSHOT_ID_MAX) {
+        printf("--snapshot: invalid id \"%s\"\n", argv[i]);
+        return -1;
+      }
+    } else {
+      printf("unknown option: %s\n", argv[i]);
+      return -1;
+    }
+    i++;
+  }
+  return i;
+}
+
+void print_restore_options_help(void) {
+  printf("Options for restore:\n");
+  printf("  --threads N      apply the restore with N worker threads (default %d)\n",
+         RESTORE_THREADS_DEFAULT);
+  printf("  --verify         hash files of equal size whose mtime differs and keep\n"
+         "                   the identical ones instead of copying them again\n");
+  printf("  --snapshot ID    restore the snapshot ID instead of the live target\n");
+}
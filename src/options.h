@@ -0,0 +1,48 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "config.h"
+#include "snapshot.h"
+
+#define RESCAN_RATE_DEFAULT 50000
+#define RESTORE_THREADS_DEFAULT 8
+
+// per-backup settings given as leading flags to `add`
+typedef struct {
+  int delta;       // rewrite only the changed blocks of modified files
+  int incremental; // accept a non-empty target, copy only what differs
+  int checksum;    // incremental: compare regular files by content hash
+  int threads;     // worker threads for the initial copy (1 = sequential)
+  int inotify;     // never use the fanotify backend
+  int debounce_ms; // copy a modified file once it was quiet this long (0 = off)
+  int max_delay_ms; // ...but never hold a copy back longer than this
+  int rescan_rate; // entries/s checked when resyncing after lost events
+  int io_uring;    // batch tree copies and removals through io_uring
+  char dedup[PATH_MAX]; // content-addressed store to link files into, "" = off
+  int compress;    // store regular files packed, see compress.h
+  int snapshot_every; // minutes between scheduled snapshots (0 = none)
+  int keep_hourly; // snapshot retention, see snapshot_prune (0 and 0 = all)
+  int keep_daily;
+} BackupOptions;
+
+// Parses leading "--flag" arguments starting at argv[first]. Returns the index
+// of the first positional argument, or -1 on an unknown or malformed flag.
+int parse_backup_options(char *argv[], int argc, int first,
+                         BackupOptions *opts);
+
+void print_backup_options_help(void);
+
+// settings given as leading flags to `restore`
+typedef struct {
+  int threads; // workers applying the restore plan
+  int verify;  // same-size files differing in mtime are compared by content
+  char snapshot[SNAPSHOT_ID_MAX]; // restore this generation, "" = the target
+} RestoreOptions;
+
+// Same conventions as parse_backup_options.
+int parse_restore_options(char *argv[], int argc, int first,
+                          RestoreOptions *opts);
+
+void print_restore_options_help(void);
+
+#endif
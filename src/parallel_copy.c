@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include "parallel_copy.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "config.h"
+#include "filesystem_utils.h"
+
+typedef struct {
+  int is_dir;
+  struct stat st; // of the source
+  char *src;
+  char *dst;
+} CopyTask;
+
+// ring buffer; the owner works at the bottom (newest), thieves take the top
+typedef struct {
+  pthread_mutex_t lock;
+  CopyTask *tasks;
+  size_t head;
+  size_t count;
+  size_t capacity;
+} TaskDeque;
+
+typedef struct {
+  TaskDeque *deques;
+  int workers;
+  const char *src_real;
+  const char *dst_real;
+  LinkMap *links;
+  volatile sig_atomic_t *stop_flag;
+  atomic_size_t pending; // queued or running tasks
+  atomic_int failed;
+  atomic_int idle;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+} CopyPool;
+
+typedef struct {
+  CopyPool *pool;
+  int id;
+} CopyWorker;
+
+static int deque_push(TaskDeque *d, CopyTask task) {
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity) {
+    size_t new_cap = (d->capacity == 0) ? 64 : (d->capacity * 2);
+    CopyTask *new_tasks = malloc(new_cap * sizeof(*new_tasks));
+    if (!new_tasks) {
+      pthread_mutex_unlock(&d->lock);
+      fprintf(stderr, "task deque malloc failed\n");
+      return -1;
+    }
+    for (size_t i = 0; i < d->count; i++)
+      new_tasks[i] = d->tasks[(d->head + i) % d->capacity];
+    free(d->tasks);
+    d->tasks = new_tasks;
+    d->head = 0;
+    d->capacity = new_cap;
+  }
+  d->tasks[(d->head + d->count) % d->capacity] = task;
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+static int deque_pop_bottom(TaskDeque *d, CopyTask *out) {
+  pthread_mutex_lock(&d->lock);
+  int found = d->count > 0;
+  if (found) {
+    *out = d->tasks[(d->head + d->count - 1) % d->capacity];
+    d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int deque_steal_top(TaskDeque *d, CopyTask *out) {
+  pthread_mutex_lock(&d->lock);
+  int found = d->count > 0;
+  if (found) {
+    *out = d->tasks[d->head];
+    d->head = (d->head + 1) % d->capacity;
+    d->count--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static void task_free(CopyTask *task) {
+  free(task->src);
+  free(task->dst);
+}
+
+static int pool_push(CopyPool *pool, int id, int is_dir, const struct stat *st,
+                     const char *src, const char *dst) {
+  CopyTask task = {is_dir, *st, strdup(src), strdup(dst)};
+  if (!task.src || !task.dst) {
+    task_free(&task);
+    return -1;
+  }
+
+  atomic_fetch_add(&pool->pending, 1);
+  if (deque_push(&pool->deques[id], task) < 0) {
+    atomic_fetch_sub(&pool->pending, 1);
+    task_free(&task);
+    return -1;
+  }
+
+  if (atomic_load(&pool->idle) > 0) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+  return 0;
+}
+
+static int pool_take(CopyPool *pool, int id, CopyTask *out) {
+  if (deque_pop_bottom(&pool->deques[id], out))
+    return 1;
+  for (int i = 1; i < pool->workers; i++) {
+    int victim = (id + i) % pool->workers;
+    if (deque_steal_top(&pool->deques[victim], out))
+      return 1;
+  }
+  return 0;
+}
+
+// lists one directory: subdirectories and files become tasks, symlinks are
+// cheap enough to rewrite on the spot
+static int run_dir_task(CopyPool *pool, int id, const CopyTask *task) {
+  DIR *d = opendir(task->src);
+  if (!d) {
+    perror("opendir(src_dir)");
+    return -1;
+  }
+
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    if (*pool->stop_flag || atomic_load(&pool->failed)) {
+      closedir(d);
+      return -1;
+    }
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+
+    char src_path[PATH_MAX], dst_path[PATH_MAX];
+    if (snprintf(src_path, PATH_MAX, "%s/%s", task->src, entity->d_name) >=
+            PATH_MAX ||
+        snprintf(dst_path, PATH_MAX, "%s/%s", task->dst, entity->d_name) >=
+            PATH_MAX) {
+      closedir(d);
+      fprintf(stderr, "Name too long(parallel_copy_tree)\n");
+      return -1;
+    }
+
+    struct stat st;
+    if (lstat(src_path, &st) < 0) {
+      perror("lstat(parallel_copy_tree)");
+      closedir(d);
+      return -1;
+    }
+
+    int ret = 0;
+    if (S_ISDIR(st.st_mode)) {
+      if (mkdir(dst_path, st.st_mode & 0777) < 0 && errno != EEXIST) {
+        perror("mkdir(parallel_copy_tree)");
+        ret = -1;
+      } else {
+        ret = pool_push(pool, id, 1, &st, src_path, dst_path);
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      ret = pool_push(pool, id, 0, &st, src_path, dst_path);
+    } else if (S_ISLNK(st.st_mode)) {
+      ret = copy_symplink_rewrite(src_path, dst_path, pool->src_real,
+                                  pool->dst_real);
+    } else {
+      fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+    }
+
+    if (ret < 0) {
+      closedir(d);
+      return -1;
+    }
+  }
+
+  if (closedir(d) < 0) {
+    perror("closedir");
+    return -1;
+  }
+  return 0;
+}
+
+static void *copy_worker(void *arg) {
+  CopyWorker *worker = arg;
+  CopyPool *pool = worker->pool;
+
+  while (1) {
+    CopyTask task;
+    if (pool_take(pool, worker->id, &task)) {
+      // after a failure or stop request the remaining tasks are only drained
+      if (!*pool->stop_flag && !atomic_load(&pool->failed)) {
+        int ret = task.is_dir
+                      ? run_dir_task(pool, worker->id, &task)
+                      : link_or_copy(pool->links, task.src, task.dst,
+                                     &task.st, pool->stop_flag);
+        if (ret < 0)
+          atomic_store(&pool->failed, 1);
+      }
+      task_free(&task);
+
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_broadcast(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+      }
+      continue;
+    }
+
+    if (atomic_load(&pool->pending) == 0)
+      break;
+
+    // nothing to steal right now; the timeout covers a push racing our wait
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->idle, 1);
+    if (atomic_load(&pool->pending) != 0) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += 1000000;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&pool->idle_cond, &pool->idle_lock, &deadline);
+    }
+    atomic_fetch_sub(&pool->idle, 1);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+  return NULL;
+}
+
+int parallel_copy_tree(const char *src_dir, const char *dst_dir,
+                       const char *src_real, const char *dst_real,
+                       LinkMap *links, int threads,
+                       volatile sig_atomic_t *stop_flag) {
+  if (threads < 1)
+    threads = 1;
+  if (threads > COPY_THREADS_MAX)
+    threads = COPY_THREADS_MAX;
+
+  CopyPool pool;
+  memset(&pool, 0, sizeof(pool));
+  pool.workers = threads;
+  pool.src_real = src_real;
+  pool.dst_real = dst_real;
+  pool.links = links;
+  pool.stop_flag = stop_flag;
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+
+  pool.deques = calloc((size_t)threads, sizeof(*pool.deques));
+  CopyWorker *workers = calloc((size_t)threads, sizeof(*workers));
+  pthread_t *tids = calloc((size_t)threads, sizeof(*tids));
+  if (!pool.deques || !workers || !tids) {
+    fprintf(stderr, "copy pool allocation failed\n");
+    free(pool.deques);
+    free(workers);
+    free(tids);
+    return -1;
+  }
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+  int ret = 0;
+  struct stat root_st;
+  memset(&root_st, 0, sizeof(root_st));
+  if (pool_push(&pool, 0, 1, &root_st, src_dir, dst_dir) < 0) {
+    ret = -1;
+  } else {
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+      workers[i].pool = &pool;
+      workers[i].id = i;
+      if (pthread_create(&tids[i], NULL, copy_worker, &workers[i]) != 0) {
+        fprintf(stderr, "pthread_create failed, using %d workers\n", i);
+        break;
+      }
+      started++;
+    }
+    // workers that failed to start just leave their deque empty; with none
+    // at all the calling thread does the whole job
+    if (started == 0)
+      copy_worker(&workers[0]);
+    for (int i = 0; i < started; i++)
+      pthread_join(tids[i], NULL);
+    if (atomic_load(&pool.failed) || *stop_flag)
+      ret = -1;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    free(pool.deques[i].tasks);
+    pthread_mutex_destroy(&pool.deques[i].lock);
+  }
+  pthread_mutex_destroy(&pool.idle_lock);
+  pthread_cond_destroy(&pool.idle_cond);
+  free(pool.deques);
+  free(workers);
+  free(tids);
+  return ret;
+}
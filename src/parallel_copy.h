@@ -0,0 +1,20 @@
+#ifndef PARALLEL_COPY_H
+#define PARALLEL_COPY_H
+
+#include <signal.h>  // sig_atomic_t
+
+#include "link_map.h"
+
+// upper bound for --threads
+#define COPY_THREADS_MAX 256
+
+// Same result as copy_tree, but directories and files are spread over a pool
+// of worker threads. Each worker owns a deque: it pushes and pops its own
+// work at the bottom, idle workers steal from the top of the others.
+// links (may be NULL) is shared by the workers.
+int parallel_copy_tree(const char *src_dir, const char *dst_dir,
+                       const char *src_real, const char *dst_real,
+                       LinkMap *links, int threads,
+                       volatile sig_atomic_t *stop_flag);
+
+#endif
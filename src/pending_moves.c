@@ -30,7 +30,7 @@
 
 // helpers for pending move management
 void pending_move_add(PendingMoves *pm, uint32_t cookie, int is_dir,
-                      const char *src_old, const char *dst_old) {
+                      const char *src_old) {
   if (pm->pending_count == PENDING_MAX) {
     size_t oldest = 0;
     for (size_t i = 0; i < pm->pending_count; i++) {
@@ -48,7 +48,6 @@ void pending_move_add(PendingMoves *pm, uint32_t cookie, int is_dir,
   new_move->is_dir = is_dir;
   new_move->t = time(NULL);
   snprintf(new_move->src_old, PATH_MAX, "%s", src_old);
-  snprintf(new_move->dst_old, PATH_MAX, "%s", dst_old);
 }
 
 int pm_take(PendingMoves *pm, uint32_t cookie, PendingMove *out) {
@@ -64,7 +63,9 @@ int pm_take(PendingMoves *pm, uint32_t cookie, PendingMove *out) {
   return 0;
 }
 
-void pm_1s_expire(PendingMoves *pm, int notify_fd, WatchMap *map) {
+void pm_1s_expire(PendingMoves *pm,
+                  void (*moved_out)(void *arg, const char *src_old, int is_dir),
+                  void *arg) {
   time_t now = time(NULL);
   size_t i = 0;
   while (i < pm->pending_count) {
@@ -73,13 +74,27 @@ void pm_1s_expire(PendingMoves *pm, int notify_fd, WatchMap *map) {
       continue;
     }
 
-    rm_tree(pm->pending[i].dst_old);
-    if (pm->pending[i].is_dir) {
-      watch_remove_subtree(notify_fd, map, pm->pending[i].src_old);
-    }
-
+    PendingMove expired = pm->pending[i];
     pm->pending[i] = pm->pending[pm->pending_count - 1];
     pm->pending_count--;
+    moved_out(arg, expired.src_old, expired.is_dir);
   }
 }
 
+int pm_timeout_ms(const PendingMoves *pm) {
+  if (pm->pending_count == 0)
+    return -1;
+
+  time_t oldest = pm->pending[0].t;
+  for (size_t i = 1; i < pm->pending_count; i++) {
+    if (pm->pending[i].t < oldest)
+      oldest = pm->pending[i].t;
+  }
+
+  // entries expire once time() reaches t + 1
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  long long ms = ((long long)oldest + 1 - now.tv_sec) * 1000 -
+                 now.tv_nsec / 1000000;
+  return ms > 0 ? (int)ms : 0;
+}
@@ -8,7 +8,6 @@ typedef struct {
     int is_dir;
     time_t t;
     char src_old[PATH_MAX];
-    char dst_old[PATH_MAX];
 } PendingMove;
 
 typedef struct {
@@ -16,12 +15,16 @@ typedef struct {
     size_t pending_count;
 } PendingMoves;
 
-
-struct WatchMap;
-
 void pending_move_add(PendingMoves* pm, uint32_t cookie, int is_dir,
-                      const char* src_old, const char* dst_old);
+                      const char* src_old);
 
 int pm_take(PendingMoves* pm, uint32_t cookie, PendingMove* out);
 
-void pm_1s_expire(PendingMoves* pm, int notify_fd, struct WatchMap* map);
\ No newline at end of file
+// moves without a matching IN_MOVED_TO after 1s left the source; they are
+// handed to moved_out as deletions
+void pm_1s_expire(PendingMoves* pm,
+                  void (*moved_out)(void* arg, const char* src_old, int is_dir),
+                  void* arg);
+
+// milliseconds until pm_1s_expire has work, -1 if nothing is pending
+int pm_timeout_ms(const PendingMoves* pm);
\ No newline at end of file
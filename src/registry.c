@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define SLOT_EMPTY ((size_t)-1)
+
+static uint64_t src_hash(const char *src) {
+  return hash64(src, strlen(src), 0);
+}
+
+static uint64_t pair_hash(const char *src, const char *dst) {
+  return hash64(dst, strlen(dst), src_hash(src));
+}
+
+// slot holding the pair, or the empty slot ending its probe sequence
+static size_t backup_slot(const Registry *reg, const char *src,
+                          const char *dst, uint64_t hash) {
+  size_t mask = reg->backup_slots_capacity - 1;
+  size_t i = (size_t)hash & mask;
+  while (reg->backup_slots[i] != SLOT_EMPTY) {
+    const Backup *b = &reg->backups[reg->backup_slots[i]];
+    if (b->hash == hash && strcmp(b->dst, dst) == 0 &&
+        strcmp(b->src, src) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static size_t watcher_slot(const Registry *reg, const char *src,
+                           uint64_t hash) {
+  size_t mask = reg->watcher_slots_capacity - 1;
+  size_t i = (size_t)hash & mask;
+  while (reg->watcher_slots[i] != SLOT_EMPTY) {
+    const Watcher *w = reg->watchers[reg->watcher_slots[i]];
+    if (w->hash == hash && strcmp(w->src, src) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static size_t *new_slots(size_t cap) {
+  size_t *slots = malloc(cap * sizeof(*slots));
+  if (!slots) {
+    fprintf(stderr, "registry index malloc failed\n");
+    return NULL;
+  }
+  for (size_t i = 0; i < cap; i++)
+    slots[i] = SLOT_EMPTY;
+  return slots;
+}
+
+static int rehash_backups(Registry *reg, size_t new_cap) {
+  size_t *slots = new_slots(new_cap);
+  if (!slots)
+    return -1;
+  free(reg->backup_slots);
+  reg->backup_slots = slots;
+  reg->backup_slots_capacity = new_cap;
+  for (size_t i = 0; i < reg->backups_count; i++) {
+    const Backup *b = &reg->backups[i];
+    reg->backup_slots[backup_slot(reg, b->src, b->dst, b->hash)] = i;
+  }
+  return 0;
+}
+
+static int rehash_watchers(Registry *reg, size_t new_cap) {
+  size_t *slots = new_slots(new_cap);
+  if (!slots)
+    return -1;
+  free(reg->watcher_slots);
+  reg->watcher_slots = slots;
+  reg->watcher_slots_capacity = new_cap;
+  for (size_t i = 0; i < reg->watchers_count; i++) {
+    const Watcher *w = reg->watchers[i];
+    reg->watcher_slots[watcher_slot(reg, w->src, w->hash)] = i;
+  }
+  return 0;
+}
+
+int registry_find(const Registry *reg, const char *src, const char *dst) {
+  if (reg->backups_count == 0)
+    return -1;
+  size_t slot = backup_slot(reg, src, dst, pair_hash(src, dst));
+  size_t index = reg->backup_slots[slot];
+  return index == SLOT_EMPTY ? -1 : (int)index;
+}
+
+int registry_add(Registry *reg, const char *src, const char *dst) {
+  if ((reg->backups_count + 1) * 2 > reg->backup_slots_capacity &&
+      rehash_backups(reg, reg->backup_slots_capacity
+                              ? reg->backup_slots_capacity * 2
+                              : 64) < 0)
+    return -1;
+  if (reg->backups_count == reg->backups_capacity) {
+    size_t new_cap = reg->backups_capacity ? reg->backups_capacity * 2 : 8;
+    Backup *new_backups = realloc(reg->backups, new_cap * sizeof(*new_backups));
+    if (!new_backups) {
+      fprintf(stderr, "registry realloc failed\n");
+      return -1;
+    }
+    reg->backups = new_backups;
+    reg->backups_capacity = new_cap;
+  }
+
+  Backup *b = &reg->backups[reg->backups_count];
+  memset(b, 0, sizeof(*b));
+  b->src = strdup(src);
+  b->dst = strdup(dst);
+  if (!b->src || !b->dst) {
+    free(b->src);
+    free(b->dst);
+    return -1;
+  }
+  b->hash = pair_hash(src, dst);
+  b->prev = REG_NONE;
+  b->next = REG_NONE;
+  b->slot = -1;
+  reg->backup_slots[backup_slot(reg, src, dst, b->hash)] = reg->backups_count;
+  return (int)reg->backups_count++;
+}
+
+Watcher *registry_watcher(const Registry *reg, const char *src) {
+  if (reg->watchers_count == 0)
+    return NULL;
+  size_t slot = watcher_slot(reg, src, src_hash(src));
+  size_t index = reg->watcher_slots[slot];
+  return index == SLOT_EMPTY ? NULL : reg->watchers[index];
+}
+
+Watcher *registry_add_watcher(Registry *reg, const char *src) {
+  if ((reg->watchers_count + 1) * 2 > reg->watcher_slots_capacity &&
+      rehash_watchers(reg, reg->watcher_slots_capacity
+                               ? reg->watcher_slots_capacity * 2
+                               : 64) < 0)
+    return NULL;
+  if (reg->watchers_count == reg->watchers_capacity) {
+    size_t new_cap = reg->watchers_capacity ? reg->watchers_capacity * 2 : 8;
+    Watcher **new_watchers =
+        realloc(reg->watchers, new_cap * sizeof(*new_watchers));
+    if (!new_watchers) {
+      fprintf(stderr, "registry realloc failed\n");
+      return NULL;
+    }
+    reg->watchers = new_watchers;
+    reg->watchers_capacity = new_cap;
+  }
+
+  Watcher *w = calloc(1, sizeof(*w));
+  if (!w || !(w->src = strdup(src))) {
+    fprintf(stderr, "registry watcher allocation failed\n");
+    free(w);
+    return NULL;
+  }
+  w->hash = src_hash(src);
+  w->pidfd = -1;
+  w->ctl_fd = -1;
+  w->first = REG_NONE;
+  w->index = reg->watchers_count;
+  reg->watchers[reg->watchers_count++] = w;
+  reg->watcher_slots[watcher_slot(reg, src, w->hash)] = w->index;
+  return w;
+}
+
+// removes slot i and pulls later entries of the cluster back into the gap
+static void watcher_slot_delete(Registry *reg, size_t i) {
+  size_t mask = reg->watcher_slots_capacity - 1;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (reg->watcher_slots[j] == SLOT_EMPTY)
+      break;
+    size_t home = (size_t)reg->watchers[reg->watcher_slots[j]]->hash & mask;
+    if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    reg->watcher_slots[i] = reg->watcher_slots[j];
+    i = j;
+  }
+  reg->watcher_slots[i] = SLOT_EMPTY;
+}
+
+void registry_remove_watcher(Registry *reg, Watcher *w) {
+  watcher_slot_delete(reg, watcher_slot(reg, w->src, w->hash));
+  size_t last = reg->watchers_count - 1;
+  if (w->index != last) {
+    Watcher *moved = reg->watchers[last];
+    moved->index = w->index;
+    reg->watchers[w->index] = moved;
+    reg->watcher_slots[watcher_slot(reg, moved->src, moved->hash)] =
+        moved->index;
+  }
+  reg->watchers_count--;
+  free(w->src);
+  free(w);
+}
+
+void registry_link(Registry *reg, size_t backup, Watcher *w) {
+  Backup *b = &reg->backups[backup];
+  b->watcher = w;
+  b->pid = w->pid;
+  b->active = 1;
+  b->prev = REG_NONE;
+  b->next = w->first;
+  if (w->first != REG_NONE)
+    reg->backups[w->first].prev = backup;
+  w->first = backup;
+  w->targets++;
+}
+
+void registry_unlink(Registry *reg, size_t backup) {
+  Backup *b = &reg->backups[backup];
+  Watcher *w = b->watcher;
+  if (!w)
+    return;
+  if (b->prev != REG_NONE)
+    reg->backups[b->prev].next = b->next;
+  else
+    w->first = b->next;
+  if (b->next != REG_NONE)
+    reg->backups[b->next].prev = b->prev;
+  w->targets--;
+  b->watcher = NULL;
+  b->prev = REG_NONE;
+  b->next = REG_NONE;
+  b->pid = 0;
+  b->active = 0;
+}
+
+void registry_free(Registry *reg) {
+  for (size_t i = 0; i < reg->backups_count; i++) {
+    free(reg->backups[i].src);
+    free(reg->backups[i].dst);
+  }
+  for (size_t i = 0; i < reg->watchers_count; i++) {
+    free(reg->watchers[i]->src);
+    free(reg->watchers[i]);
+  }
+  free(reg->backups);
+  free(reg->backup_slots);
+  free(reg->watchers);
+  free(reg->watcher_slots);
+  memset(reg, 0, sizeof(*reg));
+}
@@ -0,0 +1,85 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>
+#include <sys/types.h>  // pid_t
+#include <time.h>
+
+#include "live_stats.h"
+#include "options.h"
+
+#define REG_NONE ((size_t)-1)
+
+// one process per watched source; the targets of that source are attached
+// to it over ctl_fd instead of each getting a process of its own
+typedef struct {
+  char *src;
+  uint64_t hash;
+  pid_t pid;
+  int pidfd;        // readable once the process exited
+  int ctl_fd;
+  size_t targets;
+  size_t first;     // its backups, linked through Backup.next
+  size_t index;     // position in Registry.watchers
+  LiveShared *live; // counters it publishes, NULL when mapping failed
+  uint32_t slots;   // LiveShared.targets in use, one bit each
+} Watcher;
+
+// A (source, target) pair. Ended pairs stay registered for restore, so
+// backups only ever get appended and their indices stay valid.
+typedef struct {
+  char *src;
+  char *dst;
+  uint64_t hash;
+  pid_t pid;
+  time_t created_at;
+  int active;
+  BackupOptions opts;
+  Watcher *watcher; // while active
+  size_t prev;      // neighbours among the watcher's backups
+  size_t next;
+  int slot; // its counters in the watcher's LiveShared, -1 = none
+  // what `list` saw last, rates are over the time since
+  uint64_t seen_ns;
+  unsigned long long seen_bytes;
+  unsigned long long seen_events;
+} Backup;
+
+// Backups and watchers with open-addressing indexes (linear probing,
+// power-of-two size, no tombstones) on (src, dst) and on src, so finding
+// either costs the same however many there are.
+typedef struct {
+  Backup *backups;
+  size_t backups_count;
+  size_t backups_capacity;
+  size_t *backup_slots;
+  size_t backup_slots_capacity;
+
+  Watcher **watchers; // watchers never move, only these pointers do
+  size_t watchers_count;
+  size_t watchers_capacity;
+  size_t *watcher_slots;
+  size_t watcher_slots_capacity;
+} Registry;
+
+// index of the pair in reg->backups, -1 if it was never added
+int registry_find(const Registry *reg, const char *src, const char *dst);
+// Appends an ended pair with no options set; returns its index or -1.
+int registry_add(Registry *reg, const char *src, const char *dst);
+
+Watcher *registry_watcher(const Registry *reg, const char *src);
+// a zeroed watcher of src, not running yet (pid 0, fds -1)
+Watcher *registry_add_watcher(Registry *reg, const char *src);
+// Forgets and frees the watcher; its backups must be unlinked and its fds
+// closed already.
+void registry_remove_watcher(Registry *reg, Watcher *w);
+
+// Makes backup one of the watcher's targets and marks it active, or the
+// other way round.
+void registry_link(Registry *reg, size_t backup, Watcher *w);
+void registry_unlink(Registry *reg, size_t backup);
+
+void registry_free(Registry *reg);
+
+#endif
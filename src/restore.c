@@ -0,0 +1,673 @@
+#define _GNU_SOURCE
+#include "restore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "config.h"
+#include "dedup_store.h"
+#include "filesystem_utils.h"
+#include "hash_cache.h"
+#include "io_utils.h"
+#include "link_map.h"
+#include "manifest.h"
+#include "snapshot.h"
+
+// how often a running phase reports
+#define PROGRESS_INTERVAL_SEC 1
+
+// one step of the plan; what it does depends on the list it is in
+typedef struct {
+  char *rel;    // below both roots
+  off_t size;   // of the backup entry
+  mode_t mode;
+  dev_t dev;
+  ino_t ino;
+  nlink_t nlink;
+  struct timespec mtime;
+  int verify;   // same size, other mtime: compare contents before copying
+} RestoreAction;
+
+typedef struct {
+  RestoreAction *items;
+  size_t count;
+  size_t capacity;
+} ActionList;
+
+typedef struct Restore Restore;
+typedef int (*ActionFn)(Restore *r, const RestoreAction *a);
+
+struct Restore {
+  const char *backup_real;
+  const char *src_real;
+  Manifest *man;  // trusted manifest of the backup, or NULL
+  LinkMap links;  // backup inodes already restored under some name
+  HashCache *hashes; // content hashes, with --verify
+  int dedup;      // backup files are links into a dedup store
+  RestoreStats *stats;
+  volatile sig_atomic_t *stop_flag;
+
+  ActionList deletes; // source entries the backup doesn't have (or differ)
+  ActionList dirs;    // directories to create or fix the mode of
+  ActionList files;   // regular files and symlinks to copy
+
+  // the phase being run
+  const ActionList *run;
+  ActionFn fn;
+  atomic_size_t next;
+  atomic_size_t done;
+  atomic_ullong bytes_done;
+  atomic_ullong copied;
+  atomic_ullong bytes_copied;
+  atomic_ullong linked;
+  atomic_ullong identical;
+  atomic_ullong failed;
+  pthread_mutex_t lock;
+  pthread_cond_t finished; // the last worker of a phase is done
+  int running;
+};
+
+static int same_mtime(const struct stat *a, const struct stat *b) {
+  return a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// root/rel, or root itself for rel ""
+static int join_path(char out[PATH_MAX], const char *root, const char *rel) {
+  int n = rel[0] ? snprintf(out, PATH_MAX, "%s/%s", root, rel)
+                 : snprintf(out, PATH_MAX, "%s", root);
+  if (n >= PATH_MAX) {
+    fprintf(stderr, "Name too long(restore)\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int list_add(ActionList *l, const char *rel, const struct stat *st) {
+  if (l->count == l->capacity) {
+    size_t new_cap = l->capacity ? l->capacity * 2 : 256;
+    RestoreAction *items = realloc(l->items, new_cap * sizeof(*items));
+    if (!items) {
+      fprintf(stderr, "restore plan realloc failed\n");
+      return -1;
+    }
+    l->items = items;
+    l->capacity = new_cap;
+  }
+  char *copy = strdup(rel);
+  if (!copy) {
+    fprintf(stderr, "restore plan strdup failed\n");
+    return -1;
+  }
+  RestoreAction *a = &l->items[l->count++];
+  memset(a, 0, sizeof(*a));
+  a->rel = copy;
+  if (st) {
+    a->size = st->st_size;
+    a->mode = st->st_mode;
+    a->dev = st->st_dev;
+    a->ino = st->st_ino;
+    a->nlink = st->st_nlink;
+    a->mtime = st->st_mtim;
+  }
+  return 0;
+}
+
+static void list_free(ActionList *l) {
+  for (size_t i = 0; i < l->count; i++)
+    free(l->items[i].rel);
+  free(l->items);
+  memset(l, 0, sizeof(*l));
+}
+
+static int cmp_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// entry names of dir, sorted
+static int list_dir(const char *dir, char ***out, size_t *count) {
+  *out = NULL;
+  *count = 0;
+  DIR *d = opendir(dir);
+  if (!d) {
+    perror("opendir(restore)");
+    return -1;
+  }
+
+  char **names = NULL;
+  size_t n = 0, cap = 0;
+  int ret = 0;
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+    if (n == cap) {
+      size_t new_cap = cap ? cap * 2 : 64;
+      char **new_names = realloc(names, new_cap * sizeof(*names));
+      if (!new_names) {
+        ret = -1;
+        break;
+      }
+      names = new_names;
+      cap = new_cap;
+    }
+    if (!(names[n] = strdup(entity->d_name))) {
+      ret = -1;
+      break;
+    }
+    n++;
+  }
+  closedir(d);
+  if (ret < 0) {
+    fprintf(stderr, "restore listing failed\n");
+    for (size_t i = 0; i < n; i++)
+      free(names[i]);
+    free(names);
+    return -1;
+  }
+  // names is NULL for an empty directory
+  if (n > 1)
+    qsort(names, n, sizeof(*names), cmp_names);
+  *out = names;
+  *count = n;
+  return 0;
+}
+
+static void free_names(char **names, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    free(names[i]);
+  free(names);
+}
+
+// the backup entry as recorded in the manifest, or as lstat finds it;
+// full says nlink (and dev) are needed, which only lstat has
+static int backup_stat(Restore *r, const char *rel, const char *path,
+                       struct stat *st, int full) {
+  ManifestEntry e;
+  if (!full && r->man && manifest_get(r->man, rel, &e)) {
+    manifest_entry_stat(&e, st);
+  } else if (lstat(path, st) < 0) {
+    perror("lstat(restore backup)");
+    return -1;
+  }
+  // in a dedup target equal files share an inode whatever the source had,
+  // so no links are rebuilt from it
+  if (r->dedup)
+    st->st_nlink = 1;
+  return 0;
+}
+
+static int symlink_matches(Restore *r, const char *bck_path,
+                           const char *src_path) {
+  char want[PATH_MAX], have[PATH_MAX];
+  if (symlink_rewrite_target(bck_path, r->backup_real, r->src_real, want) < 0)
+    return 0;
+  ssize_t n = readlink(src_path, have, sizeof(have) - 1);
+  if (n < 0)
+    return 0;
+  have[n] = '\0';
+  return strcmp(want, have) == 0;
+}
+
+static int plan_dir(Restore *r, const char *rel, int src_exists);
+
+// plans one backup entry; src_exists says the source may have it too
+static int plan_entry(Restore *r, const char *rel, int src_exists) {
+  char bck_path[PATH_MAX], src_path[PATH_MAX];
+  if (join_path(bck_path, r->backup_real, rel) < 0 ||
+      join_path(src_path, r->src_real, rel) < 0)
+    return -1;
+
+  struct stat bst, sst;
+  if (backup_stat(r, rel, bck_path, &bst, 0) < 0)
+    return -1;
+  if (src_exists && lstat(src_path, &sst) < 0) {
+    if (errno != ENOENT) {
+      perror("lstat(restore source)");
+      return -1;
+    }
+    src_exists = 0;
+  }
+  if (src_exists && (sst.st_mode & S_IFMT) != (bst.st_mode & S_IFMT)) {
+    if (list_add(&r->deletes, rel, NULL) < 0)
+      return -1;
+    src_exists = 0;
+  }
+
+  if (S_ISDIR(bst.st_mode)) {
+    if ((!src_exists || (sst.st_mode & 0777) != (bst.st_mode & 0777)) &&
+        list_add(&r->dirs, rel, &bst) < 0)
+      return -1;
+    return plan_dir(r, rel, src_exists);
+  }
+
+  if (S_ISREG(bst.st_mode)) {
+    if (src_exists && sst.st_size == bst.st_size && same_mtime(&sst, &bst)) {
+      if ((sst.st_mode & 0777) != (bst.st_mode & 0777) &&
+          list_add(&r->dirs, rel, &bst) < 0)
+        return -1;
+      // further links of this backup inode join the file already there
+      if (bst.st_nlink > 1 &&
+          (!r->man || backup_stat(r, rel, bck_path, &bst, 1) == 0))
+        link_map_add(&r->links, &bst, src_path);
+      r->stats->kept++;
+      return 0;
+    }
+    // hard-linked backup files go the usual way: a kept copy would not
+    // join the links restored meanwhile by the workers
+    if (r->hashes && src_exists && sst.st_size == bst.st_size &&
+        bst.st_nlink == 1) {
+      if (list_add(&r->files, rel, &bst) < 0)
+        return -1;
+      r->files.items[r->files.count - 1].verify = 1;
+      return 0;
+    }
+    // the old file may have other names in the source: it is replaced,
+    // never written through
+    if (src_exists && list_add(&r->deletes, rel, NULL) < 0)
+      return -1;
+    if (r->man && backup_stat(r, rel, bck_path, &bst, 1) < 0)
+      return -1;
+    return list_add(&r->files, rel, &bst);
+  }
+
+  if (S_ISLNK(bst.st_mode)) {
+    if (src_exists && symlink_matches(r, bck_path, src_path)) {
+      r->stats->kept++;
+      return 0;
+    }
+    if (src_exists && list_add(&r->deletes, rel, NULL) < 0)
+      return -1;
+    return list_add(&r->files, rel, &bst);
+  }
+
+  fprintf(stderr, "Skipping unsupported file type: %s\n", bck_path);
+  return 0;
+}
+
+// merge-join of the sorted listings of one directory on both sides
+static int plan_dir(Restore *r, const char *rel, int src_exists) {
+  char bck_dir[PATH_MAX], src_dir[PATH_MAX];
+  if (join_path(bck_dir, r->backup_real, rel) < 0 ||
+      join_path(src_dir, r->src_real, rel) < 0)
+    return -1;
+
+  char **bck = NULL, **src = NULL;
+  size_t nb = 0, ns = 0;
+  if (list_dir(bck_dir, &bck, &nb) < 0)
+    return -1;
+  if (src_exists && list_dir(src_dir, &src, &ns) < 0) {
+    free_names(bck, nb);
+    return -1;
+  }
+
+  int ret = 0;
+  size_t i = 0, j = 0;
+  while (ret == 0 && (i < nb || j < ns)) {
+    if (*r->stop_flag) {
+      ret = -1;
+      break;
+    }
+    int cmp = i == nb ? 1 : j == ns ? -1 : strcmp(bck[i], src[j]);
+    const char *name = cmp <= 0 ? bck[i] : src[j];
+    char child[PATH_MAX];
+    if (snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name) >=
+        PATH_MAX) {
+      fprintf(stderr, "Name too long(restore)\n");
+      ret = -1;
+      break;
+    }
+    if (cmp > 0)
+      ret = list_add(&r->deletes, child, NULL);
+    else
+      ret = plan_entry(r, child, cmp == 0);
+    if (cmp <= 0)
+      i++;
+    if (cmp >= 0)
+      j++;
+  }
+  free_names(bck, nb);
+  free_names(src, ns);
+  return ret;
+}
+
+static int do_delete(Restore *r, const RestoreAction *a) {
+  char path[PATH_MAX];
+  if (join_path(path, r->src_real, a->rel) < 0)
+    return -1;
+  return rm_tree(path);
+}
+
+// created writable for the files still to come, the mode is set afterwards
+static int do_mkdir(Restore *r, const RestoreAction *a) {
+  char path[PATH_MAX];
+  if (!S_ISDIR(a->mode) || join_path(path, r->src_real, a->rel) < 0)
+    return 0;
+  if (mkdir(path, (a->mode & 0777) | S_IRWXU) < 0 && errno != EEXIST) {
+    perror("mkdir(restore)");
+    return -1;
+  }
+  return 0;
+}
+
+static int do_chmod(Restore *r, const RestoreAction *a) {
+  char path[PATH_MAX];
+  if (join_path(path, r->src_real, a->rel) < 0)
+    return -1;
+  if (chmod(path, a->mode & 0777) < 0) {
+    perror("chmod(restore)");
+    return -1;
+  }
+  return 0;
+}
+
+// 1 when the source file turned out identical to the backup and was kept
+// (taking the backup's mtime and mode), 0 when it is to be replaced
+static int verify_file(Restore *r, const RestoreAction *a,
+                       const char *bck_path, const char *src_path) {
+  // a packed backup file has its contents' hash at hand
+  uint64_t want, have;
+  int got = r->links.compress ? compress_content_hash(bck_path, &want)
+                              : hash_cache_file(r->hashes, bck_path, &want);
+  if (got < 0 ||
+      hash_cache_file(r->hashes, src_path, &have) < 0 || want != have) {
+    if (unlink(src_path) < 0 && errno != ENOENT) {
+      perror("unlink(restore verify)");
+      return -1;
+    }
+    return 0;
+  }
+
+  struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, a->mtime};
+  struct stat st;
+  if (utimensat(AT_FDCWD, src_path, times, AT_SYMLINK_NOFOLLOW) < 0) {
+    perror("utimensat(restore verify)");
+    return -1;
+  }
+  if (lstat(src_path, &st) < 0) {
+    perror("lstat(restore verify)");
+    return -1;
+  }
+  if ((st.st_mode & 0777) != (a->mode & 0777)) {
+    if (chmod(src_path, a->mode & 0777) < 0) {
+      perror("chmod(restore verify)");
+      return -1;
+    }
+    if (lstat(src_path, &st) < 0) {
+      perror("lstat(restore verify)");
+      return -1;
+    }
+  }
+  // both calls moved the ctime: remember the file as it is now
+  hash_cache_put(r->hashes, &st, have);
+  return 1;
+}
+
+static int do_copy(Restore *r, const RestoreAction *a) {
+  char bck_path[PATH_MAX], src_path[PATH_MAX];
+  if (join_path(bck_path, r->backup_real, a->rel) < 0 ||
+      join_path(src_path, r->src_real, a->rel) < 0)
+    return -1;
+  if (a->verify) {
+    int same = verify_file(r, a, bck_path, src_path);
+    if (same != 0) {
+      if (same > 0)
+        atomic_fetch_add(&r->identical, 1);
+      return same < 0 ? -1 : 0;
+    }
+  }
+  if (S_ISLNK(a->mode))
+    return copy_symplink_rewrite(bck_path, src_path, r->backup_real,
+                                 r->src_real);
+
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = a->mode;
+  st.st_size = a->size;
+  st.st_dev = a->dev;
+  st.st_ino = a->ino;
+  st.st_nlink = a->nlink;
+  int ret = link_or_copy(&r->links, bck_path, src_path, &st, r->stop_flag);
+  if (ret > 0) {
+    atomic_fetch_add(&r->linked, 1);
+  } else if (ret == 0) {
+    atomic_fetch_add(&r->copied, 1);
+    atomic_fetch_add(&r->bytes_copied, (unsigned long long)a->size);
+  }
+  return ret < 0 ? -1 : 0;
+}
+
+static void *worker_main(void *arg) {
+  Restore *r = arg;
+  while (!*r->stop_flag) {
+    size_t i = atomic_fetch_add(&r->next, 1);
+    if (i >= r->run->count)
+      break;
+    const RestoreAction *a = &r->run->items[i];
+    if (r->fn(r, a) < 0 && !*r->stop_flag)
+      atomic_fetch_add(&r->failed, 1);
+    atomic_fetch_add(&r->bytes_done, (unsigned long long)a->size);
+    atomic_fetch_add(&r->done, 1);
+  }
+  pthread_mutex_lock(&r->lock);
+  if (--r->running == 0)
+    pthread_cond_signal(&r->finished);
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+static unsigned long long total_bytes(const ActionList *l) {
+  unsigned long long sum = 0;
+  for (size_t i = 0; i < l->count; i++)
+    sum += (unsigned long long)l->items[i].size;
+  return sum;
+}
+
+// one line of "what, how far, how long still"; the estimate is the slower
+// of the file count and byte count rates, so both many small files and a
+// few big ones are covered
+static void report_progress(Restore *r, const char *what, uint64_t started,
+                            unsigned long long bytes_total) {
+  size_t done = atomic_load(&r->done);
+  unsigned long long bytes = atomic_load(&r->bytes_done);
+  double elapsed = (double)(now_ns() - started) / 1e9;
+  double eta = 0;
+  if (done > 0)
+    eta = elapsed * (double)(r->run->count - done) / (double)done;
+  if (bytes > 0 && bytes_total > bytes) {
+    double eta_bytes = elapsed * (double)(bytes_total - bytes) / (double)bytes;
+    if (eta_bytes > eta)
+      eta = eta_bytes;
+  }
+
+  if (bytes_total > 0) {
+    fprintf(stderr,
+            "restore: %s %zu/%zu, %llu/%llu MiB, %.0f MiB/s, ETA %.0f s\n",
+            what, done, r->run->count, bytes >> 20, bytes_total >> 20,
+            elapsed > 0 ? (double)(bytes >> 20) / elapsed : 0.0, eta);
+  } else {
+    fprintf(stderr, "restore: %s %zu/%zu, ETA %.0f s\n", what, done,
+            r->run->count, eta);
+  }
+}
+
+// applies every action of l with up to threads workers; the calling thread
+// reports progress meanwhile
+static void run_phase(Restore *r, const ActionList *l, ActionFn fn,
+                      int threads, const char *what) {
+  if (l->count == 0 || *r->stop_flag)
+    return;
+  r->run = l;
+  r->fn = fn;
+  atomic_store(&r->next, 0);
+  atomic_store(&r->done, 0);
+  atomic_store(&r->bytes_done, 0);
+  if ((size_t)threads > l->count)
+    threads = (int)l->count;
+
+  pthread_t *tids = calloc((size_t)threads, sizeof(*tids));
+  int started = 0;
+  if (tids) {
+    // signals stay with the calling thread, the workers' syscalls are not
+    // interrupted by them
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_mutex_lock(&r->lock);
+    for (; started < threads; started++) {
+      if (pthread_create(&tids[started], NULL, worker_main, r) != 0)
+        break;
+      r->running++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+  if (started == 0) {
+    // no threads to be had: the work still gets done, just sequentially
+    r->running = 1;
+    worker_main(r);
+  }
+
+  unsigned long long bytes_total = total_bytes(l);
+  uint64_t phase_start = now_ns();
+  pthread_mutex_lock(&r->lock);
+  while (r->running > 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += PROGRESS_INTERVAL_SEC;
+    if (pthread_cond_timedwait(&r->finished, &r->lock, &deadline) ==
+            ETIMEDOUT &&
+        r->running > 0)
+      report_progress(r, what, phase_start, bytes_total);
+  }
+  pthread_mutex_unlock(&r->lock);
+  for (int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+}
+
+// biggest files first, so the long copies don't end up trailing alone
+static int cmp_size_desc(const void *a, const void *b) {
+  const RestoreAction *x = a, *y = b;
+  return (x->size < y->size) - (x->size > y->size);
+}
+
+int restore_tree(const char *backup_real, const char *src_real,
+                 const RestoreOptions *opts, RestoreStats *stats,
+                 volatile sig_atomic_t *stop_flag) {
+  Restore r;
+  memset(&r, 0, sizeof(r));
+  memset(stats, 0, sizeof(*stats));
+  // a generation is restored like the target itself; metadata (manifest,
+  // dedup marker, hash cache) is only kept for the live target
+  char snap_real[PATH_MAX];
+  const char *tree = backup_real;
+  if (opts->snapshot[0]) {
+    if (snapshot_path(backup_real, opts->snapshot, snap_real) < 0) {
+      fprintf(stderr, "restore: no snapshot %s of \"%s\"\n", opts->snapshot,
+              backup_real);
+      return -1;
+    }
+    tree = snap_real;
+  }
+  r.backup_real = tree;
+  r.src_real = src_real;
+  r.stats = stats;
+  r.stop_flag = stop_flag;
+  link_map_init(&r.links, tree, src_real);
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&r.finished, &attr);
+  pthread_condattr_destroy(&attr);
+  // without a trusted manifest every backup entry is lstat'ed
+  Manifest *man = opts->snapshot[0] ? NULL : manifest_open(backup_real);
+  if (manifest_trusted(man))
+    r.man = man;
+  r.dedup = dedup_store_marked(backup_real);
+  // packed files are unpacked on the way back
+  if (compress_marked(backup_real))
+    r.links.compress = COMPRESS_UNPACK;
+  HashCache hashes;
+  char cache_path[PATH_MAX];
+  if (opts->verify) {
+    // an unusable cache file only costs the rehashing, it is not saved
+    if (snprintf(cache_path, PATH_MAX, "%s.meta/hash-cache", backup_real) >=
+        PATH_MAX)
+      cache_path[0] = '\0';
+    if (hash_cache_open(&hashes, cache_path) < 0)
+      hashes.path[0] = '\0';
+    r.hashes = &hashes;
+  }
+
+  uint64_t started = now_ns();
+  int ret = plan_dir(&r, "", 1);
+  if (ret == 0) {
+    size_t verify = 0;
+    for (size_t i = 0; i < r.files.count; i++)
+      verify += (size_t)r.files.items[i].verify;
+    fprintf(stderr,
+            "restore: plan has %zu deletions, %zu directories, %zu files "
+            "(%llu MiB, %zu to verify), %llu kept\n",
+            r.deletes.count, r.dirs.count, r.files.count,
+            total_bytes(&r.files) >> 20, verify, stats->kept);
+    if (r.files.count > 1)
+      qsort(r.files.items, r.files.count, sizeof(*r.files.items),
+            cmp_size_desc);
+
+    run_phase(&r, &r.deletes, do_delete, opts->threads, "deleting");
+    stats->deleted = r.deletes.count - atomic_load(&r.failed);
+    if (*stop_flag)
+      stats->deleted = atomic_load(&r.done);
+    // parents come before their children in the plan
+    run_phase(&r, &r.dirs, do_mkdir, 1, "creating directories");
+    run_phase(&r, &r.files, do_copy, opts->threads, "copying");
+    run_phase(&r, &r.dirs, do_chmod, 1, "setting modes");
+
+    stats->linked = atomic_load(&r.linked);
+    stats->failed = atomic_load(&r.failed);
+    stats->files_copied = atomic_load(&r.copied);
+    stats->bytes_copied = atomic_load(&r.bytes_copied);
+    stats->identical = atomic_load(&r.identical);
+    stats->kept += stats->identical;
+    if (*stop_flag || stats->failed)
+      ret = -1;
+    if (r.hashes) {
+      fprintf(stderr,
+              "restore: verified %zu files, %llu identical, hash cache %llu "
+              "hits, %llu misses\n",
+              verify, stats->identical, hashes.hits, hashes.misses);
+    }
+    fprintf(stderr,
+            "restore: deleted %llu, copied %llu files (%llu bytes), linked "
+            "%llu, kept %llu, %llu failed, took %llu ms\n",
+            stats->deleted, stats->files_copied, stats->bytes_copied,
+            stats->linked, stats->kept, stats->failed,
+            (unsigned long long)((now_ns() - started) / 1000000));
+  }
+
+  list_free(&r.deletes);
+  list_free(&r.dirs);
+  list_free(&r.files);
+  link_map_free(&r.links);
+  pthread_cond_destroy(&r.finished);
+  pthread_mutex_destroy(&r.lock);
+  manifest_close(man);
+  if (r.hashes) {
+    if (hashes.path[0])
+      hash_cache_save(&hashes);
+    hash_cache_free(&hashes);
+  }
+  return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <signal.h>  // sig_atomic_t
+
+#include "options.h"
+
+typedef struct {
+  unsigned long long deleted;      // entries removed from the source
+  unsigned long long files_copied;
+  unsigned long long bytes_copied;
+  unsigned long long linked;       // hard links recreated instead of copies
+  unsigned long long kept;         // already matched the backup
+  unsigned long long identical;    // of those, found equal by content hash
+  unsigned long long failed;       // entries that could not be restored
+} RestoreStats;
+
+// Makes src_real a copy of the backup backup_real. Both trees are walked
+// once, side by side over sorted directory listings, to build a plan:
+// what to delete from the source, which directories to create and which
+// files and symlinks to copy (regular files matching by size and mtime are
+// kept; with opts->verify, ones matching only in size are hashed and kept
+// when identical, through a hash cache next to the manifest). The plan is
+// then applied by opts->threads workers, deletions first, with progress on
+// stderr. A trusted manifest of the backup stands in for lstat on the
+// backup side. Hard links of the backup are restored as links, except in a
+// --dedup target, where they only mean equal contents. Files of a
+// --compress target are unpacked. With opts->snapshot
+// the generation of that id is restored instead of the target as it is.
+// Returns -1 when stopped or when any entry failed (the rest is still
+// restored).
+int restore_tree(const char *backup_real, const char *src_real,
+                 const RestoreOptions *opts, RestoreStats *stats,
+                 volatile sig_atomic_t *stop_flag);
+
+#endif
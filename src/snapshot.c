@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesystem_utils.h"
+
+// a generation still being built; leftovers of a crash are removed
+#define PARTIAL_PREFIX ".partial-"
+
+static int snap_root(const char *dst_real, char out[PATH_MAX]) {
+  if (snprintf(out, PATH_MAX, "%s" SNAPSHOT_DIR_SUFFIX, dst_real) >=
+      PATH_MAX) {
+    fprintf(stderr, "Name too long(snapshot)\n");
+    return -1;
+  }
+  return 0;
+}
+
+// "YYYYMMDD-HHMMSS", maybe followed by "-N"
+static int valid_id(const char *name) {
+  size_t n = strlen(name);
+  if (n != 15 && n != 17)
+    return 0;
+  for (size_t i = 0; i < 15; i++) {
+    if (i == 8 ? name[i] != '-' : !isdigit((unsigned char)name[i]))
+      return 0;
+  }
+  return n == 15 || (name[15] == '-' && isdigit((unsigned char)name[16]));
+}
+
+// mirrors live_dir into snap_dir with links; live_real and snap_final are
+// the roots symlinks are rewritten between
+static int link_tree(const char *live_dir, const char *snap_dir,
+                     const char *live_real, const char *snap_final,
+                     volatile sig_atomic_t *stop_flag) {
+  DIR *d = opendir(live_dir);
+  if (!d) {
+    perror("opendir(snapshot)");
+    return -1;
+  }
+
+  int ret = 0;
+  struct dirent *entity;
+  while (ret == 0 && (entity = readdir(d)) != NULL) {
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+    if (*stop_flag) {
+      ret = -1;
+      break;
+    }
+    char live[PATH_MAX], snap[PATH_MAX];
+    if (snprintf(live, PATH_MAX, "%s/%s", live_dir, entity->d_name) >=
+            PATH_MAX ||
+        snprintf(snap, PATH_MAX, "%s/%s", snap_dir, entity->d_name) >=
+            PATH_MAX) {
+      fprintf(stderr, "Name too long(snapshot)\n");
+      ret = -1;
+      break;
+    }
+    struct stat st;
+    if (lstat(live, &st) < 0) {
+      // removed by the target meanwhile
+      if (errno != ENOENT) {
+        perror("lstat(snapshot)");
+        ret = -1;
+      }
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      if (mkdir(snap, 0700) < 0) {
+        perror("mkdir(snapshot)");
+        ret = -1;
+        break;
+      }
+      ret = link_tree(live, snap, live_real, snap_final, stop_flag);
+      // the generation is never written to again: the real mode can go on
+      if (ret == 0 && chmod(snap, st.st_mode & 0777) < 0) {
+        perror("chmod(snapshot)");
+        ret = -1;
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      // a file with as many links as the filesystem allows gets a copy
+      if (link(live, snap) < 0 &&
+          (errno != EMLINK || copy_file(live, snap, st.st_mode, stop_flag) < 0)) {
+        if (errno != ENOENT) {
+          perror("link(snapshot)");
+          ret = -1;
+        }
+      }
+    } else if (S_ISLNK(st.st_mode)) {
+      ret = copy_symplink_rewrite(live, snap, live_real, snap_final);
+    }
+  }
+  closedir(d);
+  return ret;
+}
+
+static void remove_partials(const char *root) {
+  DIR *d = opendir(root);
+  if (!d)
+    return;
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    if (strncmp(entity->d_name, PARTIAL_PREFIX, strlen(PARTIAL_PREFIX)) != 0 ||
+        snprintf(path, PATH_MAX, "%s/%s", root, entity->d_name) >= PATH_MAX)
+      continue;
+    chmod(path, 0700);
+    rm_tree(path);
+  }
+  closedir(d);
+}
+
+int snapshot_create(const char *dst_real, char id[SNAPSHOT_ID_MAX],
+                    volatile sig_atomic_t *stop_flag) {
+  char root[PATH_MAX], final[PATH_MAX], partial[PATH_MAX];
+  if (snap_root(dst_real, root) < 0)
+    return -1;
+  if (mkdir(root, 0700) < 0 && errno != EEXIST) {
+    perror("mkdir(snapshot root)");
+    return -1;
+  }
+  remove_partials(root);
+
+  time_t now = time(NULL);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  char base[16];
+  strftime(base, sizeof(base), "%Y%m%d-%H%M%S", &tm);
+  struct stat st;
+  int n = 0;
+  for (; n < 10; n++) {
+    if (n == 0)
+      snprintf(id, SNAPSHOT_ID_MAX, "%s", base);
+    else
+      snprintf(id, SNAPSHOT_ID_MAX, "%s-%d", base, n);
+    if (snprintf(final, PATH_MAX, "%s/%s", root, id) >= PATH_MAX ||
+        snprintf(partial, PATH_MAX, "%s/" PARTIAL_PREFIX "%s", root, id) >=
+            PATH_MAX) {
+      fprintf(stderr, "Name too long(snapshot)\n");
+      return -1;
+    }
+    if (lstat(final, &st) < 0 && errno == ENOENT)
+      break;
+  }
+  if (n == 10) {
+    fprintf(stderr, "snapshot: too many generations this second\n");
+    return -1;
+  }
+
+  if (mkdir(partial, 0700) < 0) {
+    perror("mkdir(snapshot)");
+    return -1;
+  }
+  if (link_tree(dst_real, partial, dst_real, final, stop_flag) < 0 ||
+      chmod(partial, 0555) < 0 || rename(partial, final) < 0) {
+    if (!*stop_flag)
+      fprintf(stderr, "snapshot of \"%s\" failed\n", dst_real);
+    chmod(partial, 0700);
+    rm_tree(partial);
+    return -1;
+  }
+  return 0;
+}
+
+static int cmp_ids(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int snapshot_list(const char *dst_real, char ***ids, size_t *count) {
+  *ids = NULL;
+  *count = 0;
+  char root[PATH_MAX];
+  if (snap_root(dst_real, root) < 0)
+    return -1;
+  DIR *d = opendir(root);
+  if (!d)
+    return errno == ENOENT ? 0 : -1;
+
+  char **list = NULL;
+  size_t n = 0, cap = 0;
+  int ret = 0;
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    if (!valid_id(entity->d_name))
+      continue;
+    if (n == cap) {
+      size_t new_cap = cap ? cap * 2 : 16;
+      char **new_list = realloc(list, new_cap * sizeof(*list));
+      if (!new_list) {
+        ret = -1;
+        break;
+      }
+      list = new_list;
+      cap = new_cap;
+    }
+    if (!(list[n] = strdup(entity->d_name))) {
+      ret = -1;
+      break;
+    }
+    n++;
+  }
+  closedir(d);
+  if (ret < 0) {
+    fprintf(stderr, "snapshot listing failed\n");
+    snapshot_list_free(list, n);
+    return -1;
+  }
+  // list is NULL when there are no snapshots yet
+  if (n > 1)
+    qsort(list, n, sizeof(*list), cmp_ids);
+  *ids = list;
+  *count = n;
+  return 0;
+}
+
+void snapshot_list_free(char **ids, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    free(ids[i]);
+  free(ids);
+}
+
+int snapshot_path(const char *dst_real, const char *id, char out[PATH_MAX]) {
+  char root[PATH_MAX];
+  struct stat st;
+  if (!valid_id(id) || snap_root(dst_real, root) < 0 ||
+      snprintf(out, PATH_MAX, "%s/%s", root, id) >= PATH_MAX ||
+      lstat(out, &st) < 0 || !S_ISDIR(st.st_mode))
+    return -1;
+  return 0;
+}
+
+int snapshot_prune(const char *dst_real, int keep_hourly, int keep_daily) {
+  if (keep_hourly <= 0 && keep_daily <= 0)
+    return 0;
+  char **ids;
+  size_t count;
+  if (snapshot_list(dst_real, &ids, &count) < 0)
+    return -1;
+
+  // newest first: each hour (day) seen starts with its newest generation
+  int hours = 0, days = 0, removed = 0;
+  const char *last_hour = NULL, *last_day = NULL;
+  for (size_t i = count; i-- > 0;) {
+    const char *id = ids[i];
+    int keep = 0;
+    if (!last_hour || strncmp(id, last_hour, 11) != 0) {
+      last_hour = id;
+      keep |= ++hours <= keep_hourly;
+    }
+    if (!last_day || strncmp(id, last_day, 8) != 0) {
+      last_day = id;
+      keep |= ++days <= keep_daily;
+    }
+    char path[PATH_MAX];
+    if (keep || snapshot_path(dst_real, id, path) < 0)
+      continue;
+    chmod(path, 0700);
+    if (rm_tree(path) == 0)
+      removed++;
+  }
+  snapshot_list_free(ids, count);
+  return removed;
+}
@@ -0,0 +1,37 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <signal.h>  // sig_atomic_t
+#include <stddef.h>  // size_t
+
+#include "config.h"
+
+// generations of a target live next to it, in <dst_real>.snap/<id>
+#define SNAPSHOT_DIR_SUFFIX ".snap"
+// "YYYYMMDD-HHMMSS" in UTC, "-N" appended for more than one per second, so
+// ids sort in the order they were taken
+#define SNAPSHOT_ID_MAX 32
+
+// Freezes the target dst_real as a new generation: a tree of directories
+// and hard links to the target's files, symlinks into the target pointing
+// into the generation instead. Built under a temporary name and renamed
+// into place, so a generation is either complete or absent; its top
+// directory is read-only. The target stays frozen in it because nothing
+// writes to a target file whose link count is above its source's: such a
+// file is replaced instead (see copy_file_from_fd).
+int snapshot_create(const char *dst_real, char id[SNAPSHOT_ID_MAX],
+                    volatile sig_atomic_t *stop_flag);
+
+// Removes the generations that are not the newest one of one of the last
+// keep_hourly hours or keep_daily days that have any. Both 0 keeps all.
+// Returns how many were removed, or -1.
+int snapshot_prune(const char *dst_real, int keep_hourly, int keep_daily);
+
+// ids of dst_real's generations, oldest first; free with snapshot_list_free
+int snapshot_list(const char *dst_real, char ***ids, size_t *count);
+void snapshot_list_free(char **ids, size_t count);
+
+// where generation id of dst_real is; -1 when there is none
+int snapshot_path(const char *dst_real, const char *id, char out[PATH_MAX]);
+
+#endif
@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+#include "sync_tree.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "config.h"
+#include "filesystem_utils.h"
+#include "hash.h"
+
+// what a sync (or one step of a scan) works with
+typedef struct {
+  const char *src_real;
+  const char *dst_real;
+  int checksum;
+  LinkMap *links;
+  Manifest *man;
+  int trusted;   // the manifest lists the target's entries this pass
+  SyncStats *stats;
+  volatile sig_atomic_t *stop_flag;
+} SyncCtx;
+
+// the manifest answers which entries the target has instead of readdir;
+// --checksum is about what is really there, so it always looks. Decided
+// once per pass.
+static int trust_manifest(const Manifest *man, int checksum) {
+  return manifest_trusted(man) && !checksum;
+}
+
+// dst_path relative to the target root, the manifest's key
+static const char *dst_rel(const SyncCtx *c, const char *dst_path) {
+  return dst_path + strlen(c->dst_real) + 1;
+}
+
+static int same_mtime(const struct stat *a, const struct stat *b) {
+  return a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// the target file has links its source doesn't (a snapshot's): it is only
+// ever replaced, never changed in place
+static int shared_inode(const char *dst_path, const struct stat *src_st) {
+  struct stat st;
+  return lstat(dst_path, &st) == 0 && st.st_nlink > src_st->st_nlink;
+}
+
+// content hash of a target file; a packed one stands for its contents
+static int hash_dst(const SyncCtx *c, const char *dst_path, uint64_t *out) {
+  if (c->links && c->links->compress)
+    return compress_content_hash(dst_path, out);
+  return hash_file(dst_path, out);
+}
+
+// with checksum the target's hash comes from *dst_hash if have_dst_hash, or
+// is computed and left there; in_place says an off mtime may be fixed on
+// the target file
+static int file_up_to_date(const SyncCtx *c, const char *src_path,
+                           const char *dst_path, const struct stat *src_st,
+                           const struct stat *dst_st, uint64_t *dst_hash,
+                           int have_dst_hash, int in_place) {
+  if (src_st->st_size != dst_st->st_size)
+    return 0;
+  if (!c->checksum)
+    return same_mtime(src_st, dst_st);
+
+  uint64_t src_hash;
+  if (hash_file(src_path, &src_hash) < 0 ||
+      (!have_dst_hash && hash_dst(c, dst_path, dst_hash) < 0))
+    return 0;
+  if (src_hash != *dst_hash || (!in_place && !same_mtime(src_st, dst_st)))
+    return 0;
+
+  // same bytes, only the timestamp is off: fix it instead of copying
+  if (!same_mtime(src_st, dst_st)) {
+    if (shared_inode(dst_path, src_st))
+      return 0;
+    struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+    if (utimensat(AT_FDCWD, dst_path, times, AT_SYMLINK_NOFOLLOW) < 0) {
+      perror("utimensat(sync)");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int symlink_up_to_date(const char *src_path, const char *dst_path,
+                              const char *src_real, const char *dst_real) {
+  char want[PATH_MAX], have[PATH_MAX];
+  if (symlink_rewrite_target(src_path, src_real, dst_real, want) < 0)
+    return 0;
+  ssize_t n = readlink(dst_path, have, sizeof(have) - 1);
+  if (n < 0)
+    return 0;
+  have[n] = '\0';
+  return strcmp(want, have) == 0;
+}
+
+// the recorded hash still describes the target file if nothing about it
+// changed since
+static int manifest_hash_valid(const ManifestEntry *e,
+                               const struct stat *dst_st) {
+  return (e->flags & MANIFEST_HAS_HASH) && e->ino == dst_st->st_ino &&
+         e->size == dst_st->st_size &&
+         e->mtime_sec == dst_st->st_mtim.tv_sec &&
+         e->mtime_nsec == (uint32_t)dst_st->st_mtim.tv_nsec;
+}
+
+// the entry as recorded is the one on the target: same inode and type, and
+// for a file the same size and mtime
+static int manifest_current(const ManifestEntry *e,
+                            const struct stat *dst_st) {
+  if (e->ino != dst_st->st_ino || e->mode != dst_st->st_mode)
+    return 0;
+  return !S_ISREG(dst_st->st_mode) ||
+         (e->size == dst_st->st_size &&
+          e->mtime_sec == dst_st->st_mtim.tv_sec &&
+          e->mtime_nsec == (uint32_t)dst_st->st_mtim.tv_nsec);
+}
+
+// the entry was left alone (touch) or changed (record it again); a pass
+// that doesn't trust the manifest records everything, it may be missing
+static void note_entry(const SyncCtx *c, const char *dst_path, int changed) {
+  if (!c->man)
+    return;
+  // the manifest would hash a packed file as it is on disk
+  if (changed || !c->trusted)
+    manifest_record(c->man, dst_rel(c, dst_path), dst_path,
+                    c->checksum && !(c->links && c->links->compress));
+  else
+    manifest_touch(c->man, dst_rel(c, dst_path));
+}
+
+static int sync_dir(const SyncCtx *c, const char *src_dir, const char *dst_dir);
+
+// with recurse unset a directory is only created or fixed up, not entered
+static int sync_entry(const SyncCtx *c, const char *src_path,
+                      const char *dst_path, const struct stat *src_st,
+                      int recurse) {
+  ManifestEntry me = {0};
+  int have_me = c->man && manifest_get(c->man, dst_rel(c, dst_path), &me);
+  // even a trusted manifest only knows what the target held when it was
+  // written: anything changed there while we were stopped shows up here
+  struct stat dst_st;
+  int dst_exists = (lstat(dst_path, &dst_st) == 0);
+  if (!dst_exists && errno != ENOENT) {
+    perror("lstat(sync dst)");
+    return -1;
+  }
+  // the recorded entry is out of date, so it is recorded again even if the
+  // target entry can stay
+  int stale = dst_exists && (!have_me || !manifest_current(&me, &dst_st));
+
+  // a different kind of entry sits where this one should go
+  if (dst_exists && (dst_st.st_mode & S_IFMT) != (src_st->st_mode & S_IFMT)) {
+    if (rm_tree(dst_path) < 0)
+      return -1;
+    if (c->man)
+      manifest_remove(c->man, dst_rel(c, dst_path), 1);
+    c->stats->entries_removed++;
+    dst_exists = 0;
+  }
+
+  if (S_ISDIR(src_st->st_mode)) {
+    int changed = 1;
+    if (!dst_exists) {
+      if (mkdir(dst_path, src_st->st_mode & 0777) < 0 && errno != EEXIST) {
+        perror("mkdir(sync)");
+        return -1;
+      }
+    } else if ((dst_st.st_mode & 0777) != (src_st->st_mode & 0777)) {
+      chmod(dst_path, src_st->st_mode & 0777);
+    } else {
+      changed = 0;
+    }
+    note_entry(c, dst_path, changed || stale);
+    if (!recurse)
+      return 0;
+    return sync_dir(c, src_path, dst_path);
+  }
+
+  if (S_ISREG(src_st->st_mode)) {
+    // a file linked into a dedup store (or that should be) is relinked
+    // rather than touched up: its inode is shared with other targets
+    int stored = c->links && c->links->store;
+    uint64_t dst_hash = me.content_hash;
+    int have_hash = have_me && dst_exists && manifest_hash_valid(&me, &dst_st);
+    if (dst_exists &&
+        (!stored || (dst_st.st_nlink > 1 &&
+                     (dst_st.st_mode & 0777) == (src_st->st_mode & 0777))) &&
+        file_up_to_date(c, src_path, dst_path, src_st, &dst_st, &dst_hash,
+                        have_hash, !stored) &&
+        ((dst_st.st_mode & 0777) == (src_st->st_mode & 0777) ||
+         !shared_inode(dst_path, src_st))) {
+      int changed = 0;
+      if ((dst_st.st_mode & 0777) != (src_st->st_mode & 0777)) {
+        chmod(dst_path, src_st->st_mode & 0777);
+        changed = 1;
+      }
+      // an older target may hold separate copies of what is one file in the
+      // source; the first one found is kept and the others are linked to it
+      if (c->links && !stored) {
+        if (link_map_link(c->links, src_st, dst_path) == 1)
+          changed = 1;
+        else
+          link_map_add(c->links, src_st, dst_path);
+      }
+      if (c->man && c->checksum) {
+        // the hash just computed saves reading the target next time
+        manifest_record(c->man, dst_rel(c, dst_path), dst_path, 0);
+        manifest_set_hash(c->man, dst_rel(c, dst_path), dst_hash);
+      } else {
+        note_entry(c, dst_path, changed || stale);
+      }
+      if (c->links)
+        live_kept(c->links->live, (unsigned long long)src_st->st_size);
+      c->stats->entries_kept++;
+      return 0;
+    }
+    int ret = link_or_copy(c->links, src_path, dst_path, src_st, c->stop_flag);
+    note_entry(c, dst_path, 1);
+    if (ret < 0)
+      return -1;
+    if (ret > 0) {
+      c->stats->entries_kept++;
+      return 0;
+    }
+    c->stats->files_copied++;
+    c->stats->bytes_copied += (unsigned long long)src_st->st_size;
+    return 0;
+  }
+
+  if (S_ISLNK(src_st->st_mode)) {
+    if (dst_exists && symlink_up_to_date(src_path, dst_path, c->src_real,
+                                         c->dst_real)) {
+      note_entry(c, dst_path, stale);
+      c->stats->entries_kept++;
+      return 0;
+    }
+    int ret = copy_symplink_rewrite(src_path, dst_path, c->src_real,
+                                    c->dst_real);
+    note_entry(c, dst_path, 1);
+    return ret;
+  }
+
+  fprintf(stderr, "Skipping unsupported file type: %s\n", src_path);
+  return 0;
+}
+
+// deletes dst_dir/name unless src_dir still has it
+static int remove_extra(const SyncCtx *c, const char *src_dir,
+                        const char *dst_dir, const char *name) {
+  char src_path[PATH_MAX], dst_path[PATH_MAX];
+  if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, name) >= PATH_MAX ||
+      snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, name) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(remove_extras)\n");
+    return -1;
+  }
+
+  struct stat st;
+  if (lstat(src_path, &st) == 0)
+    return 0;
+  if (errno != ENOENT) {
+    perror("lstat(remove_extras)");
+    return -1;
+  }
+  if (rm_tree(dst_path) < 0)
+    return -1;
+  if (c->man)
+    manifest_remove(c->man, dst_rel(c, dst_path), 1);
+  c->stats->entries_removed++;
+  return 0;
+}
+
+// deletes whatever dst_dir holds that src_dir doesn't
+static int remove_extras(const SyncCtx *c, const char *src_dir,
+                         const char *dst_dir) {
+  DIR *d = opendir(dst_dir);
+  if (!d) {
+    perror("opendir(dst_dir)");
+    return -1;
+  }
+
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+    if (remove_extra(c, src_dir, dst_dir, entity->d_name) < 0) {
+      closedir(d);
+      return -1;
+    }
+  }
+
+  if (closedir(d) < 0) {
+    perror("closedir");
+    return -1;
+  }
+  return 0;
+}
+
+static int sync_dir(const SyncCtx *c, const char *src_dir,
+                    const char *dst_dir) {
+  DIR *d = opendir(src_dir);
+  if (!d) {
+    perror("opendir(src_dir)");
+    return -1;
+  }
+
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL) {
+    if (*c->stop_flag) {
+      closedir(d);
+      return -1;
+    }
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+
+    char src_path[PATH_MAX], dst_path[PATH_MAX];
+    if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >=
+            PATH_MAX ||
+        snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >=
+            PATH_MAX) {
+      closedir(d);
+      fprintf(stderr, "Name too long(sync_tree)\n");
+      return -1;
+    }
+
+    struct stat st;
+    if (lstat(src_path, &st) < 0) {
+      if (errno == ENOENT)
+        continue; // deleted under us, the monitor will catch up
+      perror("lstat(sync src)");
+      closedir(d);
+      return -1;
+    }
+
+    if (sync_entry(c, src_path, dst_path, &st, 1) < 0) {
+      closedir(d);
+      return -1;
+    }
+  }
+
+  if (closedir(d) < 0) {
+    perror("closedir");
+    return -1;
+  }
+  // with a trusted manifest the extras are whatever the pass didn't see
+  if (c->trusted)
+    return 0;
+  return remove_extras(c, src_dir, dst_dir);
+}
+
+// manifest_sweep callback: an entry the pass didn't see is gone from the
+// source
+static void remove_unseen(void *arg, const char *rel) {
+  const SyncCtx *c = arg;
+  char dst_path[PATH_MAX];
+  struct stat st;
+  // a directory's entries come up after the directory itself is gone
+  if (snprintf(dst_path, PATH_MAX, "%s/%s", c->dst_real, rel) >= PATH_MAX ||
+      lstat(dst_path, &st) < 0)
+    return;
+  if (rm_tree(dst_path) == 0)
+    c->stats->entries_removed++;
+}
+
+// after a complete pass: with a trusted manifest whatever it still lists
+// that the pass didn't see is an extra; otherwise the extras were removed
+// on the way and only the stale entries go. Either way the manifest now
+// matches the target.
+static void finish_pass(const SyncCtx *c) {
+  manifest_sweep(c->man, c->trusted ? remove_unseen : NULL, (void *)c);
+  manifest_set_trusted(c->man, 1);
+}
+
+int sync_tree(const char *src_real, const char *dst_real, int checksum,
+              LinkMap *links, Manifest *man, SyncStats *stats,
+              volatile sig_atomic_t *stop_flag) {
+  SyncCtx c = {src_real, dst_real, checksum, links, man,
+               trust_manifest(man, checksum), stats, stop_flag};
+  if (man)
+    manifest_begin_pass(man);
+  if (sync_dir(&c, src_real, dst_real) < 0)
+    return -1;
+  if (man)
+    finish_pass(&c);
+  return 0;
+}
+
+// scan state: a stack of directories still to visit and the one being read;
+// each directory is read twice, the source for updates, then the target for
+// extras (unless a trusted manifest finds those at the end)
+struct SyncScan {
+  SyncCtx c;
+  void (*on_dir)(void *arg, const char *src_dir);
+  void *arg;
+  int failed;   // an entry could not be synced, so no sweep at the end
+
+  char **stack; // source directories, relative to src_real ("" = root)
+  size_t stack_count;
+  size_t stack_capacity;
+
+  DIR *d;
+  int reading_dst;
+  char src_dir[PATH_MAX];
+  char dst_dir[PATH_MAX];
+};
+
+static int scan_push(SyncScan *scan, const char *rel) {
+  if (scan->stack_count == scan->stack_capacity) {
+    size_t new_cap = scan->stack_capacity ? scan->stack_capacity * 2 : 64;
+    char **new_stack = realloc(scan->stack, new_cap * sizeof(*new_stack));
+    if (!new_stack) {
+      fprintf(stderr, "sync scan realloc failed\n");
+      return -1;
+    }
+    scan->stack = new_stack;
+    scan->stack_capacity = new_cap;
+  }
+  char *copy = strdup(rel);
+  if (!copy)
+    return -1;
+  scan->stack[scan->stack_count++] = copy;
+  return 0;
+}
+
+SyncScan *sync_scan_start(const char *src_real, const char *dst_real,
+                          int checksum, LinkMap *links, Manifest *man,
+                          void (*on_dir)(void *arg, const char *src_dir),
+                          void *arg) {
+  SyncScan *scan = calloc(1, sizeof(*scan));
+  if (!scan) {
+    fprintf(stderr, "sync scan calloc failed\n");
+    return NULL;
+  }
+  scan->c.src_real = src_real;
+  scan->c.dst_real = dst_real;
+  scan->c.checksum = checksum;
+  scan->c.links = links;
+  scan->c.man = man;
+  scan->c.trusted = trust_manifest(man, checksum);
+  scan->on_dir = on_dir;
+  scan->arg = arg;
+  if (scan_push(scan, "") < 0) {
+    sync_scan_free(scan);
+    return NULL;
+  }
+  if (man)
+    manifest_begin_pass(man);
+  return scan;
+}
+
+// opens the next directory from the stack; 0 when the stack is empty
+static int scan_next_dir(SyncScan *scan) {
+  const char *src_real = scan->c.src_real;
+  const char *dst_real = scan->c.dst_real;
+  while (scan->stack_count > 0) {
+    char *rel = scan->stack[--scan->stack_count];
+    int n = rel[0] ? snprintf(scan->src_dir, PATH_MAX, "%s/%s", src_real, rel)
+                   : snprintf(scan->src_dir, PATH_MAX, "%s", src_real);
+    int m = 0;
+    if (dst_real)
+      m = rel[0] ? snprintf(scan->dst_dir, PATH_MAX, "%s/%s", dst_real, rel)
+                 : snprintf(scan->dst_dir, PATH_MAX, "%s", dst_real);
+    free(rel);
+    if (n >= PATH_MAX || m >= PATH_MAX)
+      continue;
+
+    scan->d = opendir(scan->src_dir);
+    if (!scan->d)
+      continue; // gone since it was queued; its events cover it
+    scan->reading_dst = 0;
+    if (scan->on_dir)
+      scan->on_dir(scan->arg, scan->src_dir);
+    return 1;
+  }
+  return 0;
+}
+
+static int scan_entry(SyncScan *scan, const char *name) {
+  if (scan->reading_dst)
+    return remove_extra(&scan->c, scan->src_dir, scan->dst_dir, name);
+
+  if (!scan->c.dst_real) {
+    // walk only: directories are pushed so on_dir sees them
+    char src_path[PATH_MAX];
+    struct stat st;
+    if (snprintf(src_path, PATH_MAX, "%s/%s", scan->src_dir, name) >= PATH_MAX ||
+        lstat(src_path, &st) < 0 || !S_ISDIR(st.st_mode))
+      return 0;
+    return scan_push(scan, src_path + strlen(scan->c.src_real) + 1);
+  }
+
+  char src_path[PATH_MAX], dst_path[PATH_MAX];
+  if (snprintf(src_path, PATH_MAX, "%s/%s", scan->src_dir, name) >= PATH_MAX ||
+      snprintf(dst_path, PATH_MAX, "%s/%s", scan->dst_dir, name) >= PATH_MAX) {
+    fprintf(stderr, "Name too long(sync scan)\n");
+    return -1;
+  }
+
+  struct stat st;
+  if (lstat(src_path, &st) < 0)
+    return 0; // deleted under us
+
+  if (sync_entry(&scan->c, src_path, dst_path, &st, 0) < 0)
+    return -1;
+  if (S_ISDIR(st.st_mode))
+    return scan_push(scan, src_path + strlen(scan->c.src_real) + 1);
+  return 0;
+}
+
+int sync_scan_step(SyncScan *scan, size_t budget, SyncStats *stats,
+                   volatile sig_atomic_t *stop_flag) {
+  scan->c.stats = stats;
+  scan->c.stop_flag = stop_flag;
+  while (budget > 0) {
+    if (*stop_flag)
+      return -1;
+    if (!scan->d && !scan_next_dir(scan)) {
+      if (scan->c.man && !scan->failed)
+        finish_pass(&scan->c);
+      return 0;
+    }
+
+    struct dirent *entity = readdir(scan->d);
+    if (!entity) {
+      closedir(scan->d);
+      scan->d = NULL;
+      if (!scan->reading_dst && scan->c.dst_real &&
+          !scan->c.trusted) {
+        scan->d = opendir(scan->dst_dir);
+        scan->reading_dst = 1;
+      }
+      continue;
+    }
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+
+    budget--;
+    // a failing entry is logged and skipped, the rest still gets fixed
+    if (scan_entry(scan, entity->d_name) < 0)
+      scan->failed = 1;
+  }
+  return 1;
+}
+
+void sync_scan_free(SyncScan *scan) {
+  if (!scan)
+    return;
+  if (scan->d)
+    closedir(scan->d);
+  for (size_t i = 0; i < scan->stack_count; i++)
+    free(scan->stack[i]);
+  free(scan->stack);
+  free(scan);
+}
@@ -0,0 +1,49 @@
+#ifndef SYNC_TREE_H
+#define SYNC_TREE_H
+
+#include <signal.h>  // sig_atomic_t
+#include <stddef.h>  // size_t
+
+#include "link_map.h"
+#include "manifest.h"
+
+typedef struct {
+  unsigned long long files_copied;
+  unsigned long long bytes_copied;
+  unsigned long long entries_kept;    // already up to date
+  unsigned long long entries_removed; // extras deleted from the target
+} SyncStats;
+
+// Brings an existing (possibly non-empty) dst_real in line with src_real:
+// entries that match by type, size and mtime are left alone (with checksum
+// set, regular files of equal size are compared by content instead), the
+// rest is copied and anything missing from the source is removed. With
+// links (may be NULL) files linked in the source end up linked in dst_real.
+// With man (may be NULL) every entry is recorded; a trusted manifest stands
+// in for readdir on the target (target entries are still lstat'ed), and a
+// completed pass leaves it trusted.
+int sync_tree(const char *src_real, const char *dst_real, int checksum,
+              LinkMap *links, Manifest *man, SyncStats *stats,
+              volatile sig_atomic_t *stop_flag);
+
+// Same reconciliation done a few entries at a time, so a running monitor can
+// interleave it with live events. on_dir (may be NULL) sees every source
+// directory as it is entered; with dst_real NULL the source is only walked
+// and stats may be NULL.
+typedef struct SyncScan SyncScan;
+
+SyncScan *sync_scan_start(const char *src_real, const char *dst_real,
+                          int checksum, LinkMap *links, Manifest *man,
+                          void (*on_dir)(void *arg, const char *src_dir),
+                          void *arg);
+// entries a rescan step handles before events or queued operations get a
+// turn again
+#define RESCAN_SLICE 256
+
+// Handles up to budget entries. Returns 1 while work is left, 0 once the
+// whole tree was visited, -1 when stopped.
+int sync_scan_step(SyncScan *scan, size_t budget, SyncStats *stats,
+                   volatile sig_atomic_t *stop_flag);
+void sync_scan_free(SyncScan *scan);
+
+#endif
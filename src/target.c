@@ -0,0 +1,757 @@
+#define _GNU_SOURCE
+#include "target.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "config.h"
+#include "dedup_store.h"
+#include "delta.h"
+#include "filesystem_utils.h"
+#include "io_utils.h"
+#include "link_map.h"
+#include "manifest.h"
+#include "mirror.h"
+#include "parallel_copy.h"
+#include "snapshot.h"
+#include "sync_tree.h"
+#include "uring_tree.h"
+
+struct SharedSource {
+  int fd;
+  atomic_int refs;
+};
+
+static atomic_int g_shared_open = 0;
+
+typedef struct TargetOp {
+  TargetOpKind kind;
+  int is_dir;
+  char *src_path;
+  char *src_old;        // OP_RENAME
+  SharedSource *shared; // OP_COPY, NULL: reopen src_path
+  uint64_t event_ns;    // event read at, 0 when not from an event
+  struct TargetOp *next;
+} TargetOp;
+
+struct Target {
+  const char *src_real;
+  char dst[PATH_MAX];      // as given by the user, identifies the target
+  char dst_real[PATH_MAX];
+  BackupOptions opts;
+  volatile sig_atomic_t stop;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;     // new operations or stop
+  TargetOp *head;
+  TargetOp *tail;
+  size_t queued;
+  int overflowed;          // the queue was dropped, a rescan replaces it
+  unsigned long long dropped;
+
+  // only touched by the target thread
+  DeltaCache dc;
+  LinkMap links;           // copies of files linked in the source
+  Manifest *manifest;      // what the target holds, NULL when none is kept
+  DedupStore *store;       // --dedup, also reachable as links.store
+  UringTree *uring;        // --io-uring, NULL when off or unavailable
+  SyncScan *rescan;
+  int rescan_again;        // more events were lost during the scan
+  SyncStats rescan_stats;
+  uint64_t rescan_started_ns;
+  uint64_t rescan_next_ns; // next slice may start at
+  unsigned long long rescans;
+  uint64_t rescan_last_ns;
+  uint64_t rescan_total_ns;
+  int snapshot_pending;      // asked for during a rescan, taken after it
+  uint64_t snapshot_next_ns; // next scheduled one, with --snapshot-every
+  unsigned long long store_unlinked; // target files gone since the last gc
+  uint64_t gc_next_ns;       // the earliest the store is collected again
+
+  // written by the target thread only, read by the watcher for `stats`
+  LatencyHist latency[LAT_KINDS];
+  LiveTarget *live;          // shared with the parent, NULL when none
+  atomic_int initial_done;   // stops the source count of the initial phase
+};
+
+SharedSource *shared_source_open(const char *path) {
+  if (atomic_fetch_add(&g_shared_open, 1) >= SHARED_SOURCE_MAX) {
+    atomic_fetch_sub(&g_shared_open, 1);
+    return NULL;
+  }
+
+  // O_NONBLOCK: a fifo must not hang the watcher before we see what it is
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  struct stat st;
+  SharedSource *s = NULL;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    s = malloc(sizeof(*s));
+  if (!s) {
+    if (fd >= 0)
+      close(fd);
+    atomic_fetch_sub(&g_shared_open, 1);
+    return NULL;
+  }
+  s->fd = fd;
+  atomic_init(&s->refs, 1);
+  return s;
+}
+
+void shared_source_put(SharedSource *s) {
+  if (!s || atomic_fetch_sub(&s->refs, 1) != 1)
+    return;
+  close(s->fd);
+  free(s);
+  atomic_fetch_sub(&g_shared_open, 1);
+}
+
+static void op_free(TargetOp *op) {
+  free(op->src_path);
+  free(op->src_old);
+  shared_source_put(op->shared);
+  free(op);
+}
+
+static void ops_free(TargetOp *op) {
+  while (op) {
+    TargetOp *next = op->next;
+    op_free(op);
+    op = next;
+  }
+}
+
+// for the parent's `list`; a source entry gone meanwhile is no error, its
+// delete is on the way
+static void copy_failed(Target *t, const char *what, const char *src_path) {
+  if (errno != ENOENT && !t->stop)
+    live_error(t->live, "%s %s: %s", what, src_path, strerror(errno));
+}
+
+// the shared descriptor is reopened through /proc, so every target reads at
+// its own offset and copy_fd can still clone or use copy_file_range
+static int copy_shared(Target *t, const SharedSource *s, const char *dst_path) {
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", s->fd);
+  int in = open(link, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    return -1;
+
+  struct stat st;
+  int ret = -1;
+  if (fstat(in, &st) == 0 && ensure_parent_dir(dst_path) == 0)
+    ret = copy_file_from_fd(in, &st, dst_path, &t->stop);
+  close(in);
+  if (ret == 0)
+    live_copied(t->live, (unsigned long long)st.st_size);
+  return ret;
+}
+
+static void copy_changed(Target *t, const TargetOp *op, const char *dst_path) {
+  // stored files are never written to, the new contents get linked
+  // instead; packed ones are written whole
+  if (t->store || t->links.compress) {
+    if (mirror_create_or_update(op->src_path, dst_path, t->src_real,
+                                t->dst_real, &t->links, &t->stop) < 0)
+      copy_failed(t, "cannot copy", op->src_path);
+    return;
+  }
+
+  // written through one of several names: that name joins the copy of the
+  // others first, so the new data reaches all of them
+  struct stat st;
+  int have_st = lstat(op->src_path, &st) == 0;
+  int linked = have_st && S_ISREG(st.st_mode) && st.st_nlink > 1;
+  if (linked)
+    link_map_link(&t->links, &st, dst_path);
+
+  // in delta mode only changed blocks are rewritten; anything the delta
+  // can't handle (new or small file, error) gets a full copy
+  unsigned long long written = t->dc.bytes_written;
+  if (t->opts.delta &&
+      delta_sync_file(&t->dc, op->src_path, dst_path, &t->stop) == 0) {
+    if (linked)
+      link_map_add(&t->links, &st, dst_path);
+    live_copied(t->live, t->dc.bytes_written - written);
+    return;
+  }
+  if (t->stop)
+    return;
+  delta_forget(&t->dc, dst_path, 0);
+  if (op->shared && copy_shared(t, op->shared, dst_path) == 0) {
+    if (linked)
+      link_map_add(&t->links, &st, dst_path);
+    return;
+  }
+  if (mirror_create_or_update(op->src_path, dst_path, t->src_real,
+                              t->dst_real, &t->links, &t->stop) < 0)
+    copy_failed(t, "cannot copy", op->src_path);
+}
+
+// objects whose last target file went away
+static void collect_garbage(Target *t) {
+  unsigned long long removed, bytes;
+  t->store_unlinked = 0;
+  t->gc_next_ns = now_ns() + DEDUP_GC_INTERVAL * 1000000000ull;
+  if (t->store && dedup_store_gc(t->store, &removed, &bytes) == 0 && removed)
+    fprintf(stderr, "target \"%s\": removed %llu unused objects (%llu bytes) "
+                    "from the dedup store\n", t->dst, removed, bytes);
+}
+
+// sizes up the source for the progress the parent shows, alongside the copy
+static void *count_source(void *arg) {
+  Target *t = arg;
+  live_count_source(t->live, t->src_real, &t->stop, &t->initial_done);
+  return NULL;
+}
+
+static void initial_copy(Target *t) {
+  uint64_t started = now_ns();
+  pthread_t counter;
+  int counting = t->live && pthread_create(&counter, NULL, count_source, t) == 0;
+  int ret;
+  if (t->opts.incremental) {
+    SyncStats stats = {0};
+    ret = sync_tree(t->src_real, t->dst_real, t->opts.checksum, &t->links,
+                    t->manifest, &stats, &t->stop);
+    if (ret == 0) {
+      fprintf(stderr,
+              "sync: copied %llu files (%llu bytes), kept %llu, removed %llu\n",
+              stats.files_copied, stats.bytes_copied, stats.entries_kept,
+              stats.entries_removed);
+    }
+    collect_garbage(t);
+  } else if (t->uring) {
+    ret = uring_copy_tree(t->uring, t->src_real, t->dst_real, t->src_real,
+                          t->dst_real, &t->links, &t->stop);
+  } else if (t->opts.threads > 1) {
+    ret = parallel_copy_tree(t->src_real, t->dst_real, t->src_real,
+                             t->dst_real, &t->links, t->opts.threads,
+                             &t->stop);
+  } else {
+    ret = copy_tree(t->src_real, t->dst_real, t->src_real, t->dst_real,
+                    &t->links, &t->stop);
+  }
+  atomic_store(&t->initial_done, 1);
+  if (counting)
+    pthread_join(counter, NULL);
+  if (ret < 0 && !t->stop)
+    live_error(t->live, "initial copy incomplete, some entries failed");
+  if (!t->opts.incremental && t->manifest) {
+    // the copy started from an empty target; a stopped one leaves the
+    // manifest untrusted, so the next start crawls instead
+    manifest_reset(t->manifest);
+    if (!t->stop && manifest_record_tree(t->manifest, "", t->dst_real, 0) == 0)
+      manifest_set_trusted(t->manifest, 1);
+  }
+  // from here on the target only follows events
+  live_phase(t->live, PHASE_LIVE);
+  if (!t->stop)
+    fprintf(stderr, "target \"%s\": initial copy done in %llu ms\n", t->dst,
+            (unsigned long long)((now_ns() - started) / 1000000));
+}
+
+// a generation of the target, old ones pruned by the retention policy
+static void take_snapshot(Target *t) {
+  // halfway through a rescan the target is no point in time of the source
+  if (t->rescan) {
+    t->snapshot_pending = 1;
+    return;
+  }
+  t->snapshot_pending = 0;
+  uint64_t started = now_ns();
+  char id[SNAPSHOT_ID_MAX];
+  if (snapshot_create(t->dst_real, id, &t->stop) < 0) {
+    live_error(t->live, "snapshot failed");
+    return;
+  }
+  fprintf(stderr, "target \"%s\": snapshot %s taken in %llu ms\n", t->dst, id,
+          (unsigned long long)((now_ns() - started) / 1000000));
+  int removed =
+      snapshot_prune(t->dst_real, t->opts.keep_hourly, t->opts.keep_daily);
+  if (removed > 0)
+    fprintf(stderr, "target \"%s\": removed %d old snapshots\n", t->dst,
+            removed);
+}
+
+static void rescan_start(Target *t) {
+  memset(&t->rescan_stats, 0, sizeof(t->rescan_stats));
+  t->rescan = sync_scan_start(t->src_real, t->dst_real, t->opts.checksum,
+                              &t->links, t->manifest, NULL, NULL);
+  if (!t->rescan) {
+    fprintf(stderr, "target \"%s\": cannot start rescan, re-add the backup\n",
+            t->dst);
+    live_error(t->live, "cannot start rescan, re-add the backup");
+  } else {
+    live_phase(t->live, PHASE_RESCAN);
+  }
+  t->rescan_again = 0;
+  t->rescan_started_ns = now_ns();
+  t->rescan_next_ns = t->rescan_started_ns;
+}
+
+static void rescan_request(Target *t) {
+  if (t->rescan) {
+    // the lost events may be in the part already scanned; finishing this
+    // pass first keeps repeated overflows from starving the scan
+    t->rescan_again = 1;
+    return;
+  }
+  rescan_start(t);
+}
+
+// one slice of the scan, paced to opts.rescan_rate entries per second
+static void rescan_step(Target *t, uint64_t now) {
+  int ret = sync_scan_step(t->rescan, RESCAN_SLICE, &t->rescan_stats, &t->stop);
+  t->rescan_next_ns =
+      now + (uint64_t)RESCAN_SLICE * 1000000000ull / (uint64_t)t->opts.rescan_rate;
+  if (ret > 0)
+    return;
+
+  sync_scan_free(t->rescan);
+  t->rescan = NULL;
+  live_phase(t->live, PHASE_LIVE);
+  if (ret < 0)
+    return;
+  if (t->rescan_again) {
+    rescan_start(t);
+    return;
+  }
+  collect_garbage(t);
+  t->rescans++;
+  t->rescan_last_ns = now_ns() - t->rescan_started_ns;
+  t->rescan_total_ns += t->rescan_last_ns;
+  fprintf(stderr,
+          "target \"%s\": in sync again after %llu ms (copied %llu, "
+          "removed %llu, kept %llu)\n",
+          t->dst, (unsigned long long)(t->rescan_last_ns / 1000000),
+          t->rescan_stats.files_copied, t->rescan_stats.entries_removed,
+          t->rescan_stats.entries_kept);
+  if (t->snapshot_pending)
+    take_snapshot(t);
+}
+
+// dst_path is about to be removed or replaced; with a store that may leave
+// an object no target file links to
+static void note_unlinked(Target *t, const char *dst_path) {
+  struct stat st;
+  if (t->store && lstat(dst_path, &st) == 0)
+    t->store_unlinked++;
+}
+
+static void run_op(Target *t, const TargetOp *op) {
+  if (op->kind == OP_INITIAL) {
+    initial_copy(t);
+    return;
+  }
+  if (op->kind == OP_RESCAN) {
+    rescan_request(t);
+    return;
+  }
+  if (op->kind == OP_SNAPSHOT) {
+    take_snapshot(t);
+    return;
+  }
+
+  char dst_path[PATH_MAX];
+  if (map_src_to_dst(t->src_real, t->dst_real, op->src_path, dst_path) < 0)
+    return;
+  // the manifest follows every change made below the target root
+  size_t root_len = strlen(t->dst_real);
+  Manifest *man = dst_path[root_len] ? t->manifest : NULL;
+  const char *rel = dst_path + root_len + 1;
+
+  switch (op->kind) {
+  case OP_NEW_DIR:
+    if (mirror_create_or_update(op->src_path, dst_path, t->src_real,
+                                t->dst_real, &t->links, &t->stop) < 0 ||
+        uring_copy_tree(t->uring, op->src_path, dst_path, t->src_real,
+                        t->dst_real, &t->links, &t->stop) < 0)
+      copy_failed(t, "cannot copy directory", op->src_path);
+    if (man)
+      manifest_record_tree(man, rel, dst_path, 0);
+    break;
+  case OP_UPDATE:
+    delta_forget(&t->dc, dst_path, op->is_dir);
+    note_unlinked(t, dst_path);
+    if (mirror_create_or_update(op->src_path, dst_path, t->src_real,
+                                t->dst_real, &t->links, &t->stop) < 0)
+      copy_failed(t, "cannot copy", op->src_path);
+    if (man)
+      manifest_record(man, rel, dst_path, 0);
+    break;
+  case OP_COPY:
+    note_unlinked(t, dst_path);
+    copy_changed(t, op, dst_path);
+    if (man)
+      manifest_record(man, rel, dst_path, 0);
+    break;
+  case OP_RENAME: {
+    char dst_old[PATH_MAX];
+    if (map_src_to_dst(t->src_real, t->dst_real, op->src_old, dst_old) < 0 ||
+        ensure_parent_dir(dst_path) < 0)
+      break;
+    note_unlinked(t, dst_path);
+    // fails harmlessly when the old name's copy is still pending
+    if (rename(dst_old, dst_path) == 0) {
+      struct stat st;
+      if (op->is_dir)
+        link_map_rename(&t->links, dst_old, dst_path);
+      else if (lstat(op->src_path, &st) == 0 && S_ISREG(st.st_mode))
+        link_map_add(&t->links, &st, dst_path);
+      if (man)
+        manifest_rename(man, dst_old + root_len + 1, rel, op->is_dir);
+    }
+    delta_forget(&t->dc, dst_old, op->is_dir);
+    break;
+  }
+  case OP_DELETE:
+    note_unlinked(t, dst_path);
+    uring_rm_tree(t->uring, dst_path);
+    delta_forget(&t->dc, dst_path, op->is_dir);
+    if (man)
+      manifest_remove(man, rel, op->is_dir);
+    break;
+  default:
+    break;
+  }
+}
+
+// -1 for operations no single event stands behind
+static int latency_kind(TargetOpKind kind) {
+  switch (kind) {
+  case OP_NEW_DIR:
+  case OP_UPDATE:
+    return LAT_CREATE;
+  case OP_COPY:
+    return LAT_CLOSE_WRITE;
+  case OP_RENAME:
+    return LAT_MOVE;
+  case OP_DELETE:
+    return LAT_DELETE;
+  default:
+    return -1;
+  }
+}
+
+static uint64_t snapshot_interval_ns(const Target *t) {
+  return (uint64_t)t->opts.snapshot_every * 60ull * 1000000000ull;
+}
+
+static void *target_main(void *arg) {
+  Target *t = arg;
+  pthread_mutex_lock(&t->lock);
+  while (!t->stop) {
+    if (t->overflowed) {
+      t->overflowed = 0;
+      pthread_mutex_unlock(&t->lock);
+      rescan_request(t);
+      pthread_mutex_lock(&t->lock);
+      continue;
+    }
+
+    // scan slices and queued operations take turns
+    uint64_t now = now_ns();
+    if (t->opts.snapshot_every && now >= t->snapshot_next_ns) {
+      t->snapshot_next_ns = now + snapshot_interval_ns(t);
+      pthread_mutex_unlock(&t->lock);
+      take_snapshot(t);
+      pthread_mutex_lock(&t->lock);
+      continue;
+    }
+    if (t->rescan && now >= t->rescan_next_ns) {
+      pthread_mutex_unlock(&t->lock);
+      rescan_step(t, now);
+      pthread_mutex_lock(&t->lock);
+      continue;
+    }
+    if (t->store_unlinked && now >= t->gc_next_ns) {
+      pthread_mutex_unlock(&t->lock);
+      collect_garbage(t);
+      pthread_mutex_lock(&t->lock);
+      continue;
+    }
+
+    TargetOp *op = t->head;
+    if (op) {
+      t->head = op->next;
+      if (!t->head)
+        t->tail = NULL;
+      t->queued--;
+      if (t->live)
+        atomic_store_explicit(&t->live->queued, t->queued,
+                              memory_order_relaxed);
+      pthread_mutex_unlock(&t->lock);
+      run_op(t, op);
+      int kind = latency_kind(op->kind);
+      if (op->event_ns && kind >= 0 && !t->stop)
+        latency_record(&t->latency[kind], now_ns() - op->event_ns);
+      if (t->live)
+        atomic_fetch_add_explicit(&t->live->ops, 1, memory_order_relaxed);
+      op_free(op);
+      pthread_mutex_lock(&t->lock);
+      continue;
+    }
+
+    uint64_t wake = t->rescan ? t->rescan_next_ns : 0;
+    if (t->opts.snapshot_every && (!wake || t->snapshot_next_ns < wake))
+      wake = t->snapshot_next_ns;
+    if (t->store_unlinked && (!wake || t->gc_next_ns < wake))
+      wake = t->gc_next_ns;
+    if (wake) {
+      struct timespec until = {.tv_sec = (time_t)(wake / 1000000000ull),
+                               .tv_nsec = (long)(wake % 1000000000ull)};
+      pthread_cond_timedwait(&t->cond, &t->lock, &until);
+    } else {
+      pthread_cond_wait(&t->cond, &t->lock);
+    }
+  }
+  pthread_mutex_unlock(&t->lock);
+  return NULL;
+}
+
+static TargetOp *op_new(TargetOpKind kind, int is_dir, const char *src_path,
+                        const char *src_old, SharedSource *shared,
+                        uint64_t event_ns) {
+  TargetOp *op = calloc(1, sizeof(*op));
+  if (!op)
+    return NULL;
+  op->kind = kind;
+  op->is_dir = is_dir;
+  op->event_ns = event_ns;
+  if ((src_path && !(op->src_path = strdup(src_path))) ||
+      (src_old && !(op->src_old = strdup(src_old)))) {
+    op_free(op);
+    return NULL;
+  }
+  if (shared) {
+    atomic_fetch_add(&shared->refs, 1);
+    op->shared = shared;
+  }
+  return op;
+}
+
+void target_push(Target *t, TargetOpKind kind, int is_dir,
+                 const char *src_path, const char *src_old,
+                 SharedSource *shared, uint64_t event_ns) {
+  TargetOp *op = op_new(kind, is_dir, src_path, src_old, shared, event_ns);
+  TargetOp *dropped = NULL;
+
+  pthread_mutex_lock(&t->lock);
+  // a snapshot request is no event a rescan could stand in for
+  if (!op || (t->queued >= TARGET_QUEUE_MAX && kind != OP_SNAPSHOT)) {
+    // too far behind to replay event by event: comparing the trees once is
+    // cheaper and keeps memory bounded
+    dropped = t->head;
+    t->dropped += t->queued + 1;
+    t->head = t->tail = NULL;
+    t->queued = 0;
+    t->overflowed = 1;
+  } else {
+    if (t->tail)
+      t->tail->next = op;
+    else
+      t->head = op;
+    t->tail = op;
+    t->queued++;
+    op = NULL;
+  }
+  if (t->live)
+    atomic_store_explicit(&t->live->queued, t->queued, memory_order_relaxed);
+  pthread_cond_signal(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+
+  if (dropped || op) {
+    fprintf(stderr, "target \"%s\": fell behind, rescanning\n", t->dst);
+    live_error(t->live, "fell behind, rescanning");
+    ops_free(dropped);
+    if (op)
+      op_free(op);
+  }
+}
+
+// --delta and --io-uring write into the target's files in place, which
+// option (packing or sharing them) no longer allows
+static void in_place_off(Target *t, const char *option) {
+  if (t->opts.delta || t->opts.io_uring)
+    fprintf(stderr, "target \"%s\": --delta and --io-uring are off with %s\n",
+            t->dst, option);
+  t->opts.delta = 0;
+  t->opts.io_uring = 0;
+}
+
+Target *target_start(const char *src_real, const char *dst,
+                     const BackupOptions *opts, LiveTarget *live) {
+  Target *t = calloc(1, sizeof(*t));
+  if (!t) {
+    fprintf(stderr, "target calloc failed\n");
+    return NULL;
+  }
+  t->src_real = src_real;
+  t->opts = *opts;
+  if (snprintf(t->dst, PATH_MAX, "%s", dst) >= PATH_MAX ||
+      create_empty_dir(t->dst) < 0 || !realpath(t->dst, t->dst_real)) {
+    fprintf(stderr, "target \"%s\": cannot create it\n", dst);
+    free(t);
+    return NULL;
+  }
+  link_map_init(&t->links, t->src_real, t->dst_real);
+  t->live = live;
+  t->links.live = live;
+  // without one the target is crawled on every start, as before
+  t->manifest = manifest_open(t->dst_real);
+  // files packed by an earlier run are only readable through restore, so a
+  // target resumed with some stays compressed
+  int compress = opts->compress ||
+                 (opts->incremental && compress_marked(t->dst_real));
+  if (compress && (opts->dedup[0] || compress_mark(t->dst_real, 1) < 0)) {
+    fprintf(stderr, "target \"%s\": cannot compress it%s\n", dst,
+            opts->dedup[0] ? ", it is compressed and --dedup was given" : "");
+    link_map_free(&t->links);
+    manifest_close(t->manifest);
+    free(t);
+    return NULL;
+  }
+  if (compress) {
+    if (!opts->compress)
+      fprintf(stderr, "target \"%s\": holds compressed files, --compress "
+                      "stays on\n", dst);
+    t->links.compress = COMPRESS_PACK;
+    t->opts.compress = 1;
+    in_place_off(t, "--compress");
+  } else {
+    compress_mark(t->dst_real, 0);
+  }
+  if (opts->dedup[0]) {
+    t->store = dedup_store_open(opts->dedup, t->dst_real);
+    if (!t->store || dedup_store_mark(t->dst_real, opts->dedup) < 0) {
+      fprintf(stderr, "target \"%s\": cannot use dedup store \"%s\"\n", dst,
+              opts->dedup);
+      dedup_store_close(t->store);
+      link_map_free(&t->links);
+      manifest_close(t->manifest);
+      free(t);
+      return NULL;
+    }
+    t->links.store = t->store;
+    in_place_off(t, "--dedup");
+  } else {
+    dedup_store_mark(t->dst_real, NULL);
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&t->cond, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&t->lock, NULL);
+
+  if (t->opts.io_uring) {
+    t->uring = uring_tree_open();
+    if (!t->uring)
+      fprintf(stderr, "target \"%s\": io_uring unavailable, using plain "
+                      "syscalls\n", dst);
+  }
+
+  t->head = t->tail = op_new(OP_INITIAL, 1, NULL, NULL, NULL, 0);
+  t->queued = 1;
+  // the first scheduled snapshot is of the target synced once
+  t->snapshot_next_ns = now_ns() + snapshot_interval_ns(t);
+
+  // SIGTERM is for the watcher thread, which stops the targets itself
+  sigset_t term, old;
+  sigemptyset(&term);
+  sigaddset(&term, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &term, &old);
+  int err = t->head ? pthread_create(&t->thread, NULL, target_main, t) : ENOMEM;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    errno = err;
+    perror("pthread_create(target)");
+    ops_free(t->head);
+    uring_tree_close(t->uring);
+    link_map_free(&t->links);
+    manifest_close(t->manifest);
+    dedup_store_close(t->store);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+const char *target_dst(const Target *t) { return t->dst; }
+
+void target_latency(const Target *t, LatencySummary out[LAT_KINDS]) {
+  for (int k = 0; k < LAT_KINDS; k++)
+    latency_summarize(&t->latency[k], &out[k]);
+}
+
+void target_stop(Target *t) {
+  pthread_mutex_lock(&t->lock);
+  t->stop = 1;
+  pthread_cond_signal(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->thread, NULL);
+
+  // like events still unread in the kernel queue, anything queued here is
+  // left for the next (incremental) add to pick up
+  if (t->rescan || t->head)
+    fprintf(stderr, "target \"%s\": stopped with the target still unsynced\n",
+            t->dst);
+  ops_free(t->head);
+  sync_scan_free(t->rescan);
+
+  if (t->rescans || t->dropped) {
+    fprintf(stderr,
+            "target \"%s\": %llu rescans, last took %llu ms, %llu ms in total, "
+            "%llu operations dropped\n",
+            t->dst, t->rescans,
+            (unsigned long long)(t->rescan_last_ns / 1000000),
+            (unsigned long long)(t->rescan_total_ns / 1000000), t->dropped);
+  }
+  if (t->opts.delta) {
+    fprintf(stderr, "delta: wrote %llu bytes, skipped %llu unchanged bytes\n",
+            t->dc.bytes_written, t->dc.bytes_skipped);
+  }
+  if (t->links.linked) {
+    fprintf(stderr, "target \"%s\": %llu files linked instead of copied\n",
+            t->dst, t->links.linked);
+  }
+  if (t->store) {
+    collect_garbage(t);
+    fprintf(stderr,
+            "target \"%s\": dedup stored %llu new objects, linked %llu files "
+            "to stored ones (%llu bytes saved)\n",
+            t->dst, atomic_load(&t->store->stored),
+            atomic_load(&t->store->shared),
+            atomic_load(&t->store->bytes_saved));
+  }
+  if (t->links.compress) {
+    const CompressStats *cs = &t->links.compress_stats;
+    fprintf(stderr,
+            "target \"%s\": packed %llu files (%llu bytes into %llu), %llu "
+            "copied as they are\n",
+            t->dst, atomic_load(&cs->files), atomic_load(&cs->bytes_in),
+            atomic_load(&cs->bytes_out), atomic_load(&cs->plain));
+  }
+  delta_free_all(&t->dc);
+  link_map_free(&t->links);
+  manifest_close(t->manifest);
+  dedup_store_close(t->store);
+  uring_tree_close(t->uring);
+  pthread_cond_destroy(&t->cond);
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+}
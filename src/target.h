@@ -0,0 +1,59 @@
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <stdint.h>
+
+#include "latency.h"
+#include "live_stats.h"
+#include "options.h"
+
+// past this many queued operations a target drops its queue and rescans,
+// so a stalled target costs memory up to here and no further
+#define TARGET_QUEUE_MAX 4096
+// changed files kept open for targets that haven't copied them yet; above
+// this targets reopen the file by path
+#define SHARED_SOURCE_MAX 256
+
+typedef enum {
+  OP_INITIAL, // first copy of the whole source
+  OP_NEW_DIR, // a directory appeared: mirror it with its contents
+  OP_UPDATE,  // recreate one entry from the source as it is now
+  OP_COPY,    // file contents changed
+  OP_RENAME,
+  OP_DELETE,
+  OP_RESCAN,  // events were lost, reconcile the whole tree
+  OP_SNAPSHOT, // freeze the target as a new generation
+} TargetOpKind;
+
+// A changed file opened once by the watcher and handed to every target, so
+// N targets cost one open and one pass of the source through the page cache.
+typedef struct SharedSource SharedSource;
+
+// NULL when the entry is not a regular file or too many are open already
+SharedSource *shared_source_open(const char *path);
+void shared_source_put(SharedSource *s);
+
+// One target of a watched source. Operations are queued by the watcher and
+// applied by the target's own thread, so a slow target only delays itself.
+typedef struct Target Target;
+
+// Creates dst, starts the target's thread and queues the initial copy.
+// live (may be NULL) is the target's slot of counters for the parent.
+Target *target_start(const char *src_real, const char *dst,
+                     const BackupOptions *opts, LiveTarget *live);
+// paths are absolute source paths; src_old is for OP_RENAME, shared (may be
+// NULL) for OP_COPY. Everything is copied or referenced, nothing is taken.
+// event_ns (CLOCK_MONOTONIC) is when the event behind the operation was
+// read, 0 for none; the time until it is applied goes into the target's
+// latency histograms.
+void target_push(Target *t, TargetOpKind kind, int is_dir,
+                 const char *src_path, const char *src_old,
+                 SharedSource *shared, uint64_t event_ns);
+// dst as passed to target_start
+const char *target_dst(const Target *t);
+// event-to-mirror latencies so far, by LatencyKind; safe from any thread
+void target_latency(const Target *t, LatencySummary out[LAT_KINDS]);
+// Stops the thread, drops whatever is still queued and frees t.
+void target_stop(Target *t);
+
+#endif
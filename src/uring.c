@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int supports_ops(Uring *r, const int *ops, size_t ops_count) {
+  size_t len = sizeof(struct io_uring_probe) +
+               256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  if (!probe)
+    return 0;
+  int ok = sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (size_t i = 0; ok && i < ops_count; i++) {
+    ok = ops[i] <= probe->last_op &&
+         (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+static int register_sparse_files(Uring *r, unsigned files) {
+  int *fds = malloc(files * sizeof(*fds));
+  if (!fds)
+    return -1;
+  for (unsigned i = 0; i < files; i++)
+    fds[i] = -1;
+  int ret = sys_register(r->fd, IORING_REGISTER_FILES, fds, files);
+  free(fds);
+  return ret;
+}
+
+int uring_init(Uring *r, unsigned entries, unsigned files, const int *ops,
+               size_t ops_count) {
+  memset(r, 0, sizeof(*r));
+  r->sq_map = r->cq_map = r->sqes = MAP_FAILED;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = sys_setup(entries, &p);
+  if (r->fd < 0) {
+    // ENOSYS: no io_uring, EPERM: io_uring_disabled or a seccomp filter
+    if (errno != ENOSYS && errno != EPERM)
+      perror("io_uring_setup");
+    return -1;
+  }
+  r->sq_entries = p.sq_entries;
+
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_len > r->sq_map_len)
+      r->sq_map_len = r->cq_map_len;
+    r->cq_map_len = r->sq_map_len;
+  }
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_map = r->sq_map;
+  } else {
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED)
+      goto fail;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  char *sq = r->sq_map;
+  char *cq = r->cq_map;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->sqe_tail = *r->sq_tail;
+
+  // the opcodes we need arrived over several releases (statx 5.6, mkdirat
+  // 5.15); a partial set is treated like no io_uring at all
+  if (!supports_ops(r, ops, ops_count))
+    goto fail;
+  if (files > 0 && register_sparse_files(r, files) < 0)
+    goto fail;
+  return 0;
+
+fail:
+  uring_free(r);
+  return -1;
+}
+
+void uring_free(Uring *r) {
+  if (r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_len);
+  if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_map_len);
+  if (r->sq_map != MAP_FAILED)
+    munmap(r->sq_map, r->sq_map_len);
+  if (r->fd >= 0)
+    close(r->fd);
+  r->sq_map = r->cq_map = r->sqes = MAP_FAILED;
+  r->fd = -1;
+}
+
+unsigned uring_space(const Uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  return r->sq_entries - (r->sqe_tail - head);
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *r) {
+  if (uring_space(r) == 0)
+    return NULL;
+  unsigned idx = r->sqe_tail++ & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  return sqe;
+}
+
+int uring_submit(Uring *r, unsigned wait_nr) {
+  // entries become visible to the kernel only once the tail moves past them
+  r->to_submit += r->sqe_tail - *r->sq_tail;
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  while (1) {
+    int n = sys_enter(r->fd, r->to_submit, wait_nr, flags);
+    if (n >= 0) {
+      r->to_submit -= (unsigned)n < r->to_submit ? (unsigned)n : r->to_submit;
+      return n;
+    }
+    if (errno == EINTR)
+      continue;
+    // EAGAIN/EBUSY: completions must be reaped before more can go in
+    if (errno == EAGAIN || errno == EBUSY)
+      return 0;
+    perror("io_uring_enter");
+    return -1;
+  }
+}
+
+int uring_peek(Uring *r, struct io_uring_cqe *out) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  *out = r->cqes[head & *r->cq_mask];
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
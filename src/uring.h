@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// Minimal io_uring ring driven through the raw syscalls, so no liburing is
+// needed. Single-threaded use only.
+typedef struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  void *cq_map; // same mapping as sq_map with IORING_FEAT_SINGLE_MMAP
+  size_t sq_map_len;
+  size_t cq_map_len;
+  size_t sqes_len;
+  unsigned sqe_tail;  // tail including sqes not yet published
+  unsigned to_submit; // published but not yet taken by io_uring_enter
+} Uring;
+
+// Sets up a ring with a sparse table of files fixed slots for direct
+// descriptors and checks that every opcode in ops is supported. Returns -1,
+// quietly for the expected reasons (old kernel, disabled by sysctl or
+// seccomp), when the caller should use plain syscalls instead.
+int uring_init(Uring *r, unsigned entries, unsigned files, const int *ops,
+               size_t ops_count);
+void uring_free(Uring *r);
+
+// free submission entries
+unsigned uring_space(const Uring *r);
+// next zeroed submission entry, NULL when the ring is full
+struct io_uring_sqe *uring_get_sqe(Uring *r);
+// Submits what was queued and waits for at least wait_nr completions.
+int uring_submit(Uring *r, unsigned wait_nr);
+// Pops one completion into *out; 0 when none is ready.
+int uring_peek(Uring *r, struct io_uring_cqe *out);
+
+#endif
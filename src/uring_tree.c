@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include "uring_tree.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "filesystem_utils.h"
+#include "uring.h"
+
+// submission queue size; URING_SLOTS chains of six always fit
+#define URING_ENTRIES 512
+
+enum { JOB_FREE, JOB_FILE, JOB_MKDIR, JOB_UNLINK };
+
+// one request of a job, kept in the low byte of user_data
+enum {
+  STEP_STATX,
+  STEP_OPEN_SRC,
+  STEP_OPEN_DST,
+  STEP_READ,
+  STEP_WRITE,
+  STEP_CLOSE_SRC,
+  STEP_CLOSE_DST,
+  STEP_MKDIR,
+  STEP_UNLINK,
+  STEP_COUNT
+};
+
+typedef struct {
+  int kind;
+  int pending; // completions still expected
+  int res[STEP_COUNT];
+  struct statx stx;
+  char *buf;   // URING_SMALL_FILE bytes, allocated on first use
+  char src[PATH_MAX];
+  char dst[PATH_MAX];
+} Job;
+
+struct UringTree {
+  Uring ring;
+  Job jobs[URING_SLOTS]; // job i reads through fixed file 2i, writes 2i+1
+  int free_jobs[URING_SLOTS];
+  int free_count;
+  int mkdirs;            // directories queued but not created yet
+  int failed;
+  int broken;            // io_uring_enter itself failed, stop using the ring
+  const char *src_real;
+  const char *dst_real;
+  LinkMap *links;
+  volatile sig_atomic_t *stop_flag;
+};
+
+UringTree *uring_tree_open(void) {
+  static const int ops[] = {IORING_OP_STATX, IORING_OP_OPENAT,
+                            IORING_OP_READ,  IORING_OP_WRITE,
+                            IORING_OP_CLOSE, IORING_OP_MKDIRAT,
+                            IORING_OP_UNLINKAT};
+  UringTree *ut = calloc(1, sizeof(*ut));
+  if (!ut)
+    return NULL;
+  if (uring_init(&ut->ring, URING_ENTRIES, 2 * URING_SLOTS, ops,
+                 sizeof(ops) / sizeof(ops[0])) < 0) {
+    free(ut);
+    return NULL;
+  }
+  for (int i = 0; i < URING_SLOTS; i++)
+    ut->free_jobs[ut->free_count++] = URING_SLOTS - 1 - i;
+  return ut;
+}
+
+void uring_tree_close(UringTree *ut) {
+  if (!ut)
+    return;
+  uring_free(&ut->ring);
+  for (int i = 0; i < URING_SLOTS; i++)
+    free(ut->jobs[i].buf);
+  free(ut);
+}
+
+static struct io_uring_sqe *queue(UringTree *ut, int j, int step, int op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&ut->ring);
+  if (!sqe) {
+    uring_submit(&ut->ring, 0);
+    sqe = uring_get_sqe(&ut->ring);
+  }
+  sqe->opcode = (unsigned char)op;
+  sqe->user_data = ((uint64_t)j << 8) | (uint64_t)step;
+  ut->jobs[j].pending++;
+  return sqe;
+}
+
+static void queue_statx(UringTree *ut, int j) {
+  Job *job = &ut->jobs[j];
+  struct io_uring_sqe *sqe = queue(ut, j, STEP_STATX, IORING_OP_STATX);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)job->src;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+  sqe->addr2 = (uintptr_t)&job->stx;
+}
+
+// open both ends, one read, one write, close both; hard links keep the
+// closes running when something before them fails, so every step completes
+// and the direct descriptors are always released
+static void queue_copy_chain(UringTree *ut, int j) {
+  Job *job = &ut->jobs[j];
+  unsigned size = (unsigned)job->stx.stx_size;
+  struct io_uring_sqe *sqe;
+
+  sqe = queue(ut, j, STEP_OPEN_SRC, IORING_OP_OPENAT);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)job->src;
+  sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+  sqe->file_index = (unsigned)(2 * j) + 1;
+  sqe->flags = IOSQE_IO_HARDLINK;
+
+  sqe = queue(ut, j, STEP_OPEN_DST, IORING_OP_OPENAT);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)job->dst;
+  // an existing file may share its inode with a snapshot: failing here
+  // hands it to copy_file, which replaces it
+  sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL;
+  sqe->len = job->stx.stx_mode & 0777;
+  sqe->file_index = (unsigned)(2 * j + 1) + 1;
+  sqe->flags = IOSQE_IO_HARDLINK;
+
+  sqe = queue(ut, j, STEP_READ, IORING_OP_READ);
+  sqe->fd = 2 * j;
+  sqe->addr = (uintptr_t)job->buf;
+  sqe->len = size;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+  sqe = queue(ut, j, STEP_WRITE, IORING_OP_WRITE);
+  sqe->fd = 2 * j + 1;
+  sqe->addr = (uintptr_t)job->buf;
+  sqe->len = size;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+  sqe = queue(ut, j, STEP_CLOSE_SRC, IORING_OP_CLOSE);
+  sqe->file_index = (unsigned)(2 * j) + 1;
+  sqe->flags = IOSQE_IO_HARDLINK;
+
+  sqe = queue(ut, j, STEP_CLOSE_DST, IORING_OP_CLOSE);
+  sqe->file_index = (unsigned)(2 * j + 1) + 1;
+}
+
+static void release(UringTree *ut, int j) {
+  ut->jobs[j].kind = JOB_FREE;
+  ut->free_jobs[ut->free_count++] = j;
+}
+
+static void file_stated(UringTree *ut, int j) {
+  Job *job = &ut->jobs[j];
+  if (job->res[STEP_STATX] < 0) {
+    if (job->res[STEP_STATX] != -ENOENT) { // gone already: nothing to copy
+      errno = -job->res[STEP_STATX];
+      perror("statx(src)");
+      ut->failed = 1;
+    }
+    release(ut, j);
+    return;
+  }
+
+  mode_t mode = job->stx.stx_mode;
+  // another name of the file may have been copied already
+  int linked = S_ISREG(mode) && ut->links && job->stx.stx_nlink > 1;
+  // a read and a write would fill the holes of a sparse file in
+  int sparse = job->stx.stx_blocks * 512 < job->stx.stx_size;
+  if (S_ISREG(mode) && !linked && !sparse &&
+      job->stx.stx_size <= URING_SMALL_FILE) {
+    if (!job->buf)
+      job->buf = malloc(URING_SMALL_FILE);
+    if (job->buf) {
+      queue_copy_chain(ut, j);
+      return;
+    }
+  }
+
+  int ret = 0;
+  if (linked) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_dev = makedev(job->stx.stx_dev_major, job->stx.stx_dev_minor);
+    st.st_ino = job->stx.stx_ino;
+    st.st_nlink = job->stx.stx_nlink;
+    st.st_mode = mode;
+    st.st_size = (off_t)job->stx.stx_size;
+    ret = link_or_copy(ut->links, job->src, job->dst, &st, ut->stop_flag);
+  } else if (S_ISREG(mode)) {
+    ret = copy_file(job->src, job->dst, mode, ut->stop_flag);
+    if (ret >= 0 && ut->links)
+      live_copied(ut->links->live, job->stx.stx_size);
+  } else if (S_ISLNK(mode)) {
+    ret = copy_symplink_rewrite(job->src, job->dst, ut->src_real, ut->dst_real);
+  } else {
+    fprintf(stderr, "Skipping unsupported file type: %s\n", job->src);
+  }
+  if (ret < 0)
+    ut->failed = 1;
+  release(ut, j);
+}
+
+static void file_copied(UringTree *ut, int j) {
+  Job *job = &ut->jobs[j];
+  int size = (int)job->stx.stx_size;
+  int ok = job->res[STEP_OPEN_SRC] >= 0 && job->res[STEP_OPEN_DST] >= 0 &&
+           job->res[STEP_READ] == size && job->res[STEP_WRITE] == size;
+
+  // the source mtime travels with the data, like in copy_file
+  if (ok) {
+    struct timespec times[2] = {
+        {job->stx.stx_atime.tv_sec, job->stx.stx_atime.tv_nsec},
+        {job->stx.stx_mtime.tv_sec, job->stx.stx_mtime.tv_nsec}};
+    ok = utimensat(AT_FDCWD, job->dst, times, 0) == 0;
+  }
+  // a short read (the file changed under us) or an error: the plain path
+  // redoes it and reports what is really wrong
+  if (!ok && copy_file(job->src, job->dst, job->stx.stx_mode, ut->stop_flag) < 0)
+    ut->failed = 1;
+  else if (ut->links)
+    live_copied(ut->links->live, job->stx.stx_size);
+  release(ut, j);
+}
+
+static void dir_stated(UringTree *ut, int j) {
+  Job *job = &ut->jobs[j];
+  if (job->res[STEP_STATX] < 0) {
+    ut->mkdirs--;
+    release(ut, j);
+    return;
+  }
+  struct io_uring_sqe *sqe = queue(ut, j, STEP_MKDIR, IORING_OP_MKDIRAT);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)job->dst;
+  sqe->len = job->stx.stx_mode & 0777;
+}
+
+static void complete(UringTree *ut, const struct io_uring_cqe *cqe) {
+  int j = (int)(cqe->user_data >> 8);
+  int step = (int)(cqe->user_data & 0xff);
+  Job *job = &ut->jobs[j];
+  job->res[step] = cqe->res;
+  if (--job->pending > 0)
+    return;
+
+  switch (job->kind) {
+  case JOB_FILE:
+    if (step == STEP_STATX)
+      file_stated(ut, j);
+    else
+      file_copied(ut, j);
+    return;
+  case JOB_MKDIR:
+    if (step == STEP_STATX) {
+      dir_stated(ut, j);
+      return;
+    }
+    if (cqe->res < 0 && cqe->res != -EEXIST) {
+      errno = -cqe->res;
+      perror("mkdirat(copy_tree)");
+      ut->failed = 1;
+    }
+    ut->mkdirs--;
+    break;
+  case JOB_UNLINK:
+    if (cqe->res < 0 && cqe->res != -ENOENT) {
+      errno = -cqe->res;
+      perror("unlinkat(rm_tree)");
+      ut->failed = 1;
+    }
+    break;
+  }
+  release(ut, j);
+}
+
+// submits what is queued and handles every completion that is ready,
+// sleeping for at least one when wait is set
+static int reap(UringTree *ut, int wait) {
+  if (uring_submit(&ut->ring, wait ? 1 : 0) < 0) {
+    ut->failed = 1;
+    ut->broken = 1;
+    return -1;
+  }
+  struct io_uring_cqe cqe;
+  while (uring_peek(&ut->ring, &cqe))
+    complete(ut, &cqe);
+  return 0;
+}
+
+// a free job, -1 when the ring stopped working
+static int acquire(UringTree *ut, int kind, const char *src, const char *dst) {
+  while (ut->free_count == 0) {
+    if (reap(ut, 1) < 0)
+      return -1;
+  }
+  int j = ut->free_jobs[--ut->free_count];
+  Job *job = &ut->jobs[j];
+  job->kind = kind;
+  job->pending = 0;
+  snprintf(job->src, PATH_MAX, "%s", src ? src : "");
+  snprintf(job->dst, PATH_MAX, "%s", dst);
+  return j;
+}
+
+static void drain(UringTree *ut) {
+  while (ut->free_count < URING_SLOTS) {
+    if (reap(ut, 1) < 0)
+      return;
+  }
+}
+
+// d_type, or the lstat result when the filesystem doesn't fill it in
+static int entry_type(const struct dirent *entity, const char *path) {
+  if (entity->d_type != DT_UNKNOWN)
+    return entity->d_type;
+  struct stat st;
+  if (lstat(path, &st) < 0)
+    return DT_UNKNOWN;
+  if (S_ISDIR(st.st_mode))
+    return DT_DIR;
+  if (S_ISREG(st.st_mode))
+    return DT_REG;
+  return S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+}
+
+typedef struct {
+  char **dirs; // relative to the roots, "" = the roots themselves
+  size_t count;
+  size_t capacity;
+} DirStack;
+
+static int dir_push(DirStack *s, const char *rel) {
+  if (s->count == s->capacity) {
+    size_t new_cap = s->capacity ? s->capacity * 2 : 64;
+    char **new_dirs = realloc(s->dirs, new_cap * sizeof(*new_dirs));
+    if (!new_dirs)
+      return -1;
+    s->dirs = new_dirs;
+    s->capacity = new_cap;
+  }
+  char *copy = strdup(rel);
+  if (!copy)
+    return -1;
+  s->dirs[s->count++] = copy;
+  return 0;
+}
+
+// queues every entry of one directory; subdirectories are created now and
+// entered once their mkdir completed
+static int copy_dir(UringTree *ut, const char *src_dir, const char *dst_dir,
+                    const char *rel, DirStack *stack) {
+  DIR *d = opendir(src_dir);
+  if (!d) {
+    perror("opendir(src_dir)");
+    return -1;
+  }
+
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL && !*ut->stop_flag && !ut->failed) {
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+
+    char src_path[PATH_MAX], dst_path[PATH_MAX], child[PATH_MAX];
+    if (snprintf(src_path, PATH_MAX, "%s/%s", src_dir, entity->d_name) >=
+            PATH_MAX ||
+        snprintf(dst_path, PATH_MAX, "%s/%s", dst_dir, entity->d_name) >=
+            PATH_MAX ||
+        snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "",
+                 entity->d_name) >= PATH_MAX) {
+      closedir(d);
+      fprintf(stderr, "Name too long(copy_tree)\n");
+      return -1;
+    }
+
+    int type = entry_type(entity, src_path);
+    if (type == DT_LNK) {
+      if (copy_symplink_rewrite(src_path, dst_path, ut->src_real,
+                                ut->dst_real) < 0)
+        ut->failed = 1;
+      continue;
+    }
+
+    // regular files and anything odd: the statx result decides
+    int is_dir = (type == DT_DIR);
+    int j = acquire(ut, is_dir ? JOB_MKDIR : JOB_FILE, src_path, dst_path);
+    if (j < 0 || (is_dir && dir_push(stack, child) < 0)) {
+      closedir(d);
+      return -1;
+    }
+    queue_statx(ut, j);
+    ut->mkdirs += is_dir;
+  }
+
+  if (closedir(d) < 0) {
+    perror("closedir");
+    return -1;
+  }
+  return 0;
+}
+
+int uring_copy_tree(UringTree *ut, const char *src_dir, const char *dst_dir,
+                    const char *src_real, const char *dst_real, LinkMap *links,
+                    volatile sig_atomic_t *stop_flag) {
+  if (!ut || ut->broken)
+    return copy_tree(src_dir, dst_dir, src_real, dst_real, links, stop_flag);
+
+  ut->src_real = src_real;
+  ut->dst_real = dst_real;
+  ut->links = links;
+  ut->stop_flag = stop_flag;
+  ut->failed = 0;
+
+  DirStack stack = {0};
+  if (dir_push(&stack, "") < 0)
+    return -1;
+  while (stack.count > 0 && !*stop_flag && !ut->failed) {
+    char *rel = stack.dirs[--stack.count];
+    while (ut->mkdirs > 0 && !ut->failed && reap(ut, 1) == 0) {
+    }
+
+    char src_path[PATH_MAX], dst_path[PATH_MAX];
+    int n = snprintf(src_path, PATH_MAX, "%s%s%s", src_dir, rel[0] ? "/" : "", rel);
+    int m = snprintf(dst_path, PATH_MAX, "%s%s%s", dst_dir, rel[0] ? "/" : "", rel);
+    if (n >= PATH_MAX || m >= PATH_MAX ||
+        copy_dir(ut, src_path, dst_path, rel, &stack) < 0)
+      ut->failed = 1;
+    free(rel);
+  }
+  drain(ut);
+
+  for (size_t i = 0; i < stack.count; i++)
+    free(stack.dirs[i]);
+  free(stack.dirs);
+  return (ut->failed || *stop_flag) ? -1 : 0;
+}
+
+static void rm_dir(UringTree *ut, const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    perror("opendir(rm_tree)");
+    ut->failed = 1;
+    return;
+  }
+
+  struct dirent *entity;
+  while ((entity = readdir(d)) != NULL && !ut->failed) {
+    if (!strcmp(entity->d_name, ".") || !strcmp(entity->d_name, ".."))
+      continue;
+
+    char child[PATH_MAX];
+    if (snprintf(child, PATH_MAX, "%s/%s", dir, entity->d_name) >= PATH_MAX) {
+      fprintf(stderr, "Name too long(rm_tree)\n");
+      ut->failed = 1;
+      break;
+    }
+    if (entry_type(entity, child) == DT_DIR) {
+      rm_dir(ut, child);
+      continue;
+    }
+    int j = acquire(ut, JOB_UNLINK, NULL, child);
+    if (j < 0)
+      break;
+    struct io_uring_sqe *sqe = queue(ut, j, STEP_UNLINK, IORING_OP_UNLINKAT);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)ut->jobs[j].dst;
+  }
+  if (closedir(d) < 0) {
+    perror("closedir(rm_tree)");
+    ut->failed = 1;
+  }
+
+  // the directory can only go once everything in it is unlinked
+  drain(ut);
+  if (!ut->failed && rmdir(dir) < 0 && errno != ENOENT) {
+    perror("rmdir(rm_tree)");
+    ut->failed = 1;
+  }
+}
+
+int uring_rm_tree(UringTree *ut, const char *path) {
+  struct stat st;
+  if (!ut || ut->broken || lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+    return rm_tree(path);
+
+  ut->failed = 0;
+  rm_dir(ut, path);
+  return ut->failed ? -1 : 0;
+}
@@ -0,0 +1,32 @@
+#ifndef URING_TREE_H
+#define URING_TREE_H
+
+#include <signal.h>  // sig_atomic_t
+
+#include "link_map.h"
+
+// files in flight at once; each small file is one chain of six requests
+#define URING_SLOTS 64
+// files up to this size are copied with one read and one write; bigger
+// ones go through copy_file, where copy_file_range or clone do better
+#define URING_SMALL_FILE (64 * 1024)
+
+typedef struct UringTree UringTree;
+
+// NULL when io_uring can't be used; the functions below then fall back to
+// copy_tree and rm_tree.
+UringTree *uring_tree_open(void);
+void uring_tree_close(UringTree *ut);
+
+// Same result as copy_tree: stats, directory creation and small-file copies
+// (openat, read, write, close as one linked chain per file) are queued
+// together so hundreds of requests are in flight instead of one syscall.
+// Files with more than one link go through link_or_copy.
+int uring_copy_tree(UringTree *ut, const char *src_dir, const char *dst_dir,
+                    const char *src_real, const char *dst_real, LinkMap *links,
+                    volatile sig_atomic_t *stop_flag);
+
+// Same result as rm_tree, with each directory's entries unlinked in a batch.
+int uring_rm_tree(UringTree *ut, const char *path);
+
+#endif
@@ -2,6 +2,7 @@
 #include "watch_map.h"
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,12 +11,234 @@
 #include <unistd.h>
 
 #include "filesystem_utils.h"
+#include "hash.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+#define SLOT_EMPTY ((size_t)-1)
+
+// index helpers
+
+static size_t wd_home(const WatchIndex *index, int wd) {
+  // Fibonacci hashing spreads the small sequential wds over the table
+  return (size_t)(((uint32_t)wd * 2654435769u) & (index->capacity - 1));
+}
+
+static size_t name_home(const WatchIndex *index, size_t parent,
+                        const char *name) {
+  return (size_t)(hash64(name, strlen(name), (uint64_t)parent) &
+                  (index->capacity - 1));
+}
+
+static size_t node_home(const WatchMap *map, const WatchIndex *index,
+                        size_t node) {
+  const Watch *w = &map->watches[node];
+  if (index == &map->by_wd)
+    return wd_home(index, w->wd);
+  return name_home(index, w->parent, w->name);
+}
+
+// slot holding wd, or the empty slot ending its probe sequence
+static size_t wd_slot(const WatchMap *map, int wd) {
+  const WatchIndex *index = &map->by_wd;
+  size_t mask = index->capacity - 1;
+  size_t i = wd_home(index, wd);
+  while (index->slots[i] != SLOT_EMPTY &&
+         map->watches[index->slots[i]].wd != wd)
+    i = (i + 1) & mask;
+  return i;
+}
+
+static size_t name_slot(const WatchMap *map, size_t parent, const char *name) {
+  const WatchIndex *index = &map->by_name;
+  size_t mask = index->capacity - 1;
+  size_t i = name_home(index, parent, name);
+  while (index->slots[i] != SLOT_EMPTY) {
+    const Watch *w = &map->watches[index->slots[i]];
+    if (w->parent == parent && strcmp(w->name, name) == 0)
+      break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static size_t node_slot(const WatchMap *map, const WatchIndex *index,
+                        size_t node) {
+  const Watch *w = &map->watches[node];
+  if (index == &map->by_wd)
+    return wd_slot(map, w->wd);
+  return name_slot(map, w->parent, w->name);
+}
+
+static int index_rehash(WatchMap *map, WatchIndex *index, size_t new_cap) {
+  size_t *new_slots = malloc(new_cap * sizeof(*new_slots));
+  if (!new_slots) {
+    fprintf(stderr, "watch index malloc failed\n");
+    return -1;
+  }
+  for (size_t i = 0; i < new_cap; i++)
+    new_slots[i] = SLOT_EMPTY;
+
+  free(index->slots);
+  index->slots = new_slots;
+  index->capacity = new_cap;
+  for (size_t i = 0; i < map->watches_used; i++) {
+    if (map->watches[i].wd >= 0)
+      index->slots[node_slot(map, index, i)] = i;
+  }
+  return 0;
+}
+
+// removes slot i and pulls later entries of the cluster back into the gap
+static void index_delete(WatchMap *map, WatchIndex *index, size_t i) {
+  size_t mask = index->capacity - 1;
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (index->slots[j] == SLOT_EMPTY)
+      break;
+    size_t home = node_home(map, index, index->slots[j]);
+    // move j into the gap unless its home lies cyclically in (i, j]
+    if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    index->slots[i] = index->slots[j];
+    i = j;
+  }
+  index->slots[i] = SLOT_EMPTY;
+}
+
+// tree helpers
+
+static void node_link(WatchMap *map, size_t node, size_t parent) {
+  Watch *w = &map->watches[node];
+  w->parent = parent;
+  w->prev_sibling = WATCH_NONE;
+  w->next_sibling = WATCH_NONE;
+  if (parent == WATCH_NONE)
+    return;
+  w->next_sibling = map->watches[parent].first_child;
+  if (w->next_sibling != WATCH_NONE)
+    map->watches[w->next_sibling].prev_sibling = node;
+  map->watches[parent].first_child = node;
+}
+
+static void node_unlink(WatchMap *map, size_t node) {
+  Watch *w = &map->watches[node];
+  if (w->prev_sibling != WATCH_NONE)
+    map->watches[w->prev_sibling].next_sibling = w->next_sibling;
+  else if (w->parent != WATCH_NONE)
+    map->watches[w->parent].first_child = w->next_sibling;
+  if (w->next_sibling != WATCH_NONE)
+    map->watches[w->next_sibling].prev_sibling = w->prev_sibling;
+  w->prev_sibling = WATCH_NONE;
+  w->next_sibling = WATCH_NONE;
+}
+
+// drops one childless, already unlinked node
+static void node_free(WatchMap *map, size_t node, int notify_fd) {
+  Watch *w = &map->watches[node];
+  index_delete(map, &map->by_wd, wd_slot(map, w->wd));
+  index_delete(map, &map->by_name, name_slot(map, w->parent, w->name));
+  if (notify_fd >= 0)
+    inotify_rm_watch(notify_fd, w->wd);
+
+  free(w->name);
+  w->name = NULL;
+  w->wd = -1;
+  w->next_sibling = map->free_head;
+  map->free_head = node;
+  map->watches_count--;
+}
+
+// removes node and everything below it, touching nothing else
+static void node_free_subtree(WatchMap *map, size_t node, int notify_fd) {
+  node_unlink(map, node);
+
+  size_t cur = node;
+  while (1) {
+    while (map->watches[cur].first_child != WATCH_NONE)
+      cur = map->watches[cur].first_child;
+
+    size_t parent = map->watches[cur].parent;
+    if (cur == node) {
+      node_free(map, cur, notify_fd);
+      return;
+    }
+    // cur is its parent's first child, pop it off the front
+    size_t next = map->watches[cur].next_sibling;
+    map->watches[parent].first_child = next;
+    if (next != WATCH_NONE)
+      map->watches[next].prev_sibling = WATCH_NONE;
+    node_free(map, cur, notify_fd);
+    cur = parent;
+  }
+}
+
+static size_t node_lookup(WatchMap *map, const char *path) {
+  if (map->watches_count == 0)
+    return WATCH_NONE;
+
+  const char *root_path = map->watches[map->root].name;
+  if (!has_prefix_path(path, root_path))
+    return WATCH_NONE;
+
+  size_t node = map->root;
+  const char *p = path + strlen(root_path);
+  char name[PATH_MAX];
+  while (*p) {
+    while (*p == '/')
+      p++;
+    size_t len = strcspn(p, "/");
+    if (len == 0)
+      break;
+    if (len >= PATH_MAX)
+      return WATCH_NONE;
+    memcpy(name, p, len);
+    name[len] = '\0';
+
+    size_t slot = name_slot(map, node, name);
+    if (map->by_name.slots[slot] == SLOT_EMPTY)
+      return WATCH_NONE;
+    node = map->by_name.slots[slot];
+    p += len;
+  }
+  return node;
+}
+
+// gives node a new name under a new parent; its subtree follows for free
+static int node_move(WatchMap *map, size_t node, size_t parent,
+                     const char *name) {
+  char *new_name = strdup(name);
+  if (!new_name) {
+    fprintf(stderr, "watch name strdup failed\n");
+    return -1;
+  }
+
+  Watch *w = &map->watches[node];
+  index_delete(map, &map->by_name, name_slot(map, w->parent, w->name));
+  node_unlink(map, node);
+  free(w->name);
+  w->name = new_name;
+  node_link(map, node, parent);
+  map->by_name.slots[name_slot(map, parent, new_name)] = node;
+  return 0;
+}
+
+// public API
+
 int watch_ensure_capacity(WatchMap *map, size_t need) {
+  // keep both indexes at most half full
+  if (map->by_wd.capacity < need * 2) {
+    size_t new_cap = (map->by_wd.capacity == 0) ? 128 : map->by_wd.capacity;
+    while (new_cap < need * 2)
+      new_cap *= 2;
+    if (index_rehash(map, &map->by_wd, new_cap) < 0 ||
+        index_rehash(map, &map->by_name, new_cap) < 0)
+      return -1;
+  }
+
   if (map->watches_capacity >= need)
     return 0;
   size_t new_cap =
@@ -36,58 +259,146 @@ int watch_ensure_capacity(WatchMap *map, size_t need) {
 
 // some of the functions below were taken/modified from
 // https://gitlab.com/SaQQ/sop1/-/blob/master/05_events/watch_tree.c?ref_type=heads
-int watch_add(WatchMap *map, int wd, char *path) {
+int watch_add(WatchMap *map, int wd, const char *path) {
   if (watch_ensure_capacity(map, map->watches_count + 1) < 0) {
     fprintf(stderr, "watch add failed\n");
     return -1;
   }
 
-  map->watches[map->watches_count].wd = wd;
-  map->watches[map->watches_count].path = path;
+  // the first watch is the root and keeps its full path as its name
+  size_t parent = WATCH_NONE;
+  char dir[PATH_MAX], base[PATH_MAX];
+  const char *name = path;
+  if (map->watches_count > 0) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", path);
+    split_dir_base(tmp, dir, base);
+    parent = node_lookup(map, dir);
+    if (parent == WATCH_NONE) {
+      fprintf(stderr, "watch add: parent of %s is not watched\n", path);
+      return -1;
+    }
+    name = base;
+  }
+
+  // inotify hands out the same wd when a directory is watched twice
+  size_t same = map->by_wd.slots[wd_slot(map, wd)];
+  size_t old = map->by_name.slots[name_slot(map, parent, name)];
+  if (same != SLOT_EMPTY && same == old)
+    return 0;
+
+  // a stale node still sits under this name (directory was replaced)
+  if (old != SLOT_EMPTY)
+    node_free_subtree(map, old, -1);
+  if (same != SLOT_EMPTY && map->watches[same].wd == wd)
+    return node_move(map, same, parent, name);
+
+  char *copy = strdup(name);
+  if (!copy) {
+    fprintf(stderr, "watch name strdup failed\n");
+    return -1;
+  }
+
+  // every node between the live count and the high-water mark is free
+  size_t node;
+  if (map->watches_used > map->watches_count) {
+    node = map->free_head;
+    map->free_head = map->watches[node].next_sibling;
+  } else {
+    node = map->watches_used++;
+  }
+
+  Watch *w = &map->watches[node];
+  w->wd = wd;
+  w->name = copy;
+  w->first_child = WATCH_NONE;
+  node_link(map, node, parent);
+  if (parent == WATCH_NONE)
+    map->root = node;
+
+  map->by_wd.slots[wd_slot(map, wd)] = node;
+  map->by_name.slots[name_slot(map, parent, copy)] = node;
   map->watches_count++;
   return 0;
 }
 
 Watch *watch_find(WatchMap *map, int wd) {
-  for (size_t i = 0; i < map->watches_count; i++) {
-    if (map->watches[i].wd == wd) {
-      return &map->watches[i];
+  if (map->watches_count == 0)
+    return NULL;
+  size_t node = map->by_wd.slots[wd_slot(map, wd)];
+  return (node == SLOT_EMPTY) ? NULL : &map->watches[node];
+}
+
+Watch *watch_lookup(WatchMap *map, const char *path) {
+  size_t node = node_lookup(map, path);
+  return (node == WATCH_NONE) ? NULL : &map->watches[node];
+}
+
+int watch_path(const WatchMap *map, const Watch *watch, char out[PATH_MAX]) {
+  // collect the chain up to the root, then print it top-down
+  size_t chain[PATH_MAX / 2];
+  size_t depth = 0;
+  size_t node = (size_t)(watch - map->watches);
+  while (node != WATCH_NONE) {
+    if (depth == PATH_MAX / 2)
+      return -1;
+    chain[depth++] = node;
+    node = map->watches[node].parent;
+  }
+
+  size_t len = 0;
+  for (size_t i = depth; i-- > 0;) {
+    const char *fmt = (i == depth - 1) ? "%s" : "/%s";
+    int n = snprintf(out + len, PATH_MAX - len, fmt, map->watches[chain[i]].name);
+    if (n < 0 || (size_t)n >= PATH_MAX - len) {
+      fprintf(stderr, "watch path too long\n");
+      return -1;
     }
+    len += (size_t)n;
   }
-  return NULL;
+  return 0;
 }
 
 void watch_remove(WatchMap *map, int wd) {
-  for (size_t i = 0; i < map->watches_count; i++) {
-    if (map->watches[i].wd == wd) {
-      free(map->watches[i].path);
-      map->watches[i] = map->watches[map->watches_count - 1];
-      map->watches_count--;
-      return;
-    }
-  }
+  if (map->watches_count == 0)
+    return;
+  size_t node = map->by_wd.slots[wd_slot(map, wd)];
+  if (node == SLOT_EMPTY)
+    return;
+  // the kernel drops watches below a removed directory on its own
+  node_free_subtree(map, node, -1);
 }
 
 void watch_free_all(WatchMap *map) {
-  for (size_t i = 0; i < map->watches_count; i++) {
-    free(map->watches[i].path);
+  for (size_t i = 0; i < map->watches_used; i++) {
+    if (map->watches[i].wd >= 0)
+      free(map->watches[i].name);
   }
   free(map->watches);
-  map->watches = NULL;
-  map->watches_capacity = 0;
-  map->watches_count = 0;
+  free(map->by_wd.slots);
+  free(map->by_name.slots);
+  memset(map, 0, sizeof(*map));
 }
 
-int add_watch_tree(int notify_fd, WatchMap *map, const char *base_path) {
+int add_watch(int notify_fd, WatchMap *map, const char *path) {
   uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
                   IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED;
 
-  int wd = inotify_add_watch(notify_fd, base_path, mask);
+  int wd = inotify_add_watch(notify_fd, path, mask);
   if (wd < 0) {
     perror("inotify_add_watch");
     return -1;
   }
-  watch_add(map, wd, strdup(base_path));
+  if (watch_add(map, wd, path) < 0) {
+    inotify_rm_watch(notify_fd, wd);
+    return -1;
+  }
+  return 0;
+}
+
+int add_watch_tree(int notify_fd, WatchMap *map, const char *base_path) {
+  if (add_watch(notify_fd, map, base_path) < 0)
+    return -1;
 
   DIR *dir = opendir(base_path);
   if (!dir) {
@@ -132,38 +443,27 @@ int add_watch_tree(int notify_fd, WatchMap *map, const char *base_path) {
 
 void watch_update_prefix(WatchMap *map, const char *old_path,
                          const char *new_path) {
-  size_t oldlen = strlen(old_path);
-
-  for (size_t i = 0; i < map->watches_count; i++) {
-    char *p = map->watches[i].path;
-    if (!has_prefix_path(p, old_path)) {
-      continue;
-    }
+  size_t node = node_lookup(map, old_path);
+  if (node == WATCH_NONE || node == map->root)
+    return;
 
-    char *suffix = p + oldlen;
-    if (*suffix == '/')
-      suffix++;
+  char tmp[PATH_MAX], dir[PATH_MAX], base[PATH_MAX];
+  snprintf(tmp, PATH_MAX, "%s", new_path);
+  split_dir_base(tmp, dir, base);
+  size_t parent = node_lookup(map, dir);
+  if (parent == WATCH_NONE)
+    return;
 
-    char buf[PATH_MAX];
-    if (*suffix) {
-      snprintf(buf, PATH_MAX, "%s/%s", new_path, suffix);
-    } else {
-      snprintf(buf, PATH_MAX, "%s", new_path);
-    }
+  // renamed over an existing directory: that one is gone now
+  size_t old = map->by_name.slots[name_slot(map, parent, base)];
+  if (old != SLOT_EMPTY && old != node)
+    node_free_subtree(map, old, -1);
 
-    free(map->watches[i].path);
-    map->watches[i].path = strdup(buf);
-  }
+  node_move(map, node, parent, base);
 }
 
 void watch_remove_subtree(int notify_fd, WatchMap *map, const char *prefix) {
-  size_t i = 0;
-  while (i < map->watches_count) {
-    if (has_prefix_path(map->watches[i].path, prefix)) {
-      inotify_rm_watch(notify_fd, map->watches[i].wd);
-      watch_remove(map, map->watches[i].wd);
-      continue;
-    }
-    i++;
-  }
-}
\ No newline at end of file
+  size_t node = node_lookup(map, prefix);
+  if (node != WATCH_NONE)
+    node_free_subtree(map, node, notify_fd);
+}
@@ -7,23 +7,48 @@
 #define PATH_MAX 4096
 #endif
 
+#define WATCH_NONE ((size_t)-1)
+
+// One watched directory. Watches form a tree of name components: the root
+// holds the full source path, every other node only its own name, so full
+// paths are rebuilt on demand with watch_path().
 typedef struct {
-    int wd;
-    char *path;   
+    int wd;               // -1 while the slot sits on the free list
+    char *name;
+    size_t parent;        // WATCH_NONE for the root
+    size_t first_child;
+    size_t next_sibling;  // doubles as the free list link
+    size_t prev_sibling;
 } Watch;
 
+// open-addressing index (linear probing, power-of-two size, no tombstones)
+// holding positions in WatchMap.watches
 typedef struct {
-    Watch *watches;
-    size_t watches_count;
+    size_t *slots;
+    size_t capacity;
+} WatchIndex;
+
+typedef struct WatchMap {
+    Watch *watches;       // nodes never move, freed ones are reused
+    size_t watches_count; // live watches
+    size_t watches_used;  // high-water mark in `watches`
     size_t watches_capacity;
+    size_t free_head;
+    size_t root;
+    WatchIndex by_wd;     // wd -> node
+    WatchIndex by_name;   // (parent, name) -> node
 } WatchMap;
 
 int   watch_ensure_capacity(WatchMap *map, size_t need);
-int   watch_add(WatchMap *map, int wd, char *path);
+int   watch_add(WatchMap *map, int wd, const char *path);
 Watch* watch_find(WatchMap *map, int wd);
+Watch* watch_lookup(WatchMap *map, const char *path);
+int   watch_path(const WatchMap *map, const Watch *watch, char out[PATH_MAX]);
 void  watch_remove(WatchMap *map, int wd);
 void  watch_free_all(WatchMap *map);
 
+// watches one directory; an already watched one just gets its path refreshed
+int   add_watch(int notify_fd, WatchMap *map, const char *path);
 int   add_watch_tree(int notify_fd, WatchMap *map, const char *base_path);
 void  watch_update_prefix(WatchMap *map, const char *old_path, const char *new_path);
 void  watch_remove_subtree(int notify_fd, WatchMap *map, const char *prefix);